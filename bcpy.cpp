@@ -48,12 +48,23 @@
 
 #include "util.h"
 #include "filetree.h"
+#include "watch.h"
+#include "filter.h"
+#include "strkern.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef _WIN32
 #include <conio.h>
 #include <direct.h>
+#else
+#include <sys/resource.h>
+#endif
 #include <time.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 //----------------------------------------------------------
 // MACROS
@@ -70,11 +81,26 @@
 // Bit flags for dwUser field of directory entries.
 #define USERFLAG_EXISTSINSOURCE  0x0001
 
+// Most files and directories the scanner can get ahead of
+// the copying in /PIPELINE mode.
+#define PIPELINE_QUEUE_SIZE      4096
+
+// In /WATCH mode, changes are collected until none have arrived
+// for WATCH_QUIET_MS milliseconds (but for no more than
+// WATCH_MAX_DELAY_MS milliseconds), then copied all at once.
+#define WATCH_QUIET_MS           500
+#define WATCH_MAX_DELAY_MS       5000
+
+// Deepest that @file arguments can be nested in argument files.
+// Anything deeper is taken to be a file that includes itself.
+#define ARGFILE_MAX_DEPTH        16
+
 //----------------------------------------------------------
 // FORWARD PROTOTYPES
 //----------------------------------------------------------
 
 static int ParseArgument(_TCHAR *szArg);
+bool QuerySource(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir);
 
 //----------------------------------------------------------
 // CLASSES
@@ -115,6 +141,28 @@ public:
       dDestBytesDeleted = 0.0;
       iNumErrors = iNumWarnings = 0;
    }
+
+   // Adds another set of totals to these, such as the ones
+   // kept by each of the copy threads.
+   void
+   Add(const CTotals &cOther)
+   {
+      dBytesCopied += cOther.dBytesCopied;
+      dBytesAlreadyExist += cOther.dBytesAlreadyExist;
+      iFilesCopied += cOther.iFilesCopied;
+      iFilesAlreadyExist += cOther.iFilesAlreadyExist;
+      iDirsCopied += cOther.iDirsCopied;
+      iDirsCreated += cOther.iDirsCreated;
+      iDirsAlreadyExist += cOther.iDirsAlreadyExist;
+      iSourceFilesDeleted += cOther.iSourceFilesDeleted;
+      iSourceDirsDeleted += cOther.iSourceDirsDeleted;
+      dSourceBytesDeleted += cOther.dSourceBytesDeleted;
+      iDestFilesDeleted += cOther.iDestFilesDeleted;
+      iDestDirsDeleted += cOther.iDestDirsDeleted;
+      dDestBytesDeleted += cOther.dDestBytesDeleted;
+      iNumErrors += cOther.iNumErrors;
+      iNumWarnings += cOther.iNumWarnings;
+   }
 };
 
 // Container class for the program's settings.
@@ -131,8 +179,40 @@ public:
    // Pathname of log output file (if any).
    _TCHAR szLogFile[MAXPATH];
 
+   // If true, the destination tree isn't scanned up front.
+   // Instead, each destination directory is read the first
+   // time a file being copied needs to be looked up in it.
+   // Can't be used with bClean.
+   bool bLazyDest;
+
+   // If true, names in the source are matched to names in the
+   // destination with case significant, as most Linux file
+   // systems do.  Otherwise "FILE.TXT" and "file.txt" are taken
+   // to be the same file.
+   bool bCaseSensitive;
+
+   // If true, after copying, keeps watching the source for
+   // changes and copies them as they happen.
+   bool bWatch;
+
+   // Number of threads that copy files at the same time.  If
+   // more than one, the files are handed to a pool of copy
+   // threads, while the directories are still created in
+   // order, before anything in them.
+   int iCopyThreads;
+
+   // If true, copying starts as soon as the first source
+   // directory has been read, and goes on while the rest of
+   // the source tree is being scanned.
+   bool bPipeline;
+
+   // Pathname of the file that keeps the scanned trees from one
+   // run to the next (if any), so that only the directories that
+   // changed in between have to be read again.
+   _TCHAR szSnapshot[MAXPATH];
+
    // List of wildcard filenames to match.
-   std::vector<std::wstring> cWilds;
+   std::vector<tstring> cWilds;
 
    // Only copy files newer than this date.
    // Year will be -1 if this feature was not requested by user.
@@ -146,16 +226,40 @@ public:
    int iOlderMonth;
    int iOlderDay;
 
+   // The dates above as timestamps, so each file's last write
+   // time can be checked without converting it to a date.
+   // Files are copied if qwNewerThan <= time < qwOlderThan.
+   ULONGLONG qwNewerThan;
+   ULONGLONG qwOlderThan;
+
    // List of include strings.  Only files whose absolute
    // pathnames contain one or more of these substrings are
    // copied.  If this is empty, then all files are included.
-   std::vector<std::wstring> cIncludes;
+   std::vector<tstring> cIncludes;
 
    // List of exclude strings.  Any files whose aboslute
    // pathnames contain one or more of these substrings
    // are not copied.  If this is empty, then no files
    // are excluded.
-   std::vector<std::wstring> cExcludes;
+   std::vector<tstring> cExcludes;
+
+   // List of filter expressions.  Only files that pass all of
+   // them are copied (see CFilter::AddExpression).
+   std::vector<tstring> cFilters;
+
+   // Global rules files, in the format of git's ".gitignore"
+   // files.  Files and directories that they ignore are not
+   // copied.
+   std::vector<tstring> cRulesFiles;
+
+   // Name of the rules files to look for in each directory of
+   // the source, or empty if there aren't any.
+   tstring sIgnoreFile;
+
+   // All of the selection settings above (wildcards, dates,
+   // includes, excludes, filters, rules files, and hidden
+   // files) compiled into one filter for QuerySource.
+   CFilter cFilter;
 
    // If true, output debugging info.
    bool bDebug;
@@ -212,7 +316,7 @@ public:
    // path to which the full path of the source files are appended
    // to make the destination paths.
    // Example:
-   //    BCPY /ROOT C:\MYFILES\STUFF D:\
+   //    BCPY /ROOT C:\MYFILES\STUFF D:\ (the root of drive D)
    // ...is the same as:
    //    BCPY C:\MYFILES\STUFF D:\MYFILES\STUFF
    // Example:
@@ -223,6 +327,12 @@ public:
    // If true, selects a low priority for the process.
    bool bPriorityLow;
 
+   // Number of worker threads to use when scanning the source
+   // and destination trees, and when fetching file information
+   // the scan left for later.  If more than one, the two trees
+   // are also scanned at the same time.
+   int iScanThreads;
+
 public:
 
    // Set all member variables to desired 'default' states.
@@ -232,11 +342,18 @@ public:
       szSource[0] = '\0';
       szDest[0] = '\0';
       szLogFile[0] = '\0';
+      szSnapshot[0] = '\0';
       cWilds.clear();
       iNewerYear = iNewerMonth = iNewerDay = -1;
       iOlderYear = iOlderMonth = iOlderDay = -1;
+      qwNewerThan = 0;
+      qwOlderThan = ~0ULL;
       cIncludes.clear();
       cExcludes.clear();
+      cFilters.clear();
+      cRulesFiles.clear();
+      sIgnoreFile = _T("");
+      cFilter.Clear();
       bDebug = false;
       bVerbose = false;
       bUpdate = false;
@@ -253,12 +370,290 @@ public:
       bWait = false;
       bRoot = false;
       bPriorityLow = false;
+      iScanThreads = 1;
+      iCopyThreads = 1;
+      bPipeline = false;
+      bLazyDest = false;
+      bCaseSensitive = false;
+      bWatch = false;
    }
 
    // Default constructor.
    CSettings() { Defaults(); }
 };
 
+// One file or directory waiting to be copied in /PIPELINE mode,
+// or one file waiting for a copy thread.  The copy threads get
+// the destination looked up already, and their own copy of the
+// source entry, since the one passed in may be a temporary.
+typedef struct
+{
+   tstring           sPath;      // Full pathname in source.
+   const CDirEntry  *pEntry;     // Entry in the source tree (/PIPELINE).
+   CDirEntry         cEntry;     // Copy of the source entry (copy threads).
+   bool              bIsDir;     // True if entry is a directory.
+   size_t            nRelStart;  // Where the part of sPath relative
+                                 // to the source starts.
+   tstring           sNewPath;   // Full pathname in destination.
+   bool              bExists;    // True if it's in the destination.
+   CDirEntry         cExists;    // Entry in the destination, if so.
+} COPY_JOB;
+
+// Context passed through CTreeDiff::EnumActions by EnumDiffSource.
+typedef struct
+{
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir);
+   void             *pContext;   // Context for pEnum.
+   bool              bSkipSame;  // Leave out files that are up to date.
+} DIFF_SOURCE_CONTEXT;
+
+// One stage of the single pass over Globals.cDiff that does the
+// listing, or the copying, moving, and cleaning (see
+// RunDiffStages).  pEnter is called for each action on the way
+// down, and pLeave for each action once everything below it is
+// done.  Either may be NULL.
+typedef struct
+{
+   bool (*pEnter)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath);
+   bool (*pLeave)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath);
+   void             *pContext;   // Context for pEnter and pLeave.
+} DIFF_STAGE;
+
+// Queue of files and directories passed from the scanner to the
+// copier in /PIPELINE mode.  The queue holds a limited number of
+// jobs, so the scanner waits when it gets too far ahead.
+class CCopyQueue
+{
+private:
+   std::deque<COPY_JOB>    cJobs;
+   std::mutex              mtx;
+   std::condition_variable cvNotFull;
+   std::condition_variable cvNotEmpty;
+   bool                    bDone;      // Scanner has finished.
+   bool                    bAbort;     // Copier has given up.
+
+public:
+   CCopyQueue() : bDone(false), bAbort(false) {}
+
+   // Adds a job, waiting for room if the queue is full.
+   // Returns false if the copier has given up.
+   bool
+   Push(const COPY_JOB &stJob)
+   {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (!bAbort && cJobs.size() >= PIPELINE_QUEUE_SIZE)
+         cvNotFull.wait(lock);
+      if (bAbort)
+         return false;
+      cJobs.push_back(stJob);
+      cvNotEmpty.notify_one();
+      return true;
+   }
+
+   // Same, for a job from the /PIPELINE scanner.
+   bool
+   Push(const tstring &sPath, const CDirEntry *pEntry, bool bIsDir)
+   {
+      COPY_JOB stJob;
+      stJob.sPath = sPath;
+      stJob.pEntry = pEntry;
+      stJob.bIsDir = bIsDir;
+      stJob.nRelStart = 0;
+      stJob.bExists = false;
+      return Push(stJob);
+   }
+
+   // Takes the oldest job, waiting for one if the queue is
+   // empty.  Returns false when the scanner has finished and
+   // there are no more jobs.
+   bool
+   Pop(COPY_JOB &stJob)
+   {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (!bDone && cJobs.empty())
+         cvNotEmpty.wait(lock);
+      if (cJobs.empty())
+         return false;
+      stJob = cJobs.front();
+      cJobs.pop_front();
+      cvNotFull.notify_one();
+      return true;
+   }
+
+   // Called by the scanner when there are no more jobs coming.
+   void
+   Finish(void)
+   {
+      std::lock_guard<std::mutex> lock(mtx);
+      bDone = true;
+      cvNotEmpty.notify_all();
+   }
+
+   // Called by the copier to make the scanner stop.
+   void
+   Abort(void)
+   {
+      std::lock_guard<std::mutex> lock(mtx);
+      bAbort = true;
+      cvNotFull.notify_all();
+   }
+};
+
+// Pool of threads that copy files at the same time, for the
+// /COPYTHREADS option.  The copying goes through the tree in
+// the usual order, and hands each file to the pool through a
+// CCopyQueue, after creating the directory it goes in.  Each
+// thread keeps its own totals, which are added up by Finish.
+// Once a copy fails (and shouldn't be continued after), the
+// files still waiting are dropped, and Submit returns false.
+class CCopyPool
+{
+private:
+   CCopyQueue                 cQueue;
+   std::vector<std::thread>   cThreads;
+   std::vector<CTotals>       cTotals;    // Totals of each thread.
+   std::mutex                 mtx;        // Protects nPending and bFailed.
+   std::condition_variable    cvIdle;
+   size_t                     nPending;   // Files handed out but not done.
+   bool                       bFailed;    // A copy has failed.
+   bool                       bActive;    // Threads are running.
+
+public:
+   CCopyPool() : nPending(0), bFailed(false), bActive(false) {}
+
+   ~CCopyPool()
+   {
+      if (bActive)
+      {
+         {
+            std::lock_guard<std::mutex> lock(mtx);
+            bFailed = true;
+         }
+         CTotals cIgnored;
+         Finish(cIgnored);
+      }
+   }
+
+   // Determines if files are being handed to the pool.
+   bool Active(void) const  { return bActive; }
+
+   // Starts nThreads threads, each running pWorker, which
+   // should copy the files from Take until it returns false,
+   // calling Done after each one.
+   void
+   Start(int nThreads, void (*pWorker)(CCopyPool *pPool, CTotals *pTotals))
+   {
+      bActive = true;
+      cTotals.assign(nThreads, CTotals());
+      for (int i = 0; i < nThreads; i++)
+         cThreads.push_back(std::thread(pWorker, this, &cTotals[i]));
+   }
+
+   // Hands a file to the pool, waiting if too many are already
+   // waiting.  Returns false if a copy has failed.
+   bool
+   Submit(const _TCHAR *pszPath, const _TCHAR *pszRelPath, const _TCHAR *pszNewPath, const CDirEntry *pEntry, const CDirEntry *pExists)
+   {
+      {
+         std::lock_guard<std::mutex> lock(mtx);
+         if (bFailed)
+            return false;
+         nPending++;
+      }
+      COPY_JOB stJob;
+      stJob.sPath = pszPath;
+      stJob.pEntry = NULL;
+      stJob.cEntry = *pEntry;
+      stJob.bIsDir = false;
+      stJob.nRelStart = static_cast<size_t>(pszRelPath - pszPath);
+      stJob.sNewPath = pszNewPath;
+      stJob.bExists = (pExists != NULL);
+      if (pExists != NULL)
+         stJob.cExists = *pExists;
+      if (!cQueue.Push(stJob))
+      {
+         Done(true);
+         return false;
+      }
+      return true;
+   }
+
+   // Takes the next file to copy, for a copy thread.  Returns
+   // false when there are no more.
+   bool
+   Take(COPY_JOB &stJob)
+   {
+      while (cQueue.Pop(stJob))
+      {
+         {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!bFailed)
+               return true;
+         }
+         Done(true);
+      }
+      return false;
+   }
+
+   // Called by a copy thread when it's done with a file.
+   // bOk is what CopyEntry returned.
+   void
+   Done(bool bOk)
+   {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!bOk && !bFailed)
+      {
+         bFailed = true;
+         cQueue.Abort();
+      }
+      if (--nPending == 0)
+         cvIdle.notify_all();
+   }
+
+   // Waits until every file handed to the pool so far has been
+   // copied.  Returns false if a copy has failed.
+   bool
+   Wait(void)
+   {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (nPending > 0)
+         cvIdle.wait(lock);
+      return !bFailed;
+   }
+
+   // Waits for the threads to finish the rest of the files,
+   // and adds their totals to cSum.  Returns false if a copy
+   // has failed.
+   bool
+   Finish(CTotals &cSum)
+   {
+      if (!bActive)
+         return true;
+      cQueue.Finish();
+      for (size_t i = 0; i < cThreads.size(); i++)
+         cThreads[i].join();
+      cThreads.clear();
+      for (size_t i = 0; i < cTotals.size(); i++)
+         cSum.Add(cTotals[i]);
+      cTotals.clear();
+      bActive = false;
+      std::lock_guard<std::mutex> lock(mtx);
+      return !bFailed;
+   }
+};
+
+// Function object to pass QuerySource to CDir::Prune, so the
+// query is compiled into the tree walk.
+class CSourceQuery
+{
+public:
+   bool
+   operator()(const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir) const
+   {
+      return QuerySource(NULL, cPath.Path(), &cEntry, bIsDir);
+   }
+};
+
 //----------------------------------------------------------
 // DATA
 //----------------------------------------------------------
@@ -272,9 +667,20 @@ static struct
    CSettings cSettings;       // Program options and settings.
    CTotals  cTotals;          // Statistics accumulators.
    CDir     cSrcTree;         // Tree of files/dirs in source.
-   CDir     cDestTree;        // Tree of files/dirs in destination.
+   CFlatTree cSrcFlat;        // Same, once scanned, when comparing the trees.
+   CDir     cDestTree;        // Tree of files/dirs in destination, while scanning.
+   CFlatTree cDestFlat;       // Same, once scanned.
+   CTreeDiff cDiff;           // What to do to each file and directory.
+   size_t   nSrcRelStart;     // Where the part after the source directory
+                              // starts in the source pathnames.
    clock_t  tStartTime;       // Time at which the program started working.
    clock_t  tLastProgress;    // Time at which the last progress update was displayed.
+   double   dJobBytes;        // Bytes in the source, for the progress
+                              // display (0 if not counted).
+   std::mutex mtxConsole;     // Serializes console output from worker threads.
+   CWatcher cWatcher;         // Source change notifications for /WATCH mode.
+   CCopyPool cCopyPool;       // Copy threads, for /COPYTHREADS (last, so the
+                              // threads stop before the rest goes away).
 
 } Globals;
 
@@ -287,7 +693,7 @@ static struct
 // Trims leading and trailing whitespace from a string.
 //
 static void
-Trim(std::wstring &s)
+Trim(tstring &s)
 {
    if (s.size() < 1)
       return;
@@ -296,15 +702,13 @@ Trim(std::wstring &s)
    while (*p == ' ' || *p == '\t')
       p++;
 
-   int i = static_cast<int>(_tcslen(p));
-   while (i > 0 && p[i] == ' ' || p[i] == '\t')
-   {
-      i--;
-   }
+   size_t nLen = _tcslen(p);
+   while (nLen > 0 && (p[nLen - 1] == ' ' || p[nLen - 1] == '\t'))
+      nLen--;
 
-   std::wstring s2 = _T("");
-   for (int j = 0; j < i; j++)
-      s2 += p[i];
+   // p points into s, so build the result separately.
+   tstring s2(p, nLen);
+   s.swap(s2);
 }
 
 //
@@ -341,6 +745,19 @@ logtext(const _TCHAR *pszText)
    fclose(pFile);
 }
 
+//
+// outtext:
+// Outputs a null-terminated character string to the console,
+// all at once, so the lines from the copy threads don't get
+// mixed together.
+//
+static void
+outtext(const _TCHAR *pszText)
+{
+   std::lock_guard<std::mutex> lock(Globals.mtxConsole);
+   _tprintf(_T("%s"), pszText);
+}
+
 //
 // errmsg:
 // Outputs error messages to the console in a consistent format.
@@ -362,10 +779,8 @@ logtext(const _TCHAR *pszText)
 static void
 errmsg(const char *pszFile, int iLine, const _TCHAR *msg, const _TCHAR *omsg = NULL)
 {
-   _TCHAR szText[MAXPATH * 5] = _T("");
-
    // Convert pszFile to wide string.
-   std::wstring sFile;
+   tstring sFile;
    if (pszFile != NULL)
    {
       for (int i = 0; pszFile[i] != '\0'; i++)
@@ -378,16 +793,19 @@ errmsg(const char *pszFile, int iLine, const _TCHAR *msg, const _TCHAR *omsg = N
 
    if (msg == NULL)
       return;
-   _stprintf_s(szText, MAXPATH * 5, _T("bcpy|%s(%d):  %s"), sFile.c_str(), iLine < 1 ? 0 : iLine, msg);
+   _TCHAR szLine[32];
+   _stprintf_s(szLine, 32, _T("(%d):  "), iLine < 1 ? 0 : iLine);
+   tstring sText = _T("bcpy|") + sFile + szLine + msg;
    if (omsg != NULL && omsg[0] != '\0')
    {
-      _tcscat_s(szText, MAXPATH * 5, _T(":  "));
-      _tcscat_s(szText, MAXPATH * 5, omsg);
+      sText += _T(":  ");
+      sText += omsg;
    }
-   _tcscat_s(szText, MAXPATH * 5, _T("\n"));
-   _tprintf(_T("%s"), szText);
+   sText += _T("\n");
+   std::lock_guard<std::mutex> lock(Globals.mtxConsole);
+   _tprintf(_T("%s"), sText.c_str());
    fflush(stdout);
-   logtext(szText);
+   logtext(sText.c_str());
 }
 
 //
@@ -409,20 +827,20 @@ errmsg(const char *pszFile, int iLine, const _TCHAR *msg, const _TCHAR *omsg = N
 static void
 statmsg(const _TCHAR *msg, const _TCHAR *omsg = NULL)
 {
-   _TCHAR szText[MAXPATH * 5];
-
    if (msg == NULL)
       return;
-   _stprintf_s(szText, MAXPATH * 5, _T("bcpy:  %s"), msg);
+   tstring sText = _T("bcpy:  ");
+   sText += msg;
    if (omsg != NULL && omsg[0] != '\0')
    {
-      _tcscat_s(szText, MAXPATH * 5, _T(":  "));
-      _tcscat_s(szText, MAXPATH * 5, omsg);
+      sText += _T(":  ");
+      sText += omsg;
    }
-   _tcscat_s(szText, MAXPATH * 5, _T("\n"));
-   _tprintf(_T("%s"), szText);
+   sText += _T("\n");
+   std::lock_guard<std::mutex> lock(Globals.mtxConsole);
+   _tprintf(_T("%s"), sText.c_str());
    fflush(stdout);
-   logtext(szText);
+   logtext(sText.c_str());
 }
 
 //
@@ -451,10 +869,14 @@ TreeScanCallback(void *pContext, const _TCHAR *pszDirPath)
    if (Globals.cSettings.bQuiet)
       return true;
 
+   // The source and destination may be scanned by several
+   // threads at once.
+   std::lock_guard<std::mutex> lock(Globals.mtxConsole);
+
    // Wait a bit between progress updates.
-   if ((clock() - Globals.tLastProgress) < CLOCKS_PER_SEC / 4)
+   if ((WallClock() - Globals.tLastProgress) < CLOCKS_PER_SEC / 4)
       return true;
-   Globals.tLastProgress = clock();
+   Globals.tLastProgress = WallClock();
 
    // Get directory name, and trim it if it is too long to
    // fit on one line.
@@ -469,7 +891,7 @@ TreeScanCallback(void *pContext, const _TCHAR *pszDirPath)
    {
       // We will display part of the path with "..." in front of it.
       _tcscpy_s(szOut, MAXPATH, _T("..."));
-      const _TCHAR *p = _tcschr(&pszDirPath[iLen - 75], _TCHAR('\\'));
+      const _TCHAR *p = FindChar(&pszDirPath[iLen - 75], 75, PATHSEP);
       if (p == NULL)
          p = &pszDirPath[iLen - 75];
       _tcscat_s(szOut, MAXPATH, p);
@@ -484,6 +906,96 @@ TreeScanCallback(void *pContext, const _TCHAR *pszDirPath)
    return true;
 }
 
+//
+// FlattenDestTree:
+// Moves the scanned destination tree into the flat tree store,
+// which needs much less memory for a large tree, and frees
+// the CDir tree.
+//
+static void
+FlattenDestTree(void)
+{
+   Globals.cDestFlat.Build(&Globals.cDestTree);
+   Globals.cDestTree = CDir();
+}
+
+//
+// FlattenSourceTree:
+// Same as FlattenDestTree, for the scanned source tree, when
+// the trees are to be compared.
+//
+static void
+FlattenSourceTree(void)
+{
+   Globals.cSrcFlat.Build(&Globals.cSrcTree);
+   Globals.cSrcTree = CDir();
+}
+
+//
+// ScanDestThread:
+// Thread procedure for scanning the destination tree while
+// the main thread scans the source tree.  The context pointer
+// points to a bool that receives the result of the scan.
+//
+static void
+ScanDestThread(bool *pbResult)
+{
+   // The destination will be looked up on demand instead.
+   if (Globals.cSettings.bLazyDest)
+   {
+      *pbResult = true;
+      return;
+   }
+
+   *pbResult = Globals.cDestTree.ScanFilesParallel(Globals.cSettings.szDest,
+      Globals.cSettings.iScanThreads, TreeScanCallback, NULL);
+}
+
+//
+// LoadSnapshots:
+// Loads the source and destination trees saved by the last
+// run from the snapshot file, for use as caches by the scan.
+// A tree that was scanned from a different path than the one
+// being copied this time is discarded.  A missing or damaged
+// snapshot file just means that everything gets scanned.
+//
+static void
+LoadSnapshots(CDir *pSrcCache, CDir *pDestCache)
+{
+   FILE *pFile = NULL;
+   if (_tfopen_s(&pFile, Globals.cSettings.szSnapshot, _T("rb")))
+      return;
+
+   tstring sPath;
+   if (!pSrcCache->LoadSnapshot(pFile, sPath) || _tcscmp(sPath.c_str(), Globals.cSettings.szSource) != 0)
+      *pSrcCache = CDir();
+   else if (!pDestCache->LoadSnapshot(pFile, sPath) || _tcscmp(sPath.c_str(), Globals.cSettings.szDest) != 0)
+      *pDestCache = CDir();
+   fclose(pFile);
+}
+
+//
+// SaveSnapshots:
+// Writes the freshly scanned source and destination trees
+// to the snapshot file for the next run.
+// Returns true if successful.
+//
+static bool
+SaveSnapshots(void)
+{
+   FILE *pFile = NULL;
+   if (_tfopen_s(&pFile, Globals.cSettings.szSnapshot, _T("wb")))
+      return false;
+
+   bool bOk = Globals.cSrcTree.SaveSnapshot(pFile, Globals.cSettings.szSource) &&
+              Globals.cDestTree.SaveSnapshot(pFile, Globals.cSettings.szDest);
+   if (fclose(pFile) != 0)
+      bOk = false;
+   if (!bOk)
+      _tunlink(Globals.cSettings.szSnapshot);
+   return bOk;
+}
+
 //
 // CopyProgress:
 // Callback function that is called during the copying or verifying
@@ -510,7 +1022,7 @@ CopyProgress(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double
       return true;
 
    // Wait a bit between progress updates.
-   DWORD dwTick = clock();
+   DWORD dwTick = WallClock();
    if ((dwTick - Globals.tLastProgress) < CLOCKS_PER_SEC / 4)
       return true;
    Globals.tLastProgress = dwTick;
@@ -534,6 +1046,18 @@ CopyProgress(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double
    static _TCHAR spin[] = _T("/-\\|");
    _ftprintf(stderr, _T("%c"), spin[(dwTick % CLOCKS_PER_SEC) * 4 / CLOCKS_PER_SEC]);
 
+   // Show how far along the whole job is, if the source was
+   // counted.  A file being verified was already counted as
+   // copied.
+   if (Globals.dJobBytes > 0.0)
+   {
+      double dDone = Globals.cTotals.dBytesCopied + Globals.cTotals.dBytesAlreadyExist;
+      if (*pSymbol == 'C')
+         dDone += dBytesCopied;
+      double dPercent = dDone * 100.0 / Globals.dJobBytes;
+      _ftprintf(stderr, _T(" %3.0f%% of total"), (dPercent > 100.0) ? 100.0 : dPercent);
+   }
+
    _ftprintf(stderr, _T("\r"));
    fflush(stderr);
 
@@ -547,135 +1071,19 @@ CopyProgress(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double
 // be removed from the source tree of files to be copied.
 // The context pointer points to Globals.cSettings.  If the passed
 // file doesn't match the program settings (includes,
-// excludes, dates, etc.) then false will be returned,
+// excludes, dates, filters, etc.) then false will be returned,
 // which causes the corresponding entry to be removed
-// from the tree.
+// from the tree.  For a directory, false is only returned if
+// nothing in it could match.
 //
 bool
 QuerySource(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)
 {
    (void)pContext;
-   (void)bIsDir;
-
-   // If includes list is non-empty, then the file must
-   // match something in the includes list or be removed.
-   if (Globals.cSettings.cIncludes.size() > 0)
-   {
-      // Check for a substring match of any of the includes with the
-      // file path.
-      bool bMatched = false;
-      for (int i = 0; i < (int)Globals.cSettings.cIncludes.size(); i++)
-      {
-         if (SubstringMatch(Globals.cSettings.cIncludes[i].c_str(), pszPath))
-         {
-            // This file matched one of the includes.
-            bMatched = true;
-            break;
-         }
-      }
-      if (!bMatched)
-      {
-         return false; // This file doesn't match any of the includes!
-      }
-   }
-
-   // If the excludes list is non-empty, then if the file
-   // matches one of the excludes, then the file needs to
-   // be removed from the tree.
-   if (Globals.cSettings.cExcludes.size() > 0)
-   {
-      // Check for a substring match of any of the excludes with the
-      // file path.
-      for (int i = 0; i < (int)Globals.cSettings.cExcludes.size(); i++)
-      {
-         if (SubstringMatch(Globals.cSettings.cExcludes[i].c_str(), pszPath))
-         {
-            // This file matched one of the excludes.
-            return false;
-         }
-      }
-   }
-
-   // If wildcards were given on command line, remove anything
-   // from the source tree that doesn't match one of the
-   // wildcards.
-   if (Globals.cSettings.cWilds.size() > 0)
-   {
-      // Check for a wildcard match of any of the cWilds[] with the
-      // file path.
-      bool bMatched = false;
-      for (int i = 0; i < (int)Globals.cSettings.cWilds.size(); i++)
-      {
-         if (WildcardMatch(Globals.cSettings.cWilds[i].c_str(), pszPath))
-         {
-            // This file matched one of the wildcards.
-            bMatched = true;
-            break;
-         }
-      }
-      if (!bMatched)
-      {
-         return false; // This file doesn't match any of the wildcards!
-      }
-   }
-
-   // If new/old dates were given on the command line, remove
-   // any files from the source three that are outside the
-   // given date range.
-   if (Globals.cSettings.iOlderYear != -1 || Globals.cSettings.iNewerYear != -1)
-   {
-      // Convert file time to usable form.
-      SYSTEMTIME stTime;
-      FileTimeToSystemTime(&pEntry->ftLastWrite, &stTime);
-
-      // If file must be older than a certain date, check it.
-      if (Globals.cSettings.iOlderYear != -1)
-      {
-         if (stTime.wYear > Globals.cSettings.iOlderYear)
-            return false;
-         else if (stTime.wYear == Globals.cSettings.iOlderYear)
-         {
-            if (stTime.wMonth > Globals.cSettings.iOlderMonth)
-               return false;
-            else if (stTime.wMonth == Globals.cSettings.iOlderMonth)
-            {
-               if (stTime.wDay > Globals.cSettings.iOlderDay)
-                  return false;
-            }
-         }
-      }
 
-      // If file must be newer than a certain date, check it.
-      if (Globals.cSettings.iNewerYear != -1)
-      {
-         if (stTime.wYear < Globals.cSettings.iNewerYear)
-            return false;
-         else if (stTime.wYear == Globals.cSettings.iNewerYear)
-         {
-            if (stTime.wMonth < Globals.cSettings.iNewerMonth)
-               return false;
-            else if (stTime.wMonth == Globals.cSettings.iNewerMonth)
-            {
-               if (stTime.wDay < Globals.cSettings.iNewerDay)
-                  return false;
-            }
-         }
-      }
-   }
-
-   // If the bHidden option isn't enabled, remove the file
-   // from the tree if it has the hidden or system attributes.
-   if (!Globals.cSettings.bHidden)
-   {
-      if ((pEntry->dwAttrib & FILE_ATTRIBUTE_HIDDEN) ||
-          (pEntry->dwAttrib & FILE_ATTRIBUTE_SYSTEM))
-      {
-         return false;
-      }
-   }
-
-   // Keep this file.
-   return true;
+   // The settings were compiled into one filter, which runs
+   // the cheapest tests first.
+   return Globals.cSettings.cFilter.Test(pszPath, pEntry, bIsDir);
 }
 
 //
@@ -706,6 +1114,7 @@ EnumDebugShowNodeInfo(void *pContext, const _TCHAR *pszPath, const CDirEntry *pE
 {
    (void)pContext;
 
+   LoadEntryInfo(pszPath, pEntry);
    if (bIsDir)
       _tprintf(_T("d "));
    else
@@ -713,7 +1122,7 @@ EnumDebugShowNodeInfo(void *pContext, const _TCHAR *pszPath, const CDirEntry *pE
    _tprintf(_T("S:%10.0f "), pEntry->dBytes);
    _tprintf(_T("A:%08X "), pEntry->dwAttrib);
    _tprintf(_T("U:%08X "), pEntry->dwUser);
-   _tprintf(_T("LW:%08X:%08X "), pEntry->ftLastWrite.dwLowDateTime, pEntry->ftLastWrite.dwHighDateTime);
+   _tprintf(_T("LW:%08X:%08X "), static_cast<DWORD>(pEntry->qwLastWrite & 0xFFFFFFFF), static_cast<DWORD>(pEntry->qwLastWrite >> 32));
    _tprintf(_T("N:%-40s "), pEntry->sName.c_str());
    _tprintf(_T("\n"));
    _tprintf(_T("    P: '%s'\n"), pszPath);
@@ -732,10 +1141,15 @@ EnumCheckDest(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bo
    (void)pEntry;
    (void)bIsDir;
 
-   const _TCHAR *pszRelPath = pszPath + _tcslen(Globals.cSettings.szSource) + ((Globals.cSettings.szSource[_tcslen(Globals.cSettings.szSource) - 1] == '\\') ? 0 : 1);
-   CDirEntry *pDestEntry = Globals.cDestTree.FileExists(pszRelPath);
-   if (pDestEntry != NULL)
-      pDestEntry->dwUser |= USERFLAG_EXISTSINSOURCE;
+   // Only cleaning uses the marks, and the destination tree
+   // isn't there to mark when it's looked up on demand.
+   if (Globals.cSettings.bLazyDest)
+      return true;
+
+   const _TCHAR *pszRelPath = pszPath + Globals.nSrcRelStart;
+   DWORD iDestNode = Globals.cDestFlat.FindNode(pszRelPath, Globals.cSettings.bCaseSensitive);
+   if (iDestNode != FLAT_NONE)
+      Globals.cDestFlat.SetUserFlags(iDestNode, USERFLAG_EXISTSINSOURCE);
 
    return true;
 }
@@ -770,6 +1184,51 @@ EnumDelDir(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool
    return true;
 }
 
+//
+// DeleteDestEntry:
+// Deletes a file or (empty) directory from the destination,
+// for the /CLEAN option.
+//
+static void
+DeleteDestEntry(const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)
+{
+   LoadEntryInfo(pszPath, pEntry);
+   if (!Globals.cSettings.bQuiet)
+      statmsg(_T("Deleting"), pszPath);
+   if (bIsDir)
+   {
+      if (_trmdir(pszPath))
+      {
+         statmsg(_T("Warning: Couldn't delete directory"), pszPath);
+         Globals.cTotals.iNumWarnings++;
+      }
+      Globals.cTotals.iDestDirsDeleted++;
+   }
+   else
+   {
+      // Try to delete the file.
+      if (_tunlink(pszPath))
+      {
+         // Couldn't delete the file, so try to turn off readonly, system, and hidden flags.
+         DWORD dwTmp = pEntry->dwAttrib & (~(FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM));
+         if (!SetFileAttributes(pszPath, dwTmp))
+         {
+            statmsg(_T("Warning:  Failed changing existing read-only or hidden or system file to writable"), pszPath);
+            Globals.cTotals.iNumWarnings++;
+         }
+
+         // Try to delete it again.
+         if (_tunlink(pszPath))
+         {
+            statmsg(_T("Warning: Couldn't delete file"), pszPath);
+            Globals.cTotals.iNumWarnings++;
+         }
+      }
+      Globals.cTotals.iDestFilesDeleted++;
+      Globals.cTotals.dDestBytesDeleted += pEntry->dBytes;
+   }
+}
+
 //
 // EnumDelTagged:
 // Enumeration callback function to delete files and directories
@@ -784,92 +1243,45 @@ EnumDelTagged(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bo
    // Don't delete the destination root, which sometimes doesn't
    // get tagged (e.g. if it doesn't exist yet during the initial
    // scan, for example).
-   if (_tcsicmp(pszPath, Globals.cSettings.szDest) == 0)
+   size_t nLen = _tcslen(pszPath);
+   if (nLen == _tcslen(Globals.cSettings.szDest) && EqualNoCase(pszPath, Globals.cSettings.szDest, nLen))
       return true;
 
    // Delete the file.
    if (!(pEntry->dwUser & USERFLAG_EXISTSINSOURCE))
+      DeleteDestEntry(pszPath, pEntry, bIsDir);
+
+   // Keep processing.
+   return true;
+}
+
+//
+// CopyEntry:
+// Copies one of the source files (or creates one of the source
+// directories) in the destination.  pszRelPath is the pathname
+// relative to the source, pszNewPath is the full pathname in
+// the destination, and pExists is the entry for the same name
+// in the destination, or NULL if there isn't one.  What's
+// done is counted in cTotals, since this may be run by one of
+// the copy threads.  Returns false if copying should stop.
+//
+static bool
+CopyEntry(const _TCHAR *pszPath, const _TCHAR *pszRelPath, const _TCHAR *pszNewPath, const CDirEntry *pEntry, bool bIsDir, CDirEntry *pExists, CTotals &cTotals)
+{
+   if (pExists)
    {
-      if (!Globals.cSettings.bQuiet)
-         statmsg(_T("Deleting"), pszPath);
-      if (bIsDir)
-      {
-         if (_trmdir(pszPath))
-         {
-            statmsg(_T("Warning: Couldn't delete directory"), pszPath);
-            Globals.cTotals.iNumWarnings++;
-         }
-         Globals.cTotals.iDestDirsDeleted++;
-      }
-      else
-      {
-         // Try to delete the file.
-         if (_tunlink(pszPath))
-         {
-            // Couldn't delete the file, so try to turn off readonly, system, and hidden flags.
-            DWORD dwTmp = pEntry->dwAttrib & (~(FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM));
-            if (SetFileAttributes(pszPath, dwTmp) == INVALID_FILE_ATTRIBUTES)
-            {
-               statmsg(_T("Warning:  Failed changing existing read-only or hidden or system file to writable"), pszPath);
-               Globals.cTotals.iNumWarnings++;
-            }
-
-            // Try to delete it again.
-            if (_tunlink(pszPath))
-            {
-               statmsg(_T("Warning: Couldn't delete file"), pszPath);
-               Globals.cTotals.iNumWarnings++;
-            }
-         }
-         Globals.cTotals.iDestFilesDeleted++;
-         Globals.cTotals.dDestBytesDeleted += pEntry->dBytes;
-      }
-   }
-
-   // Keep processing.
-   return true;
-}
-
-//
-// EnumCopy:
-// Enumeration callback function to copy one of the source files
-// to the destination.
-//
-bool
-EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)
-{
-   (void)pContext;
-
-   // Build pathname of destination file or directory.
-   if (_tcsnicmp(Globals.cSettings.szSource, pszPath, _tcslen(Globals.cSettings.szSource)) != 0)
-   {
-      errmsg(__FILE__, __LINE__, _T("Internal error; bad prefix on source path"), pszPath);
-      Globals.cTotals.iNumErrors++;
-      return false;
-   }
-   _TCHAR szNewPath[MAXPATH];
-   _tcscpy_s(szNewPath, MAXPATH, Globals.cSettings.szDest);
-   if (szNewPath[_tcslen(szNewPath) - 1] != '\\')
-      _tcscat_s(szNewPath, MAXPATH, _T("\\"));
-   const _TCHAR *pszRelPath = pszPath + _tcslen(Globals.cSettings.szSource) + ((Globals.cSettings.szSource[_tcslen(Globals.cSettings.szSource) - 1] == '\\') ? 0 : 1);
-   _tcscat_s(szNewPath, MAXPATH, pszRelPath);
-
-   // See if this file exists in the destination already.
-   CDirEntry *pExists = Globals.cDestTree.FileExists(pszRelPath);
-   if (pExists)
-   {
-      // If this name is a file in one place but a directory in
-      // the other place, then complain.
-      if (bIsDir && !(pExists->dwAttrib & FILE_ATTRIBUTE_DIRECTORY))
+      // If this name is a file in one place but a directory in
+      // the other place, then complain.
+      if (bIsDir && !(pExists->dwAttrib & FILE_ATTRIBUTE_DIRECTORY))
       {
          errmsg(__FILE__, __LINE__, _T("Directory in source has same name as a file in destination"), pszRelPath);
-         Globals.cTotals.iNumErrors++;
+         cTotals.iNumErrors++;
          return false;
       }
       if (!bIsDir && (pExists->dwAttrib & FILE_ATTRIBUTE_DIRECTORY))
       {
          errmsg(__FILE__, __LINE__, _T("File in source has same name as a directory in destination"), pszRelPath);
-         Globals.cTotals.iNumErrors++;
+         cTotals.iNumErrors++;
          return false;
       }
    }
@@ -887,13 +1299,13 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
          // Create the directory.
          if (!Globals.cSettings.bNoCopy)
          {
-            if (!MakeDir(szNewPath))
+            if (!MakeDir(pszNewPath))
             {
                // Failed creating it.
-               errmsg(__FILE__, __LINE__, _T("Failed creating directory"), szNewPath);
-               Globals.cTotals.iNumErrors++;
-               if (DirExists(szNewPath))
-                  errmsg(__FILE__, __LINE__, _T("...Because it already exists"), szNewPath);
+               errmsg(__FILE__, __LINE__, _T("Failed creating directory"), pszNewPath);
+               cTotals.iNumErrors++;
+               if (DirExists(pszNewPath))
+                  errmsg(__FILE__, __LINE__, _T("...Because it already exists"), pszNewPath);
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
             }
@@ -901,17 +1313,17 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
             {
                // The directory was created ok.
                if (Globals.cSettings.bVerbose)
-                  statmsg(_T("Created directory"), szNewPath);
+                  statmsg(_T("Created directory"), pszNewPath);
    
                // Copy the source dir's attributes to the destination dir.
                DWORD dwTmp = GetFileAttributes(pszPath);
-               if (SetFileAttributes(szNewPath, dwTmp) == INVALID_FILE_ATTRIBUTES)
+               if (!SetFileAttributes(pszNewPath, dwTmp))
                {
-                  statmsg(_T("Warning:  Failed resetting file attributes on new directory"), szNewPath);
-                  Globals.cTotals.iNumWarnings++;
+                  statmsg(_T("Warning:  Failed resetting file attributes on new directory"), pszNewPath);
+                  cTotals.iNumWarnings++;
                }
    
-               Globals.cTotals.iDirsCreated++;
+               cTotals.iDirsCreated++;
             }
          }
          else // bNoCopy
@@ -921,18 +1333,20 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
             // have created if we had not been in no-copy mode.
             if (!Globals.cSettings.bQuiet)
             {
-               _tprintf(_T("Would be creating directory "));
-               _tprintf(_T("%s\n"), szNewPath);
+               tstring sText = _T("Would be creating directory ");
+               sText += pszNewPath;
+               sText += _T("\n");
+               outtext(sText.c_str());
             }
          }
       }
       else
       {
          // The destination directory already exists.
-         Globals.cTotals.iDirsAlreadyExist++;
+         cTotals.iDirsAlreadyExist++;
       }
       if (!Globals.cSettings.bNoCopy)
-         Globals.cTotals.iDirsCopied++;
+         cTotals.iDirsCopied++;
    }
    else
    {
@@ -940,6 +1354,14 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
       // Copy this file from the source to the destination.
       //
 
+      // If the file already exists in the destination, we need
+      // the size, timestamps, and attributes of both copies.
+      if (pExists)
+      {
+         LoadEntryInfo(pszPath, pEntry);
+         LoadEntryInfo(pszNewPath, pExists);
+      }
+
       // If update option is enabled, and if file already exists in
       // destination, and if it has the same file timestamp and same
       // file size, then skip copying it.
@@ -950,16 +1372,16 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
          //        the same on NTFS and WIN32 drives, so we only
          //        compare the high bits.
          if (pEntry->dBytes == pExists->dBytes &&
-            FileTimeCompare(&pEntry->ftLastWrite, &pExists->ftLastWrite) == 0
+            FileTimeCompare(pEntry->qwLastWrite, pExists->qwLastWrite) == 0
             )
          {
             // Tell the user why we're not copying this file.
             // This is not an error.
             if (Globals.cSettings.bVerbose)
-               statmsg(_T("Already exists and has same size and date"), szNewPath);
+               statmsg(_T("Already exists and has same size and date"), pszNewPath);
 
-            Globals.cTotals.iFilesAlreadyExist++;
-            Globals.cTotals.dBytesAlreadyExist += pExists->dBytes;
+            cTotals.iFilesAlreadyExist++;
+            cTotals.dBytesAlreadyExist += pExists->dBytes;
 
             return true;
          }
@@ -984,80 +1406,96 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
 #else
             DWORD dwTmp = pEntry->dwAttrib & (~(FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM));
 #endif
-            if (SetFileAttributes(szNewPath, dwTmp) == INVALID_FILE_ATTRIBUTES)
+            if (!SetFileAttributes(pszNewPath, dwTmp))
             {
-               statmsg(_T("Warning:  Failed changing existing read-only or hidden or system file to writable"), szNewPath);
-               Globals.cTotals.iNumWarnings++;
+               statmsg(_T("Warning:  Failed changing existing read-only or hidden or system file to writable"), pszNewPath);
+               cTotals.iNumWarnings++;
             }
          }
          else
          {
             // Warn user that file already exists and is read-only.
             // This is not an error.
-            statmsg(_T("Warning:  Already exists and is read-only, hidden, or system"), szNewPath);
-            Globals.cTotals.iNumWarnings++;
+            statmsg(_T("Warning:  Already exists and is read-only, hidden, or system"), pszNewPath);
+            cTotals.iNumWarnings++;
          }
       }
 
       // Tell the user which file we're copying, if not in quiet mode.
       if (!Globals.cSettings.bQuiet)
       {
-         if (Globals.cSettings.bNoCopy)
-            _tprintf(_T("Would be copying "));
-         else
-            _tprintf(_T("Copying "));
+         tstring sText = Globals.cSettings.bNoCopy ? _T("Would be copying ") : _T("Copying ");
          if (Globals.cSettings.bShowPath)
-            _tprintf(_T("%s -> %s\n"), pszPath, szNewPath);
+         {
+            sText += pszPath;
+            sText += _T(" -> ");
+            sText += pszNewPath;
+         }
          else
-            _tprintf(_T("%s\n"), pszRelPath);
+         {
+            sText += pszRelPath;
+         }
+         sText += _T("\n");
+         outtext(sText.c_str());
       }
 
+      // The progress bar is left out when several files are
+      // being copied at once.
+      bool bProgress = !Globals.cSettings.bQuiet && !Globals.cCopyPool.Active();
+      bool (*pProgress)(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double dBytesCopied, double dFileSize) =
+         bProgress ? CopyProgress : NULL;
+
       // Copy the file (unless copying is disabled).
       double dBytesCopied = 0;
       if (!Globals.cSettings.bNoCopy)
       {
          bool bCopiedOk = false;
-         switch(RawCopyFileWin32(pszPath, szNewPath, &dBytesCopied, Globals.cSettings.bPriorityLow, CopyProgress, (void *)"C"))
+#ifdef _WIN32
+         switch(RawCopyFileWin32(pszPath, pszNewPath, &dBytesCopied, Globals.cSettings.bPriorityLow, pProgress, (void *)"C"))
+#else
+         switch(RawCopyFilePosix(pszPath, pszNewPath, &dBytesCopied, Globals.cSettings.bPriorityLow, pProgress, (void *)"C"))
+#endif
          {
             case -1:
                errmsg(__FILE__, __LINE__, _T("Open for read failed"), pszPath);
-               Globals.cTotals.iNumErrors++;
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
                break;
             case -2:
-               errmsg(__FILE__, __LINE__, _T("Open for write failed"), szNewPath);
-               Globals.cTotals.iNumErrors++;
+               errmsg(__FILE__, __LINE__, _T("Open for write failed"), pszNewPath);
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
                break;
             case -3:
-               errmsg(__FILE__, __LINE__, _T("File write failed"), szNewPath);
-               Globals.cTotals.iNumErrors++;
+               errmsg(__FILE__, __LINE__, _T("File write failed"), pszNewPath);
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
                break;
             case -4:
                errmsg(__FILE__, __LINE__, _T("File read failed"), pszPath);
-               Globals.cTotals.iNumErrors++;
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
                break;
             case -5:
                errmsg(__FILE__, __LINE__, _T("Aborted by user"), pszPath);
-               Globals.cTotals.iNumErrors++;
+               cTotals.iNumErrors++;
                return false;
             default:
                bCopiedOk = true;
          }
 
-         if (!Globals.cSettings.bQuiet)
+         if (bProgress)
             _ftprintf(stderr, pszClearLine);  // To terminate line after progress report.
 
          // If copy of file's data succeeded above, then
          // also copy the file's timestamps and attributes.
          if (bCopiedOk)
          {
+#ifdef _WIN32
             // Retrieve the timestamps from the source file.
             FILETIME ftCreate, ftAccess, ftWrite;
             HANDLE hFile;
@@ -1065,7 +1503,7 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
             if (hFile == NULL)
             {
                errmsg(__FILE__, __LINE__, _T("Failed opening for timestamp retrieval"), pszPath);
-               Globals.cTotals.iNumErrors++;
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
             }
@@ -1073,56 +1511,70 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
             {
                errmsg(__FILE__, __LINE__, _T("Failed retrieving timestamp"), pszPath);
                CloseHandle(hFile);
-               Globals.cTotals.iNumErrors++;
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
             }
             CloseHandle(hFile);
    
             // Copy the source file's timestamps to the destination file.
-            hFile = CreateFile(szNewPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            hFile = CreateFile(pszNewPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
             if (hFile == NULL)
             {
-               errmsg(__FILE__, __LINE__, _T("Failed opening for timestamp update"), szNewPath);
-               Globals.cTotals.iNumErrors++;
+               errmsg(__FILE__, __LINE__, _T("Failed opening for timestamp update"), pszNewPath);
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
             }
             if (!SetFileTime(hFile, &ftCreate, &ftAccess, &ftWrite))
             {
-               errmsg(__FILE__, __LINE__, _T("Failed setting timestamp"), szNewPath);
+               errmsg(__FILE__, __LINE__, _T("Failed setting timestamp"), pszNewPath);
                CloseHandle(hFile);
-               Globals.cTotals.iNumErrors++;
+               cTotals.iNumErrors++;
                if (!Globals.cSettings.bContinueAfterError)
                   return false;
             }
             CloseHandle(hFile);
+#else
+            // Copy the source file's timestamps to the destination file.
+            if (!CopyFileTimesPosix(pszPath, pszNewPath))
+            {
+               errmsg(__FILE__, __LINE__, _T("Failed setting timestamp"), pszNewPath);
+               cTotals.iNumErrors++;
+               if (!Globals.cSettings.bContinueAfterError)
+                  return false;
+            }
+#endif
 
             // Copy the source file's attributes to the destination file.
             DWORD dwTmp = GetFileAttributes(pszPath);
-            if (SetFileAttributes(szNewPath, dwTmp) == INVALID_FILE_ATTRIBUTES)
+            if (!SetFileAttributes(pszNewPath, dwTmp))
             {
-               statmsg(_T("Warning:  Failed resetting file attributes"), szNewPath);
-               Globals.cTotals.iNumWarnings++;
+               statmsg(_T("Warning:  Failed resetting file attributes"), pszNewPath);
+               cTotals.iNumWarnings++;
             }
    
-            Globals.cTotals.iFilesCopied++;
-            Globals.cTotals.dBytesCopied += dBytesCopied;
+            cTotals.iFilesCopied++;
+            cTotals.dBytesCopied += dBytesCopied;
    
             // If verify option is enabled, compare the contents of the
             // source file with the destination file.
             if (Globals.cSettings.bVerify)
             {
                // Run the compare between the original and the copy.
-               if (!CompareFileWin32(pszPath, szNewPath, Globals.cSettings.bPriorityLow, CopyProgress, (void *)"V"))
+#ifdef _WIN32
+               if (!CompareFileWin32(pszPath, pszNewPath, Globals.cSettings.bPriorityLow, pProgress, (void *)"V"))
+#else
+               if (!CompareFilePosix(pszPath, pszNewPath, Globals.cSettings.bPriorityLow, pProgress, (void *)"V"))
+#endif
                {
                   // The copied file doesn't match the original!
                   errmsg(__FILE__, __LINE__, _T("Verify error; files are different"), pszRelPath);
-                  Globals.cTotals.iNumErrors++;
+                  cTotals.iNumErrors++;
                   if (!Globals.cSettings.bContinueAfterError)
                      return false;
                }
-               if (!Globals.cSettings.bQuiet)
+               if (bProgress)
                   _ftprintf(stderr, pszClearLine);  // To terminate line after progress report.
             }
          }
@@ -1132,21 +1584,717 @@ EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bI
          if (Globals.cSettings.bMove)
          {
             // Delete the original file.
+            LoadEntryInfo(pszPath, pEntry);
             if (_tunlink(pszPath))
             {
                statmsg(_T("Warning: Couldn't delete original file"), pszPath);
-               Globals.cTotals.iNumWarnings++;
+               cTotals.iNumWarnings++;
             }
-            Globals.cTotals.iSourceFilesDeleted++;
-            Globals.cTotals.dSourceBytesDeleted += pEntry->dBytes;
+            cTotals.iSourceFilesDeleted++;
+            cTotals.dSourceBytesDeleted += pEntry->dBytes;
+         }
+
+      }
+
+   }
+
+   // Keep copying.
+   return true;
+}
+
+//
+// CopyWorker:
+// Thread procedure for each of the copy threads, which copies
+// the files handed to the pool until there are no more.
+//
+static void
+CopyWorker(CCopyPool *pPool, CTotals *pTotals)
+{
+   COPY_JOB stJob;
+   while (pPool->Take(stJob))
+   {
+      bool bOk = CopyEntry(stJob.sPath.c_str(), stJob.sPath.c_str() + stJob.nRelStart, stJob.sNewPath.c_str(),
+         &stJob.cEntry, false, stJob.bExists ? &stJob.cExists : NULL, *pTotals);
+      pPool->Done(bOk);
+   }
+}
+
+//
+// QueueCopyEntry:
+// Same as CopyEntry, but when there are copy threads, a file
+// is handed to them instead of being copied right away.  A
+// directory is always created right away, so that it's there
+// before anything in it is copied.  Returns false if copying
+// should stop.
+//
+static bool
+QueueCopyEntry(const _TCHAR *pszPath, const _TCHAR *pszRelPath, const _TCHAR *pszNewPath, const CDirEntry *pEntry, bool bIsDir, CDirEntry *pExists)
+{
+   if (!bIsDir && Globals.cCopyPool.Active())
+      return Globals.cCopyPool.Submit(pszPath, pszRelPath, pszNewPath, pEntry, pExists);
+   return CopyEntry(pszPath, pszRelPath, pszNewPath, pEntry, bIsDir, pExists, Globals.cTotals);
+}
+
+//
+// CopySourceEntry:
+// Copies one of the source files to the destination, after
+// looking it up there.  pszRelPath is the pathname relative
+// to the source.  Returns false if copying should stop.
+//
+static bool
+CopySourceEntry(const _TCHAR *pszPath, const _TCHAR *pszRelPath, const CDirEntry *pEntry, bool bIsDir)
+{
+   // See if this file exists in the destination already.
+   CDirEntry *pExists = NULL;
+   CDirEntry cDestEntry;
+   if (Globals.cSettings.bLazyDest)
+      pExists = Globals.cDestTree.FileExistsOnDemand(Globals.cSettings.szDest, pszRelPath, Globals.cSettings.bCaseSensitive);
+   else
+   {
+      DWORD iDestNode = Globals.cDestFlat.FindNode(pszRelPath, Globals.cSettings.bCaseSensitive);
+      if (iDestNode != FLAT_NONE)
+      {
+         Globals.cDestFlat.GetEntry(iDestNode, &cDestEntry);
+         pExists = &cDestEntry;
+      }
+   }
+
+   // Build pathname of destination file or directory.
+   CPathStack cNewPath(Globals.cSettings.szDest);
+   cNewPath.Push(pszRelPath, _tcslen(pszRelPath));
+
+   return QueueCopyEntry(pszPath, pszRelPath, cNewPath.Path(), pEntry, bIsDir, pExists);
+}
+
+//
+// EnumCopy:
+// Enumeration callback function to copy one of the source files
+// to the destination.
+//
+bool
+EnumCopy(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)
+{
+   (void)pContext;
+
+   // Find the pathname relative to the source.
+   if (!StartsWithNoCase(pszPath, _tcslen(pszPath), Globals.cSettings.szSource, _tcslen(Globals.cSettings.szSource)))
+   {
+      errmsg(__FILE__, __LINE__, _T("Internal error; bad prefix on source path"), pszPath);
+      Globals.cTotals.iNumErrors++;
+      return false;
+   }
+
+   return CopySourceEntry(pszPath, pszPath + Globals.nSrcRelStart, pEntry, bIsDir);
+}
+
+//
+// DiffSourceAction:
+// CTreeDiff::EnumActions callback for EnumDiffSource.  The
+// context pointer should point to a DIFF_SOURCE_CONTEXT.
+//
+static bool
+DiffSourceAction(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   (void)cDestPath;
+   const DIFF_SOURCE_CONTEXT *pInfo = (const DIFF_SOURCE_CONTEXT *)pContext;
+   const DIFF_ACTION &stAction = Globals.cDiff.cActions[iAction];
+   if (stAction.dwAction == DIFF_DELETE || stAction.dwAction == DIFF_EXCLUDED)
+      return true;
+   if (pInfo->bSkipSame && stAction.dwAction == DIFF_SKIP && !stAction.bIsDir)
+      return true;
+   CDirEntry cEntry;
+   Globals.cDiff.GetSource(iAction, &cEntry);
+   return pInfo->pEnum(pInfo->pContext, cSrcPath.Path(), &cEntry, stAction.bIsDir);
+}
+
+//
+// EnumDiffSource:
+// Passes the source entries that have actions in Globals.cDiff
+// (that is, everything in the source that wasn't left out) to
+// an enumeration function, the same way CDir::EnumFiles would
+// for the pruned source tree, but in the order of the actions.
+// If bReverse is true, goes from the last action backwards, so
+// each directory comes after its contents.  If bSkipSame is
+// true, files that are already up to date are left out.
+// Returns false if the enumeration function returned false.
+//
+static bool
+EnumDiffSource(
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pContext,
+   bool bReverse,
+   bool bSkipSame
+   )
+{
+   DIFF_SOURCE_CONTEXT stInfo;
+   stInfo.pEnum = pEnum;
+   stInfo.pContext = pContext;
+   stInfo.bSkipSame = bSkipSame;
+   return Globals.cDiff.EnumActions(DiffSourceAction, (void *)&stInfo, bReverse);
+}
+
+//
+// CopyDiffAction:
+// CTreeDiff::EnumActions callback that copies the source file
+// or directory of one action.  The destination isn't looked up
+// again, since the action already says what's there.
+// Returns false if copying should stop.
+//
+static bool
+CopyDiffAction(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   (void)pContext;
+   const DIFF_ACTION &stAction = Globals.cDiff.cActions[iAction];
+   if (stAction.dwAction == DIFF_DELETE || stAction.dwAction == DIFF_EXCLUDED)
+      return true;
+
+   CDirEntry cEntry;
+   Globals.cDiff.GetSource(iAction, &cEntry);
+   CDirEntry cDestEntry;
+   CDirEntry *pExists = NULL;
+   if (stAction.iDest != FLAT_NONE)
+   {
+      Globals.cDestFlat.GetEntry(stAction.iDest, &cDestEntry);
+      pExists = &cDestEntry;
+   }
+   return QueueCopyEntry(cSrcPath.Path(), cSrcPath.RelPath(), cDestPath.Path(), &cEntry, stAction.bIsDir, pExists);
+}
+
+//
+// WaitDiffCopies:
+// CTreeDiff::WalkActions callback that waits for the copy
+// threads to finish everything handed to them, when leaving a
+// directory, so that /MOVE can remove it.  Returns false if a
+// copy has failed.
+//
+static bool
+WaitDiffCopies(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   (void)pContext;
+   (void)cSrcPath;
+   (void)cDestPath;
+   if (!Globals.cDiff.cActions[iAction].bIsDir)
+      return true;
+   return Globals.cCopyPool.Wait();
+}
+
+//
+// DeleteDiffAction:
+// CTreeDiff::WalkActions callback that deletes the destination
+// file or directory of an action, if it's only in the
+// destination.  Used on the way back up, so each directory is
+// emptied before it's deleted.
+//
+static bool
+DeleteDiffAction(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   (void)pContext;
+   (void)cSrcPath;
+   const DIFF_ACTION &stAction = Globals.cDiff.cActions[iAction];
+   if (stAction.dwAction == DIFF_DELETE)
+   {
+      CDirEntry cDestEntry;
+      Globals.cDestFlat.GetEntry(stAction.iDest, &cDestEntry);
+      DeleteDestEntry(cDestPath.Path(), &cDestEntry, stAction.bIsDir);
+   }
+   return true;
+}
+
+//
+// ListDiffDelete:
+// CTreeDiff::WalkActions callback that adds the destination
+// pathname of an action to a list, the same way EnumDisplay
+// would display it, if it's only in the destination.  The
+// context pointer should point to the tstring holding the list,
+// which is displayed after the source files.
+//
+static bool
+ListDiffDelete(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   (void)cSrcPath;
+   const DIFF_ACTION &stAction = Globals.cDiff.cActions[iAction];
+   if (stAction.dwAction == DIFF_DELETE)
+   {
+      tstring *psList = (tstring *)pContext;
+      *psList += stAction.bIsDir ? _T("  [") : _T("  ");
+      *psList += cDestPath.Path();
+      *psList += stAction.bIsDir ? _T("]\n") : _T("\n");
+   }
+   return true;
+}
+
+//
+// EnterDiffStages:
+// CTreeDiff::WalkActions callback for RunDiffStages, which
+// passes the action to the pEnter function of each stage, in
+// order.  The context pointer should point to the vector of
+// stages.
+//
+static bool
+EnterDiffStages(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   const std::vector<DIFF_STAGE> *pStages = (const std::vector<DIFF_STAGE> *)pContext;
+   for (size_t iStage = 0; iStage < pStages->size(); iStage++)
+   {
+      const DIFF_STAGE &stStage = (*pStages)[iStage];
+      if (stStage.pEnter != NULL && !stStage.pEnter(stStage.pContext, iAction, cSrcPath, cDestPath))
+         return false;
+   }
+   return true;
+}
+
+//
+// LeaveDiffStages:
+// Same as EnterDiffStages, but for the pLeave functions.
+//
+static bool
+LeaveDiffStages(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath)
+{
+   const std::vector<DIFF_STAGE> *pStages = (const std::vector<DIFF_STAGE> *)pContext;
+   for (size_t iStage = 0; iStage < pStages->size(); iStage++)
+   {
+      const DIFF_STAGE &stStage = (*pStages)[iStage];
+      if (stStage.pLeave != NULL && !stStage.pLeave(stStage.pContext, iAction, cSrcPath, cDestPath))
+         return false;
+   }
+   return true;
+}
+
+//
+// RunDiffStages:
+// Goes through the actions in Globals.cDiff once, passing each
+// one through all of the given stages, instead of going through
+// them once for each stage.  Each stage sees the actions in the
+// same order it would on its own: directories before their
+// contents on the way down, and after them on the way back up.
+// Returns false if a stage returned false, which stops the pass.
+//
+static bool
+RunDiffStages(const std::vector<DIFF_STAGE> &cStages)
+{
+   return Globals.cDiff.WalkActions(EnterDiffStages, LeaveDiffStages, (void *)&cStages);
+}
+
+//
+// AddDiffStage:
+// Adds a stage to the end of a list for RunDiffStages.
+//
+static void
+AddDiffStage(
+   std::vector<DIFF_STAGE> &cStages,
+   bool (*pEnter)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath),
+   bool (*pLeave)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath),
+   void *pContext
+   )
+{
+   DIFF_STAGE stStage;
+   stStage.pEnter = pEnter;
+   stStage.pLeave = pLeave;
+   stStage.pContext = pContext;
+   cStages.push_back(stStage);
+}
+
+//
+// PipelineScan:
+// Scans one directory of the source tree for /PIPELINE mode,
+// then its children.  The directory's entries are checked
+// against the destination and pruned the same way the whole
+// tree is in normal mode, then handed to the copier.  The
+// copier gets each directory before anything in it.
+// Returns false if error, or if the copier gave up.
+//
+static bool
+PipelineScan(CCopyQueue *pQueue, CDir *pDir, const tstring &sDirPath)
+{
+   // Read the entries in this directory.  Unless cleaning, what
+   // doesn't match the program options is skipped right away.
+   bool bPruneNow = !Globals.cSettings.bClean;
+   if (!pDir->ReadDirectory(sDirPath.c_str(), bPruneNow ? QuerySource : NULL, (void *)&Globals.cSettings))
+      return false;
+
+   tstring sBase = sDirPath;
+   if (sBase[sBase.size() - 1] != PATHSEP)
+      sBase += PATHSEP;
+
+   // Mark the files in the destination that also exist in the
+   // source.  An excluded subdirectory won't be scanned, so when
+   // cleaning, its contents are scanned here just for this.
+   for (int iFile = 0; iFile < static_cast<int>(pDir->cFiles.size()); iFile++)
+      EnumCheckDest(NULL, (sBase + pDir->cFiles[iFile].sName).c_str(), &pDir->cFiles[iFile], false);
+   for (int iDir = 0; iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+   {
+      tstring sSubPath = sBase + pDir->cDirs[iDir].cThis.sName;
+      EnumCheckDest(NULL, sSubPath.c_str(), &pDir->cDirs[iDir].cThis, true);
+      if (Globals.cSettings.bClean &&
+          !QuerySource((void *)&Globals.cSettings, sSubPath.c_str(), &pDir->cDirs[iDir].cThis, true))
+      {
+         CDir cExcluded;
+         if (cExcluded.ScanFiles(sSubPath.c_str()))
+         {
+            for (const CDirWalk &cItem : cExcluded.Walk(sSubPath.c_str()))
+               EnumCheckDest(NULL, cItem.Path(), cItem.Entry(), cItem.IsDir());
+         }
+      }
+   }
+
+   // Remove what doesn't match the program options.
+   if (!bPruneNow && !pDir->Prune(sDirPath.c_str(), CSourceQuery()))
+      return false;
+
+   // Pass the files to the copier.
+   for (int iFile = 0; iFile < static_cast<int>(pDir->cFiles.size()); iFile++)
+   {
+      if (!pQueue->Push(sBase + pDir->cFiles[iFile].sName, &pDir->cFiles[iFile], false))
+         return false;
+   }
+
+   // Pass each subdirectory to the copier, then scan it.
+   for (int iDir = 0; iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+   {
+      tstring sSubPath = sBase + pDir->cDirs[iDir].cThis.sName;
+      if (!pQueue->Push(sSubPath, &pDir->cDirs[iDir].cThis, true))
+         return false;
+      if (!PipelineScan(pQueue, &pDir->cDirs[iDir], sSubPath))
+      {
+         pDir->sError = pDir->cDirs[iDir].sError;
+         return false;
+      }
+   }
+
+   return true;
+}
+
+//
+// PipelineScanThread:
+// Thread procedure that scans the source tree for /PIPELINE
+// mode while the main thread copies.  pbResult points to a
+// bool that receives the result of the scan.
+//
+static void
+PipelineScanThread(CCopyQueue *pQueue, bool *pbResult)
+{
+   *pbResult = PipelineScan(pQueue, &Globals.cSrcTree, Globals.cSettings.szSource);
+   pQueue->Finish();
+}
+
+//
+// RunCopyPipeline:
+// Copies the source tree to the destination in /PIPELINE mode.
+// The source tree is scanned on a separate thread, and each file
+// and directory is copied as soon as the scanner finds it.  When
+// the copying falls behind, the scanner waits for it.  Copying is
+// done by the calling thread, in the same order as EnumFiles would
+// have passed the entries to EnumCopy.
+// Returns true if successful.
+//
+static bool
+RunCopyPipeline(void)
+{
+   CCopyQueue cQueue;
+   bool bScanOk = false;
+   std::thread cScan(PipelineScanThread, &cQueue, &bScanOk);
+
+   bool bCopyOk = true;
+   COPY_JOB stJob;
+   while (cQueue.Pop(stJob))
+   {
+      if (!EnumCopy((void *)&Globals.cSettings, stJob.sPath.c_str(), stJob.pEntry, stJob.bIsDir))
+      {
+         bCopyOk = false;
+         cQueue.Abort();
+         break;
+      }
+   }
+   cScan.join();
+
+   return bCopyOk && bScanOk;
+}
+
+//
+// WatchRelPath:
+// Returns the part of a source pathname that follows the
+// source directory.
+//
+static tstring
+WatchRelPath(const tstring &sSrcPath)
+{
+   size_t iLen = _tcslen(Globals.cSettings.szSource);
+   if (Globals.cSettings.szSource[iLen - 1] != PATHSEP)
+      iLen++;
+   if (sSrcPath.size() <= iLen)
+      return _T("");
+   return sSrcPath.substr(iLen);
+}
+
+//
+// WatchDestPath:
+// Returns the destination pathname that corresponds to a
+// source pathname.
+//
+static tstring
+WatchDestPath(const tstring &sSrcPath)
+{
+   tstring sDestPath = Globals.cSettings.szDest;
+   tstring sRelPath = WatchRelPath(sSrcPath);
+   if (sRelPath.size() > 0)
+   {
+      if (sDestPath[sDestPath.size() - 1] != PATHSEP)
+         sDestPath += PATHSEP;
+      sDestPath += sRelPath;
+   }
+   return sDestPath;
+}
+
+//
+// WatchDirIncluded:
+// Determines if a source directory would survive pruning,
+// which means that it and each directory above it (up to
+// the source directory) must be accepted by QuerySource.
+//
+static bool
+WatchDirIncluded(const tstring &sSrcDir)
+{
+   size_t iLen = _tcslen(Globals.cSettings.szSource);
+   if (!StartsWithNoCase(sSrcDir.c_str(), sSrcDir.size(), Globals.cSettings.szSource, iLen))
+      return false;
+
+   size_t iPos = iLen;
+   while (iPos < sSrcDir.size())
+   {
+      // Find the end of the next directory name.
+      while (iPos < sSrcDir.size() && sSrcDir[iPos] == PATHSEP)
+         iPos++;
+      size_t iStart = iPos;
+      while (iPos < sSrcDir.size() && sSrcDir[iPos] != PATHSEP)
+         iPos++;
+      if (iPos == iStart)
+         break;
+
+      tstring sPath = sSrcDir.substr(0, iPos);
+      CDirEntry cEntry;
+      cEntry.sName = sSrcDir.substr(iStart, iPos - iStart);
+      cEntry.dwAttrib = FILE_ATTRIBUTE_DIRECTORY;
+      cEntry.bInfoLoaded = false;
+      LoadEntryInfo(sPath.c_str(), &cEntry);
+      if (!QuerySource((void *)&Globals.cSettings, sPath.c_str(), &cEntry, true))
+         return false;
+   }
+
+   return true;
+}
+
+//
+// WatchSyncDir:
+// Brings one destination directory up to date with the
+// corresponding source directory in /WATCH mode.  New and
+// changed files are copied, new subdirectories are copied
+// whole (and watched), and with /CLEAN, anything that's no
+// longer in the source is deleted.  If bRecurse is true,
+// the subdirectories that were already in the destination
+// are brought up to date too.
+//
+static void
+WatchSyncDir(const tstring &sSrcDir, bool bRecurse)
+{
+   // Changes in a directory that's gone, or excluded, are
+   // taken care of by the directory above it, or ignored.
+   if (!DirExists(sSrcDir.c_str()) || !WatchDirIncluded(sSrcDir))
+      return;
+
+   tstring sDestDir = WatchDestPath(sSrcDir);
+   tstring sSrcBase = sSrcDir;
+   if (sSrcBase[sSrcBase.size() - 1] != PATHSEP)
+      sSrcBase += PATHSEP;
+   tstring sDestBase = sDestDir;
+   if (sDestBase[sDestBase.size() - 1] != PATHSEP)
+      sDestBase += PATHSEP;
+
+   // Read both directories.
+   CDir cSrc, cDest;
+   cSrc.ReadDirectory(sSrcDir.c_str());
+   cDest.ReadDirectory(sDestDir.c_str());
+
+   // Start watching any new subdirectories.
+   for (int iDir = 0; iDir < static_cast<int>(cSrc.cDirs.size()); iDir++)
+   {
+      tstring sSubPath = sSrcBase + cSrc.cDirs[iDir].cThis.sName;
+      if (!Globals.cWatcher.IsWatched(sSubPath.c_str()))
+      {
+         CDir cWatched;
+         if (!cWatched.ScanFiles(sSubPath.c_str(), WatchScanCallback, (void *)&Globals.cWatcher))
+         {
+            statmsg(_T("Warning:  Failed watching directory"), sSubPath.c_str());
+            Globals.cTotals.iNumWarnings++;
          }
+      }
+   }
+
+   // Mark what's in both places, before pruning, the same
+   // way EnumCheckDest does for the whole tree.
+   for (int iFile = 0; iFile < static_cast<int>(cSrc.cFiles.size()); iFile++)
+   {
+      CDirEntry *pDestEntry = cDest.FileExists(cSrc.cFiles[iFile].sName.c_str(), Globals.cSettings.bCaseSensitive);
+      if (pDestEntry != NULL)
+         pDestEntry->dwUser |= USERFLAG_EXISTSINSOURCE;
+   }
+   for (int iDir = 0; iDir < static_cast<int>(cSrc.cDirs.size()); iDir++)
+   {
+      CDirEntry *pDestEntry = cDest.FileExists(cSrc.cDirs[iDir].cThis.sName.c_str(), Globals.cSettings.bCaseSensitive);
+      if (pDestEntry != NULL)
+         pDestEntry->dwUser |= USERFLAG_EXISTSINSOURCE;
+   }
+
+   // Remove what doesn't match the program options, then fill
+   // in the subdirectories that aren't in the destination yet,
+   // so they get copied whole.
+   cSrc.Prune(sSrcDir.c_str(), CSourceQuery());
+   std::vector<tstring> cExisting;
+   for (int iDir = 0; iDir < static_cast<int>(cSrc.cDirs.size()); iDir++)
+   {
+      tstring sSubPath = sSrcBase + cSrc.cDirs[iDir].cThis.sName;
+      if (cDest.FileExists(cSrc.cDirs[iDir].cThis.sName.c_str(), Globals.cSettings.bCaseSensitive) == NULL)
+      {
+         cSrc.cDirs[iDir].ScanFiles(sSubPath.c_str());
+         cSrc.cDirs[iDir].Prune(sSubPath.c_str(), CSourceQuery());
+      }
+      else
+      {
+         cExisting.push_back(sSubPath);
+      }
+   }
+
+   // Copy, looking up the destination on demand.
+   if (!DirExists(sDestDir.c_str()) && !Globals.cSettings.bNoCopy)
+   {
+      if (!MakeDir(sDestDir.c_str()))
+      {
+         errmsg(__FILE__, __LINE__, _T("Failed creating directory"), sDestDir.c_str());
+         Globals.cTotals.iNumErrors++;
+         return;
+      }
+      Globals.cTotals.iDirsCreated++;
+   }
+   Globals.cDestTree = CDir();
+   cSrc.EnumFiles(sSrcDir.c_str(), EnumCopy, (void *)&Globals.cSettings);
 
+   // Delete what's no longer in the source.
+   if (Globals.cSettings.bClean)
+   {
+      for (int iDir = 0; iDir < static_cast<int>(cDest.cDirs.size()); iDir++)
+      {
+         if (!(cDest.cDirs[iDir].cThis.dwUser & USERFLAG_EXISTSINSOURCE))
+            cDest.cDirs[iDir].ScanFiles((sDestBase + cDest.cDirs[iDir].cThis.sName).c_str());
       }
+      cDest.EnumFilesReverse(sDestDir.c_str(), EnumDelTagged, (void *)&Globals.cSettings);
+   }
 
+   // Check the subdirectories that were already there.
+   if (bRecurse)
+   {
+      for (int i = 0; i < static_cast<int>(cExisting.size()); i++)
+         WatchSyncDir(cExisting[i], true);
    }
+}
 
-   // Keep copying.
-   return true;
+//
+// WatchRename:
+// Renames the destination copy of a source file or directory
+// that was renamed, in /WATCH mode with /CLEAN, rather than
+// copying it again under the new name and deleting the old.
+// Does nothing if the destination doesn't have the old name,
+// or already has the new one, or if the new name isn't to be
+// copied; the directories involved are brought up to date
+// afterwards anyway.
+//
+static void
+WatchRename(const tstring &sSrcFrom, const tstring &sSrcTo)
+{
+   if (!Globals.cSettings.bClean || Globals.cSettings.bNoCopy)
+      return;
+
+   // The new name has to be one that would be copied.
+   size_t iSep = sSrcTo.rfind(PATHSEP);
+   if (iSep == tstring::npos || !WatchDirIncluded(sSrcTo.substr(0, iSep)))
+      return;
+   CDirEntry cEntry;
+   cEntry.sName = sSrcTo.substr(iSep + 1);
+   cEntry.bInfoLoaded = false;
+   if (!LoadEntryInfo(sSrcTo.c_str(), &cEntry) ||
+       !QuerySource((void *)&Globals.cSettings, sSrcTo.c_str(), &cEntry, (cEntry.dwAttrib & FILE_ATTRIBUTE_DIRECTORY) != 0))
+   {
+      return;
+   }
+
+   tstring sDestFrom = WatchDestPath(sSrcFrom);
+   tstring sDestTo = WatchDestPath(sSrcTo);
+   if (GetFileAttributes(sDestFrom.c_str()) == INVALID_FILE_ATTRIBUTES ||
+       GetFileAttributes(sDestTo.c_str()) != INVALID_FILE_ATTRIBUTES)
+   {
+      return;
+   }
+
+   if (!Globals.cSettings.bQuiet)
+      statmsg(_T("Renaming"), sDestTo.c_str());
+   if (_trename(sDestFrom.c_str(), sDestTo.c_str()) != 0)
+   {
+      statmsg(_T("Warning:  Couldn't rename"), sDestFrom.c_str());
+      Globals.cTotals.iNumWarnings++;
+   }
+}
+
+//
+// RunWatch:
+// Copies changes from the source to the destination as they
+// happen, for /WATCH mode.  Changes that arrive together are
+// collected and copied in one batch.  Each changed directory
+// is compared with its copy in the destination, and only the
+// differences are copied.  Runs until interrupted.
+// Returns an exit code for the program if it fails.
+//
+static int
+RunWatch(void)
+{
+   // From here on, files that haven't changed are skipped, and
+   // the destination is read only where something changed.
+   Globals.cSettings.bUpdate = true;
+   Globals.cSettings.bLazyDest = true;
+
+   statmsg(_T("Watching for changes"), Globals.cSettings.szSource);
+   for (;;)
+   {
+      std::vector<tstring> cDirty;
+      std::vector<std::pair<tstring, tstring> > cRenames;
+      bool bOverflow = false;
+      if (!Globals.cWatcher.WaitForChanges(WATCH_QUIET_MS, WATCH_MAX_DELAY_MS, cDirty, cRenames, bOverflow))
+      {
+         errmsg(__FILE__, __LINE__, Globals.cWatcher.sError.c_str());
+         return EXIT_FAILURE;
+      }
+
+      CTotals cBefore = Globals.cTotals;
+      if (bOverflow)
+      {
+         // Some changes were lost, so check everything.
+         statmsg(_T("Too many changes at once; checking the whole tree"));
+         WatchSyncDir(Globals.cSettings.szSource, true);
+      }
+      else
+      {
+         for (int i = 0; i < static_cast<int>(cRenames.size()); i++)
+            WatchRename(cRenames[i].first, cRenames[i].second);
+         for (int i = 0; i < static_cast<int>(cDirty.size()); i++)
+            WatchSyncDir(cDirty[i], false);
+      }
+
+      // Report what this batch did.
+      _TCHAR szText[MAXPATH];
+      _stprintf_s(szText, MAXPATH, _T("Copied %d files, deleted %d files and %d directories, %d errors"),
+         Globals.cTotals.iFilesCopied - cBefore.iFilesCopied,
+         Globals.cTotals.iDestFilesDeleted - cBefore.iDestFilesDeleted,
+         Globals.cTotals.iDestDirsDeleted - cBefore.iDestDirsDeleted,
+         Globals.cTotals.iNumErrors - cBefore.iNumErrors);
+      statmsg(szText);
+   }
 }
 
 //
@@ -1178,7 +2326,8 @@ Usage(void)
      /LOG=file    Log status and error messages to specified file.\n\
 ");
    printf("\
-     /LIST        List files that would be copied, but don't copy.\n\
+     /LIST        List files that would be copied (and erased, with\n\
+                  /CLEAN), but don't copy.\n\
      /HIDDEN      Enable copying of hidden and system files.\n\
      /OVERWRITE   Enable overwriting of read-only, hidden, and system\n\
                   files in destination.\n\
@@ -1186,6 +2335,28 @@ Usage(void)
      /CLEAN       Erase files in destination that don't exist in source.\n\
      /WAIT        Wait for a keypress before copying.\n\
      /PRIORITYLOW Run program as a low priority process.\n\
+     /SCANTHREADS=n  Scan source and destination at the same time,\n\
+                  each with n worker threads, which also fetch file\n\
+                  sizes and dates n at a time.\n\
+     /SNAPSHOT=file  Keep the scanned trees in the specified file, so\n\
+                  the next run only has to read directories that\n\
+                  have changed since.\n\
+     /PIPELINE    Start copying as soon as scanning of the source\n\
+                  begins, rather than after it finishes.  The totals\n\
+                  before copying aren't shown.\n\
+     /COPYTHREADS=n  Copy up to n files at a time, each on its own\n\
+                  thread, which is much faster for lots of small\n\
+                  files.  Directories are still created first.  No\n\
+                  progress bars are shown for the files.\n\
+     /LAZYDEST    Don't scan the whole destination first; only read\n\
+                  the destination directories that files are being\n\
+                  copied to.  Can't be used with /CLEAN.\n\
+     /CASESENSITIVE  Treat names that differ only in case as different\n\
+                  files when matching the source to the destination.\n\
+     /WATCH       After copying, keep watching the source for changes\n\
+                  and copy them as they happen, until interrupted.\n\
+                  With /CLEAN, deletions and renames are mirrored too.\n\
+                  (Linux only.)\n\
 ");
    printf("\
      /ROOT        Specifies that the destination given is a \"root\" \n\
@@ -1203,17 +2374,36 @@ Usage(void)
      /INCLUDE={string}[,...]  or  /EXCLUDE={string}[,...]\n\
                   Include or exclude files whose absolute pathnames contain\n\
                   any of the specified substrings.\n\
+     /FILTER=expression\n\
+                  Only copy files that pass the given tests, which can\n\
+                  be combined with and, or, not, and parentheses:\n\
+                     size<n  size>n  (also <=, >=, =; K, M, G, T units)\n\
+                     age<n  age>n  (hours since written; M, D units)\n\
+                     depth<n  depth>n  (names below source directory)\n\
+                     attr=RHSA  name=wild  dir=wild  path~string\n\
+                  Use != or !~ for the opposite.  Example:\n\
+                     BCPY \"/FILTER=size<10M and not dir=obj\" C:\\SRC D:\\DST\n\
+");
+   printf("\
+     /RULES=file  Don't copy files or directories ignored by the rules\n\
+                  in the given file, which has the same format as the\n\
+                  .gitignore files used by git.  Its patterns match\n\
+                  pathnames below the source directory.\n\
+     /IGNOREFILE=name  Also use the rules in any file with the given\n\
+                  name (such as .gitignore) in each source directory,\n\
+                  for the files below that directory.\n\
+     @file        Read more options and arguments from the given file,\n\
+                  one per line.  Blank lines and lines starting with\n\
+                  # or ; are skipped.\n\
      /VERBOSE     Enable verbose output.\n\
 ");
 
 }
 
-#if 0
-// Not currently used
-
 //
 // ParseArgFile:
-// Parses command-line arguments from a file.
+// Parses command-line arguments from a file, one per line,
+// for the @file argument.  Lines can be any length.
 //
 // Parameters:
 //    Name     Description
@@ -1229,14 +2419,14 @@ Usage(void)
 static int
 ParseArgFile(FILE *fp)
 {
-   _TCHAR   szLine[512];
+   tstring  sLine;
    _TCHAR * p;
 
    // Process each line of text in the file.
-   while (readline(fp, szLine, 511))
+   while (readline(fp, sLine))
    {
       // Skip leading whitespace on input line.
-      p = &szLine[0];
+      p = &sLine[0];
       while (*p == ' ' || *p == '\t')
          p++;
 
@@ -1244,8 +2434,13 @@ ParseArgFile(FILE *fp)
       if (*p == '\0' || *p == '#' || *p == ';')
          continue;  // Line is blank or has a comment.
 
+      // Drop trailing whitespace.
+      size_t nLen = _tcslen(p);
+      while (nLen > 0 && (p[nLen - 1] == ' ' || p[nLen - 1] == '\t'))
+         p[--nLen] = '\0';
+
       // Parse the argument in the line.
-      if (!ParseArgument(szLine))
+      if (!ParseArgument(p))
       {
          return 0;
       }
@@ -1255,7 +2450,39 @@ ParseArgFile(FILE *fp)
    return 1;
 }
 
-#endif
+//
+// ParseDate:
+// Parses a date of the form mm/dd/yyyy, for the /NEW and /OLD
+// options.  Fills in the month, day, and year, and the time of
+// midnight (UTC) at the start of that day.
+// Returns false if the date isn't valid.
+//
+static bool
+ParseDate(const _TCHAR *pszDate, int *piMonth, int *piDay, int *piYear, ULONGLONG *pqwTicks)
+{
+   if (_tcslen(pszDate) != 10 || pszDate[2] != '/' || pszDate[5] != '/')
+      return false;
+   for (int i = 0; i < 10; i++)
+   {
+      if (i != 2 && i != 5 && !_istdigit(pszDate[i]))
+         return false;
+   }
+
+   *piMonth = _ttoi(pszDate);
+   *piDay = _ttoi(&pszDate[3]);
+   *piYear = _ttoi(&pszDate[6]);
+
+   SYSTEMTIME stTime;
+   memset(&stTime, 0, sizeof(stTime));
+   stTime.wYear = static_cast<WORD>(*piYear);
+   stTime.wMonth = static_cast<WORD>(*piMonth);
+   stTime.wDay = static_cast<WORD>(*piDay);
+   FILETIME ftTime;
+   if (!SystemTimeToFileTime(&stTime, &ftTime))
+      return false;
+   *pqwTicks = FileTimeToTicks(&ftTime);
+   return true;
+}
 
 //
 // ParseArgument:
@@ -1284,7 +2511,32 @@ ParseArgument(_TCHAR *szArg)
       Usage();
       return 0;
    }
+   else if (szArg[0] == '@')
+   {
+      // Read more arguments from a file.
+      static int iDepth = 0;
+      if (iDepth >= ARGFILE_MAX_DEPTH)
+      {
+         errmsg(__FILE__, __LINE__, _T("Argument files nested too deeply (does one include itself?)"), szArg);
+         return 0;
+      }
+      FILE *pFile;
+      if (_tfopen_s(&pFile, szArg + 1, _T("r")))
+      {
+         errmsg(__FILE__, __LINE__, _T("Failed opening argument file"), szArg);
+         return 0;
+      }
+      iDepth++;
+      int iResult = ParseArgFile(pFile);
+      iDepth--;
+      fclose(pFile);
+      return iResult;
+   }
+#ifdef _WIN32
    else if (szArg[0] == '/' || szArg[0] == '-')
+#else
+   else if (szArg[0] == '-')  // On POSIX systems, '/' begins a pathname.
+#endif
    {
       // This command line argument is an option switch.
       // Figure out which one and set the corresponding option.
@@ -1374,13 +2626,58 @@ ParseArgument(_TCHAR *szArg)
          // Select low priority execution.
          Globals.cSettings.bPriorityLow = true;
       }
+      else if (OptionNameIs(szArg, _T("WATCH")))
+      {
+         // Enable mirroring of changes.
+         Globals.cSettings.bWatch = true;
+      }
+      else if (OptionNameIs(szArg, _T("CASESENSITIVE")))
+      {
+         // Enable case-sensitive name matching.
+         Globals.cSettings.bCaseSensitive = true;
+      }
+      else if (OptionNameIs(szArg, _T("LAZYDEST")))
+      {
+         // Enable on-demand destination lookups.
+         Globals.cSettings.bLazyDest = true;
+      }
+      else if (OptionNameIs(szArg, _T("PIPELINE")))
+      {
+         // Enable copying while scanning.
+         Globals.cSettings.bPipeline = true;
+      }
+      else if (OptionNameIs(szArg, _T("SNAPSHOT")))
+      {
+         // Set snapshot file name.
+         _tcscpy_s(Globals.cSettings.szSnapshot, MAXPATH, OptionValue(szArg));
+      }
+      else if (OptionNameIs(szArg, _T("SCANTHREADS")))
+      {
+         // Set number of scanning threads.
+         Globals.cSettings.iScanThreads = _ttoi(OptionValue(szArg));
+         if (Globals.cSettings.iScanThreads < 1 || Globals.cSettings.iScanThreads > 256)
+         {
+            errmsg(__FILE__, __LINE__, _T("Invalid number of scanning threads"), szArg);
+            return 0;
+         }
+      }
+      else if (OptionNameIs(szArg, _T("COPYTHREADS")))
+      {
+         // Set number of copying threads.
+         Globals.cSettings.iCopyThreads = _ttoi(OptionValue(szArg));
+         if (Globals.cSettings.iCopyThreads < 1 || Globals.cSettings.iCopyThreads > 256)
+         {
+            errmsg(__FILE__, __LINE__, _T("Invalid number of copying threads"), szArg);
+            return 0;
+         }
+      }
       else if (OptionNameIs(szArg, _T("INCLUDE")))
       {
          // Add include strings.
          const _TCHAR *p = OptionValue(szArg);
          while (*p != '\0')
          {
-            std::wstring s;
+            tstring s;
             s = _T("");
             while (*p == ' ' || *p == '\t' || *p == ',')
                p++;
@@ -1398,6 +2695,7 @@ ParseArgument(_TCHAR *szArg)
                p++;
             Trim(s);
             Globals.cSettings.cIncludes.push_back(s);
+            Globals.cSettings.cFilter.AddSubstring(s.c_str(), true);
          }
       }
       else if (OptionNameIs(szArg, _T("EXCLUDE")))
@@ -1406,7 +2704,7 @@ ParseArgument(_TCHAR *szArg)
          const _TCHAR *p = OptionValue(szArg);
          while (*p != '\0')
          {
-            std::wstring s;
+            tstring s;
             s = _T("");
             while (*p == ' ' || *p == '\t' || *p == ',')
                p++;
@@ -1424,31 +2722,64 @@ ParseArgument(_TCHAR *szArg)
                p++;
             Trim(s);
             Globals.cSettings.cExcludes.push_back(s);
+            Globals.cSettings.cFilter.AddSubstring(s.c_str(), false);
+         }
+      }
+      else if (OptionNameIs(szArg, _T("FILTER")))
+      {
+         // Add a filter expression.
+         if (!Globals.cSettings.cFilter.AddExpression(OptionValue(szArg)))
+         {
+            errmsg(__FILE__, __LINE__, Globals.cSettings.cFilter.sError.c_str(), szArg);
+            return 0;
+         }
+         Globals.cSettings.cFilters.push_back(OptionValue(szArg));
+      }
+      else if (OptionNameIs(szArg, _T("RULES")))
+      {
+         // Add a global rules file.
+         if (!Globals.cSettings.cFilter.AddRulesFile(OptionValue(szArg)))
+         {
+            errmsg(__FILE__, __LINE__, Globals.cSettings.cFilter.sError.c_str(), szArg);
+            return 0;
+         }
+         Globals.cSettings.cRulesFiles.push_back(OptionValue(szArg));
+      }
+      else if (OptionNameIs(szArg, _T("IGNOREFILE")))
+      {
+         // Set name of per-directory rules files.
+         if (*OptionValue(szArg) == '\0')
+         {
+            errmsg(__FILE__, __LINE__, _T("Missing rules file name"), szArg);
+            return 0;
          }
+         Globals.cSettings.cFilter.AddDirRulesFile(OptionValue(szArg));
+         Globals.cSettings.sIgnoreFile = OptionValue(szArg);
       }
       else if (OptionNameIs(szArg, _T("NEW")))
       {
-         // Get newer-than date setting.
-         if (_tcslen(OptionValue(szArg)) >= 11 || szArg[2] != '/' || szArg[5] != '/')
+         // Get newer-than date setting.  Files from that day
+         // on are copied.
+         if (!ParseDate(OptionValue(szArg), &Globals.cSettings.iNewerMonth,
+               &Globals.cSettings.iNewerDay, &Globals.cSettings.iNewerYear,
+               &Globals.cSettings.qwNewerThan))
          {
             errmsg(__FILE__, __LINE__, _T("Invalid date format"), szArg);
                return 0;
          }
-         Globals.cSettings.iNewerMonth = _ttoi(OptionValue(szArg));
-         Globals.cSettings.iNewerDay = _ttoi(&OptionValue(szArg)[3]);
-         Globals.cSettings.iNewerYear = _ttoi(&OptionValue(szArg)[6]);
       }
       else if (OptionNameIs(szArg, _T("OLD")))
       {
-         // Get older-than date setting.
-         if (_tcslen(OptionValue(szArg)) >= 11 || szArg[2] != '/' || szArg[5] != '/')
+         // Get older-than date setting.  Files up to the end
+         // of that day are copied.
+         if (!ParseDate(OptionValue(szArg), &Globals.cSettings.iOlderMonth,
+               &Globals.cSettings.iOlderDay, &Globals.cSettings.iOlderYear,
+               &Globals.cSettings.qwOlderThan))
          {
             errmsg(__FILE__, __LINE__, _T("Invalid date format"), szArg);
                return 0;
          }
-         Globals.cSettings.iOlderMonth = _ttoi(OptionValue(szArg));
-         Globals.cSettings.iOlderDay = _ttoi(&OptionValue(szArg)[3]);
-         Globals.cSettings.iOlderYear = _ttoi(&OptionValue(szArg)[6]);
+         Globals.cSettings.qwOlderThan += FILETIME_TICKS_PER_DAY;
       }
       else
       {
@@ -1475,7 +2806,12 @@ ParseArgument(_TCHAR *szArg)
       {
          // This argument is a wildcard base filename to match.
          // Add it to the list of wildcards.
-         std::wstring s = szArg;
+         if (!Globals.cSettings.cFilter.AddWildcard(szArg))
+         {
+            errmsg(__FILE__, __LINE__, Globals.cSettings.cFilter.sError.c_str(), szArg);
+            return 0;
+         }
+         tstring s = szArg;
          Globals.cSettings.cWilds.push_back(s);
       }
    }
@@ -1527,6 +2863,29 @@ main(int argc, char **argv)
       return EXIT_FAILURE;
    }
 
+   // Pipeline mode copies while scanning, so it can't list the
+   // files first, or scan from a snapshot.
+   if (Globals.cSettings.bPipeline && (Globals.cSettings.bList || Globals.cSettings.szSnapshot[0] != '\0'))
+   {
+      errmsg(__FILE__, __LINE__, _T("/PIPELINE can't be used with /LIST or /SNAPSHOT"));
+      return EXIT_FAILURE;
+   }
+
+   // Cleaning needs to see everything in the destination.
+   if (Globals.cSettings.bLazyDest && Globals.cSettings.bClean)
+   {
+      errmsg(__FILE__, __LINE__, _T("/LAZYDEST can't be used with /CLEAN"));
+      return EXIT_FAILURE;
+   }
+
+   // Watching makes no sense if the source goes away, or if
+   // nothing is copied.
+   if (Globals.cSettings.bWatch && (Globals.cSettings.bMove || Globals.cSettings.bList))
+   {
+      errmsg(__FILE__, __LINE__, _T("/WATCH can't be used with /MOVE or /LIST"));
+      return EXIT_FAILURE;
+   }
+
    // Rationalize source and destination paths.
    rationalize_path(Globals.cSettings.szSource);
    rationalize_path(Globals.cSettings.szDest);
@@ -1552,7 +2911,28 @@ main(int argc, char **argv)
             _tcscat_s(Globals.cSettings.szDest, MAXPATH, _T("\\"));
          _tcscat_s(Globals.cSettings.szDest, MAXPATH, &p[3]);
       }
+#ifndef _WIN32
+      else if (p[0] == '/' && p[1] != '\0')
+      {
+         // POSIX paths have no drive, so just skip the root.
+         if (Globals.cSettings.szDest[_tcslen(Globals.cSettings.szDest) - 1] != PATHSEP)
+            _tcscat_s(Globals.cSettings.szDest, MAXPATH, PATHSEP_STR);
+         _tcscat_s(Globals.cSettings.szDest, MAXPATH, &p[1]);
+      }
+#endif
    }
+   Globals.nSrcRelStart = _tcslen(Globals.cSettings.szSource);
+   if (Globals.cSettings.szSource[Globals.nSrcRelStart - 1] != PATHSEP)
+      Globals.nSrcRelStart++;
+
+   // Add the dates and hidden file settings to the filter (the
+   // rest were added as they were parsed), and compile it.
+   if (Globals.cSettings.iOlderYear != -1 || Globals.cSettings.iNewerYear != -1)
+      Globals.cSettings.cFilter.AddDateRange(Globals.cSettings.qwNewerThan, Globals.cSettings.qwOlderThan);
+   if (!Globals.cSettings.bHidden)
+      Globals.cSettings.cFilter.AddNoAttributes(FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+   Globals.cSettings.cFilter.SetCaseSensitive(Globals.cSettings.bCaseSensitive);
+   Globals.cSettings.cFilter.Compile(Globals.nSrcRelStart);
 
    // Display summary of options.
    if (Globals.cSettings.bVerbose)
@@ -1567,9 +2947,9 @@ main(int argc, char **argv)
             _tprintf(_T("    %s\n"), Globals.cSettings.cWilds[iWild].c_str());
       }
       if (Globals.cSettings.iNewerYear != -1)
-         _tprintf(_T("  Only if newer than %02d/%02d/%04d\n"), Globals.cSettings.iNewerMonth, Globals.cSettings.iNewerMonth, Globals.cSettings.iNewerYear);
+         _tprintf(_T("  Only if newer than %02d/%02d/%04d\n"), Globals.cSettings.iNewerMonth, Globals.cSettings.iNewerDay, Globals.cSettings.iNewerYear);
       if (Globals.cSettings.iOlderYear != -1)
-         _tprintf(_T("  Only if older than %02d/%02d/%04d\n"), Globals.cSettings.iOlderMonth, Globals.cSettings.iOlderMonth, Globals.cSettings.iOlderYear);
+         _tprintf(_T("  Only if older than %02d/%02d/%04d\n"), Globals.cSettings.iOlderMonth, Globals.cSettings.iOlderDay, Globals.cSettings.iOlderYear);
       if (Globals.cSettings.cIncludes.size() > 0)
       {
          _tprintf(_T("  Including:\n"));
@@ -1582,6 +2962,20 @@ main(int argc, char **argv)
          for (int i = 0; i < (int)Globals.cSettings.cExcludes.size(); i++)
             _tprintf(_T("    %s\n"), Globals.cSettings.cExcludes[i].c_str());
       }
+      if (Globals.cSettings.cFilters.size() > 0)
+      {
+         _tprintf(_T("  Filters:\n"));
+         for (int i = 0; i < (int)Globals.cSettings.cFilters.size(); i++)
+            _tprintf(_T("    %s\n"), Globals.cSettings.cFilters[i].c_str());
+      }
+      if (Globals.cSettings.cRulesFiles.size() > 0)
+      {
+         _tprintf(_T("  Rules files:\n"));
+         for (int i = 0; i < (int)Globals.cSettings.cRulesFiles.size(); i++)
+            _tprintf(_T("    %s\n"), Globals.cSettings.cRulesFiles[i].c_str());
+      }
+      if (!Globals.cSettings.sIgnoreFile.empty())
+         _tprintf(_T("  Rules in each directory:  %s\n"), Globals.cSettings.sIgnoreFile.c_str());
       _tprintf(_T("  Verbose output:           %s\n"), Globals.cSettings.bVerbose ? _T("yes") : _T("no"));
       _tprintf(_T("  Update if different:      %s\n"), Globals.cSettings.bUpdate ? _T("yes") : _T("no"));
       _tprintf(_T("  Verify copied files:      %s\n"), Globals.cSettings.bVerify ? _T("yes") : _T("no"));
@@ -1595,67 +2989,239 @@ main(int argc, char **argv)
       _tprintf(_T("  Clean destination:        %s\n"), Globals.cSettings.bClean ? _T("yes") : _T("no"));
       _tprintf(_T("  Wait before starting:     %s\n"), Globals.cSettings.bWait ? _T("yes") : _T("no"));
       _tprintf(_T("  Low priority mode:        %s\n"), Globals.cSettings.bPriorityLow ? _T("yes") : _T("no"));
+      _tprintf(_T("  Scanning threads:         %d\n"), Globals.cSettings.iScanThreads);
+      if (Globals.cSettings.szSnapshot[0] != '\0')
+         _tprintf(_T("  Snapshot file:            %s\n"), Globals.cSettings.szSnapshot);
+      _tprintf(_T("  Copy while scanning:      %s\n"), Globals.cSettings.bPipeline ? _T("yes") : _T("no"));
+      _tprintf(_T("  Copying threads:          %d\n"), Globals.cSettings.iCopyThreads);
+      _tprintf(_T("  Scan dest on demand:      %s\n"), Globals.cSettings.bLazyDest ? _T("yes") : _T("no"));
+      _tprintf(_T("  Case sensitive names:     %s\n"), Globals.cSettings.bCaseSensitive ? _T("yes") : _T("no"));
+      _tprintf(_T("  Watch for changes:        %s\n"), Globals.cSettings.bWatch ? _T("yes") : _T("no"));
+      _tprintf(_T("  String functions:         %s\n"), StringKernelName());
    }
 
    // If low priority execution requested, then change priority of
    // the current process.
    if (Globals.cSettings.bPriorityLow)
    {
+#ifdef _WIN32
       SetPriorityClass(GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS);
+#else
+      setpriority(PRIO_PROCESS, 0, 10);
+#endif
    }
 
-   // Start timing.
-   Globals.tStartTime = clock();
-   Globals.tLastProgress = clock();
-
-   // Scan source directory tree for all files.
-   statmsg(_T("Scanning source tree"), Globals.cSettings.szSource);
-   if (!Globals.cSrcTree.ScanFiles(Globals.cSettings.szSource, TreeScanCallback, NULL))
+   // Start watching the source before it's scanned, so that
+   // nothing that changes during the first copy is missed.
+   if (Globals.cSettings.bWatch)
    {
-      statmsg(Globals.cSrcTree.sError.c_str());
-      return EXIT_FAILURE;
+      statmsg(_T("Setting up watch on source tree"), Globals.cSettings.szSource);
+      CDir cWatched;
+      if (!Globals.cWatcher.Open() ||
+          !cWatched.ScanFiles(Globals.cSettings.szSource, WatchScanCallback, (void *)&Globals.cWatcher))
+      {
+         errmsg(__FILE__, __LINE__, Globals.cWatcher.sError.c_str());
+         return EXIT_FAILURE;
+      }
    }
-   _ftprintf(stderr, pszClearLine);
-   if (Globals.cSrcTree.cFiles.size() < 1 && Globals.cSrcTree.cDirs.size() < 1)
+
+   // Start timing.
+   Globals.tStartTime = WallClock();
+   Globals.tLastProgress = WallClock();
+
+   // Unless the destination is being cleaned (which has to see
+   // everything in the source, so that the destination copies of
+   // excluded files are kept), the source is pruned as it's
+   // scanned, so excluded directories are never read.
+   bool (*pScanQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir) = NULL;
+   if (!Globals.cSettings.bClean)
+      pScanQuery = QuerySource;
+   bool bPrunedAtScan = false;
+
+   // When the whole destination is scanned, the two trees are
+   // compared once, and the copying, listing, and cleaning all
+   // work from the result.  Otherwise (in pipeline mode, or when
+   // the destination is looked up on demand), each source file
+   // is looked up in the destination as it's copied.  When
+   // comparing, the source tree is kept in the flat tree store
+   // once it's scanned, the same as the destination.
+   bool bDiff = !Globals.cSettings.bPipeline && !Globals.cSettings.bLazyDest;
+
+   if (Globals.cSettings.bPipeline)
    {
-      errmsg(__FILE__, __LINE__, _T("Nothing in source directory to copy"));
-      return EXIT_FAILURE;
+      // Only the destination is scanned up front.  The source
+      // is scanned while copying.
+      if (!Globals.cSettings.bLazyDest)
+      {
+         statmsg(_T("Scanning destination tree"), Globals.cSettings.szDest);
+         if (!Globals.cDestTree.ScanFilesParallel(Globals.cSettings.szDest,
+               Globals.cSettings.iScanThreads, TreeScanCallback, NULL))
+         {
+            errmsg(__FILE__, __LINE__, Globals.cDestTree.sError.c_str());
+            return EXIT_FAILURE;
+         }
+         _ftprintf(stderr, pszClearLine);
+         FlattenDestTree();
+      }
    }
+   else if (Globals.cSettings.szSnapshot[0] != '\0')
+   {
+      // Scan both trees, reading only the directories that have
+      // changed since the snapshot was taken.
+      CDir cSrcCache, cDestCache;
+      LoadSnapshots(&cSrcCache, &cDestCache);
+
+      statmsg(_T("Scanning source tree"), Globals.cSettings.szSource);
+      if (!Globals.cSrcTree.ScanFilesIncremental(Globals.cSettings.szSource, &cSrcCache, TreeScanCallback, NULL))
+      {
+         statmsg(Globals.cSrcTree.sError.c_str());
+         return EXIT_FAILURE;
+      }
+      _ftprintf(stderr, pszClearLine);
+      if (Globals.cSrcTree.cFiles.size() < 1 && Globals.cSrcTree.cDirs.size() < 1)
+      {
+         errmsg(__FILE__, __LINE__, _T("Nothing in source directory to copy"));
+         return EXIT_FAILURE;
+      }
+
+      if (!Globals.cSettings.bLazyDest)
+      {
+         statmsg(_T("Scanning destination tree"), Globals.cSettings.szDest);
+         if (!Globals.cDestTree.ScanFilesIncremental(Globals.cSettings.szDest, &cDestCache, TreeScanCallback, NULL))
+         {
+            errmsg(__FILE__, __LINE__, Globals.cDestTree.sError.c_str());
+            return EXIT_FAILURE;
+         }
+         _ftprintf(stderr, pszClearLine);
+      }
 
-   // Scan destination directory tree for all files.
-   statmsg(_T("Scanning destination tree"), Globals.cSettings.szDest);
-   if (!Globals.cDestTree.ScanFiles(Globals.cSettings.szDest, TreeScanCallback, NULL))
+      // Save the trees for next time, before pruning removes
+      // anything from them.
+      if (!SaveSnapshots())
+         statmsg(_T("Warning: Couldn't write snapshot file"), Globals.cSettings.szSnapshot);
+      if (bDiff)
+         FlattenSourceTree();
+      if (!Globals.cSettings.bLazyDest)
+         FlattenDestTree();
+   }
+   else if (Globals.cSettings.iScanThreads > 1)
    {
-      errmsg(__FILE__, __LINE__, Globals.cSrcTree.sError.c_str());
-      return EXIT_FAILURE;
+      // Scan the source and destination trees at the same time,
+      // each with a team of worker threads.
+      statmsg(_T("Scanning source tree"), Globals.cSettings.szSource);
+      if (!Globals.cSettings.bLazyDest)
+         statmsg(_T("Scanning destination tree"), Globals.cSettings.szDest);
+      bool bDestOk = false;
+      std::thread cDestScan(ScanDestThread, &bDestOk);
+      bool bSrcOk = Globals.cSrcTree.ScanFilesParallel(Globals.cSettings.szSource,
+         Globals.cSettings.iScanThreads, TreeScanCallback, NULL, pScanQuery, (void *)&Globals.cSettings);
+      bPrunedAtScan = (pScanQuery != NULL);
+      cDestScan.join();
+      _ftprintf(stderr, pszClearLine);
+      if (!bSrcOk)
+      {
+         statmsg(Globals.cSrcTree.sError.c_str());
+         return EXIT_FAILURE;
+      }
+      if (Globals.cSrcTree.cFiles.size() < 1 && Globals.cSrcTree.cDirs.size() < 1)
+      {
+         errmsg(__FILE__, __LINE__, _T("Nothing in source directory to copy"));
+         return EXIT_FAILURE;
+      }
+      if (!bDestOk)
+      {
+         errmsg(__FILE__, __LINE__, Globals.cDestTree.sError.c_str());
+         return EXIT_FAILURE;
+      }
+      if (bDiff)
+         FlattenSourceTree();
+      if (!Globals.cSettings.bLazyDest)
+         FlattenDestTree();
+   }
+   else
+   {
+      // Scan source directory tree for all files, straight
+      // into the flat tree store if the trees are to be
+      // compared.
+      statmsg(_T("Scanning source tree"), Globals.cSettings.szSource);
+      if (bDiff ? !Globals.cSrcFlat.ScanFiles(Globals.cSettings.szSource, TreeScanCallback, NULL, pScanQuery, (void *)&Globals.cSettings) :
+                  !Globals.cSrcTree.ScanFiles(Globals.cSettings.szSource, TreeScanCallback, NULL, pScanQuery, (void *)&Globals.cSettings))
+      {
+         statmsg(bDiff ? Globals.cSrcFlat.sError.c_str() : Globals.cSrcTree.sError.c_str());
+         return EXIT_FAILURE;
+      }
+      bPrunedAtScan = (pScanQuery != NULL);
+      _ftprintf(stderr, pszClearLine);
+      if (bDiff ? Globals.cSrcFlat.cNodes.size() < 2 :
+                  Globals.cSrcTree.cFiles.size() < 1 && Globals.cSrcTree.cDirs.size() < 1)
+      {
+         errmsg(__FILE__, __LINE__, _T("Nothing in source directory to copy"));
+         return EXIT_FAILURE;
+      }
+
+      // Scan destination directory tree for all files.
+      if (!Globals.cSettings.bLazyDest)
+      {
+         statmsg(_T("Scanning destination tree"), Globals.cSettings.szDest);
+         if (!Globals.cDestFlat.ScanFiles(Globals.cSettings.szDest, TreeScanCallback, NULL))
+         {
+            errmsg(__FILE__, __LINE__, Globals.cDestFlat.sError.c_str());
+            return EXIT_FAILURE;
+         }
+         _ftprintf(stderr, pszClearLine);
+      }
    }
-   _ftprintf(stderr, pszClearLine);
 
    // Display scanning time.
-   _tprintf(_T("Scanning Time:  %.2f Seconds\n"), (double)(clock() - Globals.tStartTime) / (double)CLOCKS_PER_SEC);
+   _tprintf(_T("Scanning Time:  %.2f Seconds\n"), (double)(WallClock() - Globals.tStartTime) / (double)CLOCKS_PER_SEC);
 
-   // Mark files in dest tree that also exist in source tree.
-   if (!Globals.cSrcTree.EnumFiles(Globals.cSettings.szSource, EnumCheckDest, (void *)&Globals.cSettings))
-   {
-      errmsg(__FILE__, __LINE__, _T("Failed enumerating files"));
-      return EXIT_FAILURE;
-   }
+   // The date filters need the timestamps of all the source
+   // files, so fetch any the scan didn't get, in bulk.  When
+   // comparing, nothing is pruned first, so that's done below.
+   if (!Globals.cSettings.bPipeline && !bPrunedAtScan && !bDiff &&
+       (Globals.cSettings.iOlderYear != -1 || Globals.cSettings.iNewerYear != -1))
+      Globals.cSrcTree.LoadTreeInfo(Globals.cSettings.szSource, Globals.cSettings.iScanThreads);
 
    // Remove any files from the source tree that don't match
    // the program options (e.g. excluded files, files outside
    // the specified date range, files not matching the wildcards,
-   // etc.)
-   if (Globals.cSettings.bVerbose)
+   // etc.)  When comparing the trees, this is done as part of
+   // the comparison instead.
+   if (Globals.cSettings.bVerbose && !Globals.cSettings.bPipeline && !bPrunedAtScan && !bDiff)
       statmsg(_T("Pruning source tree"));
-   if (!Globals.cSrcTree.PruneFiles(Globals.cSettings.szSource, QuerySource, (void *)&Globals.cSettings))
+   if (!Globals.cSettings.bPipeline && !bPrunedAtScan && !bDiff && !Globals.cSrcTree.Prune(Globals.cSettings.szSource, CSourceQuery(), Globals.cSettings.iScanThreads))
    {
       errmsg(__FILE__, __LINE__, _T("Failed pruning source file list"), Globals.cSrcTree.sError.c_str());
       return EXIT_FAILURE;
    }
 
-   // Display summary of file counts and sizes.
-   if (Globals.cSettings.bVerbose)
+   // Fetch the sizes and timestamps for the rest of the copy,
+   // for the files that survived pruning.
+   if (bDiff)
+      Globals.cSrcFlat.LoadTreeInfo(Globals.cSettings.szSource, Globals.cSettings.iScanThreads);
+   else if (!Globals.cSettings.bPipeline)
+      Globals.cSrcTree.LoadTreeInfo(Globals.cSettings.szSource, Globals.cSettings.iScanThreads);
+   Globals.cDestFlat.LoadTreeInfo(Globals.cSettings.szDest, Globals.cSettings.iScanThreads);
+
+   // Work out what to do with each file and directory.
+   if (bDiff)
+   {
+      if (Globals.cSettings.bVerbose)
+         statmsg(_T("Comparing source and destination trees"));
+      if (!Globals.cDiff.Compare(&Globals.cSrcFlat, Globals.cSettings.szSource,
+            &Globals.cDestFlat, Globals.cSettings.szDest, Globals.cSettings.bCaseSensitive,
+            bPrunedAtScan ? NULL : QuerySource, (void *)&Globals.cSettings))
+      {
+         errmsg(__FILE__, __LINE__, _T("Failed comparing trees"), Globals.cDiff.sError.c_str());
+         return EXIT_FAILURE;
+      }
+   }
+
+   // Display summary of file counts and sizes.  In pipeline
+   // mode, the source hasn't been scanned yet.
+   if (Globals.cSettings.bVerbose && !Globals.cSettings.bPipeline)
       statmsg(_T("Totalling"));
+   if (!Globals.cSettings.bPipeline)
    {
       ENUM_COUNT_STRUCT stCounts;
 
@@ -1664,13 +3230,11 @@ main(int argc, char **argv)
       _tprintf(_T("  --------------------- ------------- ----------- ------------------\n"));
 
       // Count source files.
-      memset(&stCounts, 0, sizeof(stCounts));
-      if (!Globals.cSrcTree.EnumFiles(Globals.cSettings.szSource, EnumCallbackCountFiles, (void *)&stCounts))
-      {
-         errmsg(__FILE__, __LINE__, _T("Failed enumerating files"));
-         return EXIT_FAILURE;
-      }
-      if (Globals.cSettings.szSource[_tcslen(Globals.cSettings.szSource) - 1] != '\\')
+      if (bDiff)
+         Globals.cDiff.CountSource(&stCounts);
+      else
+         Globals.cSrcTree.CountFiles(&stCounts);
+      if (Globals.cSettings.szSource[_tcslen(Globals.cSettings.szSource) - 1] != PATHSEP)
          stCounts.iNumDirs++; // Include the root.
       _TCHAR szTmp[MAXPATH];
       _TCHAR szTmp2[MAXPATH];
@@ -1683,24 +3247,28 @@ main(int argc, char **argv)
       FormatThousands(szTmp3);
       _tprintf(_T("  Source contains       %13s %11s %18s\n"),
          szTmp, szTmp2, szTmp3);
+      Globals.dJobBytes = stCounts.dTotalBytes;
 
-      // Count destination files.
-      memset(&stCounts, 0, sizeof(stCounts));
-      if (!Globals.cDestTree.EnumFiles(Globals.cSettings.szSource, EnumCallbackCountFiles, (void *)&stCounts))
+      // Count destination files, unless the destination is
+      // looked up on demand.
+      if (Globals.cSettings.bLazyDest)
       {
-         errmsg(__FILE__, __LINE__, _T("Failed enumerating files"));
-         return EXIT_FAILURE;
+         _tprintf(_T("  Destination contains  (not scanned)\n"));
+      }
+      else
+      {
+         Globals.cDestFlat.CountFiles(&stCounts, Globals.cSettings.iScanThreads);
+         if (Globals.cSettings.szDest[_tcslen(Globals.cSettings.szDest) - 1] != PATHSEP)
+            stCounts.iNumDirs++; // Include the root.
+         _stprintf_s(szTmp, MAXPATH, _T("%d"), stCounts.iNumDirs);
+         FormatThousands(szTmp);
+         _stprintf_s(szTmp2, MAXPATH, _T("%d"), stCounts.iNumFiles);
+         FormatThousands(szTmp2);
+         _stprintf_s(szTmp3, MAXPATH, _T("%.0f"), stCounts.dTotalBytes);
+         FormatThousands(szTmp3);
+         _tprintf(_T("  Destination contains  %13s %11s %18s\n"),
+            szTmp, szTmp2, szTmp3);
       }
-      if (Globals.cSettings.szDest[_tcslen(Globals.cSettings.szDest) - 1] != '\\')
-         stCounts.iNumDirs++; // Include the root.
-      _stprintf_s(szTmp, MAXPATH, _T("%d"), stCounts.iNumDirs);
-      FormatThousands(szTmp);
-      _stprintf_s(szTmp2, MAXPATH, _T("%d"), stCounts.iNumFiles);
-      FormatThousands(szTmp2);
-      _stprintf_s(szTmp3, MAXPATH, _T("%.0f"), stCounts.dTotalBytes);
-      FormatThousands(szTmp3);
-      _tprintf(_T("  Destination contains  %13s %11s %18s\n"),
-         szTmp, szTmp2, szTmp3);
    }
 
    // Wait for user, if enabled.
@@ -1720,19 +3288,35 @@ main(int argc, char **argv)
    }
 
    // Start timing.
-   Globals.tStartTime = clock();
-   Globals.tLastProgress = clock();
+   Globals.tStartTime = WallClock();
+   Globals.tLastProgress = WallClock();
 
    // Display list of what we would copy, if list option
-   // is enabled.
+   // is enabled.  When the trees have been compared, the
+   // destination files that would be deleted are listed in
+   // the same pass, and displayed afterwards.
    if (Globals.cSettings.bList)
    {
       _tprintf(_T("Source files that would be copied:\n"));
-      if (!Globals.cSrcTree.EnumFiles(Globals.cSettings.szSource, EnumDisplay, (void *)NULL))
+      DIFF_SOURCE_CONTEXT stDisplay = { EnumDisplay, NULL, Globals.cSettings.bUpdate };
+      tstring sDeleteList;
+      std::vector<DIFF_STAGE> cStages;
+      AddDiffStage(cStages, DiffSourceAction, NULL, (void *)&stDisplay);
+      if (Globals.cSettings.bClean)
+         AddDiffStage(cStages, ListDiffDelete, NULL, (void *)&sDeleteList);
+      if (bDiff ? !RunDiffStages(cStages) :
+                  !Globals.cSrcTree.Visit(Globals.cSettings.szSource,
+                     [](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+                     { return EnumDisplay(NULL, cPath.Path(), &cEntry, bIsDir); }))
       {
          errmsg(__FILE__, __LINE__, _T("Failed enumerating files"));
          return EXIT_FAILURE;
       }
+      if (bDiff && Globals.cSettings.bClean)
+      {
+         _tprintf(_T("Destination files that would be deleted:\n"));
+         _tprintf(_T("%s"), sDeleteList.c_str());
+      }
    }
 
    // If debug option enabled, display debug info.
@@ -1741,7 +3325,10 @@ main(int argc, char **argv)
       _tprintf(_T("------------------------------------------------------------\n"));
       _tprintf(_T("SOURCE TREE (%s)\n"), Globals.cSettings.szSource);
       _tprintf(_T("------------------------------------------------------------\n"));
-      if (!Globals.cSrcTree.EnumFiles(Globals.cSettings.szSource, EnumDebugShowNodeInfo, (void *)NULL))
+      if (bDiff ? !EnumDiffSource(EnumDebugShowNodeInfo, (void *)NULL, false, false) :
+                  !Globals.cSrcTree.Visit(Globals.cSettings.szSource,
+                     [](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+                     { return EnumDebugShowNodeInfo(NULL, cPath.Path(), &cEntry, bIsDir); }))
       {
          errmsg(__FILE__, __LINE__, _T("Failed enumerating files"));
          return EXIT_FAILURE;
@@ -1750,7 +3337,7 @@ main(int argc, char **argv)
       _tprintf(_T("------------------------------------------------------------\n"));
       _tprintf(_T("DESTINATION TREE (%s)\n"), Globals.cSettings.szDest);
       _tprintf(_T("------------------------------------------------------------\n"));
-      if (!Globals.cDestTree.EnumFiles(Globals.cSettings.szDest, EnumDebugShowNodeInfo, (void *)NULL))
+      if (!Globals.cDestFlat.EnumFiles(Globals.cSettings.szDest, EnumDebugShowNodeInfo, (void *)NULL))
       {
          errmsg(__FILE__, __LINE__, _T("Failed enumerating files"));
          return EXIT_FAILURE;
@@ -1783,26 +3370,77 @@ main(int argc, char **argv)
       }
       Globals.cTotals.iDirsCopied++;
 
+      // Start the copy threads, if there are to be any.
+      if (Globals.cSettings.iCopyThreads > 1)
+         Globals.cCopyPool.Start(Globals.cSettings.iCopyThreads, CopyWorker);
+
       //
-      // Use the tree enumeration function to step through all the
-      // files in the source tree.  The EnumCopy callback will do
-      // all the work of copying and verifying each file.
+      // Step through all the files in the source tree once.
+      // CopySourceEntry will do all the work of copying and
+      // verifying each file.  If bMove option is enabled, the
+      // moved files are deleted from the source as they're
+      // copied, and each moved directory is removed on the way
+      // back up, once it's empty.  In pipeline mode, the files
+      // are passed to EnumCopy as the source tree is scanned.
+      // When the trees have been compared, the copying goes by
+      // the result instead, and the extra files in the
+      // destination are deleted in the same pass if bClean
+      // option is enabled.  With copy threads, a moved
+      // directory isn't removed until they're done with
+      // everything in it.
       //
-      if (!Globals.cSrcTree.EnumFiles(Globals.cSettings.szSource, EnumCopy, (void *)&Globals.cSettings))
+      bool bCopyOk;
+      if (Globals.cSettings.bPipeline)
+      {
+         bCopyOk = RunCopyPipeline();
+      }
+      else if (bDiff)
+      {
+         DIFF_SOURCE_CONTEXT stDelDir = { EnumDelDir, (void *)&Globals.cSettings, false };
+         std::vector<DIFF_STAGE> cStages;
+         AddDiffStage(cStages, CopyDiffAction, NULL, NULL);
+         if (Globals.cSettings.bMove && Globals.cCopyPool.Active())
+            AddDiffStage(cStages, NULL, WaitDiffCopies, NULL);
+         if (Globals.cSettings.bMove)
+            AddDiffStage(cStages, NULL, DiffSourceAction, (void *)&stDelDir);
+         if (Globals.cSettings.bClean)
+            AddDiffStage(cStages, NULL, DeleteDiffAction, NULL);
+         bCopyOk = RunDiffStages(cStages);
+      }
+      else
+      {
+         bCopyOk = Globals.cSrcTree.Traverse(Globals.cSettings.szSource,
+            [](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+            { return CopySourceEntry(cPath.Path(), cPath.RelPath(), &cEntry, bIsDir); },
+            [](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+            {
+               return !Globals.cSettings.bMove ||
+                  ((!bIsDir || Globals.cCopyPool.Wait()) && EnumDelDir(NULL, cPath.Path(), &cEntry, bIsDir));
+            });
+      }
+
+      // Wait for the copy threads to finish, and add up what
+      // they did.
+      if (!Globals.cCopyPool.Finish(Globals.cTotals))
+         bCopyOk = false;
+      if (!bCopyOk)
       {
          errmsg(__FILE__, __LINE__, _T("Failed copying files"), Globals.cSrcTree.sError.c_str());
          return EXIT_FAILURE;
       }
 
-      // If bMove option is enabled, the moved files have
-      // already been deleted from the source, but the
-      // moved directories need to be removed now that
-      // they are empty.  Reenumerate the source tree,
-      // removing the source directories as we go.
+      // If bMove option is enabled, remove the moved
+      // directories.  In pipeline mode, that's done here,
+      // after the copier is done with them; otherwise it was
+      // done on the way.
       if (Globals.cSettings.bMove)
       {
-         // Delete the empty source subdiretories.
-         if (!Globals.cSrcTree.EnumFiles(Globals.cSettings.szSource, EnumDelDir, (void *)&Globals.cSettings))
+         // Delete the empty source subdiretories, each one
+         // after the ones inside it.
+         if (Globals.cSettings.bPipeline &&
+             !Globals.cSrcTree.Visit(Globals.cSettings.szSource,
+               [](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+               { return EnumDelDir(NULL, cPath.Path(), &cEntry, bIsDir); }, true))
          {
             errmsg(__FILE__, __LINE__, _T("Failed deleting original diretories"), Globals.cSrcTree.sError.c_str());
             return EXIT_FAILURE;
@@ -1817,12 +3455,13 @@ main(int argc, char **argv)
       }
 
       // Delete extra files in destination that don't exist in
-      // the source tree, if bClean option enabled.
-      if (Globals.cSettings.bClean)
+      // the source tree, if bClean option enabled (unless that
+      // was done on the way).
+      if (Globals.cSettings.bClean && !bDiff)
       {
-         if (!Globals.cDestTree.EnumFilesReverse(Globals.cSettings.szDest, EnumDelTagged, (void *)&Globals.cSettings))
+         if (!Globals.cDestFlat.EnumFilesReverse(Globals.cSettings.szDest, EnumDelTagged, (void *)&Globals.cSettings))
          {
-            errmsg(__FILE__, __LINE__, _T("Failed deleting files"), Globals.cDestTree.sError.c_str());
+            errmsg(__FILE__, __LINE__, _T("Failed deleting files"), Globals.cDestFlat.sError.c_str());
             return EXIT_FAILURE;
          }
       }
@@ -1895,7 +3534,7 @@ main(int argc, char **argv)
    }
 
    // Display working time.
-   double dSeconds = (double)(clock() - Globals.tStartTime) / (double)CLOCKS_PER_SEC;
+   double dSeconds = (double)(WallClock() - Globals.tStartTime) / (double)CLOCKS_PER_SEC;
    _tprintf(_T("Working Time:  %.2f Seconds\n"), dSeconds);
 
    // Display average copying speed.
@@ -1915,6 +3554,10 @@ main(int argc, char **argv)
    _tprintf(_T("Completed with %d errors, %d warnings.\n"),
       Globals.cTotals.iNumErrors, Globals.cTotals.iNumWarnings);
 
+   // Keep copying changes, if enabled.
+   if (Globals.cSettings.bWatch)
+      return RunWatch();
+
    // Success.
    if (Globals.cSettings.bVerbose)
       statmsg(_T("Done"));
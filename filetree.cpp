@@ -48,61 +48,2178 @@
 //----------------------------------------------------------
 
 #include "filetree.h"
+#include "strkern.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <vector>
+#include <deque>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#ifdef _WIN32
 #include <conio.h>
 #include <direct.h>
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Define the symbol DBG to enable debug/trace output to console.
+//#define DBG
+
+// Size of the buffer used for reading directory entries
+// in batches with getdents64.
+#define SCAN_BUFFER_SIZE   (128 * 1024)
+
+// Tag and format version at the start of each tree in a
+// snapshot file (see SaveSnapshot).
+#define SNAPSHOT_TAG       0x50414e53  // "SNAP"
+#define SNAPSHOT_VERSION   1
+
+// Longest name accepted from a snapshot file.  Anything longer
+// means the file is damaged.
+#define SNAPSHOT_MAXNAME   32768
+
+// Directories with fewer entries than this aren't given a name
+// index, since searching them is about as fast.
+#define INDEX_MIN_ENTRIES  16
+
+//----------------------------------------------------------
+// TYPES
+//----------------------------------------------------------
+
+#ifdef __linux__
+// Layout of the records returned by the getdents64 system call.
+typedef struct
+{
+   uint64_t       d_ino;
+   int64_t        d_off;
+   unsigned short d_reclen;
+   unsigned char  d_type;
+   char           d_name[1];
+} LINUX_DIRENT64;
+#endif
+
+//----------------------------------------------------------
+// LOCAL FUNCTIONS
+//----------------------------------------------------------
+
+#ifndef _WIN32
+//
+// StatToInfo:
+// Fills in the size, timestamp, and attribute bits of a
+// directory entry from a file's stat information.  The entry's
+// name must already be set.
+//
+static void
+StatToInfo(const struct stat *pst, const CDirEntry *pEntry)
+{
+   pEntry->dwAttrib = StatToAttributes(pEntry->sName.c_str(), pst);
+   pEntry->dBytes = S_ISDIR(pst->st_mode) ? 0.0 : (double)pst->st_size;
+   FILETIME ft;
+   TimespecToFileTime(&pst->st_mtim, &ft);
+   pEntry->qwLastWrite = FileTimeToTicks(&ft);
+   pEntry->bInfoLoaded = true;
+}
+
+//
+// StatToEntry:
+// Fills in a directory entry from a file's name and stat
+// information.
+//
+static void
+StatToEntry(const _TCHAR *pszName, const struct stat *pst, CDirEntry *pEntry)
+{
+   pEntry->sName = pszName;
+   StatToInfo(pst, pEntry);
+}
+
+//
+// StatEntryAt:
+// Fetches the information for one entry of an open directory.
+// Where statx is available, only the fields BCPY uses are
+// requested, which saves work on network file systems.
+// Returns false if the file couldn't be examined.
+//
+static bool
+StatEntryAt(int fdDir, CDirEntry *pEntry)
+{
+   struct stat st;
+#if defined(__linux__) && defined(STATX_SIZE)
+   struct statx stx;
+   if (statx(fdDir, pEntry->sName.c_str(), 0,
+         STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) != 0)
+   {
+      return false;
+   }
+   memset(&st, 0, sizeof(st));
+   st.st_mode = stx.stx_mode;
+   st.st_size = (off_t)stx.stx_size;
+   st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+   st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+#else
+   if (fstatat(fdDir, pEntry->sName.c_str(), &st, 0) != 0)
+      return false;
+#endif
+   StatToEntry(pEntry->sName.c_str(), &st, pEntry);
+   return true;
+}
+
+//
+// ReadDirError:
+// Returns the error message for a directory that couldn't be
+// read to the end.
+//
+static tstring
+ReadDirError(const _TCHAR *pszDirPath, int iErrno)
+{
+   tstring sError = _T("Failed reading directory ");
+   sError += pszDirPath;
+   sError += _T(":  ");
+   sError += strerror(iErrno);
+   return sError;
+}
+
+//
+// LinkLoops:
+// Checks whether a symbolic link found in a directory points
+// back to that directory or to one of the directories above it,
+// in which case following it would go round the same part of
+// the tree until the pathnames got too long.  The directories
+// are the ones named in the pathname, not where it leads after
+// links are followed, so a loop made by several links is caught
+// at its first repeat.
+// Returns true if the link makes a loop.
+//
+static bool
+LinkLoops(const _TCHAR *pszDirPath, const struct stat *pst)
+{
+   // A relative pathname is below the current directory,
+   // whose own pathname has no links left in it.
+   tstring sPath;
+   if (pszDirPath[0] != '/')
+   {
+      char *pszCwd = getcwd(NULL, 0);
+      if (pszCwd != NULL)
+      {
+         sPath = pszCwd;
+         free(pszCwd);
+      }
+      sPath += '/';
+   }
+   sPath += pszDirPath;
+
+   for (;;)
+   {
+      // Ignore trailing slashes.
+      while (sPath.size() > 1 && sPath[sPath.size() - 1] == '/')
+         sPath.resize(sPath.size() - 1);
+
+      struct stat st;
+      if (stat(sPath.c_str(), &st) == 0 &&
+          st.st_dev == pst->st_dev && st.st_ino == pst->st_ino)
+      {
+         return true;
+      }
+
+      // Move up to the next directory in the pathname.
+      size_t nSlash = sPath.find_last_of('/');
+      if (nSlash == tstring::npos || sPath.size() == 1)
+         break;
+      sPath.resize((nSlash == 0) ? 1 : nSlash);
+   }
+   return false;
+}
+#endif
+
+//
+// HashName:
+// Computes the hash of a name used by the name indexes.  Case
+// is ignored, so names that _tcsicmp says are the same always
+// get the same hash, and one index serves both kinds of lookup.
+//
+static DWORD
+HashName(const _TCHAR *pszName, size_t nLen)
+{
+   DWORD dwHash = 2166136261u;
+   for (size_t i = 0; i < nLen; i++)
+   {
+      dwHash ^= static_cast<DWORD>(_totlower(static_cast<_TUCHAR>(pszName[i])));
+      dwHash *= 16777619u;
+   }
+   return dwHash;
+}
+
+//
+// IndexSize:
+// Returns the number of slots to use in a name index for the
+// given number of names:  a power of two, at least twice the
+// number of names, so the probe sequences stay short.
+//
+static size_t
+IndexSize(size_t nNames)
+{
+   size_t nSize = 16;
+   while (nSize < nNames * 2)
+      nSize *= 2;
+   return nSize;
+}
+
+//
+// NameMatches:
+// Compares the name of a directory entry with the first nLen
+// characters of pszName.
+//
+static bool
+NameMatches(const _TCHAR *pszEntry, size_t nEntryLen, const _TCHAR *pszName, size_t nLen, bool bCaseSensitive)
+{
+   if (nEntryLen != nLen)
+      return false;
+   if (bCaseSensitive)
+      return _tcsncmp(pszEntry, pszName, nLen) == 0;
+   return EqualNoCase(pszEntry, pszName, nLen);
+}
+
+//
+// CompareNames:
+// Compares two names that aren't necessarily nul-terminated,
+// for sorting.  Case is ignored unless bCaseSensitive is true.
+// Returns less than, equal to, or greater than zero, the same
+// way _tcsicmp does.
+//
+static int
+CompareNames(const _TCHAR *psz1, size_t nLen1, const _TCHAR *psz2, size_t nLen2, bool bCaseSensitive)
+{
+   if (!bCaseSensitive)
+      return CompareNoCase(psz1, nLen1, psz2, nLen2);
+
+   size_t nLen = (nLen1 < nLen2) ? nLen1 : nLen2;
+   for (size_t i = 0; i < nLen; i++)
+   {
+      int c1 = static_cast<_TUCHAR>(psz1[i]);
+      int c2 = static_cast<_TUCHAR>(psz2[i]);
+      if (c1 != c2)
+         return (c1 < c2) ? -1 : 1;
+   }
+   if (nLen1 != nLen2)
+      return (nLen1 < nLen2) ? -1 : 1;
+   return 0;
+}
+
+//
+// FlatNameOrder:
+// Sorts the nodes of a CFlatTree by name, for CTreeDiff.
+//
+struct FlatNameOrder
+{
+   const CFlatTree *pTree;
+   bool             bCaseSensitive;
+
+   bool operator()(DWORD iNode1, DWORD iNode2) const
+   {
+      const FLAT_NODE &stNode1 = pTree->cNodes[iNode1];
+      const FLAT_NODE &stNode2 = pTree->cNodes[iNode2];
+      return CompareNames(pTree->cNames.data() + stNode1.dwName, stNode1.wNameLen,
+         pTree->cNames.data() + stNode2.dwName, stNode2.wNameLen, bCaseSensitive) < 0;
+   }
+};
+
+//
+// SortChildren:
+// Fills cSorted with the children of a directory node in a
+// CFlatTree, sorted by name, for CTreeDiff.  Leaves it empty if
+// iDir is FLAT_NONE.
+//
+static void
+SortChildren(const CFlatTree *pTree, DWORD iDir, bool bCaseSensitive, std::vector<DWORD> &cSorted)
+{
+   cSorted.clear();
+   if (iDir == FLAT_NONE)
+      return;
+   const FLAT_DIR &stDir = pTree->Children(iDir);
+   cSorted.resize(stDir.dwNumFiles + stDir.dwNumDirs);
+   for (DWORD i = 0; i < static_cast<DWORD>(cSorted.size()); i++)
+      cSorted[i] = stDir.dwFirstChild + i;
+   FlatNameOrder stOrder = { pTree, bCaseSensitive };
+   std::stable_sort(cSorted.begin(), cSorted.end(), stOrder);
+}
+
+//
+// QueryEntry:
+// Asks a scan-time query function (if any) whether to keep a
+// directory entry that was just read from the directory whose
+// pathname is in cDirPath.
+//
+static bool
+QueryEntry(
+   CPathStack &cDirPath,
+   const CDirEntry *pEntry,
+   bool bIsDir,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
+   )
+{
+   if (pQuery == NULL)
+      return true;
+
+   size_t nMark = cDirPath.Push(pEntry->sName);
+   bool bKeep = pQuery(pQueryContext, cDirPath.Path(), pEntry, bIsDir);
+   cDirPath.Pop(nMark);
+   return bKeep;
+}
+
+//
+// LoadInfoWorker:
+// Thread procedure for LoadTreeInfo.  Runs LoadDirInfo on each
+// directory in the job list that no other worker has taken.
+//
+static void
+LoadInfoWorker(std::vector<std::pair<CDir *, tstring> > *pJobs, std::atomic<int> *piNext)
+{
+   int iJob;
+   while ((iJob = (*piNext)++) < static_cast<int>(pJobs->size()))
+      (*pJobs)[iJob].first->LoadDirInfo((*pJobs)[iJob].second.c_str());
+}
+
+//
+// CollectInfoJobs:
+// Builds a list of the directories in a tree that have entries
+// whose information hasn't been loaded yet, along with their
+// full pathnames.
+//
+static void
+CollectInfoJobs(CDir *pDir, const tstring &sPath, std::vector<std::pair<CDir *, tstring> > &cJobs)
+{
+   bool bNeeded = false;
+   for (int iFile = 0; !bNeeded && iFile < static_cast<int>(pDir->cFiles.size()); iFile++)
+      bNeeded = !pDir->cFiles[iFile].bInfoLoaded;
+   for (int iDir = 0; !bNeeded && iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+      bNeeded = !pDir->cDirs[iDir].cThis.bInfoLoaded;
+   if (bNeeded)
+      cJobs.push_back(std::make_pair(pDir, sPath));
+
+   for (int iDir = 0; iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+   {
+      tstring sSubPath = sPath;
+      if (sSubPath[sSubPath.size() - 1] != PATHSEP)
+         sSubPath += PATHSEP;
+      sSubPath += pDir->cDirs[iDir].cThis.sName;
+      CollectInfoJobs(&pDir->cDirs[iDir], sSubPath, cJobs);
+   }
+}
+
+//
+// LoadFlatInfoWorker:
+// Thread procedure for CFlatTree::LoadTreeInfo.  Same as
+// LoadInfoWorker, but the jobs are node indices.
+//
+static void
+LoadFlatInfoWorker(CFlatTree *pTree, std::vector<std::pair<DWORD, tstring> > *pJobs, std::atomic<int> *piNext)
+{
+   int iJob;
+   while ((iJob = (*piNext)++) < static_cast<int>(pJobs->size()))
+      pTree->LoadDirInfo((*pJobs)[iJob].first, (*pJobs)[iJob].second.c_str());
+}
+
+//
+// CountEntry:
+// Adds one entry to a count of files, directories, and bytes,
+// the same way EnumCallbackCountFiles does, but without
+// fetching information that hasn't been loaded.
+//
+static inline void
+CountEntry(ENUM_COUNT_STRUCT *pCounts, double dBytes, bool bIsDir)
+{
+   if (bIsDir)
+      pCounts->iNumDirs++;
+   else
+      pCounts->iNumFiles++;
+   pCounts->dTotalBytes += dBytes;
+}
+
+//
+// CountDirEntries:
+// Counts the files and subdirectories of a directory, without
+// going into the subdirectories.
+//
+static void
+CountDirEntries(const CDir *pDir, ENUM_COUNT_STRUCT *pCounts)
+{
+   for (int iFile = 0; iFile < static_cast<int>(pDir->cFiles.size()); iFile++)
+   {
+      if (pDir->cFiles[iFile].sName.size() > 0)
+         CountEntry(pCounts, pDir->cFiles[iFile].dBytes, false);
+   }
+   for (int iDir = 0; iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+      CountEntry(pCounts, pDir->cDirs[iDir].cThis.dBytes, true);
+}
+
+//
+// AddCounts:
+// Adds one count of files, directories, and bytes to another.
+//
+static void
+AddCounts(ENUM_COUNT_STRUCT *pTotal, const ENUM_COUNT_STRUCT *pPart)
+{
+   pTotal->iNumFiles += pPart->iNumFiles;
+   pTotal->iNumDirs += pPart->iNumDirs;
+   pTotal->dTotalBytes += pPart->dTotalBytes;
+}
+
+//
+// WriteSnapDword:
+// Writes one DWORD to a snapshot file.
+// Returns false if error.
+//
+static bool
+WriteSnapDword(FILE *pFile, DWORD dwValue)
+{
+   return fwrite(&dwValue, sizeof(DWORD), 1, pFile) == 1;
+}
+
+//
+// ReadSnapDword:
+// Reads one DWORD from a snapshot file.
+// Returns false if error.
+//
+static bool
+ReadSnapDword(FILE *pFile, DWORD *pdwValue)
+{
+   return fread(pdwValue, sizeof(DWORD), 1, pFile) == 1;
+}
+
+//
+// WriteSnapString:
+// Writes a string to a snapshot file as a length followed
+// by the characters.
+// Returns false if error.
+//
+static bool
+WriteSnapString(FILE *pFile, const tstring &s)
+{
+   if (!WriteSnapDword(pFile, static_cast<DWORD>(s.size())))
+      return false;
+   if (s.size() > 0 && fwrite(s.c_str(), sizeof(_TCHAR), s.size(), pFile) != s.size())
+      return false;
+   return true;
+}
+
+//
+// ReadSnapString:
+// Reads a string written by WriteSnapString.
+// Returns false if error.
+//
+static bool
+ReadSnapString(FILE *pFile, tstring &s)
+{
+   DWORD dwLen;
+   if (!ReadSnapDword(pFile, &dwLen) || dwLen > SNAPSHOT_MAXNAME)
+      return false;
+   s.resize(dwLen);
+   if (dwLen > 0 && fread(&s[0], sizeof(_TCHAR), dwLen, pFile) != dwLen)
+      return false;
+   return true;
+}
+
+//
+// WriteSnapDir:
+// Writes a directory record to a snapshot file:  the name,
+// attribute bits, and last write time of the directory, the
+// name and attribute bits of each file, then a record for
+// each subdirectory.
+// Returns false if error.
+//
+static bool
+WriteSnapDir(FILE *pFile, const CDir *pDir)
+{
+   if (!WriteSnapString(pFile, pDir->cThis.sName) ||
+       !WriteSnapDword(pFile, pDir->cThis.dwAttrib) ||
+       !WriteSnapDword(pFile, static_cast<DWORD>(pDir->cThis.qwLastWrite & 0xFFFFFFFF)) ||
+       !WriteSnapDword(pFile, static_cast<DWORD>(pDir->cThis.qwLastWrite >> 32)))
+   {
+      return false;
+   }
+
+   if (!WriteSnapDword(pFile, static_cast<DWORD>(pDir->cFiles.size())))
+      return false;
+   for (int iFile = 0; iFile < static_cast<int>(pDir->cFiles.size()); iFile++)
+   {
+      if (!WriteSnapString(pFile, pDir->cFiles[iFile].sName) ||
+          !WriteSnapDword(pFile, pDir->cFiles[iFile].dwAttrib))
+      {
+         return false;
+      }
+   }
+
+   if (!WriteSnapDword(pFile, static_cast<DWORD>(pDir->cDirs.size())))
+      return false;
+   for (int iDir = 0; iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+   {
+      if (!WriteSnapDir(pFile, &pDir->cDirs[iDir]))
+         return false;
+   }
+
+   return true;
+}
+
+//
+// ReadSnapDir:
+// Reads a directory record written by WriteSnapDir.  The
+// entries come back with only their names and attribute bits,
+// so they're marked as not having their information loaded.
+// Returns false if error.
+//
+static bool
+ReadSnapDir(FILE *pFile, CDir *pDir)
+{
+   FILETIME ftLastWrite;
+   if (!ReadSnapString(pFile, pDir->cThis.sName) ||
+       !ReadSnapDword(pFile, &pDir->cThis.dwAttrib) ||
+       !ReadSnapDword(pFile, &ftLastWrite.dwLowDateTime) ||
+       !ReadSnapDword(pFile, &ftLastWrite.dwHighDateTime))
+   {
+      return false;
+   }
+   pDir->cThis.qwLastWrite = FileTimeToTicks(&ftLastWrite);
+   pDir->cThis.bInfoLoaded = false;
+
+   DWORD dwCount;
+   if (!ReadSnapDword(pFile, &dwCount))
+      return false;
+   for (DWORD i = 0; i < dwCount; i++)
+   {
+      CDirEntry cFile;
+      if (!ReadSnapString(pFile, cFile.sName) || !ReadSnapDword(pFile, &cFile.dwAttrib))
+         return false;
+      cFile.bInfoLoaded = false;
+      pDir->cFiles.push_back(cFile);
+   }
+
+   if (!ReadSnapDword(pFile, &dwCount))
+      return false;
+   for (DWORD i = 0; i < dwCount; i++)
+   {
+      pDir->cDirs.push_back(CDir());
+      if (!ReadSnapDir(pFile, &pDir->cDirs.back()))
+         return false;
+   }
+
+   return true;
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CPathStack
+//----------------------------------------------------------
+
+// Default constructor:
+CPathStack::CPathStack()
+   : nRootLen(0)
+{
+}
+
+// Constructor that starts at the given root.
+CPathStack::CPathStack(const _TCHAR *pszRoot)
+{
+   Reset(pszRoot);
+}
+
+//
+// Reset:
+// Sets the pathname to the root of a tree, with nothing pushed.
+//
+void
+CPathStack::Reset(const _TCHAR *pszRoot)
+{
+   sPath.reserve(MAXPATH);
+   sPath = pszRoot;
+   nRootLen = sPath.size();
+   if (nRootLen > 0 && sPath[nRootLen - 1] != PATHSEP)
+      nRootLen++;
+}
+
+//
+// Push:
+// Adds a name to the end of the pathname, with a separator if
+// needed.  Returns the mark to pass to Pop to take it off again.
+//
+size_t
+CPathStack::Push(const _TCHAR *pszName, size_t nLen)
+{
+   size_t nMark = sPath.size();
+   if (nMark > 0 && sPath[nMark - 1] != PATHSEP)
+      sPath += PATHSEP;
+   sPath.append(pszName, nLen);
+   return nMark;
+}
+
+size_t
+CPathStack::Push(const tstring &sName)
+{
+   return Push(sName.c_str(), sName.size());
+}
+
+//
+// Pop:
+// Takes off everything added since Push returned nMark.
+//
+void
+CPathStack::Pop(size_t nMark)
+{
+   sPath.resize(nMark);
+}
+
+//
+// Path:
+// Returns the full pathname.  It changes with the next Push
+// or Pop.
+//
+const _TCHAR *
+CPathStack::Path(void) const
+{
+   return sPath.c_str();
+}
+
+//
+// RelPath:
+// Returns the part of the pathname after the root, or an empty
+// string at the root itself.  It changes with the next Push or
+// Pop.
+//
+const _TCHAR *
+CPathStack::RelPath(void) const
+{
+   return (sPath.size() > nRootLen) ? sPath.c_str() + nRootLen : _T("");
+}
+
+//
+// Length:
+// Returns the length of the full pathname.
+//
+size_t
+CPathStack::Length(void) const
+{
+   return sPath.size();
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CDirWalk
+//----------------------------------------------------------
+
+// Constructor that starts at the top of a tree, before its
+// first entry.
+CDirWalk::CDirWalk(CDir *pRoot, const _TCHAR *pszDirPath)
+   : cPath(pszDirPath), pEntry(NULL), bIsDir(false)
+{
+   WALK_FRAME stFrame;
+   stFrame.pDir = pRoot;
+   stFrame.iNext = 0;
+   stFrame.nMark = cPath.Length();
+   cFrames.push_back(stFrame);
+}
+
+//
+// begin:
+// Moves to the first entry, and returns an iterator for it.
+// Call only once per walk.
+//
+CDirWalk::iterator
+CDirWalk::begin(void)
+{
+   return iterator(Next() ? this : NULL);
+}
+
+//
+// end:
+// Returns the iterator for the end of the walk.
+//
+CDirWalk::iterator
+CDirWalk::end(void)
+{
+   return iterator(NULL);
+}
+
+//
+// Next:
+// Moves to the next entry: the files in a directory first,
+// then each subdirectory followed by its contents.
+// Returns false if there are no more entries.
+//
+bool
+CDirWalk::Next(void)
+{
+   while (!cFrames.empty())
+   {
+      WALK_FRAME &stFrame = cFrames.back();
+      CDir *pDir = stFrame.pDir;
+      cPath.Pop(stFrame.nMark);
+
+      // Files in this directory.
+      if (stFrame.iNext < pDir->cFiles.size())
+      {
+         pEntry = &pDir->cFiles[stFrame.iNext++];
+         if (pEntry->sName.size() < 1)
+            continue;   // Filename is zero length, so skip it.
+         cPath.Push(pEntry->sName);
+         bIsDir = false;
+         return true;
+      }
+
+      // Subdirectories of this directory, each one before its
+      // contents.
+      size_t iDir = stFrame.iNext - pDir->cFiles.size();
+      if (iDir < pDir->cDirs.size())
+      {
+         stFrame.iNext++;
+         pEntry = &pDir->cDirs[iDir].cThis;
+         cPath.Push(pEntry->sName);
+         bIsDir = true;
+
+         WALK_FRAME stChild;
+         stChild.pDir = &pDir->cDirs[iDir];
+         stChild.iNext = 0;
+         stChild.nMark = cPath.Length();
+         cFrames.push_back(stChild);
+         return true;
+      }
+
+      // Done with this directory.
+      cFrames.pop_back();
+   }
+
+   pEntry = NULL;
+   return false;
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CDirEntry
+//----------------------------------------------------------
+
+// Default constructor:
+CDirEntry::CDirEntry()
+   : sName(_T("")), dwUser(0), dwAttrib(0), dBytes(0.0),
+     qwLastWrite(0), bInfoLoaded(true)
+{
+}
+      
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CDir
+//----------------------------------------------------------
+
+// Default constructor.
+CDir::CDir()
+   : bListed(false)
+{
+   memset(&stTotals, 0, sizeof(stTotals));
+}
+
+//
+// PruneFiles:
+// Given a query function by the caller, removes from this directory
+// (and from all its children) any files and directories whose query
+// returns false.
+//
+bool
+CDir::PruneFiles(
+   const _TCHAR *pszDirPath,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  PruneFiles(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   return Prune(pszDirPath,
+      [pQuery, pContext](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+      { return pQuery(pContext, cPath.Path(), &cEntry, bIsDir); });
+}
+
+//
+// EnumFiles:
+// Passes all the files and directories in this directory (and all
+// its children) to an enumeration function specified by the caller.
+// If the enumeration function returns false, enumeration will cease.
+// Returns true if enumeration finished, false if enumeration was
+// interrupted by a false return of the enumeration function.
+//
+bool
+CDir::EnumFiles(
+   const _TCHAR *pszDirPath,
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  EnumFiles(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   return Visit(pszDirPath,
+      [pEnum, pContext](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+      { return pEnum(pContext, cPath.Path(), &cEntry, bIsDir); }, false);
+}
+
+//
+// EnumFilesReverse:
+// Same as EnumFiles, except goes in reverse order with files in
+// this dir, then child subdirs, then subdirs.
+//
+// Passes all the files and directories in this directory (and all
+// its children) to an enumeration function specified by the caller.
+// If the enumeration function returns false, enumeration will cease.
+// Returns true if enumeration finished, false if enumeration was
+// interrupted by a false return of the enumeration function.
+//
+bool
+CDir::EnumFilesReverse(
+   const _TCHAR *pszDirPath,
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  EnumFilesReverse(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   return Visit(pszDirPath,
+      [pEnum, pContext](const CPathStack &cPath, const CDirEntry &cEntry, bool bIsDir)
+      { return pEnum(pContext, cPath.Path(), &cEntry, bIsDir); }, true);
+}
+
+//
+// ScanFiles:
+// Fills cFiles and cDirs with information from a directory on disk.
+// Optionally allows the user to specify a callback function that
+// will be called with the name of each subdirectory that is scanned
+// (for updating a status display, for example).
+//
+// If a query function is given, it's called for each entry as
+// the entry is read, the same way PruneFiles would call it, and
+// entries it returns false for are left out of the tree.  This
+// way, subdirectories that are left out are never scanned.
+//
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CDir::ScanFiles(
+   const _TCHAR *pszDirPath,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath),
+   void *pContext,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  ScanFiles(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   // If callback function given, pass directory name to it.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, pszDirPath))
+      {
+         sError = _T("Scan aborted");
+         return false; // Callback returned false, so abort.
+      }
+   }
+
+   // Read the entries in this directory.
+   if (!ReadDirectory(pszDirPath, pQuery, pQueryContext))
+      return false;
+
+   // For each subdir in this dir...
+   CPathStack cSubPath(pszDirPath);
+   for (int iDir = 0; iDir < static_cast<int>(cDirs.size()); iDir++)
+   {
+      // Scan the subdir and its children.
+      size_t nMark = cSubPath.Push(cDirs[iDir].cThis.sName);
+      if (!cDirs[iDir].ScanFiles(cSubPath.Path(), pFunc, pContext, pQuery, pQueryContext))
+      {
+         // Failed scanning files in subdirectory.
+         sError = cDirs[iDir].sError;
+         return false;
+      }
+      cSubPath.Pop(nMark);
+   }
+
+   UpdateTotals();
+   return true;
+}
+
+//
+// ScanFilesIncremental:
+// Same as ScanFiles, except that a tree from an earlier scan
+// of the same directory (usually loaded with LoadSnapshot)
+// can be given in pCache.  A directory whose last write time
+// hasn't changed since then still has the same entries, so
+// its listing is taken from the cache instead of being read
+// again, and only the directories that changed are re-read.
+//
+// Adding, removing, or renaming an entry changes the time of
+// the directory it's in, but rewriting a file doesn't, so the
+// entries taken from the cache are marked as not having their
+// information loaded, and LoadEntryInfo or LoadTreeInfo will
+// fetch the current sizes and timestamps.
+//
+// The contents of pCache are used up by the scan.  pCache may
+// be NULL, in which case this is the same as ScanFiles, except
+// that the time of each directory is kept in its cThis member
+// for the next snapshot.
+//
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CDir::ScanFilesIncremental(
+   const _TCHAR *pszDirPath,
+   CDir *pCache,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath),
+   void *pContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  ScanFilesIncremental(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   // If callback function given, pass directory name to it.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, pszDirPath))
+      {
+         sError = _T("Scan aborted");
+         return false; // Callback returned false, so abort.
+      }
+   }
+
+   // Get the current last write time of this directory.
+   cThis.bInfoLoaded = false;
+   bool bHaveTime = LoadEntryInfo(pszDirPath, &cThis);
+
+   // Use the cached listing if the directory hasn't changed.
+   bool bReuse = bHaveTime && pCache != NULL &&
+      cThis.qwLastWrite != 0 && cThis.qwLastWrite == pCache->cThis.qwLastWrite;
+   std::unordered_map<tstring, CDir *> cCacheIndex;
+   if (bReuse)
+   {
+      cFiles.swap(pCache->cFiles);
+      cDirs.swap(pCache->cDirs);
+      bListed = true;
+      BuildIndex();
+      for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+         cFiles[iFile].bInfoLoaded = false;
+   }
+   else
+   {
+      // Read the entries in this directory.
+      if (!ReadDirectory(pszDirPath))
+         return false;
+
+      // Index the cached subdirectories by name, so the ones
+      // that are still here can use their cached contents.
+      if (pCache != NULL)
+      {
+         for (int iDir = 0; iDir < static_cast<int>(pCache->cDirs.size()); iDir++)
+            cCacheIndex[pCache->cDirs[iDir].cThis.sName] = &pCache->cDirs[iDir];
+      }
+   }
+
+   // For each subdir in this dir...
+   CPathStack cSubPath(pszDirPath);
+   for (int iDir = 0; iDir < static_cast<int>(cDirs.size()); iDir++)
+   {
+      // Find the cached contents of the subdir.  If this
+      // directory's listing came from the cache, the subdir
+      // is holding them, so move them out of the way first.
+      CDir cOld;
+      CDir *pOld = NULL;
+      if (bReuse)
+      {
+         cOld.cThis = cDirs[iDir].cThis;
+         cOld.cFiles.swap(cDirs[iDir].cFiles);
+         cOld.cDirs.swap(cDirs[iDir].cDirs);
+         pOld = &cOld;
+      }
+      else if (pCache != NULL)
+      {
+         std::unordered_map<tstring, CDir *>::iterator it = cCacheIndex.find(cDirs[iDir].cThis.sName);
+         if (it != cCacheIndex.end())
+            pOld = it->second;
+      }
+
+      // Scan the subdir and its children.
+      size_t nMark = cSubPath.Push(cDirs[iDir].cThis.sName);
+      if (!cDirs[iDir].ScanFilesIncremental(cSubPath.Path(), pOld, pFunc, pContext))
+      {
+         // Failed scanning files in subdirectory.
+         sError = cDirs[iDir].sError;
+         return false;
+      }
+      cSubPath.Pop(nMark);
+   }
+
+   UpdateTotals();
+   return true;
+}
+
+//
+// SaveSnapshot:
+// Writes this tree to an open snapshot file, along with the
+// pathname it was scanned from, so that a later run can pass
+// it to ScanFilesIncremental.  Only the names, attribute bits,
+// and directory times are kept.  Several trees can be written
+// to the same file one after another.
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CDir::SaveSnapshot(FILE *pFile, const _TCHAR *pszDirPath)
+{
+   // Check for bogus parameters.
+   if (pFile == NULL || pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   if (!WriteSnapDword(pFile, SNAPSHOT_TAG) ||
+       !WriteSnapDword(pFile, SNAPSHOT_VERSION) ||
+       !WriteSnapDword(pFile, sizeof(_TCHAR)) ||
+       !WriteSnapString(pFile, pszDirPath) ||
+       !WriteSnapDir(pFile, this))
+   {
+      sError = _T("Failed writing snapshot file");
+      return false;
+   }
+
+   return true;
+}
+
+//
+// LoadSnapshot:
+// Replaces the contents of this tree with the next tree in an
+// open snapshot file written by SaveSnapshot, and returns the
+// pathname it was scanned from in sDirPath.
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CDir::LoadSnapshot(FILE *pFile, tstring &sDirPath)
+{
+   // Check for bogus parameters.
+   if (pFile == NULL)
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   cThis = CDirEntry();
+   cFiles.clear();
+   cDirs.clear();
+   cIndex.clear();
+
+   DWORD dwTag, dwVersion, dwCharSize;
+   if (!ReadSnapDword(pFile, &dwTag) || !ReadSnapDword(pFile, &dwVersion) ||
+       !ReadSnapDword(pFile, &dwCharSize))
+   {
+      sError = _T("Failed reading snapshot file");
+      return false;
+   }
+   if (dwTag != SNAPSHOT_TAG || dwVersion != SNAPSHOT_VERSION || dwCharSize != sizeof(_TCHAR))
+   {
+      sError = _T("Snapshot file is not in a recognized format");
+      return false;
+   }
+   if (!ReadSnapString(pFile, sDirPath) || !ReadSnapDir(pFile, this))
+   {
+      cFiles.clear();
+      cDirs.clear();
+      sError = _T("Failed reading snapshot file");
+      return false;
+   }
+
+   UpdateTotals(true);
+   return true;
+}
+
+//
+// ReadDirectory:
+// Fills cFiles and cDirs with the entries of one directory on
+// disk, without descending into the subdirectories (each entry
+// in cDirs gets only its cThis member filled in).
+// Entries the query function (if given) returns false for are
+// skipped.
+// Returns true if successful; false if error.  A directory that
+// can't be read is treated as empty, which is not an error.
+//
+bool
+CDir::ReadDirectory(
+   const _TCHAR *pszDirPath,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
+   )
+{
+   bListed = true;
+   CPathStack cDirPath(pszDirPath);
+
+#ifdef _WIN32
+   // Find matches.
+   WIN32_FIND_DATA   stFind;
+   HANDLE            hFind;
+   CPathStack        cPathPlusWild(pszDirPath);
+   cPathPlusWild.Push(_T("*.*"), 3);
+   memset(&stFind, 0, sizeof(stFind));
+   hFind = FindFirstFile(cPathPlusWild.Path(), &stFind);
+   if (hFind == NULL)
+   {
+      // Nothing in this directory.
+      // This is not an error.
+      return true;
+   }
+   do
+   {
+#ifdef DBG
+      _tprintf(_T("DEBUG:  Found \"%s\"\n"), stFind.cFileName);
+      fflush(stdout);
+#endif
+      // Build object describing this file or dir.
+      CDirEntry cFile;
+      cFile.sName = stFind.cFileName;
+      cFile.dwAttrib = stFind.dwFileAttributes;
+      cFile.dBytes = (double)stFind.nFileSizeHigh * 65536.0 * 65536.0 + (double)stFind.nFileSizeLow;
+      cFile.qwLastWrite = FileTimeToTicks(&stFind.ftLastWriteTime);
+
+      // Because of bug in FindFirstFile, we have to check that
+      // the filename is non-empty to make sure this match actually
+      // exists.
+      if (cFile.sName.size() > 0)
+      {
+         // Is this match a directory or file?
+         if (stFind.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+         {
+            // This match is a directory.
+            // If it's not the current directory or parent directory...
+            if (_tcsicmp(stFind.cFileName, _T(".")) != 0 &&
+                _tcsicmp(stFind.cFileName, _T("..")) != 0)
+            {
+               // This match is a normal directory, so add it to the
+               // list of subdirectories in this directory object.
+               if (QueryEntry(cDirPath, &cFile, true, pQuery, pQueryContext))
+               {
+                  CDir cDir;
+                  cDir.cThis = cFile;
+                  cDirs.push_back(cDir);
+               }
+            }
+         }
+         else
+         {
+            // This match is a file, so add it to the list of files
+            // in this directory object.
+            if (QueryEntry(cDirPath, &cFile, false, pQuery, pQueryContext))
+               cFiles.push_back(cFile);
+         }
+      }
+   }
+   while (FindNextFile(hFind, &stFind));
+   FindClose(hFind);
+#elif defined(__linux__)
+   // Open the directory.
+   int fdDir = open(pszDirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (fdDir < 0)
+   {
+      // Can't read this directory (or it doesn't exist).
+      // This is not an error.
+      return true;
+   }
+
+   // Read the entries in large batches.  The file type that comes
+   // with each entry is enough to tell files from directories, so
+   // the size and timestamps are left to be fetched later by
+   // LoadEntryInfo, and only for the entries that need them.
+   static thread_local std::vector<char> cBuffer(SCAN_BUFFER_SIZE);
+   for (;;)
+   {
+      long lBytes = syscall(SYS_getdents64, fdDir, &cBuffer[0], cBuffer.size());
+      if (lBytes == 0)
+         break;   // End of directory.
+      if (lBytes < 0)
+      {
+         // A directory that was only partly read mustn't look
+         // like a complete one, or /CLEAN would delete the
+         // destination copies of the entries that weren't read.
+         sError = ReadDirError(pszDirPath, errno);
+         close(fdDir);
+         return false;
+      }
+
+      for (long lPos = 0; lPos < lBytes; )
+      {
+         const LINUX_DIRENT64 *pEnt = (const LINUX_DIRENT64 *)&cBuffer[lPos];
+         lPos += pEnt->d_reclen;
+#ifdef DBG
+         _tprintf(_T("DEBUG:  Found \"%s\"\n"), pEnt->d_name);
+         fflush(stdout);
+#endif
+         // Skip the current directory and parent directory.
+         if (pEnt->d_name[0] == '.' &&
+             (pEnt->d_name[1] == '\0' || (pEnt->d_name[1] == '.' && pEnt->d_name[2] == '\0')))
+         {
+            continue;
+         }
+
+         CDirEntry cFile;
+         cFile.sName = pEnt->d_name;
+         if (pEnt->d_type == DT_DIR || pEnt->d_type == DT_REG)
+         {
+            // Type is known, so the rest can wait.
+            cFile.bInfoLoaded = false;
+            cFile.dwAttrib = (pEnt->d_type == DT_DIR) ? FILE_ATTRIBUTE_DIRECTORY : 0;
+            if (pEnt->d_name[0] == '.')
+               cFile.dwAttrib |= FILE_ATTRIBUTE_HIDDEN;
+            if (cFile.dwAttrib == 0)
+               cFile.dwAttrib = FILE_ATTRIBUTE_NORMAL;
+         }
+         else if (pEnt->d_type == DT_LNK || pEnt->d_type == DT_UNKNOWN)
+         {
+            // Symbolic link, or a file system that doesn't report
+            // types, so we have to stat it to find out what it is.
+            // Links are followed, except a link to a directory
+            // that the link is already inside of.
+            struct stat st;
+            if (fstatat(fdDir, pEnt->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+               continue;
+            if (S_ISLNK(st.st_mode))
+            {
+               if (fstatat(fdDir, pEnt->d_name, &st, 0) != 0)
+                  continue;   // Dangling link.
+               if (S_ISDIR(st.st_mode) && LinkLoops(pszDirPath, &st))
+                  continue;
+            }
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+               continue;
+            StatToEntry(pEnt->d_name, &st, &cFile);
+         }
+         else
+         {
+            continue;   // Devices, FIFOs, and sockets aren't copied.
+         }
+
+         // Is this match a directory or file?
+         bool bIsDir = (cFile.dwAttrib & FILE_ATTRIBUTE_DIRECTORY) != 0;
+         if (!QueryEntry(cDirPath, &cFile, bIsDir, pQuery, pQueryContext))
+            continue;
+         if (bIsDir)
+         {
+            CDir cDir;
+            cDir.cThis = cFile;
+            cDirs.push_back(cDir);
+         }
+         else
+         {
+            cFiles.push_back(cFile);
+         }
+      }
+   }
+   close(fdDir);
+#else
+   // Open the directory.  The directory handle's descriptor is
+   // used for the per-entry stat calls, so the kernel doesn't
+   // have to walk the full pathname again for every entry.
+   DIR *pDir = opendir(pszDirPath);
+   if (pDir == NULL)
+   {
+      // Can't read this directory (or it doesn't exist).
+      // This is not an error.
+      return true;
+   }
+   int fdDir = dirfd(pDir);
+
+   // readdir returns NULL both at the end and on an error, so
+   // errno is cleared before each call to tell them apart.
+   struct dirent *pEnt;
+   while ((errno = 0, pEnt = readdir(pDir)) != NULL)
+   {
+#ifdef DBG
+      _tprintf(_T("DEBUG:  Found \"%s\"\n"), pEnt->d_name);
+      fflush(stdout);
+#endif
+      // Skip the current directory and parent directory.
+      if (pEnt->d_name[0] == '.' &&
+          (pEnt->d_name[1] == '\0' || (pEnt->d_name[1] == '.' && pEnt->d_name[2] == '\0')))
+      {
+         continue;
+      }
+
+      // Get the size, timestamps, and type of the entry.
+      // Symbolic links are followed, so a link is copied as
+      // the file or directory it points to.  Dangling links
+      // are skipped, and so are links to a directory that the
+      // link is already inside of.
+      struct stat st;
+      if (fstatat(fdDir, pEnt->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+         continue;
+      if (S_ISLNK(st.st_mode))
+      {
+         if (fstatat(fdDir, pEnt->d_name, &st, 0) != 0)
+            continue;
+         if (S_ISDIR(st.st_mode) && LinkLoops(pszDirPath, &st))
+            continue;
+      }
+      if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+         continue;   // Devices, FIFOs, and sockets aren't copied.
+
+      // Build object describing this file or dir.
+      CDirEntry cFile;
+      StatToEntry(pEnt->d_name, &st, &cFile);
+      if (!QueryEntry(cDirPath, &cFile, S_ISDIR(st.st_mode), pQuery, pQueryContext))
+         continue;
+
+      // Is this match a directory or file?
+      if (S_ISDIR(st.st_mode))
+      {
+         // This match is a directory, so add it to the list of
+         // subdirectories in this directory object.
+         CDir cDir;
+         cDir.cThis = cFile;
+         cDirs.push_back(cDir);
+      }
+      else
+      {
+         // This match is a file, so add it to the list of files
+         // in this directory object.
+         cFiles.push_back(cFile);
+      }
+   }
+   if (errno != 0)
+   {
+      // Same as in the getdents64 version above.
+      sError = ReadDirError(pszDirPath, errno);
+      closedir(pDir);
+      return false;
+   }
+   closedir(pDir);
+#endif
+
+   BuildIndex();
+   return true;
+}
+
+//
+// CScanner:
+// Shared state for ScanFilesParallel.  Each worker thread has its
+// own queue of directories waiting to be scanned.  A worker takes
+// work from the back of its own queue (so it proceeds depth-first
+// through the subtree it is working on), and when its queue runs
+// dry it steals from the front of another worker's queue, which
+// is where the largest unscanned subtrees tend to be.  A worker
+// with nothing to steal sleeps until a job is queued or the
+// scan is over, rather than spinning while the slowest
+// directories are read.
+//
+class CScanner
+{
+public:
+   // One directory waiting to be scanned.
+   struct SCAN_JOB
+   {
+      CDir *   pDir;    // Node to be filled in.
+      tstring  sPath;   // Full pathname of the directory.
+   };
+
+   // Queue of jobs owned by one worker.
+   struct SCAN_QUEUE
+   {
+      std::mutex              mtx;
+      std::deque<SCAN_JOB>    cJobs;
+   };
+
+   std::vector<SCAN_QUEUE *>  cQueues;       // One queue per worker.
+   std::atomic<int>           iPending;      // Jobs queued or being scanned.
+   std::atomic<int>           iQueued;       // Jobs queued and not yet taken.
+   std::atomic<bool>          bAbort;        // Set if the callback asked to stop,
+                                             // or a directory couldn't be read.
+   tstring                    sError;        // First error from ReadDirectory.
+   std::mutex                 mtxError;      // Lock for sError.
+   std::mutex                 mtxIdle;       // Lock for cvIdle.
+   std::condition_variable    cvIdle;        // Signalled when a job is queued,
+                                             // or when the scan is over.
+   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath);
+   void *                     pContext;
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir);
+   void *                     pQueryContext;
+
+public:
+   CScanner(int iThreads, bool (*pFuncIn)(void *, const _TCHAR *), void *pContextIn,
+            bool (*pQueryIn)(void *, const _TCHAR *, const CDirEntry *, bool), void *pQueryContextIn)
+      : iPending(0), iQueued(0), bAbort(false), pFunc(pFuncIn), pContext(pContextIn),
+        pQuery(pQueryIn), pQueryContext(pQueryContextIn)
+   {
+      for (int i = 0; i < iThreads; i++)
+         cQueues.push_back(new SCAN_QUEUE);
+   }
+
+   ~CScanner()
+   {
+      for (int i = 0; i < static_cast<int>(cQueues.size()); i++)
+         delete cQueues[i];
+   }
+
+   // Adds a job to the given worker's queue.
+   void Push(int iWorker, CDir *pDir, const tstring &sPath)
+   {
+      SCAN_JOB stJob;
+      stJob.pDir = pDir;
+      stJob.sPath = sPath;
+      iPending++;
+      {
+         std::lock_guard<std::mutex> lock(cQueues[iWorker]->mtx);
+         cQueues[iWorker]->cJobs.push_back(stJob);
+      }
+      iQueued++;
+      Wake(false);
+   }
+
+   // Wakes one sleeping worker, or all of them at the end.
+   // The lock is taken so a worker that's about to sleep
+   // can't miss the change.
+   void Wake(bool bAll)
+   {
+      std::lock_guard<std::mutex> lock(mtxIdle);
+      if (bAll)
+         cvIdle.notify_all();
+      else
+         cvIdle.notify_one();
+   }
+
+   // Gets the next job for the given worker, stealing from
+   // the other workers if its own queue is empty.  Returns
+   // false if there was nothing to take.
+   bool Pop(int iWorker, SCAN_JOB &stJob)
+   {
+      {
+         SCAN_QUEUE *pQueue = cQueues[iWorker];
+         std::lock_guard<std::mutex> lock(pQueue->mtx);
+         if (!pQueue->cJobs.empty())
+         {
+            stJob = pQueue->cJobs.back();
+            pQueue->cJobs.pop_back();
+            iQueued--;
+            return true;
+         }
+      }
+      int iNum = static_cast<int>(cQueues.size());
+      for (int i = 1; i < iNum; i++)
+      {
+         SCAN_QUEUE *pVictim = cQueues[(iWorker + i) % iNum];
+         std::lock_guard<std::mutex> lock(pVictim->mtx);
+         if (!pVictim->cJobs.empty())
+         {
+            stJob = pVictim->cJobs.front();
+            pVictim->cJobs.pop_front();
+            iQueued--;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Thread procedure for one worker.
+   void Work(int iWorker)
+   {
+      SCAN_JOB stJob;
+      while (iPending > 0 && !bAbort)
+      {
+         if (!Pop(iWorker, stJob))
+         {
+            // Everything left is being scanned by other workers,
+            // which may yet queue more subdirectories.
+            std::unique_lock<std::mutex> lock(mtxIdle);
+            cvIdle.wait(lock, [this] { return iQueued > 0 || iPending == 0 || bAbort; });
+            continue;
+         }
+
+         // Report the directory, then read it.
+         if (pFunc != NULL && !pFunc(pContext, stJob.sPath.c_str()))
+         {
+            bAbort = true;
+         }
+         else if (!stJob.pDir->ReadDirectory(stJob.sPath.c_str(), pQuery, pQueryContext))
+         {
+            std::lock_guard<std::mutex> lock(mtxError);
+            if (sError.empty())
+               sError = stJob.pDir->sError;
+            bAbort = true;
+         }
+
+         // Once ReadDirectory returns, the node's cDirs vector is
+         // never resized again, so pointers to its elements stay
+         // valid while other workers fill them in.
+         CDir *pDir = stJob.pDir;
+         for (int iDir = 0; !bAbort && iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+         {
+            tstring sSubPath = stJob.sPath;
+            if (sSubPath[sSubPath.size() - 1] != PATHSEP)
+               sSubPath += PATHSEP;
+            sSubPath += pDir->cDirs[iDir].cThis.sName;
+            Push(iWorker, &pDir->cDirs[iDir], sSubPath);
+         }
+         if (--iPending == 0 || bAbort)
+            Wake(true);
+      }
+   }
+};
+
+//
+// ScanFilesParallel:
+// Same as ScanFiles, except that the tree is scanned by the
+// given number of worker threads, which share out the pending
+// subdirectories between them.  The resulting tree is the same
+// as the one ScanFiles would build.
+//
+// If a callback function or query function is given, it may be
+// called from several worker threads at the same time.
+//
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CDir::ScanFilesParallel(
+   const _TCHAR *pszDirPath,
+   int iThreads,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath),
+   void *pContext,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
+   )
+{
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   // One thread is just a normal scan.
+   if (iThreads <= 1)
+      return ScanFiles(pszDirPath, pFunc, pContext, pQuery, pQueryContext);
+
+   // Seed the first worker's queue with this directory and
+   // start the workers.
+   CScanner cScanner(iThreads, pFunc, pContext, pQuery, pQueryContext);
+   cScanner.Push(0, this, pszDirPath);
+   std::vector<std::thread> cThreads;
+   for (int i = 0; i < iThreads; i++)
+      cThreads.push_back(std::thread(&CScanner::Work, &cScanner, i));
+   for (int i = 0; i < iThreads; i++)
+      cThreads[i].join();
+
+   // A directory couldn't be read, or the callback returned
+   // false, so we aborted.
+   if (cScanner.bAbort)
+   {
+      sError = cScanner.sError.empty() ? tstring(_T("Scan aborted")) : cScanner.sError;
+      return false;
+   }
+
+   // The workers finish directories in any order, so the
+   // totals are added up here in one pass.
+   UpdateTotals(true);
+   return true;
+}
+
+//
+// LoadDirInfo:
+// Fetches the size, timestamps, and attribute bits of every
+// entry in this directory (not its children) that was scanned
+// without them.  The directory is opened once, and each entry
+// is looked up relative to it.
+// Returns true if successful; false if the directory couldn't
+// be opened.
+//
+bool
+CDir::LoadDirInfo(const _TCHAR *pszDirPath)
+{
+#ifdef _WIN32
+   // Look up each entry by its full pathname.
+   CPathStack cPath(pszDirPath);
+   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+   {
+      if (!cFiles[iFile].bInfoLoaded)
+      {
+         size_t nMark = cPath.Push(cFiles[iFile].sName);
+         LoadEntryInfo(cPath.Path(), &cFiles[iFile]);
+         cPath.Pop(nMark);
+      }
+   }
+   for (int iDir = 0; iDir < static_cast<int>(cDirs.size()); iDir++)
+   {
+      if (!cDirs[iDir].cThis.bInfoLoaded)
+      {
+         size_t nMark = cPath.Push(cDirs[iDir].cThis.sName);
+         LoadEntryInfo(cPath.Path(), &cDirs[iDir].cThis);
+         cPath.Pop(nMark);
+      }
+   }
+   return true;
+#else
+#ifdef O_PATH
+   int fdDir = open(pszDirPath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+   int fdDir = open(pszDirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+   if (fdDir < 0)
+      return false;
+
+   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+   {
+      if (!cFiles[iFile].bInfoLoaded)
+         StatEntryAt(fdDir, &cFiles[iFile]);
+   }
+   for (int iDir = 0; iDir < static_cast<int>(cDirs.size()); iDir++)
+   {
+      if (!cDirs[iDir].cThis.bInfoLoaded)
+         StatEntryAt(fdDir, &cDirs[iDir].cThis);
+   }
+
+   close(fdDir);
+   return true;
+#endif
+}
+
+//
+// LoadTreeInfo:
+// Fetches the information for all entries in this directory
+// and its children that were scanned without it, by having
+// the given number of worker threads run LoadDirInfo on the
+// directories that need it.  With several requests in flight
+// at once, the time this takes depends on how many requests
+// the storage can handle at the same time rather than on the
+// latency of each one.
+// Returns true if successful.
+//
+bool
+CDir::LoadTreeInfo(const _TCHAR *pszDirPath, int iThreads)
+{
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   // Find the directories that have work to do.
+   std::vector<std::pair<CDir *, tstring> > cJobs;
+   CollectInfoJobs(this, pszDirPath, cJobs);
+   if (iThreads > static_cast<int>(cJobs.size()))
+      iThreads = static_cast<int>(cJobs.size());
+
+   // Just do it here if there's only one thread.
+   if (iThreads <= 1)
+   {
+      for (int i = 0; i < static_cast<int>(cJobs.size()); i++)
+         cJobs[i].first->LoadDirInfo(cJobs[i].second.c_str());
+      UpdateTotals(true);
+      return true;
+   }
+
+   // Each worker takes the next directory in the list until
+   // there are none left.
+   std::atomic<int> iNext(0);
+   std::vector<std::thread> cThreads;
+   for (int i = 0; i < iThreads; i++)
+   {
+      cThreads.push_back(std::thread(LoadInfoWorker, &cJobs, &iNext));
+   }
+   for (int i = 0; i < iThreads; i++)
+      cThreads[i].join();
+
+   // The sizes have changed, so add them up again.
+   UpdateTotals(true);
+   return true;
+}
+
+//
+// FileExists:
+// Determines if a file or subdirectory with the given
+// path (relative to the root of this directory) exists
+// in the tree.  Names are compared without regard to
+// case unless bCaseSensitive is true.
+//
+// If found, a pointer to the corresponding directory
+// entry will be returned.  Otherwise, NULL will be
+// returned.
+//
+CDirEntry *
+CDir::FileExists(const _TCHAR *pszPath, bool bCaseSensitive)
+{
+   CDir *pDir = this;
+   size_t nRest = _tcslen(pszPath);
+   for (;;)
+   {
+      // The last element of the path can be a file or a
+      // directory; the others can only be directories.
+      const _TCHAR *p = FindChar(pszPath, nRest, PATHSEP);
+      size_t nLen = (p == NULL) ? nRest : static_cast<size_t>(p - pszPath);
+      int iEntry = pDir->FindEntry(pszPath, nLen, p != NULL, bCaseSensitive);
+      if (iEntry < 0)
+         return NULL;   // Didn't find it.
+
+      int iFiles = static_cast<int>(pDir->cFiles.size());
+      if (p == NULL)
+         return (iEntry < iFiles) ? &pDir->cFiles[iEntry] : &pDir->cDirs[iEntry - iFiles].cThis;
+
+      // Look for the rest of the path in this subdirectory.
+      pDir = &pDir->cDirs[iEntry - iFiles];
+      pszPath = p + 1;
+      nRest -= nLen + 1;
+   }
+}
+
+//
+// FileExistsOnDemand:
+// Same as FileExists, except that the tree doesn't have to be
+// scanned first.  Each directory on the way to the given path
+// is read from disk the first time it's looked in, and kept in
+// the tree for later lookups, so only the directories that
+// lookups actually pass through are ever read.  pszDirPath is
+// the pathname of this directory on disk.
+//
+// Changes made on disk after a directory has been read aren't
+// seen by later lookups.
+//
+CDirEntry *
+CDir::FileExistsOnDemand(const _TCHAR *pszDirPath, const _TCHAR *pszPath, bool bCaseSensitive)
+{
+   // Read this directory if this is the first lookup in it.
+   if (!bListed && !ReadDirectory(pszDirPath))
+      return NULL;
+
+   // No prepended directory on the specified pathname, so
+   // it should be at this level if it exists.
+   const _TCHAR *p = FindChar(pszPath, _tcslen(pszPath), PATHSEP);
+   if (p == NULL)
+      return FileExists(pszPath, bCaseSensitive);
+
+   // Pass the rest of the path on to the next subdirectory
+   // in the tree (if the next level exists).
+   int iEntry = FindEntry(pszPath, p - pszPath, true, bCaseSensitive);
+   if (iEntry < 0)
+      return NULL;   // Didn't find it.
+   CDir *pSub = &cDirs[iEntry - cFiles.size()];
+   tstring sSubPath = pszDirPath;
+   if (sSubPath[sSubPath.size() - 1] != PATHSEP)
+      sSubPath += PATHSEP;
+   sSubPath += pSub->cThis.sName;
+   return pSub->FileExistsOnDemand(sSubPath.c_str(), p + 1, bCaseSensitive);
+}
+
+//
+// BuildIndex:
+// Builds the hash table that FileExists uses to find names in
+// this directory without comparing against every entry.  Each
+// slot holds one more than the number of an entry (0 means the
+// slot is empty), where the files are numbered first, then the
+// subdirectories.  Small directories aren't indexed.
+//
+// ReadDirectory and PruneFiles keep the index up to date.
+// Code that changes cFiles or cDirs directly should call this
+// afterwards.
+//
+void
+CDir::BuildIndex(void)
+{
+   std::vector<DWORD>().swap(cIndex);
+   size_t nFiles = cFiles.size();
+   size_t nEntries = nFiles + cDirs.size();
+   if (nEntries < INDEX_MIN_ENTRIES)
+      return;
+
+   size_t nMask = IndexSize(nEntries) - 1;
+   cIndex.resize(nMask + 1, 0);
+   for (size_t iEntry = 0; iEntry < nEntries; iEntry++)
+   {
+      const tstring &sName = (iEntry < nFiles) ? cFiles[iEntry].sName : cDirs[iEntry - nFiles].cThis.sName;
+      size_t iSlot = HashName(sName.c_str(), sName.size()) & nMask;
+      while (cIndex[iSlot] != 0)
+         iSlot = (iSlot + 1) & nMask;
+      cIndex[iSlot] = static_cast<DWORD>(iEntry + 1);
+   }
+}
+
+//
+// UpdateTotals:
+// Adds up the files, subdirectories, and bytes below this
+// directory into stTotals, from its own entries and the totals
+// of its subdirectories.  If bSubtrees is true, the totals of
+// the subdirectories are brought up to date first; otherwise
+// they're taken as they are.
+//
+// The scans, LoadTreeInfo, and the prunes call this for each
+// directory once its children are done, so the totals of the
+// whole tree are always ready, and entries whose information
+// hasn't been loaded count as 0 bytes until it is.  Code that
+// changes cFiles or cDirs (or their sizes) directly should call
+// this afterwards, and for each directory above it.
+//
+void
+CDir::UpdateTotals(bool bSubtrees)
+{
+   memset(&stTotals, 0, sizeof(stTotals));
+   CountDirEntries(this, &stTotals);
+   for (int iDir = 0; iDir < static_cast<int>(cDirs.size()); iDir++)
+   {
+      if (bSubtrees)
+         cDirs[iDir].UpdateTotals(true);
+      AddCounts(&stTotals, &cDirs[iDir].stTotals);
+   }
+}
+
+//
+// FindEntry:
+// Looks for a name (the first nLen characters of pszName) in
+// this directory, not its children.  If bDirsOnly is true,
+// files are ignored.  If more than one entry matches, the
+// first one wins, as it would in a search from the start.
+// Returns the number of the entry (see BuildIndex), or -1 if
+// not found.
+//
+int
+CDir::FindEntry(const _TCHAR *pszName, size_t nLen, bool bDirsOnly, bool bCaseSensitive) const
+{
+   int iFiles = static_cast<int>(cFiles.size());
+   int iEntries = iFiles + static_cast<int>(cDirs.size());
 
-//----------------------------------------------------------
-// MACROS
-//----------------------------------------------------------
+   // Just search the directory if it has no index.
+   if (cIndex.empty())
+   {
+      for (int iEntry = bDirsOnly ? iFiles : 0; iEntry < iEntries; iEntry++)
+      {
+         const tstring &sName = (iEntry < iFiles) ? cFiles[iEntry].sName : cDirs[iEntry - iFiles].cThis.sName;
+         if (NameMatches(sName.c_str(), sName.size(), pszName, nLen, bCaseSensitive))
+            return iEntry;
+      }
+      return -1;
+   }
 
-// Define the symbol DBG to enable debug/trace output to console.
-//#define DBG
+   // Check each entry with the same hash.
+   int iFound = -1;
+   size_t nMask = cIndex.size() - 1;
+   for (size_t iSlot = HashName(pszName, nLen) & nMask; cIndex[iSlot] != 0; iSlot = (iSlot + 1) & nMask)
+   {
+      int iEntry = static_cast<int>(cIndex[iSlot]) - 1;
+      if ((bDirsOnly && iEntry < iFiles) || (iFound >= 0 && iEntry > iFound))
+         continue;
+      const tstring &sName = (iEntry < iFiles) ? cFiles[iEntry].sName : cDirs[iEntry - iFiles].cThis.sName;
+      if (NameMatches(sName.c_str(), sName.size(), pszName, nLen, bCaseSensitive))
+         iFound = iEntry;
+   }
+   return iFound;
+}
 
-//----------------------------------------------------------
-// IMPLEMENTATION OF CLASS CDirEntry
-//----------------------------------------------------------
+//
+// Walk:
+// Returns a CDirWalk to step through the files and directories
+// in this directory (and all its children), in the same order
+// as EnumFiles.
+//
+CDirWalk
+CDir::Walk(const _TCHAR *pszDirPath)
+{
+   return CDirWalk(this, pszDirPath);
+}
 
-// Default constructor:
-CDirEntry::CDirEntry()
-   : sName(_T("")), dwUser(0), dwAttrib(0), dBytes(0.0)
+//
+// CountFiles:
+// Returns the number of files, directories, and bytes in this
+// directory and all its children (the same entries EnumFiles
+// would pass to EnumCallbackCountFiles).  These are the totals
+// kept by UpdateTotals, so nothing is walked.
+//
+void
+CDir::CountFiles(ENUM_COUNT_STRUCT *pCounts) const
 {
-   memset(&ftCreation,   0, sizeof(FILETIME));
-   memset(&ftLastAccess, 0, sizeof(FILETIME));
-   memset(&ftLastWrite,  0, sizeof(FILETIME));
+   *pCounts = stTotals;
 }
-      
+
 //----------------------------------------------------------
-// IMPLEMENTATION OF CLASS CDir
+// IMPLEMENTATION OF CLASS CFlatTree
 //----------------------------------------------------------
 
 // Default constructor.
-CDir::CDir()
+CFlatTree::CFlatTree()
 {
-   // Nothing needed here.
+   Clear();
 }
 
 //
-// PruneFiles:
-// Given a query function by the caller, removes from this directory
-// (and from all its children) any files and directories whose query
-// returns false.
+// Clear:
+// Empties the tree, leaving just the root directory.  Any
+// entries returned by FileExists are no longer valid.
+//
+void
+CFlatTree::Clear(void)
+{
+   {
+      std::lock_guard<std::mutex> cLock(mtxProxies);
+      cProxies.clear();
+   }
+   cNodes.clear();
+   cBytes.clear();
+   cLastWrite.clear();
+   cUser.clear();
+   cNames.clear();
+   cIndex.clear();
+
+   FLAT_DIR stNone;
+   memset(&stNone, 0, sizeof(stNone));
+   cDirInfo.assign(1, stNone);
+
+   CDirEntry cRoot;
+   cRoot.dwAttrib = FILE_ATTRIBUTE_DIRECTORY;
+   AddNode(&cRoot, true);
+}
+
+//
+// Build:
+// Replaces the contents of this tree with a copy of a CDir
+// tree.  The nodes are added one directory at a time, breadth
+// first, so each directory's children end up next to each
+// other.
+// Returns true if successful.
 //
 bool
-CDir::PruneFiles(
+CFlatTree::Build(const CDir *pDir)
+{
+   Clear();
+   PutEntry(0, &pDir->cThis);
+
+   std::deque<std::pair<DWORD, const CDir *> > cQueue;
+   cQueue.push_back(std::make_pair(DWORD(0), pDir));
+   while (!cQueue.empty())
+   {
+      DWORD iDir = cQueue.front().first;
+      const CDir *pNext = cQueue.front().second;
+      cQueue.pop_front();
+
+      AddChildren(iDir, pNext);
+      DWORD iFirstDir = Children(iDir).dwFirstChild + Children(iDir).dwNumFiles;
+      for (DWORD iSub = 0; iSub < Children(iDir).dwNumDirs; iSub++)
+         cQueue.push_back(std::make_pair(iFirstDir + iSub, &pNext->cDirs[iSub]));
+   }
+
+   BuildIndex();
+   return true;
+}
+
+//
+// ScanFiles:
+// Same as CDir::ScanFiles, except that the entries go into
+// this tree.  Each directory is read into a temporary CDir,
+// and its entries are copied into the arrays before moving on
+// to its subdirectories.
+//
+bool
+CFlatTree::ScanFiles(
    const _TCHAR *pszDirPath,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath),
+   void *pContext,
    bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  CFlatTree::ScanFiles(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   Clear();
+   CPathStack cPath(pszDirPath);
+   if (!ScanDir(0, cPath, pFunc, pContext, pQuery, pQueryContext))
+      return false;
+
+   BuildIndex();
+   return true;
+}
+
+//
+// LoadDirInfo:
+// Same as CDir::LoadDirInfo, for the children of one directory
+// node.
+//
+bool
+CFlatTree::LoadDirInfo(DWORD iDir, const _TCHAR *pszDirPath)
+{
+   DWORD iFirst = Children(iDir).dwFirstChild;
+   DWORD iLast = iFirst + Children(iDir).dwNumFiles + Children(iDir).dwNumDirs;
+   CDirEntry cEntry;
+
+#ifdef _WIN32
+   // Look up each entry by its full pathname.
+   CPathStack cPath(pszDirPath);
+   for (DWORD iNode = iFirst; iNode < iLast; iNode++)
+   {
+      if (!(cNodes[iNode].wFlags & FLAT_INFOLOADED))
+      {
+         GetEntry(iNode, &cEntry);
+         size_t nMark = cPath.Push(cEntry.sName);
+         LoadEntryInfo(cPath.Path(), &cEntry);
+         cPath.Pop(nMark);
+         PutEntry(iNode, &cEntry);
+      }
+   }
+   return true;
+#else
+#ifdef O_PATH
+   int fdDir = open(pszDirPath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+   int fdDir = open(pszDirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+   if (fdDir < 0)
+      return false;
+
+   for (DWORD iNode = iFirst; iNode < iLast; iNode++)
+   {
+      if (!(cNodes[iNode].wFlags & FLAT_INFOLOADED))
+      {
+         GetEntry(iNode, &cEntry);
+         if (StatEntryAt(fdDir, &cEntry))
+            PutEntry(iNode, &cEntry);
+      }
+   }
+
+   close(fdDir);
+   return true;
+#endif
+}
+
+//
+// LoadTreeInfo:
+// Same as CDir::LoadTreeInfo.  Entries returned by FileExists
+// before the call are no longer valid.
+//
+bool
+CFlatTree::LoadTreeInfo(const _TCHAR *pszDirPath, int iThreads)
+{
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   FlushProxies();
+
+   // Find the directories that have work to do.  Each one's
+   // pathname is built from its parent's, which is always
+   // earlier in the list.
+   std::vector<std::pair<DWORD, tstring> > cJobs;
+   std::deque<std::pair<DWORD, tstring> > cQueue;
+   cQueue.push_back(std::make_pair(DWORD(0), tstring(pszDirPath)));
+   while (!cQueue.empty())
+   {
+      std::pair<DWORD, tstring> cDir = cQueue.front();
+      cQueue.pop_front();
+
+      const FLAT_DIR &stDir = Children(cDir.first);
+      DWORD iLast = stDir.dwFirstChild + stDir.dwNumFiles + stDir.dwNumDirs;
+      for (DWORD iNode = stDir.dwFirstChild; iNode < iLast; iNode++)
+      {
+         if (!(cNodes[iNode].wFlags & FLAT_INFOLOADED))
+         {
+            cJobs.push_back(cDir);
+            break;
+         }
+      }
+
+      tstring sBase = cDir.second;
+      if (sBase[sBase.size() - 1] != PATHSEP)
+         sBase += PATHSEP;
+      for (DWORD iNode = stDir.dwFirstChild + stDir.dwNumFiles; iNode < iLast; iNode++)
+         cQueue.push_back(std::make_pair(iNode, sBase + tstring(cNames.data() + cNodes[iNode].dwName, cNodes[iNode].wNameLen)));
+   }
+   if (iThreads > static_cast<int>(cJobs.size()))
+      iThreads = static_cast<int>(cJobs.size());
+
+   // Just do it here if there's only one thread.
+   if (iThreads <= 1)
+   {
+      for (int i = 0; i < static_cast<int>(cJobs.size()); i++)
+         LoadDirInfo(cJobs[i].first, cJobs[i].second.c_str());
+      return true;
+   }
+
+   // Each worker takes the next directory in the list until
+   // there are none left.
+   std::atomic<int> iNext(0);
+   std::vector<std::thread> cThreads;
+   for (int i = 0; i < iThreads; i++)
+   {
+      cThreads.push_back(std::thread(LoadFlatInfoWorker, this, &cJobs, &iNext));
+   }
+   for (int i = 0; i < iThreads; i++)
+      cThreads[i].join();
+
+   return true;
+}
+
+//
+// EnumFiles:
+// Same as CDir::EnumFiles.  Each entry is passed to the
+// enumeration function as a CDirEntry, and any changes the
+// function makes to it are copied back into the tree.
+//
+bool
+CFlatTree::EnumFiles(
+   const _TCHAR *pszDirPath,
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
    void *pContext
    )
 {
 #ifdef DBG
-   _tprintf(_T("DEBUG:  PruneFiles(\"%s\")\n"), pszDirPath);
+   _tprintf(_T("DEBUG:  CFlatTree::EnumFiles(\"%s\")\n"), pszDirPath);
    fflush(stdout);
 #endif
 
@@ -113,365 +2230,864 @@ CDir::PruneFiles(
       return false;
    }
 
-   // For each file in this dir...
-   int iFile = 0;
-   while (iFile < (int)cFiles.size())
-   {
-      // Build pathname of file.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cFiles[iFile].sName.c_str());
-
-      // Query if we should keep this file.
-      if (pQuery(pContext, szSubPath, &cFiles[iFile], false))
-         iFile++;
+   CPathStack cPath(pszDirPath);
+   return EnumDir(0, cPath, false, pEnum, pContext);
+}
+
+//
+// EnumFilesReverse:
+// Same as CDir::EnumFilesReverse, with the entries passed the
+// same way as EnumFiles does.
+//
+bool
+CFlatTree::EnumFilesReverse(
+   const _TCHAR *pszDirPath,
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pContext
+   )
+{
+#ifdef DBG
+   _tprintf(_T("DEBUG:  CFlatTree::EnumFilesReverse(\"%s\")\n"), pszDirPath);
+   fflush(stdout);
+#endif
+
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   CPathStack cPath(pszDirPath);
+   return EnumDir(0, cPath, true, pEnum, pContext);
+}
+
+//
+// FileExists:
+// Same as CDir::FileExists.  The entry returned is a copy of
+// the node that the caller may change, and the changes are
+// seen by EnumFiles and EnumFilesReverse.  It stays valid
+// until the next call to Clear, Build, ScanFiles, or
+// LoadTreeInfo.  Callers that only need to look at the node
+// can use FindNode instead, which doesn't make a copy.
+//
+CDirEntry *
+CFlatTree::FileExists(const _TCHAR *pszPath, bool bCaseSensitive)
+{
+   DWORD iNode = FindNode(pszPath, bCaseSensitive);
+   if (iNode == FLAT_NONE)
+      return NULL;
+
+   std::lock_guard<std::mutex> cLock(mtxProxies);
+   std::unordered_map<DWORD, CDirEntry>::iterator it = cProxies.find(iNode);
+   if (it == cProxies.end())
+   {
+      it = cProxies.insert(std::make_pair(iNode, CDirEntry())).first;
+      GetEntry(iNode, &it->second);
+   }
+   return &it->second;
+}
+
+//
+// FindNode:
+// Looks up a file or subdirectory by its path relative to
+// the root of the tree, the same way FileExists does.
+// Returns the index of its node, or FLAT_NONE if not found.
+//
+DWORD
+CFlatTree::FindNode(const _TCHAR *pszPath, bool bCaseSensitive) const
+{
+   size_t nMask = cIndex.size() - 1;
+   DWORD iDir = 0;
+   size_t nRest = _tcslen(pszPath);
+   for (;;)
+   {
+      // The last element of the path can be a file or a
+      // directory; the others can only be directories.
+      const _TCHAR *p = FindChar(pszPath, nRest, PATHSEP);
+      size_t nLen = (p == NULL) ? nRest : static_cast<size_t>(p - pszPath);
+      const FLAT_DIR &stDir = Children(iDir);
+      DWORD iFirst = stDir.dwFirstChild;
+      if (p != NULL)
+         iFirst += stDir.dwNumFiles;
+      DWORD iLast = stDir.dwFirstChild + stDir.dwNumFiles + stDir.dwNumDirs;
+
+      DWORD iFound = FLAT_NONE;
+      if (cIndex.empty())
+      {
+         // No index, so search the directory.
+         for (DWORD iNode = iFirst; iNode < iLast; iNode++)
+         {
+            if (NameMatches(cNames.data() + cNodes[iNode].dwName, cNodes[iNode].wNameLen,
+                  pszPath, nLen, bCaseSensitive))
+            {
+               iFound = iNode;
+               break;
+            }
+         }
+      }
       else
-         cFiles.erase(cFiles.begin() + iFile);
+      {
+         // Check each node with the same hash.  If more than
+         // one matches, the first one in the directory wins.
+         for (size_t iSlot = (HashName(pszPath, nLen) ^ (iDir * 2654435761u)) & nMask;
+              cIndex[iSlot] != 0; iSlot = (iSlot + 1) & nMask)
+         {
+            DWORD iNode = cIndex[iSlot];
+            if (iNode < iFirst || iNode >= iLast || iNode > iFound)
+               continue;
+            if (NameMatches(cNames.data() + cNodes[iNode].dwName, cNodes[iNode].wNameLen,
+                  pszPath, nLen, bCaseSensitive))
+               iFound = iNode;
+         }
+      }
+      if (iFound == FLAT_NONE || p == NULL)
+         return iFound;
+
+      // Look for the rest of the path in this subdirectory.
+      iDir = iFound;
+      pszPath = p + 1;
+      nRest -= nLen + 1;
+   }
+}
+
+//
+// GetEntry:
+// Copies the information for one node into a CDirEntry.
+//
+void
+CFlatTree::GetEntry(DWORD iNode, CDirEntry *pEntry) const
+{
+   const FLAT_NODE &stNode = cNodes[iNode];
+   pEntry->sName.assign(cNames.data() + stNode.dwName, stNode.wNameLen);
+   pEntry->dwUser = cUser[iNode].dwValue.load(std::memory_order_relaxed);
+   pEntry->dwAttrib = stNode.dwAttrib;
+   pEntry->dBytes = static_cast<double>(cBytes[iNode]);
+   pEntry->qwLastWrite = cLastWrite[iNode];
+   pEntry->bInfoLoaded = (stNode.wFlags & FLAT_INFOLOADED) != 0;
+}
+
+//
+// PutEntry:
+// Copies the information in a CDirEntry into one node.  The
+// name can't be changed this way.
+//
+void
+CFlatTree::PutEntry(DWORD iNode, const CDirEntry *pEntry)
+{
+   FLAT_NODE &stNode = cNodes[iNode];
+   stNode.dwAttrib = pEntry->dwAttrib;
+   if (pEntry->bInfoLoaded)
+      stNode.wFlags |= FLAT_INFOLOADED;
+   else
+      stNode.wFlags &= ~FLAT_INFOLOADED;
+   cBytes[iNode] = static_cast<ULONGLONG>(pEntry->dBytes);
+   cLastWrite[iNode] = pEntry->qwLastWrite;
+   cUser[iNode].dwValue.store(pEntry->dwUser, std::memory_order_relaxed);
+}
+
+//
+// BuildIndex:
+// Builds the hash table that FindNode uses to look up names.
+// There's one table for the whole tree, keyed on the name of
+// each node and the index of its parent.  Each slot holds the
+// index of a node, and 0 (the root, which isn't in the table)
+// means the slot is empty.
+//
+void
+CFlatTree::BuildIndex(void)
+{
+   size_t nMask = IndexSize(cNodes.size()) - 1;
+   cIndex.assign(nMask + 1, 0);
+   for (DWORD iDir = 0; iDir < static_cast<DWORD>(cNodes.size()); iDir++)
+   {
+      const FLAT_DIR &stDir = Children(iDir);
+      DWORD iLast = stDir.dwFirstChild + stDir.dwNumFiles + stDir.dwNumDirs;
+      for (DWORD iNode = stDir.dwFirstChild; iNode < iLast; iNode++)
+      {
+         const FLAT_NODE &stNode = cNodes[iNode];
+         size_t iSlot = (HashName(cNames.data() + stNode.dwName, stNode.wNameLen) ^ (iDir * 2654435761u)) & nMask;
+         while (cIndex[iSlot] != 0)
+            iSlot = (iSlot + 1) & nMask;
+         cIndex[iSlot] = iNode;
+      }
+   }
+}
+
+//
+// SetUserFlags:
+// Sets bits in the dwUser value of one node.  Unlike PutEntry,
+// this can be done from several threads at once, including
+// while other threads are getting entries from the tree.  Each
+// bit is set on its own, and the threads are joined before the
+// flags are acted on, so no ordering is needed.
+//
+void
+CFlatTree::SetUserFlags(DWORD iNode, DWORD dwFlags)
+{
+   cUser[iNode].dwValue.fetch_or(dwFlags, std::memory_order_relaxed);
+}
+
+//
+// CountFiles:
+// Same as CDir::CountFiles.  The directories are split into
+// ranges that are counted at the same time.
+//
+void
+CFlatTree::CountFiles(ENUM_COUNT_STRUCT *pCounts, int iThreads)
+{
+   FlushProxies();
+   memset(pCounts, 0, sizeof(*pCounts));
+
+   size_t nDirs = cDirInfo.size();
+   size_t nJobs = (iThreads <= 1) ? 1 : static_cast<size_t>(iThreads) * 4;
+   std::vector<ENUM_COUNT_STRUCT> cParts(nJobs);
+   RunParallel(iThreads, nJobs, [&](size_t iJob)
+   {
+      ENUM_COUNT_STRUCT *pPart = &cParts[iJob];
+      memset(pPart, 0, sizeof(*pPart));
+      size_t iEnd = nDirs * (iJob + 1) / nJobs;
+      for (size_t iDir = nDirs * iJob / nJobs; iDir < iEnd; iDir++)
+      {
+         DWORD iFirst = cDirInfo[iDir].dwFirstChild;
+         DWORD iFirstDir = iFirst + cDirInfo[iDir].dwNumFiles;
+         DWORD iLast = iFirstDir + cDirInfo[iDir].dwNumDirs;
+         for (DWORD iNode = iFirst; iNode < iFirstDir; iNode++)
+         {
+            if (cNodes[iNode].wNameLen > 0)
+               CountEntry(pPart, static_cast<double>(cBytes[iNode]), false);
+         }
+         for (DWORD iNode = iFirstDir; iNode < iLast; iNode++)
+            CountEntry(pPart, static_cast<double>(cBytes[iNode]), true);
+      }
+   });
+   for (size_t iJob = 0; iJob < nJobs; iJob++)
+      AddCounts(pCounts, &cParts[iJob]);
+}
+
+//
+// AddNode:
+// Adds a node to the end of the arrays, with no children.
+//
+void
+CFlatTree::AddNode(const CDirEntry *pEntry, bool bIsDir)
+{
+   FLAT_NODE stNode;
+   memset(&stNode, 0, sizeof(stNode));
+   stNode.dwName = static_cast<DWORD>(cNames.size());
+   stNode.wNameLen = static_cast<WORD>(pEntry->sName.size());
+   if (bIsDir)
+   {
+      FLAT_DIR stDir;
+      memset(&stDir, 0, sizeof(stDir));
+      stNode.dwDir = static_cast<DWORD>(cDirInfo.size());
+      cDirInfo.push_back(stDir);
+   }
+   cNames.insert(cNames.end(), pEntry->sName.begin(), pEntry->sName.end());
+   cNodes.push_back(stNode);
+   cBytes.push_back(0);
+   cLastWrite.push_back(0);
+   cUser.push_back(CAtomicDword());
+   PutEntry(static_cast<DWORD>(cNodes.size() - 1), pEntry);
+}
+
+//
+// AddChildren:
+// Adds the files and subdirectories of a CDir (not their
+// children) to the end of the arrays as the children of a
+// directory node.
+//
+void
+CFlatTree::AddChildren(DWORD iDir, const CDir *pDir)
+{
+   FLAT_DIR &stDir = cDirInfo[cNodes[iDir].dwDir];
+   stDir.dwFirstChild = static_cast<DWORD>(cNodes.size());
+   stDir.dwNumFiles = static_cast<DWORD>(pDir->cFiles.size());
+   stDir.dwNumDirs = static_cast<DWORD>(pDir->cDirs.size());
+   for (int iFile = 0; iFile < static_cast<int>(pDir->cFiles.size()); iFile++)
+      AddNode(&pDir->cFiles[iFile], false);
+   for (int iSub = 0; iSub < static_cast<int>(pDir->cDirs.size()); iSub++)
+      AddNode(&pDir->cDirs[iSub].cThis, true);
+}
+
+//
+// FlushProxies:
+// Copies the entries handed out by FileExists back into their
+// nodes, and throws them away.
+//
+void
+CFlatTree::FlushProxies(void)
+{
+   std::lock_guard<std::mutex> cLock(mtxProxies);
+   for (std::unordered_map<DWORD, CDirEntry>::iterator it = cProxies.begin(); it != cProxies.end(); ++it)
+      PutEntry(it->first, &it->second);
+   cProxies.clear();
+}
+
+//
+// ScanDir:
+// Does the work of ScanFiles for one directory node and its
+// children.
+//
+bool
+CFlatTree::ScanDir(
+   DWORD iDir,
+   CPathStack &cPath,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath),
+   void *pContext,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
+   )
+{
+   // If callback function given, pass directory name to it.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, cPath.Path()))
+      {
+         sError = _T("Scan aborted");
+         return false; // Callback returned false, so abort.
+      }
    }
 
-   // For each subdir in this dir...
-   iFile = 0;
-   while (iFile < static_cast<int>(cDirs.size()))
-   {
-      // Build pathname of subdir.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cDirs[iFile].cThis.sName.c_str());
-
-      // Query if we should keep this dir.
-      if (pQuery(pContext, szSubPath, &cDirs[iFile].cThis, true))
-         iFile++;
-      else
-         cDirs.erase(cDirs.begin() + iFile);
+   // Read the entries in this directory.
+   {
+      CDir cDir;
+      if (!cDir.ReadDirectory(cPath.Path(), pQuery, pQueryContext))
+      {
+         sError = cDir.sError;
+         return false;
+      }
+      AddChildren(iDir, &cDir);
    }
 
    // For each subdir in this dir...
-   for (int iiFile = 0; iiFile < static_cast<int>(cDirs.size()); iiFile++)
+   DWORD iFirstDir = Children(iDir).dwFirstChild + Children(iDir).dwNumFiles;
+   DWORD dwDirs = Children(iDir).dwNumDirs;
+   for (DWORD iSub = iFirstDir; iSub < iFirstDir + dwDirs; iSub++)
    {
-      // Build pathname of subdir.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cDirs[iiFile].cThis.sName.c_str());
-
-      // Do pruning on subdir.
-      if (!cDirs[iiFile].PruneFiles(szSubPath, pQuery, pContext))
-      {
-         // Pruning of subdir failed!
-         sError = cDirs[iiFile].sError;
+      size_t nMark = cPath.Push(cNames.data() + cNodes[iSub].dwName, cNodes[iSub].wNameLen);
+      if (!ScanDir(iSub, cPath, pFunc, pContext, pQuery, pQueryContext))
          return false;
-      }
+      cPath.Pop(nMark);
    }
 
    return true;
 }
 
 //
-// EnumFiles:
-// Passes all the files and directories in this directory (and all
-// its children) to an enumeration function specified by the caller.
-// If the enumeration function returns false, enumeration will cease.
-// Returns true if enumeration finished, false if enumeration was
-// interrupted by a false return of the enumeration function.
+// EnumNode:
+// Passes one node to an enumeration function, using the entry
+// handed out by FileExists if there is one, or else a copy in
+// cEntry that's copied back afterwards.
 //
 bool
-CDir::EnumFiles(
-   const _TCHAR *pszDirPath,
+CFlatTree::EnumNode(
+   DWORD iNode,
+   const _TCHAR *pszPath,
+   bool bIsDir,
+   CDirEntry &cEntry,
    bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
    void *pContext
    )
 {
-#ifdef DBG
-   _tprintf(_T("DEBUG:  EnumFiles(\"%s\")\n"), pszDirPath);
-   fflush(stdout);
-#endif
-
-   // Check for bogus parameters.
-   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   CDirEntry *pProxy = NULL;
    {
-      sError = _T("Bad Parameter");
-      return false;
+      std::lock_guard<std::mutex> cLock(mtxProxies);
+      if (!cProxies.empty())
+      {
+         std::unordered_map<DWORD, CDirEntry>::iterator it = cProxies.find(iNode);
+         if (it != cProxies.end())
+            pProxy = &it->second;
+      }
    }
+   if (pProxy != NULL)
+      return pEnum(pContext, pszPath, pProxy, bIsDir);
+
+   GetEntry(iNode, &cEntry);
+   bool bResult = pEnum(pContext, pszPath, &cEntry, bIsDir);
+   PutEntry(iNode, &cEntry);
+   return bResult;
+}
+
+//
+// EnumDir:
+// Does the work of EnumFiles (or EnumFilesReverse, if bReverse
+// is true) for one directory node and its children.
+//
+bool
+CFlatTree::EnumDir(
+   DWORD iDir,
+   CPathStack &cPath,
+   bool bReverse,
+   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pContext
+   )
+{
+   CDirEntry cEntry;
 
    // For each file in this dir...
-   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+   DWORD iFirst = Children(iDir).dwFirstChild;
+   DWORD iFirstDir = iFirst + Children(iDir).dwNumFiles;
+   DWORD iLast = iFirstDir + Children(iDir).dwNumDirs;
+   for (DWORD iNode = iFirst; iNode < iFirstDir; iNode++)
    {
-      if (cFiles[iFile].sName.size() < 1)
+      if (!bReverse && cNodes[iNode].wNameLen < 1)
          continue;   // Filename is zero length, so skip it.
 
-      // Build pathname of file.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cFiles[iFile].sName.c_str());
-
-      if (!pEnum(pContext, szSubPath, &cFiles[iFile], false))
+      size_t nMark = cPath.Push(cNames.data() + cNodes[iNode].dwName, cNodes[iNode].wNameLen);
+      if (!EnumNode(iNode, cPath.Path(), false, cEntry, pEnum, pContext))
          return false;
+      cPath.Pop(nMark);
    }
 
    // For each subdir in this dir...
-   for (int iFile = 0; iFile < static_cast<int>(cDirs.size()); iFile++)
+   for (DWORD iNode = iFirstDir; iNode < iLast; iNode++)
    {
-      // Build pathname of subdir.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cDirs[iFile].cThis.sName.c_str());
+      size_t nMark = cPath.Push(cNames.data() + cNodes[iNode].dwName, cNodes[iNode].wNameLen);
 
-      if (!pEnum(pContext, szSubPath, &cDirs[iFile].cThis, true))
+      if (!bReverse && !EnumNode(iNode, cPath.Path(), true, cEntry, pEnum, pContext))
          return false;
 
       // Enumerate children of this dir.
-      if (!cDirs[iFile].EnumFiles(szSubPath, pEnum, pContext))
+      if (!EnumDir(iNode, cPath, bReverse, pEnum, pContext))
+         return false;
+
+      if (bReverse && !EnumNode(iNode, cPath.Path(), true, cEntry, pEnum, pContext))
          return false;
+      cPath.Pop(nMark);
    }
 
    return true;
 }
 
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CTreeDiff
+//----------------------------------------------------------
+
+// Default constructor.
+CTreeDiff::CTreeDiff()
+   : pSrcTree(NULL), pDestTree(NULL), bCaseSensitive(false), pQuery(NULL), pQueryContext(NULL)
+{
+   memset(&stSrcTotals, 0, sizeof(stSrcTotals));
+}
+
 //
-// EnumFilesReverse:
-// Same as EnumFiles, except goes in reverse order with files in
-// this dir, then child subdirs, then subdirs.
+// Compare:
+// Fills cActions with what has to be done to make the tree in
+// pDest match the tree in pSrc.  Names are matched without
+// regard to case unless bCaseSensitive is true.
 //
-// Passes all the files and directories in this directory (and all
-// its children) to an enumeration function specified by the caller.
-// If the enumeration function returns false, enumeration will cease.
-// Returns true if enumeration finished, false if enumeration was
-// interrupted by a false return of the enumeration function.
+// If a query function is given, it's called for each source
+// entry, the same way PruneFiles would call it.  Entries it
+// returns false for are left out of the copy, but anything in
+// the destination with the same name is kept.  Names inside a
+// directory that's left out are treated the same way.
+//
+// Files that are in both trees are compared by size and time
+// of last write, fetching them first if they weren't loaded
+// with the tree.  The actions refer to the nodes of both trees,
+// so neither should be changed while the actions are in use.
+//
+// Returns true if successful.
 //
 bool
-CDir::EnumFilesReverse(
-   const _TCHAR *pszDirPath,
-   bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
-   void *pContext
+CTreeDiff::Compare(
+   CFlatTree *pSrc,
+   const _TCHAR *pszSrcPath,
+   CFlatTree *pDest,
+   const _TCHAR *pszDestPath,
+   bool bCaseSensitive,
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir),
+   void *pQueryContext
    )
 {
 #ifdef DBG
-   _tprintf(_T("DEBUG:  EnumFilesReverse(\"%s\")\n"), pszDirPath);
+   _tprintf(_T("DEBUG:  CTreeDiff::Compare(\"%s\", \"%s\")\n"), pszSrcPath, pszDestPath);
    fflush(stdout);
 #endif
 
    // Check for bogus parameters.
-   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   if (pSrc == NULL || pDest == NULL ||
+       pszSrcPath == nullptr || pszSrcPath[0] == '\0' ||
+       pszDestPath == nullptr || pszDestPath[0] == '\0')
    {
       sError = _T("Bad Parameter");
       return false;
    }
 
-   // For each file in this dir...
-   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
-   {
-      // Build pathname of file.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cFiles[iFile].sName.c_str());
+   cActions.clear();
+   memset(&stSrcTotals, 0, sizeof(stSrcTotals));
+   pSrcTree = pSrc;
+   pDestTree = pDest;
+   sSrcRoot = pszSrcPath;
+   sDestRoot = pszDestPath;
+   this->bCaseSensitive = bCaseSensitive;
+   this->pQuery = pQuery;
+   this->pQueryContext = pQueryContext;
 
-      if (!pEnum(pContext, szSubPath, &cFiles[iFile], false))
-         return false;
-   }
+   CPathStack cSrcPath(pszSrcPath);
+   CPathStack cDestPath(pszDestPath);
+   CompareDir(0, 0, DIFF_ROOT, cSrcPath, cDestPath, false);
+   return true;
+}
 
-   // For each subdir in this dir...
-   for (int iFile = 0; iFile < static_cast<int>(cDirs.size()); iFile++)
+//
+// EnumActions:
+// Passes each action to an enumeration function, along with
+// the pathnames of its file or directory in the source and
+// the destination.  Where a name is only on one side, the
+// other side's pathname uses the same spelling.  If bReverse
+// is true, goes from the last action backwards, so that each
+// directory comes after its contents.  The pathnames are
+// built up one name at a time as the actions are walked, and
+// are only valid until the enumeration function returns.
+// Returns false if the enumeration function returned false.
+//
+bool
+CTreeDiff::EnumActions(
+   bool (*pEnum)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath),
+   void *pContext,
+   bool bReverse
+   )
+{
+   CPathStack cSrcPath(sSrcRoot.c_str());
+   CPathStack cDestPath(sDestRoot.c_str());
+
+   // The actions whose names are on the ends of the pathnames,
+   // one for each level, and the marks to pop them with.
+   std::vector<DWORD> cChain;
+   std::vector<std::pair<size_t, size_t> > cMarks;
+   std::vector<DWORD> cMissing;
+
+   DWORD dwCount = static_cast<DWORD>(cActions.size());
+   for (DWORD i = 0; i < dwCount; i++)
    {
-      // Build pathname of subdir.
-      _TCHAR szSubPath[MAXPATH];
-      _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-      if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-         _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-      _tcscat_s(szSubPath, MAXPATH, cDirs[iFile].cThis.sName.c_str());
+      DWORD iAction = bReverse ? dwCount - 1 - i : i;
 
-      // Enumerate children of this subdir.
-      if (!cDirs[iFile].EnumFilesReverse(szSubPath, pEnum, pContext))
-         return false;
+      // Find the nearest of this action and the directories
+      // above it whose name is already in the pathnames.
+      DWORD iUp = iAction;
+      cMissing.clear();
+      while (iUp != DIFF_ROOT &&
+             !(cActions[iUp].dwDepth < cChain.size() && cChain[cActions[iUp].dwDepth] == iUp))
+      {
+         cMissing.push_back(iUp);
+         iUp = cActions[iUp].dwParent;
+      }
+
+      // Take off the names below it, and add the rest.
+      size_t nKeep = (iUp == DIFF_ROOT) ? 0 : cActions[iUp].dwDepth + 1;
+      if (cChain.size() > nKeep)
+      {
+         cSrcPath.Pop(cMarks[nKeep].first);
+         cDestPath.Pop(cMarks[nKeep].second);
+         cChain.resize(nKeep);
+         cMarks.resize(nKeep);
+      }
+      for (size_t n = cMissing.size(); n > 0; n--)
+      {
+         cMarks.push_back(PushNames(cMissing[n - 1], cSrcPath, cDestPath));
+         cChain.push_back(cMissing[n - 1]);
+      }
 
-      // Enumerate this subdir.
-      if (!pEnum(pContext, szSubPath, &cDirs[iFile].cThis, true))
+      if (!pEnum(pContext, iAction, cSrcPath, cDestPath))
          return false;
    }
-
    return true;
 }
 
 //
-// ScanFiles:
-// Fills cFiles and cDirs with information from a directory on disk.
-// Optionally allows the user to specify a callback function that
-// will be called with the name of each subdirectory that is scanned
-// (for updating a status display, for example).
-// Returns true if successful; false if error.  The sError member
-// will contain an error message if return value is false.
+// WalkActions:
+// Goes through the actions once, in order, the same way
+// EnumActions does, but with two enumeration functions: pEnter
+// is called for each action, and pLeave is called for each
+// action once everything below it is done (right after pEnter,
+// for a file).  So pEnter sees each directory before its
+// contents, and pLeave sees it after them, in the same walk.
+// Either function may be NULL.
+// Returns false if either enumeration function returned false.
 //
 bool
-CDir::ScanFiles(
-   const _TCHAR *pszDirPath,
-   bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath),
+CTreeDiff::WalkActions(
+   bool (*pEnter)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath),
+   bool (*pLeave)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath),
    void *pContext
    )
 {
-#ifdef DBG
-   _tprintf(_T("DEBUG:  ScanFiles(\"%s\")\n"), pszDirPath);
-   fflush(stdout);
-#endif
+   CPathStack cSrcPath(sSrcRoot.c_str());
+   CPathStack cDestPath(sDestRoot.c_str());
 
-   // Check for bogus parameters.
-   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   // The actions whose names are on the ends of the pathnames,
+   // one for each level, and the marks to pop them with.
+   // Compare adds each directory's action just before the
+   // actions for everything in it, so the actions an action is
+   // below are always the first dwDepth ones here.
+   std::vector<DWORD> cChain;
+   std::vector<std::pair<size_t, size_t> > cMarks;
+
+   DWORD dwCount = static_cast<DWORD>(cActions.size());
+   for (DWORD iAction = 0; iAction <= dwCount; iAction++)
    {
-      sError = _T("Bad Parameter");
-      return false;
+      // Leave the actions that this one isn't below (at the
+      // end, that's all of them).
+      size_t nKeep = (iAction < dwCount) ? cActions[iAction].dwDepth : 0;
+      while (cChain.size() > nKeep)
+      {
+         if (pLeave != NULL && !pLeave(pContext, cChain.back(), cSrcPath, cDestPath))
+            return false;
+         cSrcPath.Pop(cMarks.back().first);
+         cDestPath.Pop(cMarks.back().second);
+         cChain.pop_back();
+         cMarks.pop_back();
+      }
+      if (iAction == dwCount)
+         break;
+
+      cMarks.push_back(PushNames(iAction, cSrcPath, cDestPath));
+      cChain.push_back(iAction);
+      if (pEnter != NULL && !pEnter(pContext, iAction, cSrcPath, cDestPath))
+         return false;
    }
+   return true;
+}
 
-   // If callback function given, pass directory name to it.
-   if (pFunc != NULL)
+//
+// PushNames:
+// Adds the name of an action's file or directory to the ends of
+// the source and destination pathnames.  Where the name is only
+// on one side, the other side gets the same spelling.
+// Returns the marks to pop the names with.
+//
+std::pair<size_t, size_t>
+CTreeDiff::PushNames(DWORD iAction, CPathStack &cSrcPath, CPathStack &cDestPath) const
+{
+   const DIFF_ACTION &stAction = cActions[iAction];
+   const _TCHAR *pszDestName = NULL;
+   size_t nDestLen = 0;
+   if (stAction.iDest != FLAT_NONE)
    {
-      if (!pFunc(pContext, pszDirPath))
-         return false; // Callback returned false, so abort.
+      const FLAT_NODE &stNode = pDestTree->cNodes[stAction.iDest];
+      pszDestName = pDestTree->cNames.data() + stNode.dwName;
+      nDestLen = stNode.wNameLen;
    }
-
-   // Find matches.
-   WIN32_FIND_DATA   stFind;
-   HANDLE            hFind;
-   _TCHAR           szPathPlusWild[MAXPATH];
-   _tcscpy_s(szPathPlusWild, MAXPATH, pszDirPath);
-   if (szPathPlusWild[_tcslen(szPathPlusWild) - 1] != '\\')
-      _tcscat_s(szPathPlusWild, MAXPATH, _T("\\"));
-   _tcscat_s(szPathPlusWild, MAXPATH, _T("*.*"));
-   memset(&stFind, 0, sizeof(stFind));
-   hFind = FindFirstFile(szPathPlusWild, &stFind);
-   if (hFind == NULL)
+   const _TCHAR *pszSrcName = pszDestName;
+   size_t nSrcLen = nDestLen;
+   if (stAction.iSrc != FLAT_NONE)
    {
-      // Nothing in this directory.
-      // This is not an error.
-      return true;
+      const FLAT_NODE &stNode = pSrcTree->cNodes[stAction.iSrc];
+      pszSrcName = pSrcTree->cNames.data() + stNode.dwName;
+      nSrcLen = stNode.wNameLen;
    }
-   do
+   if (pszDestName == NULL)
    {
-#ifdef DBG
-      _tprintf(_T("DEBUG:  Found \"%s\"\n"), stFind.cFileName);
-      fflush(stdout);
-#endif
-      // Build object describing this file or dir.
-      CDirEntry cFile;
-      cFile.sName = stFind.cFileName;
-      cFile.dwAttrib = stFind.dwFileAttributes;
-      cFile.dBytes = (double)stFind.nFileSizeHigh * 65536.0 * 65536.0 + (double)stFind.nFileSizeLow;
-      cFile.ftCreation = stFind.ftCreationTime;
-      cFile.ftLastAccess = stFind.ftLastAccessTime;
-      cFile.ftLastWrite = stFind.ftLastWriteTime;
-
-      // Because of bug in FindFirstFile, we have to check that
-      // the filename is non-empty to make sure this match actually
-      // exists.
-      if (cFile.sName.size() > 0)
-      {
-         // Is this match a directory or file?
-         if (stFind.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-         {
-            // This match is a directory.
-            // If it's not the current directory or parent directory...
-            if (_tcsicmp(stFind.cFileName, _T(".")) != 0 &&
-                _tcsicmp(stFind.cFileName, _T("..")) != 0)
-            {
-               // This match is a normal directory, so add it to the
-               // list of subdirectories in this directory object.
-               _TCHAR szSubPath[MAXPATH];
-               _tcscpy_s(szSubPath, MAXPATH, pszDirPath);
-               if (szSubPath[_tcslen(szSubPath) - 1] != '\\')
-                  _tcscat_s(szSubPath, MAXPATH, _T("\\"));
-               _tcscat_s(szSubPath, MAXPATH, stFind.cFileName);
-               CDir cDir;
-               cDir.cThis = cFile;
-               cDirs.push_back(cDir);
-               if (!cDirs[cDirs.size() - 1].ScanFiles(szSubPath, pFunc, pContext))
-               {
-                  // Failed scanning files in subdirectory.
-                  sError = cDirs[cDirs.size() - 1].sError;
-                  return false;
-               }
-            }
-         }
-         else
-         {
-            // This match is a file, so add it to the list of files
-            // in this directory object.
-            cFiles.push_back(cFile);
-         }
-      }
+      pszDestName = pszSrcName;
+      nDestLen = nSrcLen;
    }
-   while (FindNextFile(hFind, &stFind));
-   FindClose(hFind);
+   std::pair<size_t, size_t> stMarks;
+   stMarks.first = cSrcPath.Push(pszSrcName, nSrcLen);
+   stMarks.second = cDestPath.Push(pszDestName, nDestLen);
+   return stMarks;
+}
 
-   return true;
+//
+// CountSource:
+// Returns the number of source files, directories, and bytes
+// that have actions (that is, everything in the source that
+// wasn't left out), the same way CDir::CountFiles does.  They
+// are added up by Compare as the actions are made.
+//
+void
+CTreeDiff::CountSource(ENUM_COUNT_STRUCT *pCounts) const
+{
+   *pCounts = stSrcTotals;
 }
 
 //
-// FileExists:
-// Determines if a file or subdirectory with the given
-// path (relative to the root of this directory) exists
-// in the tree.
+// GetSource:
+// Copies the information for the source node of an action into
+// a CDirEntry, the same way CFlatTree::GetEntry does.  The
+// action must have a source node (that is, it mustn't be a
+// DIFF_DELETE).
 //
-// If found, a pointer to the corresponding directory
-// entry will be returned.  Otherwise, NULL will be
-// returned.
+void
+CTreeDiff::GetSource(DWORD iAction, CDirEntry *pEntry) const
+{
+   pSrcTree->GetEntry(cActions[iAction].iSrc, pEntry);
+}
+
 //
-CDirEntry *
-CDir::FileExists(const _TCHAR *pszPath)
+// AddAction:
+// Adds an action to the end of the list.
+// Returns its index.
+//
+DWORD
+CTreeDiff::AddAction(DWORD dwAction, DWORD dwParent, DWORD iDest, bool bIsDir, DWORD iSrc)
 {
-   // See if path has any prepended path.
-   const _TCHAR *p = _tcsrchr(pszPath, _TCHAR('\\'));
-   if (p == NULL)
+   DIFF_ACTION stAction;
+   stAction.dwAction = dwAction;
+   stAction.dwParent = dwParent;
+   stAction.dwDepth = (dwParent == DIFF_ROOT) ? 0 : cActions[dwParent].dwDepth + 1;
+   stAction.iDest = iDest;
+   stAction.bIsDir = bIsDir;
+   stAction.iSrc = iSrc;
+   cActions.push_back(stAction);
+   if (dwAction != DIFF_DELETE && dwAction != DIFF_EXCLUDED)
+      CountEntry(&stSrcTotals, static_cast<double>(pSrcTree->cBytes[iSrc]), bIsDir);
+   return static_cast<DWORD>(cActions.size() - 1);
+}
+
+//
+// CompareDir:
+// Does the work of Compare for one pair of directories and
+// their children.  Either iSrcDir or iDestDir can be FLAT_NONE
+// if the directory is only on one side.  If bExcluded is true,
+// the directory was left out by the query function, so nothing
+// in it is copied.
+//
+void
+CTreeDiff::CompareDir(
+   DWORD iSrcDir,
+   DWORD iDestDir,
+   DWORD dwParent,
+   CPathStack &cSrcPath,
+   CPathStack &cDestPath,
+   bool bExcluded
+   )
+{
+   // Sort the names on each side.
+   std::vector<DWORD> cSrc;
+   std::vector<DWORD> cDest;
+   SortChildren(pSrcTree, iSrcDir, bCaseSensitive, cSrc);
+   SortChildren(pDestTree, iDestDir, bCaseSensitive, cDest);
+
+   // Walk the two lists side by side.
+   CDirEntry cEntry;
+   size_t iSrc = 0;
+   size_t iDest = 0;
+   while (iSrc < cSrc.size() || iDest < cDest.size())
    {
-      // No prepended directory on the specified pathname,
-      // which means it should be at this level if it exists,
-      // so search the entries in this directory for the
-      // specified name.
-      for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+      const FLAT_NODE *pSrcNode = (iSrc < cSrc.size()) ? &pSrcTree->cNodes[cSrc[iSrc]] : NULL;
+      const FLAT_NODE *pNode = (iDest < cDest.size()) ? &pDestTree->cNodes[cDest[iDest]] : NULL;
+
+      int iOrder;
+      if (pNode == NULL)
+         iOrder = -1;
+      else if (pSrcNode == NULL)
+         iOrder = 1;
+      else
+         iOrder = CompareNames(pSrcTree->cNames.data() + pSrcNode->dwName, pSrcNode->wNameLen,
+            pDestTree->cNames.data() + pNode->dwName, pNode->wNameLen, bCaseSensitive);
+
+      // Only in the destination.
+      if (iOrder > 0)
       {
-         // Is this the one we want?
-         if (_tcsicmp(pszPath, cFiles[iFile].sName.c_str()) == 0)  
-            return &cFiles[iFile]; // Found it!
+         DeleteTree(cDest[iDest++], dwParent);
+         continue;
       }
-      for (int iDir = 0; iDir < (int)cDirs.size(); iDir++)
+
+      DWORD iSrcNode = cSrc[iSrc++];
+      bool bIsDir = pSrcNode->dwDir != 0;
+      size_t nSrcMark = cSrcPath.Push(pSrcTree->cNames.data() + pSrcNode->dwName, pSrcNode->wNameLen);
+      bool bKeep = !bExcluded;
+      if (bKeep && pQuery != NULL)
       {
-         // Is this the one we want?
-         if (_tcsicmp(pszPath, cDirs[iDir].cThis.sName.c_str()) == 0)  
-            return &cDirs[iDir].cThis; // Found it!
+         pSrcTree->GetEntry(iSrcNode, &cEntry);
+         bKeep = pQuery(pQueryContext, cSrcPath.Path(), &cEntry, bIsDir);
+      }
+
+      // Only in the source.
+      if (iOrder < 0)
+      {
+         if (bKeep && bIsDir)
+         {
+            DWORD iAction = AddAction(DIFF_MKDIR, dwParent, FLAT_NONE, true, iSrcNode);
+            size_t nDestMark = cDestPath.Push(pSrcTree->cNames.data() + pSrcNode->dwName, pSrcNode->wNameLen);
+            CompareDir(iSrcNode, FLAT_NONE, iAction, cSrcPath, cDestPath, false);
+            cDestPath.Pop(nDestMark);
+         }
+         else if (bKeep)
+         {
+            AddAction(DIFF_COPY, dwParent, FLAT_NONE, false, iSrcNode);
+         }
+         cSrcPath.Pop(nSrcMark);
+         continue;
       }
-   }
-   else
-   {
-      // Remove one level of prepended directory path
-      // and pass it on to the next subdirectory in
-      // the tree (if the next level exists).
-      _TCHAR szNextBase[MAXPATH];
-      memset(szNextBase, 0, sizeof(szNextBase));
-      p = _tcschr(pszPath, _TCHAR('\\'));
-      if (p != NULL)
-         memcpy(szNextBase, pszPath, sizeof(_TCHAR) * (p - pszPath));
 
-      // Find next subdir in dirs list.
-      for (int iDir = 0; iDir < (int)cDirs.size(); iDir++)
+      // In both.
+      DWORD iNode = cDest[iDest++];
+      size_t nDestMark = cDestPath.Push(pDestTree->cNames.data() + pNode->dwName, pNode->wNameLen);
+      bool bDestIsDir = (pNode->dwAttrib & FILE_ATTRIBUTE_DIRECTORY) != 0;
+      if (!bKeep)
+      {
+         DWORD iAction = AddAction(DIFF_EXCLUDED, dwParent, iNode, bIsDir, iSrcNode);
+         if (bIsDir && bDestIsDir)
+            CompareDir(iSrcNode, iNode, iAction, cSrcPath, cDestPath, true);
+         else if (bDestIsDir)
+            DeleteChildren(iNode, iAction);
+      }
+      else if (bIsDir != bDestIsDir)
+      {
+         DWORD iAction = AddAction(DIFF_CONFLICT, dwParent, iNode, bIsDir, iSrcNode);
+         if (bDestIsDir)
+            DeleteChildren(iNode, iAction);
+      }
+      else if (bIsDir)
       {
-         // Is this the one we want?
-         if (_tcsicmp(cDirs[iDir].cThis.sName.c_str(), szNextBase) == 0)
+         DWORD iAction = AddAction(DIFF_SKIP, dwParent, iNode, true, iSrcNode);
+         CompareDir(iSrcNode, iNode, iAction, cSrcPath, cDestPath, false);
+      }
+      else
+      {
+         // Compare the two files, fetching their information
+         // first if need be.
+         CDirEntry cDestEntry;
+         pDestTree->GetEntry(iNode, &cDestEntry);
+         if (!cDestEntry.bInfoLoaded)
+         {
+            LoadEntryInfo(cDestPath.Path(), &cDestEntry);
+            pDestTree->PutEntry(iNode, &cDestEntry);
+         }
+         pSrcTree->GetEntry(iSrcNode, &cEntry);
+         if (!cEntry.bInfoLoaded)
          {
-            // Scan this subdir for the specified file.
-            return cDirs[iDir].FileExists(p + 1);
+            LoadEntryInfo(cSrcPath.Path(), &cEntry);
+            pSrcTree->PutEntry(iSrcNode, &cEntry);
          }
+         bool bSame = cEntry.dBytes == cDestEntry.dBytes &&
+            FileTimeCompare(cEntry.qwLastWrite, cDestEntry.qwLastWrite) == 0;
+         AddAction(bSame ? DIFF_SKIP : DIFF_UPDATE, dwParent, iNode, false, iSrcNode);
       }
+      cSrcPath.Pop(nSrcMark);
+      cDestPath.Pop(nDestMark);
    }
+}
+
+//
+// DeleteTree:
+// Adds actions to delete a destination node and, if it's a
+// directory, everything in it.
+//
+void
+CTreeDiff::DeleteTree(DWORD iDestNode, DWORD dwParent)
+{
+   bool bIsDir = (pDestTree->cNodes[iDestNode].dwAttrib & FILE_ATTRIBUTE_DIRECTORY) != 0;
+   DWORD iAction = AddAction(DIFF_DELETE, dwParent, iDestNode, bIsDir, FLAT_NONE);
+   if (bIsDir)
+      DeleteChildren(iDestNode, iAction);
+}
 
-   // Didn't find it.
-   return NULL;
+//
+// DeleteChildren:
+// Adds actions to delete everything in a destination directory,
+// but not the directory itself.
+//
+void
+CTreeDiff::DeleteChildren(DWORD iDestDir, DWORD dwParent)
+{
+   DWORD iFirst = pDestTree->Children(iDestDir).dwFirstChild;
+   DWORD iLast = iFirst + pDestTree->Children(iDestDir).dwNumFiles + pDestTree->Children(iDestDir).dwNumDirs;
+   for (DWORD iNode = iFirst; iNode < iLast; iNode++)
+      DeleteTree(iNode, dwParent);
 }
 
 //----------------------------------------------------------
@@ -491,68 +3107,84 @@ EnumCallbackCountFiles(
    bool bIsDir
    )
 {
-   (void)pszFullPath;
-
    ENUM_COUNT_STRUCT *pInfo = (ENUM_COUNT_STRUCT *)pContext;
    if (bIsDir)
       pInfo->iNumDirs++;
    else
+   {
       pInfo->iNumFiles++;
+      LoadEntryInfo(pszFullPath, pEntry);
+   }
    pInfo->dTotalBytes += pEntry->dBytes;
    return true;
 }
 
-// Compares two FILETIMEs.
-// Returns:
-//    0  t1 and t2 are the same time.
-//    1  t1 is after t2.
-//    -1 t1 is before t2.
-int
-FileTimeCompare(const FILETIME *t1, const FILETIME *t2, bool bExact)
-{
-   // Convert FILETIMEs to usable format.
-   SYSTEMTIME s1, s2;
-   FileTimeToSystemTime(t1, &s1);
-   FileTimeToSystemTime(t2, &s2);
-
-// For debugging only.
-/*
-   printf(" S1 Y%d M%d D%d H%d M%d S%d ms%d\n",
-      (int)s1.wYear, (int)s1.wMonth, (int)s1.wDay, (int)s1.wHour, (int)s1.wMinute, (int)s1.wSecond, (int)s1.wMilliseconds);
-   printf(" S2 Y%d M%d D%d H%d M%d S%d ms%d\n",
-      (int)s2.wYear, (int)s2.wMonth, (int)s2.wDay, (int)s2.wHour, (int)s2.wMinute, (int)s2.wSecond, (int)s2.wMilliseconds);
-*/
-
-   if (s1.wYear > s2.wYear)      return 1;
-   if (s1.wYear < s2.wYear)      return -1;
-   if (s1.wMonth > s2.wMonth)    return 1;
-   if (s1.wMonth < s2.wMonth)    return -1;
-   if (s1.wDay > s2.wDay)        return 1;
-   if (s1.wDay < s2.wDay)        return -1;
-   if (s1.wHour > s2.wHour)      return 1;
-   if (s1.wHour < s2.wHour)      return -1;
-
-   if (bExact)
-   {
-      if (s1.wMinute > s2.wMinute)              return 1;
-      if (s1.wMinute < s2.wMinute)              return -1;
-      if (s1.wSecond > s2.wSecond)              return 1;
-      if (s1.wSecond < s2.wSecond)              return -1;
-      if (s1.wMilliseconds > s2.wMilliseconds)  return 1;
-      if (s1.wMilliseconds < s2.wMilliseconds)  return -1;
+//
+// RunParallel:
+// Calls fnJob once for each job number from 0 to nJobs - 1.
+// Up to iThreads threads are started, and each one takes the
+// next job that no other thread has taken until there are none
+// left.  With one thread (or one job), the jobs are done here,
+// in order.  Returns when all the jobs are done.
+//
+void
+RunParallel(int iThreads, size_t nJobs, const std::function<void(size_t iJob)> &fnJob)
+{
+   if (iThreads > static_cast<int>(nJobs))
+      iThreads = static_cast<int>(nJobs);
+   if (iThreads <= 1)
+   {
+      for (size_t iJob = 0; iJob < nJobs; iJob++)
+         fnJob(iJob);
+      return;
    }
-   else
+
+   std::atomic<size_t> iNext(0);
+   std::vector<std::thread> cThreads;
+   for (int i = 0; i < iThreads; i++)
    {
-      // Check +/- 3 seconds.  This is approximately how far
-      // off the timestamps in FAT32 can be compared to NTFS.
-      int secs1 = s1.wMinute * 60 + s1.wSecond;
-      int secs2 = s2.wMinute * 60 + s2.wSecond;
-      if (secs1 > secs2 + 3)                    return 1;
-      if (secs1 < secs2 - 3)                    return -1;
+      cThreads.push_back(std::thread([&]()
+      {
+         size_t iJob;
+         while ((iJob = iNext++) < nJobs)
+            fnJob(iJob);
+      }));
    }
+   for (int i = 0; i < iThreads; i++)
+      cThreads[i].join();
+}
 
-   // Times are the same.
-   return 0;
+//
+// LoadEntryInfo:
+// Fetches the size, timestamps, and attribute bits of a
+// directory entry that was scanned without them.  The entry
+// lives in a tree owned by the caller, and is updated in place
+// through its mutable members (see CDirEntry).
+// Returns false if the file couldn't be examined.
+//
+bool
+LoadEntryInfo(const _TCHAR *pszPath, const CDirEntry *pEntry)
+{
+   if (pEntry->bInfoLoaded)
+      return true;
 
+#ifdef _WIN32
+   WIN32_FILE_ATTRIBUTE_DATA stData;
+   if (!GetFileAttributesEx(pszPath, GetFileExInfoStandard, &stData))
+      return false;
+   pEntry->dwAttrib = stData.dwFileAttributes;
+   if (stData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      pEntry->dBytes = 0.0;
+   else
+      pEntry->dBytes = (double)stData.nFileSizeHigh * 65536.0 * 65536.0 + (double)stData.nFileSizeLow;
+   pEntry->qwLastWrite = FileTimeToTicks(&stData.ftLastWriteTime);
+   pEntry->bInfoLoaded = true;
+   return true;
+#else
+   struct stat st;
+   if (stat(pszPath, &st) != 0)
+      return false;
+   StatToInfo(&st, pEntry);
+   return true;
+#endif
 }
-
@@ -51,11 +51,20 @@
 // INCLUDES
 //----------------------------------------------------------
 
+#include <stdio.h>
 #include <vector>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#ifdef _WIN32
 #include <tchar.h>
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include "posix.h"
+#endif
 
 //----------------------------------------------------------
 // MACROS
@@ -66,10 +75,57 @@
 #define MAXPATH   512
 #endif //MAXPATH
 
+// Character that separates the elements of a pathname.
+#ifndef PATHSEP
+#ifdef _WIN32
+#define PATHSEP      '\\'
+#define PATHSEP_STR  _T("\\")
+#else
+#define PATHSEP      '/'
+#define PATHSEP_STR  _T("/")
+#endif
+#endif //PATHSEP
+
+// Number of timestamp ticks (100 nanosecond units) per second.
+#define FILETIME_TICKS_PER_SEC   10000000ULL
+
+// Number of timestamp ticks per day.
+#define FILETIME_TICKS_PER_DAY   (86400ULL * FILETIME_TICKS_PER_SEC)
+
+// How far apart two timestamps can be and still be considered
+// the same by FileTimeCompare.  FAT stores write times to the
+// nearest 2 seconds, so a file copied between FAT and NTFS or
+// ext4 can be off by up to that much.
+#define FILETIME_TOLERANCE       (3 * FILETIME_TICKS_PER_SEC)
+
+// Node index that means "no node" in a CFlatTree.
+#define FLAT_NONE    0xFFFFFFFF
+
+// Bits for the wFlags member of FLAT_NODE.
+#define FLAT_INFOLOADED 0x0001   // Same as CDirEntry::bInfoLoaded.
+
+// Kinds of action in a CTreeDiff.
+#define DIFF_MKDIR      1  // Directory only in source; create it.
+#define DIFF_COPY       2  // File only in source; copy it.
+#define DIFF_UPDATE     3  // File in both, with different size or time.
+#define DIFF_SKIP       4  // File in both with the same size and time,
+                           // or directory in both.
+#define DIFF_DELETE     5  // Only in destination.
+#define DIFF_CONFLICT   6  // File in one, directory in the other.
+#define DIFF_EXCLUDED   7  // In both, but left out of the copy by the
+                           // query function, so the destination copy
+                           // is kept.
+
+// Parent index of the actions for the top directory in a CTreeDiff.
+#define DIFF_ROOT    0xFFFFFFFF
+
 //----------------------------------------------------------
 // TYPES
 //----------------------------------------------------------
 
+// String of _TCHAR characters.
+typedef std::basic_string<_TCHAR> tstring;
+
 // Context structure for the EnumCallbackCountFiles
 typedef struct
 {
@@ -78,27 +134,168 @@ typedef struct
    double   dTotalBytes;
 } ENUM_COUNT_STRUCT;
 
+// One file or directory in a CFlatTree.  Only what the tree
+// walks need is kept here; the rest of each node's information
+// is in the other columns of the tree.
+typedef struct
+{
+   DWORD          dwName;        // Offset of name in the name arena.
+   WORD           wNameLen;      // Length of name, in characters.
+   WORD           wFlags;        // FLAT_xxx bits.
+   DWORD          dwAttrib;      // Attribute bits.
+   DWORD          dwDir;         // Entry in cDirInfo (0 for files).
+} FLAT_NODE;
+
+// Children of one directory in a CFlatTree.  The children of each
+// directory are stored next to each other, files first, then
+// subdirectories.
+typedef struct
+{
+   DWORD          dwFirstChild;  // Index of first child.
+   DWORD          dwNumFiles;    // Number of files in directory.
+   DWORD          dwNumDirs;     // Number of subdirectories in directory.
+} FLAT_DIR;
+
+class CDir;
+class CDirEntry;
+
+// One subtree of a CDir, handed to one of the threads by the
+// parallel tree functions.
+typedef struct
+{
+   CDir          *pDir;          // Top directory of the subtree.
+   tstring        sRelPath;      // Its pathname, relative to the
+                                 // top of the whole tree.
+} SUBTREE_JOB;
+
+// One action in a CTreeDiff.
+typedef struct
+{
+   DWORD             dwAction;   // DIFF_xxx value.
+   DWORD             dwParent;   // Index of the action for the directory
+                                 // this is in, or DIFF_ROOT.
+   DWORD             dwDepth;    // Number of directories this is in,
+                                 // below the top of the trees.
+   DWORD             iDest;      // Node in destination tree, or FLAT_NONE.
+   bool              bIsDir;     // True if directory (in the source, if
+                                 // it's in both).
+   DWORD             iSrc;       // Node in source tree, or FLAT_NONE.
+} DIFF_ACTION;
+
 //----------------------------------------------------------
 // CLASSES
 //----------------------------------------------------------
 
+// Class to build the pathnames of the entries in a tree while
+// walking it.  The pathname is kept in one string: Push adds a
+// name to the end of it on the way down, and Pop takes it off
+// again on the way back up, so the part leading up to the
+// entry is never copied or measured again.  The full pathname
+// and the part after the root are both available as pointers
+// into the string, and there's no limit on their length.
+class CPathStack
+{
+public:
+   CPathStack();
+   explicit CPathStack(const _TCHAR *pszRoot);
+   void Reset(const _TCHAR *pszRoot);
+   size_t Push(const _TCHAR *pszName, size_t nLen);
+   size_t Push(const tstring &sName);
+   void Pop(size_t nMark);
+   const _TCHAR *Path(void) const;
+   const _TCHAR *RelPath(void) const;
+   size_t Length(void) const;
+
+private:
+   tstring        sPath;         // Pathname of the current entry.
+   size_t         nRootLen;      // Where the part after the root
+                                 // starts in sPath.
+};
+
+// Class to walk the entries of a CDir in the same order as
+// CDir::EnumFiles passes them, for use in a range-based for
+// loop instead of a callback:
+//
+//    for (const CDirWalk &cItem : cTree.Walk(pszDirPath))
+//       ...cItem.Path(), cItem.Entry(), cItem.IsDir()...
+//
+// The pathname and entry belong to the walk, and change when
+// it moves on to the next entry.  The tree mustn't be changed
+// during the walk.
+class CDirWalk
+{
+public:
+   // Iterator over a CDirWalk.  There is only one position in
+   // the walk, so all the iterators share it.
+   class iterator
+   {
+   public:
+      explicit iterator(CDirWalk *pWalk) : pWalk(pWalk) {}
+      const CDirWalk &operator*() const { return *pWalk; }
+      iterator &operator++() { if (!pWalk->Next()) pWalk = NULL; return *this; }
+      bool operator!=(const iterator &cOther) const { return pWalk != cOther.pWalk; }
+
+   private:
+      CDirWalk    *pWalk;        // Walk, or NULL at the end.
+   };
+
+public:
+   CDirWalk(CDir *pRoot, const _TCHAR *pszDirPath);
+   iterator begin(void);
+   iterator end(void);
+   bool Next(void);
+   const CPathStack &PathStack(void) const   { return cPath; }
+   const _TCHAR *Path(void) const            { return cPath.Path(); }
+   const _TCHAR *RelPath(void) const         { return cPath.RelPath(); }
+   CDirEntry *Entry(void) const              { return pEntry; }
+   bool IsDir(void) const                    { return bIsDir; }
+
+private:
+   // One directory being walked.
+   typedef struct
+   {
+      CDir       *pDir;          // The directory.
+      size_t      iNext;         // Next of its files, then its
+                                 // subdirectories, to visit.
+      size_t      nMark;         // Length of its pathname.
+   } WALK_FRAME;
+
+   std::vector<WALK_FRAME> cFrames; // Directories from the root down
+                                    // to the one being walked.
+   CPathStack     cPath;         // Pathname of the current entry.
+   CDirEntry     *pEntry;        // Current entry, or NULL.
+   bool           bIsDir;        // True if pEntry is a directory.
+};
+
 // Class to describe one directory entry.
+// A scan may leave the size, timestamp, and attribute bits to be
+// fetched later, when something needs them.  Those members are
+// mutable so that LoadEntryInfo can fill them in through the
+// const pointers that the tree walks hand out.  Nothing else
+// should change them through a const pointer, and an entry must
+// only be loaded by the thread that is working on it.
 class CDirEntry
 {
 public:
-   std::wstring   sName;         // Name of file or directory (not full path).
+   tstring        sName;         // Name of file or directory (not full path).
    DWORD          dwUser;        // Application-defined value for each file.
-   DWORD          dwAttrib;      // Attribute bits.
-   double         dBytes;        // Size of file in bytes (when scanned).
-   FILETIME       ftCreation;    // Timestamp for file creation.
-   FILETIME       ftLastAccess;  // Timestamp for last file access.
-   FILETIME       ftLastWrite;   // Timestamp for last file access.
+   mutable DWORD  dwAttrib;      // Attribute bits.
+   mutable double dBytes;        // Size of file in bytes (when scanned).
+   mutable ULONGLONG qwLastWrite;// Timestamp for last file write, in
+                                 // FILETIME ticks (see FileTimeToTicks).
+   mutable bool   bInfoLoaded;   // False if dBytes, the timestamp, and the
+                                 // read-only bit haven't been fetched yet
+                                 // (see LoadEntryInfo).
 
 public:
    CDirEntry();
 };
 
 // Class to describe the contents of a directory and its children.
+// Each entry is a full CDirEntry, so this is the form a tree is
+// built in while it's scanned.  A tree that's to be compared
+// with CTreeDiff is moved into a CFlatTree afterwards (see
+// CFlatTree::Build), which takes much less memory.
 class CDir
 {
 public:
@@ -106,16 +303,186 @@ public:
    std::vector<CDirEntry>  cFiles;  // Files in this directory.
    std::vector<CDir>       cDirs;   // Subdirectories of this directory.
 
-   std::wstring            sError;  // Error message string if ScanFiles
+   tstring                 sError;  // Error message string if ScanFiles
                                     // returns false.
+   bool                    bListed; // True once cFiles and cDirs have
+                                    // been read from disk.
+   std::vector<DWORD>      cIndex;  // Hash table of the names in cFiles
+                                    // and cDirs (see BuildIndex).
+   ENUM_COUNT_STRUCT       stTotals;// Files, subdirectories, and bytes
+                                    // below this directory (see
+                                    // UpdateTotals).
 
 public:
    CDir();
    bool PruneFiles(const _TCHAR *pszDirPath, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
    bool EnumFiles(const _TCHAR *pszDirPath, bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
    bool EnumFilesReverse(const _TCHAR *pszDirPath, bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
-   bool ScanFiles(const _TCHAR *pszDirPath, bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath)=NULL, void *pContext=NULL);
-   CDirEntry *FileExists(const _TCHAR *pszPath);
+   bool ScanFiles(const _TCHAR *pszDirPath, bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath)=NULL, void *pContext=NULL, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)=NULL, void *pQueryContext=NULL);
+   bool ScanFilesIncremental(const _TCHAR *pszDirPath, CDir *pCache, bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath)=NULL, void *pContext=NULL);
+   bool SaveSnapshot(FILE *pFile, const _TCHAR *pszDirPath);
+   bool LoadSnapshot(FILE *pFile, tstring &sDirPath);
+   bool ScanFilesParallel(const _TCHAR *pszDirPath, int iThreads, bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath)=NULL, void *pContext=NULL, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)=NULL, void *pQueryContext=NULL);
+   bool ReadDirectory(const _TCHAR *pszDirPath, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)=NULL, void *pQueryContext=NULL);
+   bool LoadDirInfo(const _TCHAR *pszDirPath);
+   bool LoadTreeInfo(const _TCHAR *pszDirPath, int iThreads);
+   CDirEntry *FileExists(const _TCHAR *pszPath, bool bCaseSensitive=false);
+   CDirEntry *FileExistsOnDemand(const _TCHAR *pszDirPath, const _TCHAR *pszPath, bool bCaseSensitive=false);
+   void BuildIndex(void);
+   void UpdateTotals(bool bSubtrees=false);
+
+   // Templated versions of PruneFiles, EnumFiles, and
+   // EnumFilesReverse, which take any function object (such as
+   // a lambda) called as:
+   //
+   //    bool fn(const CPathStack &cPath, CDirEntry &cEntry, bool bIsDir)
+   //
+   // The call is compiled into the tree walk, and the function
+   // object can keep its own state.
+   // If iThreads is more than 1, Prune splits the tree into
+   // subtrees and prunes them at the same time, so the query
+   // must be safe to call from several threads at once.
+   template <class Query> bool Prune(const _TCHAR *pszDirPath, Query fnQuery, int iThreads=1);
+   template <class Visitor> bool Visit(const _TCHAR *pszDirPath, Visitor fnVisit, bool bReverse=false);
+   template <class Enter, class Leave> bool Traverse(const _TCHAR *pszDirPath, Enter fnEnter, Leave fnLeave);
+   CDirWalk Walk(const _TCHAR *pszDirPath);
+   void CountFiles(ENUM_COUNT_STRUCT *pCounts) const;
+
+private:
+   int FindEntry(const _TCHAR *pszName, size_t nLen, bool bDirsOnly, bool bCaseSensitive) const;
+   template <class Query> void PruneEntries(CPathStack &cPath, Query &fnQuery);
+   template <class Query> bool PruneDir(CPathStack &cPath, Query &fnQuery);
+   template <class Level> void SplitSubtrees(CPathStack &cPath, size_t nWant, std::vector<SUBTREE_JOB> &cJobs, Level &fnLevel);
+   template <class Visitor> bool VisitDir(CPathStack &cPath, bool bReverse, Visitor &fnVisit);
+   template <class Enter, class Leave> bool TraverseDir(CPathStack &cPath, Enter &fnEnter, Leave &fnLeave);
+
+   friend class CDirWalk;
+};
+
+// A DWORD that several threads can read and change at once.
+// Unlike std::atomic<DWORD>, it can be copied, so it can be
+// kept in a vector; copying it isn't atomic, so the vector
+// must only grow or shrink while no other thread is using it.
+class CAtomicDword
+{
+public:
+   std::atomic<DWORD>   dwValue;
+
+public:
+   CAtomicDword() : dwValue(0) {}
+   CAtomicDword(const CAtomicDword &cOther) : dwValue(cOther.dwValue.load(std::memory_order_relaxed)) {}
+   CAtomicDword &operator=(const CAtomicDword &cOther)
+   {
+      dwValue.store(cOther.dwValue.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      return *this;
+   }
+};
+
+// Class to describe a directory and its children, the same as
+// CDir does, but with all of the nodes in a few arrays, one for
+// each column, and all of the names in another, so a large tree
+// takes a few big blocks of memory instead of several small ones
+// per entry.  A node takes 36 bytes, plus 12 for a directory,
+// plus its name.  EnumFiles, EnumFilesReverse, and FileExists
+// work the same as in CDir, with the entries passed to the
+// callbacks as CDirEntry objects, so the same callbacks can be
+// used with either class.
+class CFlatTree
+{
+public:
+   std::vector<FLAT_NODE>  cNodes;     // Node 0 is the root directory.
+   std::vector<FLAT_DIR>   cDirInfo;   // Children of each directory node.
+                                       // Entry 0 is empty, for files.
+   std::vector<ULONGLONG>  cBytes;     // Size of each node, in bytes.
+   std::vector<ULONGLONG>  cLastWrite; // Last write time of each node.
+   std::vector<_TCHAR>     cNames;     // Name arena, in node order.
+   std::vector<DWORD>      cIndex;     // Hash table of the names of all the
+                                       // nodes (see BuildIndex).
+
+   tstring                 sError;  // Error message string if a method
+                                    // returns false.
+
+public:
+   CFlatTree();
+   void Clear(void);
+   bool Build(const CDir *pDir);
+   bool ScanFiles(const _TCHAR *pszDirPath, bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath)=NULL, void *pContext=NULL, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)=NULL, void *pQueryContext=NULL);
+   bool LoadTreeInfo(const _TCHAR *pszDirPath, int iThreads);
+   bool EnumFiles(const _TCHAR *pszDirPath, bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
+   bool EnumFilesReverse(const _TCHAR *pszDirPath, bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
+   bool LoadDirInfo(DWORD iDir, const _TCHAR *pszDirPath);
+   CDirEntry *FileExists(const _TCHAR *pszPath, bool bCaseSensitive=false);
+   DWORD FindNode(const _TCHAR *pszPath, bool bCaseSensitive=false) const;
+   void GetEntry(DWORD iNode, CDirEntry *pEntry) const;
+   void PutEntry(DWORD iNode, const CDirEntry *pEntry);
+   void BuildIndex(void);
+   void SetUserFlags(DWORD iNode, DWORD dwFlags);
+   void CountFiles(ENUM_COUNT_STRUCT *pCounts, int iThreads=1);
+   const FLAT_DIR &Children(DWORD iNode) const  { return cDirInfo[cNodes[iNode].dwDir]; }
+
+private:
+   // The dwUser value of each node.  SetUserFlags may change it
+   // on one thread while GetEntry reads it on another, so each
+   // value is atomic.
+   std::vector<CAtomicDword>              cUser;
+
+   // Entries handed out by FileExists, which the caller may
+   // change.  While a node has one, it holds the node's current
+   // information.
+   std::unordered_map<DWORD, CDirEntry>   cProxies;
+   std::mutex                             mtxProxies;
+
+   void AddNode(const CDirEntry *pEntry, bool bIsDir);
+   void AddChildren(DWORD iDir, const CDir *pDir);
+   void FlushProxies(void);
+   bool ScanDir(DWORD iDir, CPathStack &cPath, bool (*pFunc)(void *pContext, const _TCHAR *pszDirPath), void *pContext, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pQueryContext);
+   bool EnumNode(DWORD iNode, const _TCHAR *pszPath, bool bIsDir, CDirEntry &cEntry, bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
+   bool EnumDir(DWORD iDir, CPathStack &cPath, bool bReverse, bool (*pEnum)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir), void *pContext);
+};
+
+// Class to work out what has to be done to make a destination
+// tree match a source tree.  The children of each pair of
+// directories are sorted by name once, and the two lists are
+// walked side by side, so the whole comparison takes a single
+// pass over each tree.  The result is a list of actions, one
+// for each name in either tree, with each directory's action
+// ahead of the actions for its contents.  Deletions should be
+// carried out from the end of the list backwards, so that each
+// directory's contents are removed before the directory.  Both
+// trees are CFlatTree objects, so the comparison and the passes
+// over its result walk the compact arrays; GetSource fills in a
+// CDirEntry for an action's source node when one is needed.
+class CTreeDiff
+{
+public:
+   std::vector<DIFF_ACTION>   cActions;   // The result of Compare.
+
+   tstring                    sError;     // Error message string if a
+                                          // method returns false.
+
+public:
+   CTreeDiff();
+   bool Compare(CFlatTree *pSrc, const _TCHAR *pszSrcPath, CFlatTree *pDest, const _TCHAR *pszDestPath, bool bCaseSensitive, bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir)=NULL, void *pQueryContext=NULL);
+   bool EnumActions(bool (*pEnum)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath), void *pContext, bool bReverse);
+   bool WalkActions(bool (*pEnter)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath), bool (*pLeave)(void *pContext, DWORD iAction, const CPathStack &cSrcPath, const CPathStack &cDestPath), void *pContext);
+   void CountSource(ENUM_COUNT_STRUCT *pCounts) const;
+   void GetSource(DWORD iAction, CDirEntry *pEntry) const;
+
+private:
+   CFlatTree                 *pSrcTree;
+   CFlatTree                 *pDestTree;
+   tstring                    sSrcRoot;
+   tstring                    sDestRoot;
+   bool                       bCaseSensitive;
+   bool (*pQuery)(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir);
+   void                      *pQueryContext;
+   ENUM_COUNT_STRUCT          stSrcTotals;   // See CountSource.
+
+   DWORD AddAction(DWORD dwAction, DWORD dwParent, DWORD iDest, bool bIsDir, DWORD iSrc);
+   void CompareDir(DWORD iSrcDir, DWORD iDestDir, DWORD dwParent, CPathStack &cSrcPath, CPathStack &cDestPath, bool bExcluded);
+   void DeleteTree(DWORD iDestNode, DWORD dwParent);
+   void DeleteChildren(DWORD iDestDir, DWORD dwParent);
+   std::pair<size_t, size_t> PushNames(DWORD iAction, CPathStack &cSrcPath, CPathStack &cDestPath) const;
 };
 
 //----------------------------------------------------------
@@ -126,15 +493,347 @@ public:
 // The context pointer should point to an ENUM_COUNT_STRUCT structure.
 bool EnumCallbackCountFiles(void *pContext, const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir);
 
-// Compares two FILETIMEs.  If bExact is false, the times will
-// be compared for same date and close but not exact time.
-// If bExact is true, the times must be exactly the same.
+// Calls fnJob once for each job number from 0 to nJobs - 1,
+// using up to iThreads threads.
+void RunParallel(int iThreads, size_t nJobs, const std::function<void(size_t iJob)> &fnJob);
+
+// Converts a FILETIME to a single 64-bit count of ticks, as
+// stored in CDirEntry.
+inline ULONGLONG FileTimeToTicks(const FILETIME *pft)
+{
+   return (static_cast<ULONGLONG>(pft->dwHighDateTime) << 32) | pft->dwLowDateTime;
+}
+
+// Compares two timestamps, in ticks.  Times less than
+// qwTolerance ticks apart are considered the same; pass 0
+// for an exact comparison.
 // Returns:
 //    0  t1 and t2 are the same time.
 //    1  t1 is after t2.
 //    -1 t1 is before t2.
-int FileTimeCompare(const FILETIME *t1, const FILETIME *t2, bool bExact=false);
+inline int FileTimeCompare(ULONGLONG t1, ULONGLONG t2, ULONGLONG qwTolerance=FILETIME_TOLERANCE)
+{
+   if (t1 > t2 + qwTolerance)    return 1;
+   if (t2 > t1 + qwTolerance)    return -1;
+   return 0;
+}
+
+// Fetches the size, timestamps, and attribute bits of a directory
+// entry whose bInfoLoaded member is false.  pszPath is the full
+// pathname of the entry.  Does nothing if the information is
+// already loaded.  Only the mutable members of the entry are
+// changed.  Returns false if the file couldn't be examined.
+bool LoadEntryInfo(const _TCHAR *pszPath, const CDirEntry *pEntry);
+
+//----------------------------------------------------------
+// TEMPLATE FUNCTIONS OF CLASS CDir
+//----------------------------------------------------------
+
+//
+// Prune:
+// Same as PruneFiles, but with a function object for the query.
+// With more than one thread, the entries near the top of the
+// tree are pruned first, until there are enough subtrees left
+// to go around, and then the threads take the subtrees one at
+// a time.  The result is the same either way.
+//
+// The totals of each directory are updated once its children
+// are done, so they still add up afterwards.
+//
+template <class Query>
+bool
+CDir::Prune(const _TCHAR *pszDirPath, Query fnQuery, int iThreads)
+{
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   CPathStack cPath(pszDirPath);
+   if (iThreads <= 1)
+      return PruneDir(cPath, fnQuery);
+
+   std::vector<SUBTREE_JOB> cJobs;
+   std::vector<CDir *> cSplit;
+   auto fnLevel = [&fnQuery, &cSplit](CDir *pDir, CPathStack &cDirPath)
+   {
+      pDir->PruneEntries(cDirPath, fnQuery);
+      cSplit.push_back(pDir);
+   };
+   SplitSubtrees(cPath, static_cast<size_t>(iThreads) * 4, cJobs, fnLevel);
+
+   std::vector<char> cOk(cJobs.size(), 1);
+   RunParallel(iThreads, cJobs.size(), [&](size_t iJob)
+   {
+      CPathStack cJobPath(pszDirPath);
+      cJobPath.Push(cJobs[iJob].sRelPath);
+      cOk[iJob] = cJobs[iJob].pDir->PruneDir(cJobPath, fnQuery);
+   });
+
+   // Report the first subtree that failed.
+   for (size_t iJob = 0; iJob < cJobs.size(); iJob++)
+   {
+      if (!cOk[iJob])
+      {
+         sError = cJobs[iJob].pDir->sError;
+         return false;
+      }
+   }
+
+   // The directories that were split are in breadth-first
+   // order, so going backwards does each one after all of
+   // its subdirectories.
+   for (size_t iDir = cSplit.size(); iDir-- > 0; )
+      cSplit[iDir]->UpdateTotals();
+
+   return true;
+}
+
+//
+// Visit:
+// Same as EnumFiles (or EnumFilesReverse, if bReverse is true),
+// but with a function object for the enumeration function.
+//
+template <class Visitor>
+bool
+CDir::Visit(const _TCHAR *pszDirPath, Visitor fnVisit, bool bReverse)
+{
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   CPathStack cPath(pszDirPath);
+   return VisitDir(cPath, bReverse, fnVisit);
+}
+
+//
+// Traverse:
+// Same as Visit, but with two function objects, so that two
+// walks (one forwards and one backwards) can be done in one.
+// fnEnter is called for each entry in the same order as
+// EnumFiles, and fnLeave is called for each entry once
+// everything below it is done (right after fnEnter, for a
+// file), so each directory comes after its contents.
+//
+template <class Enter, class Leave>
+bool
+CDir::Traverse(const _TCHAR *pszDirPath, Enter fnEnter, Leave fnLeave)
+{
+   // Check for bogus parameters.
+   if (pszDirPath == nullptr || pszDirPath[0] == '\0')
+   {
+      sError = _T("Bad Parameter");
+      return false;
+   }
+
+   CPathStack cPath(pszDirPath);
+   return TraverseDir(cPath, fnEnter, fnLeave);
+}
+
+//
+// PruneEntries:
+// Removes the files and subdirectories of this directory that
+// the query returns false for, without going into the
+// subdirectories that are left.  cPath holds the pathname of
+// this directory.
+//
+template <class Query>
+void
+CDir::PruneEntries(CPathStack &cPath, Query &fnQuery)
+{
+   // For each file in this dir...  The files being kept are
+   // moved down over the ones being removed, in a single pass.
+   size_t nEntries = cFiles.size() + cDirs.size();
+   int iKeep = 0;
+   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+   {
+      // Query if we should keep this file.
+      size_t nMark = cPath.Push(cFiles[iFile].sName);
+      bool bKeep = fnQuery(cPath, cFiles[iFile], false);
+      cPath.Pop(nMark);
+      if (bKeep)
+      {
+         if (iKeep != iFile)
+            cFiles[iKeep] = std::move(cFiles[iFile]);
+         iKeep++;
+      }
+   }
+   cFiles.resize(iKeep);
+
+   // For each subdir in this dir...
+   iKeep = 0;
+   for (int iFile = 0; iFile < static_cast<int>(cDirs.size()); iFile++)
+   {
+      // Query if we should keep this dir.
+      size_t nMark = cPath.Push(cDirs[iFile].cThis.sName);
+      bool bKeep = fnQuery(cPath, cDirs[iFile].cThis, true);
+      cPath.Pop(nMark);
+      if (bKeep)
+      {
+         if (iKeep != iFile)
+            cDirs[iKeep] = std::move(cDirs[iFile]);
+         iKeep++;
+      }
+   }
+   cDirs.resize(iKeep);
+   if (cFiles.size() + cDirs.size() != nEntries)
+      BuildIndex();
+}
+
+//
+// PruneDir:
+// Does the work of Prune for this directory and its children.
+// cPath holds the pathname of this directory.
+//
+template <class Query>
+bool
+CDir::PruneDir(CPathStack &cPath, Query &fnQuery)
+{
+   PruneEntries(cPath, fnQuery);
+
+   // For each subdir in this dir...
+   for (int iFile = 0; iFile < static_cast<int>(cDirs.size()); iFile++)
+   {
+      // Do pruning on subdir.
+      size_t nMark = cPath.Push(cDirs[iFile].cThis.sName);
+      if (!cDirs[iFile].PruneDir(cPath, fnQuery))
+      {
+         // Pruning of subdir failed!
+         sError = cDirs[iFile].sError;
+         return false;
+      }
+      cPath.Pop(nMark);
+   }
+
+   UpdateTotals();
+   return true;
+}
+
+//
+// VisitDir:
+// Does the work of Visit for this directory and its children.
+// cPath holds the pathname of this directory.
+//
+template <class Visitor>
+bool
+CDir::VisitDir(CPathStack &cPath, bool bReverse, Visitor &fnVisit)
+{
+   // For each file in this dir...
+   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+   {
+      if (!bReverse && cFiles[iFile].sName.size() < 1)
+         continue;   // Filename is zero length, so skip it.
+
+      size_t nMark = cPath.Push(cFiles[iFile].sName);
+      if (!fnVisit(cPath, cFiles[iFile], false))
+         return false;
+      cPath.Pop(nMark);
+   }
+
+   // For each subdir in this dir...
+   for (int iFile = 0; iFile < static_cast<int>(cDirs.size()); iFile++)
+   {
+      size_t nMark = cPath.Push(cDirs[iFile].cThis.sName);
+      if (!bReverse && !fnVisit(cPath, cDirs[iFile].cThis, true))
+         return false;
+
+      // Visit children of this dir.
+      if (!cDirs[iFile].VisitDir(cPath, bReverse, fnVisit))
+         return false;
+
+      if (bReverse && !fnVisit(cPath, cDirs[iFile].cThis, true))
+         return false;
+      cPath.Pop(nMark);
+   }
+
+   return true;
+}
+
+//
+// TraverseDir:
+// Does the work of Traverse for this directory and its
+// children.  cPath holds the pathname of this directory.
+//
+template <class Enter, class Leave>
+bool
+CDir::TraverseDir(CPathStack &cPath, Enter &fnEnter, Leave &fnLeave)
+{
+   // For each file in this dir...
+   for (int iFile = 0; iFile < static_cast<int>(cFiles.size()); iFile++)
+   {
+      if (cFiles[iFile].sName.size() < 1)
+         continue;   // Filename is zero length, so skip it.
+
+      size_t nMark = cPath.Push(cFiles[iFile].sName);
+      if (!fnEnter(cPath, cFiles[iFile], false) || !fnLeave(cPath, cFiles[iFile], false))
+         return false;
+      cPath.Pop(nMark);
+   }
+
+   // For each subdir in this dir...
+   for (int iFile = 0; iFile < static_cast<int>(cDirs.size()); iFile++)
+   {
+      size_t nMark = cPath.Push(cDirs[iFile].cThis.sName);
+      if (!fnEnter(cPath, cDirs[iFile].cThis, true) ||
+          !cDirs[iFile].TraverseDir(cPath, fnEnter, fnLeave) ||
+          !fnLeave(cPath, cDirs[iFile].cThis, true))
+         return false;
+      cPath.Pop(nMark);
+   }
+
+   return true;
+}
+
+//
+// SplitSubtrees:
+// Divides this directory's tree into at least nWant subtrees
+// (if there are that many directories), for the threads of a
+// parallel tree function to share.  Starting from the top,
+// each directory is split into its subdirectories, breadth
+// first, until there are enough.  fnLevel is called for each
+// directory that's split, with the directory and its pathname,
+// before its subdirectories are listed; whatever it does to
+// the entries of that directory (but not below it) is up to
+// the caller.  cPath holds the pathname of this directory.
+// The subtrees are left in cJobs, in breadth-first order.
+//
+template <class Level>
+void
+CDir::SplitSubtrees(CPathStack &cPath, size_t nWant, std::vector<SUBTREE_JOB> &cJobs, Level &fnLevel)
+{
+   cJobs.clear();
+   SUBTREE_JOB stJob;
+   stJob.pDir = this;
+   cJobs.push_back(stJob);
+
+   size_t iSplit = 0;
+   while (iSplit < cJobs.size() && cJobs.size() - iSplit < nWant)
+   {
+      CDir *pDir = cJobs[iSplit].pDir;
+      tstring sRelPath = cJobs[iSplit].sRelPath;
+      size_t nMark = cPath.Length();
+      if (!sRelPath.empty())
+         cPath.Push(sRelPath);
+      fnLevel(pDir, cPath);
+      cPath.Pop(nMark);
 
+      if (!sRelPath.empty())
+         sRelPath += PATHSEP;
+      for (int iDir = 0; iDir < static_cast<int>(pDir->cDirs.size()); iDir++)
+      {
+         stJob.pDir = &pDir->cDirs[iDir];
+         stJob.sRelPath = sRelPath + pDir->cDirs[iDir].cThis.sName;
+         cJobs.push_back(stJob);
+      }
+      iSplit++;
+   }
+   cJobs.erase(cJobs.begin(), cJobs.begin() + iSplit);
+}
 
 #endif //__FILETREE_H
 
@@ -0,0 +1,1046 @@
+//--------------------------------------------------------------------
+//
+// filter.cpp
+//
+// C++ code for the class that decides which source files and
+// directories are copied, from the selection options given on the
+// command line.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "filter.h"
+#include "strkern.h"
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Kinds of node in a parsed expression (FILTER_NODE::iKind).
+#define FNODE_TEST      1
+#define FNODE_AND       2
+#define FNODE_OR        3
+#define FNODE_NOT       4
+
+// Substring tags for the /INCLUDE and /EXCLUDE strings.  The
+// other bits are handed out to the "path~" tests.
+#define FILTER_TAG_INCLUDE 0x0001
+#define FILTER_TAG_EXCLUDE 0x0002
+#define FILTER_TAG_FIRST   0x0004
+
+// Results of testing a subtree.
+#define SUBTREE_FALSE   0  // Nothing in it can pass.
+#define SUBTREE_TRUE    1  // Everything in it passes.
+#define SUBTREE_UNKNOWN 2  // Depends on the entry.
+#define SUBTREE_UNSET   3  // Not worked out yet (in the memo).
+
+//----------------------------------------------------------
+// LOCAL FUNCTIONS
+//----------------------------------------------------------
+
+//
+// TestCost:
+// Returns a rough cost of running a test, relative to the
+// others.  Tests that need the entry's information from disk
+// cost far more than the rest, since that can mean a stat.
+//
+static DWORD
+TestCost(const FILTER_OP &stOp)
+{
+   DWORD dwCost;
+   switch (stOp.wTest)
+   {
+      case FTEST_ATTRIB:   dwCost = 1;  break;
+      case FTEST_DEPTH:    dwCost = 2;  break;
+      case FTEST_NAME:     dwCost = 4;  break;
+      case FTEST_DIR:      dwCost = 6;  break;
+      default:             dwCost = 8;  break;
+   }
+   if (stOp.wFlags & FOP_NEEDINFO)
+      dwCost += 100;
+   return dwCost;
+}
+
+//
+// CompareNumber:
+// Compares a number with the one in a test.
+//
+static bool
+CompareNumber(ULONGLONG qwNumber, const FILTER_OP &stOp)
+{
+   switch (stOp.wCompare)
+   {
+      case FCMP_LT:  return qwNumber < stOp.qwValue;
+      case FCMP_LE:  return qwNumber <= stOp.qwValue;
+      case FCMP_GT:  return qwNumber > stOp.qwValue;
+      case FCMP_GE:  return qwNumber >= stOp.qwValue;
+      default:       return qwNumber == stOp.qwValue;
+   }
+}
+
+//
+// CountNames:
+// Returns the number of names in a relative pathname.
+//
+static ULONGLONG
+CountNames(const _TCHAR *pszRelPath)
+{
+   size_t nRest = _tcslen(pszRelPath);
+   if (nRest == 0)
+      return 0;
+
+   ULONGLONG qwNames = 1;
+   const _TCHAR *p;
+   while ((p = FindChar(pszRelPath, nRest, PATHSEP)) != NULL)
+   {
+      qwNames++;
+      nRest -= (p - pszRelPath) + 1;
+      pszRelPath = p + 1;
+   }
+   return qwNames;
+}
+
+//
+// DirNameMatches:
+// Determines if the name of any directory in a relative
+// pathname matches a set of wildcards.  The last name in the
+// pathname is checked only if bLast is true.
+//
+static bool
+DirNameMatches(const CWildcardSet &cSet, const _TCHAR *pszRelPath, bool bLast)
+{
+   tstring sName;
+   size_t nRest = _tcslen(pszRelPath);
+   for (;;)
+   {
+      const _TCHAR *p = FindChar(pszRelPath, nRest, PATHSEP);
+      if (p == NULL)
+         return bLast && nRest > 0 && cSet.Matches(pszRelPath);
+
+      sName.assign(pszRelPath, p - pszRelPath);
+      if (!sName.empty() && cSet.Matches(sName.c_str()))
+         return true;
+      nRest -= (p - pszRelPath) + 1;
+      pszRelPath = p + 1;
+   }
+}
+
+//
+// IsWord:
+// Determines if an expression token is the given keyword,
+// ignoring case.  Quoted tokens are never keywords.
+//
+static bool
+IsWord(const tstring &sToken, bool bQuoted, const _TCHAR *pszWord)
+{
+   size_t nLen = _tcslen(pszWord);
+   return !bQuoted && sToken.size() == nLen && EqualNoCase(sToken.c_str(), pszWord, nLen);
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CFilter
+//----------------------------------------------------------
+
+// Default constructor.
+CFilter::CFilter()
+{
+   Clear();
+}
+
+//
+// Clear:
+// Removes all the clauses, so everything passes.
+//
+void
+CFilter::Clear(void)
+{
+   sError = _T("");
+   cNodes.clear();
+   cClauses.clear();
+   cWildSets.clear();
+   cSubs.Clear();
+   cIgnore.Clear();
+   bIgnoreAdded = false;
+   dwNextTag = FILTER_TAG_FIRST;
+   dwIncludeTag = 0;
+   dwExcludeTag = 0;
+   iWildSet = -1;
+   nRootLen = 0;
+   qwNow = 0;
+   cProgram.clear();
+   iStart = FILTER_ACCEPT;
+}
+
+//
+// AddExpression:
+// Parses a filter expression, and adds it as a clause.  The
+// expression is made of tests, such as "size>10M", combined
+// with "and", "or", "not", and parentheses; tests written next
+// to each other must all pass.  The tests are:
+//
+//    size<n   size<=n   size>n   size>=n   size=n
+//       File size in bytes, or with K, M, G, or T after
+//       the number, in kilobytes, megabytes, and so on.
+//    age<n   (and the rest, as for size)
+//       Time since the file was last written, in hours,
+//       or with M or D after the number, in minutes or days.
+//    depth<n   (and the rest, as for size)
+//       Number of names in the file's pathname after the
+//       source directory, so files right in the source
+//       directory are at depth 1.
+//    attr=letters   attr!=letters
+//       File has all (or not all) of the given attributes:
+//       R (read-only), H (hidden), S (system), A (archive).
+//    name=wildcard   name!=wildcard
+//       File's name matches (or doesn't) the wildcard.
+//    dir=wildcard   dir!=wildcard
+//       Name of one of the directories that the file is in,
+//       below the source directory, matches (or none match).
+//    path~string   path!~string
+//       File's pathname contains (or doesn't) the string.
+//
+// Values with spaces or parentheses in them can be put in
+// double quotes.  Returns false if the expression has an
+// error, which is described in sError.
+//
+bool
+CFilter::AddExpression(const _TCHAR *pszExpr)
+{
+   tstring sExpr = pszExpr;
+   size_t iPos = 0;
+   int iNode;
+   if (!ParseOr(sExpr, iPos, iNode))
+      return false;
+
+   // There shouldn't be anything left over.
+   tstring sToken;
+   bool bQuoted;
+   if (NextToken(sExpr, iPos, sToken, bQuoted))
+   {
+      sError = _T("Unexpected \"") + sToken + _T("\" in filter");
+      return false;
+   }
+
+   cClauses.push_back(iNode);
+   return true;
+}
+
+//
+// AddSubstring:
+// Adds an /INCLUDE string (if bInclude is true) or /EXCLUDE
+// string.  Entries are kept only if their pathnames contain at
+// least one of the include strings (if there are any), and
+// none of the exclude strings.
+//
+void
+CFilter::AddSubstring(const _TCHAR *pszSub, bool bInclude)
+{
+   DWORD &dwTag = bInclude ? dwIncludeTag : dwExcludeTag;
+   if (dwTag == 0)
+   {
+      // First string of this kind, so add its clause.
+      dwTag = bInclude ? FILTER_TAG_INCLUDE : FILTER_TAG_EXCLUDE;
+      int iNode = AddTest(FTEST_PATH, FOP_DIRS, dwTag);
+      if (!bInclude)
+      {
+         int iNot = AddNode(FNODE_NOT);
+         cNodes[iNot].cChildren.push_back(iNode);
+         iNode = iNot;
+      }
+      cClauses.push_back(iNode);
+   }
+   cSubs.Add(pszSub, dwTag);
+}
+
+//
+// AddWildcard:
+// Adds one of the wildcards given on the command line.
+// Entries are kept only if their pathnames match one of them.
+// Returns false if the wildcard is malformed.
+//
+bool
+CFilter::AddWildcard(const _TCHAR *pszWild)
+{
+   if (iWildSet < 0)
+   {
+      iWildSet = static_cast<int>(cWildSets.size());
+      cWildSets.push_back(CWildcardSet());
+      cClauses.push_back(AddTest(FTEST_WILDPATH, FOP_DIRS, iWildSet));
+   }
+   if (!cWildSets[iWildSet].Add(pszWild))
+   {
+      sError = _T("Invalid wildcard");
+      return false;
+   }
+   return true;
+}
+
+//
+// AddDateRange:
+// Keeps only the entries last written from qwFrom up to (but
+// not including) qwTo, for /NEW and /OLD.
+//
+void
+CFilter::AddDateRange(ULONGLONG qwFrom, ULONGLONG qwTo)
+{
+   int iNode = AddTest(FTEST_DATES, FOP_DIRS | FOP_NEEDINFO);
+   cNodes[iNode].stOp.qwValue = qwFrom;
+   cNodes[iNode].stOp.qwValue2 = qwTo;
+   cClauses.push_back(iNode);
+}
+
+//
+// AddNoAttributes:
+// Removes the entries that have any of the given attributes,
+// such as hidden and system files when /HIDDEN isn't given.
+//
+void
+CFilter::AddNoAttributes(DWORD dwAttrib)
+{
+   for (DWORD dwBit = 1; dwBit != 0; dwBit <<= 1)
+   {
+      if (dwAttrib & dwBit)
+      {
+         int iNot = AddNode(FNODE_NOT);
+         int iNode = AddTest(FTEST_ATTRIB, FOP_DIRS, dwBit);
+         cNodes[iNot].cChildren.push_back(iNode);
+         cClauses.push_back(iNot);
+      }
+   }
+}
+
+//
+// AddRulesFile:
+// Reads rules from a file in the format of git's ".gitignore"
+// files, for /RULES.  Entries that the rules ignore are left
+// out.  Returns false if the file can't be read.
+//
+bool
+CFilter::AddRulesFile(const _TCHAR *pszFile)
+{
+   if (!cIgnore.AddFile(pszFile))
+   {
+      sError = cIgnore.sError;
+      return false;
+   }
+   AddIgnoreClause();
+   return true;
+}
+
+//
+// AddDirRulesFile:
+// Sets the name of the rules files to look for in each
+// directory of the source, for /IGNOREFILE.  The rules in each
+// apply to the directory it's in.
+//
+void
+CFilter::AddDirRulesFile(const _TCHAR *pszName)
+{
+   cIgnore.SetDirFileName(pszName);
+   AddIgnoreClause();
+}
+
+//
+// Compile:
+// Builds the program that Test runs from the clauses, after
+// they've all been added.  nRootLen is the length of the
+// source directory's pathname, including the separator after
+// it, which is left off the pathnames for the depth and dir
+// tests.  Ages are measured from the time this is called.
+//
+void
+CFilter::Compile(size_t nRootLen)
+{
+   this->nRootLen = nRootLen;
+   FILETIME ftNow;
+   GetSystemTimeAsFileTime(&ftNow);
+   qwNow = FileTimeToTicks(&ftNow);
+   cSubs.Compile();
+
+   // Put the cheapest tests first at each level.
+   for (size_t i = 0; i < cClauses.size(); i++)
+      SortNode(cClauses[i]);
+   std::stable_sort(cClauses.begin(), cClauses.end(),
+      [this](int i1, int i2) { return cNodes[i1].dwCost < cNodes[i2].dwCost; });
+
+   // Lay the clauses out, last first, so each one knows where
+   // the next one starts.
+   cProgram.clear();
+   iStart = FILTER_ACCEPT;
+   for (size_t i = cClauses.size(); i-- > 0; )
+      iStart = Emit(cClauses[i], iStart, FILTER_REJECT);
+}
+
+//
+// Test:
+// Determines if an entry of the source tree passes the filter.
+// pszPath is its full pathname.  A directory passes unless
+// nothing in it could.  This can be called from several threads
+// at once.
+//
+bool
+CFilter::Test(const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir) const
+{
+   if (iStart == FILTER_ACCEPT)
+      return true;
+
+   FILTER_STATE stState;
+   stState.pszPath = pszPath;
+   stState.pszRelPath = pszPath + std::min(nRootLen, _tcslen(pszPath));
+   stState.pEntry = pEntry;
+   stState.bIsDir = bIsDir;
+   stState.bScanned = false;
+   stState.dwFound = 0;
+
+   if (bIsDir)
+   {
+      std::vector<signed char> cMemo(cProgram.size(), SUBTREE_UNSET);
+      return RunSubtree(iStart, stState, cMemo) != SUBTREE_FALSE;
+   }
+
+   int iOp = iStart;
+   while (iOp >= 0)
+   {
+      const FILTER_OP &stOp = cProgram[iOp];
+      iOp = TestFile(stOp, stState) ? stOp.iTrue : stOp.iFalse;
+   }
+   return iOp == FILTER_ACCEPT;
+}
+
+//
+// AddNode:
+// Adds a node for a parsed expression, and returns its number.
+//
+int
+CFilter::AddNode(int iKind, const FILTER_OP *pOp)
+{
+   FILTER_NODE stNode;
+   stNode.iKind = iKind;
+   memset(&stNode.stOp, 0, sizeof(stNode.stOp));
+   if (pOp != NULL)
+      stNode.stOp = *pOp;
+   stNode.dwCost = (iKind == FNODE_TEST) ? TestCost(stNode.stOp) : 0;
+   cNodes.push_back(stNode);
+   return static_cast<int>(cNodes.size() - 1);
+}
+
+//
+// AddIgnoreClause:
+// Adds the clause that leaves out the entries ignored by the
+// rules files, the first time it's needed.
+//
+void
+CFilter::AddIgnoreClause(void)
+{
+   if (bIgnoreAdded)
+      return;
+   bIgnoreAdded = true;
+   int iNot = AddNode(FNODE_NOT);
+   int iNode = AddTest(FTEST_IGNORED, FOP_DIRS);
+   cNodes[iNot].cChildren.push_back(iNode);
+   cClauses.push_back(iNot);
+}
+
+//
+// AddTest:
+// Adds a node for a test, and returns its number.
+//
+int
+CFilter::AddTest(WORD wTest, WORD wFlags, DWORD dwArg)
+{
+   FILTER_OP stOp;
+   memset(&stOp, 0, sizeof(stOp));
+   stOp.wTest = wTest;
+   stOp.wFlags = wFlags;
+   stOp.dwArg = dwArg;
+   return AddNode(FNODE_TEST, &stOp);
+}
+
+//
+// ParseOr:
+// Parses tests separated by "or".
+//
+bool
+CFilter::ParseOr(const tstring &sExpr, size_t &iPos, int &iNode)
+{
+   if (!ParseAnd(sExpr, iPos, iNode))
+      return false;
+
+   for (;;)
+   {
+      size_t iNext = iPos;
+      tstring sToken;
+      bool bQuoted;
+      if (!NextToken(sExpr, iNext, sToken, bQuoted) || !IsWord(sToken, bQuoted, _T("or")))
+         return true;
+      iPos = iNext;
+
+      int iRight;
+      if (!ParseAnd(sExpr, iPos, iRight))
+         return false;
+      if (cNodes[iNode].iKind != FNODE_OR)
+      {
+         int iOr = AddNode(FNODE_OR);
+         cNodes[iOr].cChildren.push_back(iNode);
+         iNode = iOr;
+      }
+      cNodes[iNode].cChildren.push_back(iRight);
+   }
+}
+
+//
+// ParseAnd:
+// Parses tests separated by "and", or by nothing.
+//
+bool
+CFilter::ParseAnd(const tstring &sExpr, size_t &iPos, int &iNode)
+{
+   if (!ParseNot(sExpr, iPos, iNode))
+      return false;
+
+   for (;;)
+   {
+      size_t iNext = iPos;
+      tstring sToken;
+      bool bQuoted;
+      if (!NextToken(sExpr, iNext, sToken, bQuoted) || IsWord(sToken, bQuoted, _T("or")) ||
+          (!bQuoted && sToken == _T(")")))
+         return true;
+      if (IsWord(sToken, bQuoted, _T("and")))
+         iPos = iNext;
+
+      int iRight;
+      if (!ParseNot(sExpr, iPos, iRight))
+         return false;
+      if (cNodes[iNode].iKind != FNODE_AND)
+      {
+         int iAnd = AddNode(FNODE_AND);
+         cNodes[iAnd].cChildren.push_back(iNode);
+         iNode = iAnd;
+      }
+      cNodes[iNode].cChildren.push_back(iRight);
+   }
+}
+
+//
+// ParseNot:
+// Parses a test, a test with "not" in front of it, or an
+// expression in parentheses.
+//
+bool
+CFilter::ParseNot(const tstring &sExpr, size_t &iPos, int &iNode)
+{
+   tstring sToken;
+   bool bQuoted;
+   if (!NextToken(sExpr, iPos, sToken, bQuoted))
+   {
+      sError = _T("Filter ends too soon");
+      return false;
+   }
+
+   if (IsWord(sToken, bQuoted, _T("not")))
+   {
+      int iChild;
+      if (!ParseNot(sExpr, iPos, iChild))
+         return false;
+      iNode = AddNode(FNODE_NOT);
+      cNodes[iNode].cChildren.push_back(iChild);
+      return true;
+   }
+
+   if (!bQuoted && sToken == _T("("))
+   {
+      if (!ParseOr(sExpr, iPos, iNode))
+         return false;
+      if (!NextToken(sExpr, iPos, sToken, bQuoted) || bQuoted || sToken != _T(")"))
+      {
+         sError = _T("Missing ')' in filter");
+         return false;
+      }
+      return true;
+   }
+
+   if (!bQuoted && sToken == _T(")"))
+   {
+      sError = _T("Unexpected ')' in filter");
+      return false;
+   }
+
+   return ParseTest(sToken, iNode);
+}
+
+//
+// ParseTest:
+// Parses one test, such as "size>10M", and adds a node for it.
+//
+bool
+CFilter::ParseTest(const tstring &sToken, int &iNode)
+{
+   // Split the test into the name, the comparison, and the value.
+   size_t iCompare = sToken.find_first_of(_T("<>=!~"));
+   if (iCompare == tstring::npos || iCompare == 0)
+   {
+      sError = _T("Unknown filter test \"") + sToken + _T("\"");
+      return false;
+   }
+   tstring sName = sToken.substr(0, iCompare);
+   FoldCase(&sName[0], sName.c_str(), sName.size());
+
+   static const struct
+   {
+      const _TCHAR  *pszText;
+      WORD           wCompare;
+      bool           bNot;
+   } astCompares[] =
+   {
+      { _T("<="), FCMP_LE, false },
+      { _T(">="), FCMP_GE, false },
+      { _T("!="), FCMP_EQ, true  },
+      { _T("!~"), 0,       true  },
+      { _T("<"),  FCMP_LT, false },
+      { _T(">"),  FCMP_GT, false },
+      { _T("="),  FCMP_EQ, false },
+      { _T("~"),  0,       false },
+   };
+   int iFound = -1;
+   int iNumCompares = static_cast<int>(sizeof(astCompares) / sizeof(astCompares[0]));
+   for (int i = 0; i < iNumCompares && iFound < 0; i++)
+   {
+      size_t nLen = _tcslen(astCompares[i].pszText);
+      if (sToken.compare(iCompare, nLen, astCompares[i].pszText) == 0)
+         iFound = i;
+   }
+   if (iFound < 0)
+   {
+      sError = _T("Unknown comparison in filter test \"") + sToken + _T("\"");
+      return false;
+   }
+   WORD wCompare = astCompares[iFound].wCompare;
+   bool bNumeric = (wCompare != 0);
+   tstring sValue = sToken.substr(iCompare + _tcslen(astCompares[iFound].pszText));
+   if (sValue.empty())
+   {
+      sError = _T("Missing value in filter test \"") + sToken + _T("\"");
+      return false;
+   }
+
+   FILTER_OP stOp;
+   memset(&stOp, 0, sizeof(stOp));
+   stOp.wCompare = wCompare;
+   if (sName == _T("size") || sName == _T("age") || sName == _T("depth"))
+   {
+      if (!bNumeric)
+      {
+         sError = _T("Bad comparison in filter test \"") + sToken + _T("\"");
+         return false;
+      }
+
+      // Get the number, and the units after it.
+      size_t i = 0;
+      while (i < sValue.size() && sValue[i] >= '0' && sValue[i] <= '9')
+         stOp.qwValue = stOp.qwValue * 10 + (sValue[i++] - '0');
+      tstring sUnits = sValue.substr(i);
+      FoldCase(&sUnits[0], sUnits.c_str(), sUnits.size());
+      ULONGLONG qwScale = 0;
+      if (sName == _T("size"))
+      {
+         stOp.wTest = FTEST_SIZE;
+         stOp.wFlags = FOP_NEEDINFO;
+         if (sUnits.empty())
+            qwScale = 1;
+         else if (sUnits == _T("k"))
+            qwScale = 1ULL << 10;
+         else if (sUnits == _T("m"))
+            qwScale = 1ULL << 20;
+         else if (sUnits == _T("g"))
+            qwScale = 1ULL << 30;
+         else if (sUnits == _T("t"))
+            qwScale = 1ULL << 40;
+      }
+      else if (sName == _T("age"))
+      {
+         stOp.wTest = FTEST_AGE;
+         stOp.wFlags = FOP_NEEDINFO;
+         if (sUnits.empty() || sUnits == _T("h"))
+            qwScale = 3600 * FILETIME_TICKS_PER_SEC;
+         else if (sUnits == _T("m"))
+            qwScale = 60 * FILETIME_TICKS_PER_SEC;
+         else if (sUnits == _T("d"))
+            qwScale = FILETIME_TICKS_PER_DAY;
+      }
+      else
+      {
+         stOp.wTest = FTEST_DEPTH;
+         if (sUnits.empty())
+            qwScale = 1;
+      }
+      if (i == 0 || qwScale == 0)
+      {
+         sError = _T("Bad number in filter test \"") + sToken + _T("\"");
+         return false;
+      }
+      stOp.qwValue *= qwScale;
+   }
+   else if (sName == _T("attr"))
+   {
+      if (wCompare != FCMP_EQ)
+      {
+         sError = _T("Bad comparison in filter test \"") + sToken + _T("\"");
+         return false;
+      }
+      stOp.wTest = FTEST_ATTRIB;
+      for (size_t i = 0; i < sValue.size(); i++)
+      {
+         switch (sValue[i])
+         {
+            case 'r': case 'R':  stOp.dwArg |= FILE_ATTRIBUTE_READONLY;  break;
+            case 'h': case 'H':  stOp.dwArg |= FILE_ATTRIBUTE_HIDDEN;    break;
+            case 's': case 'S':  stOp.dwArg |= FILE_ATTRIBUTE_SYSTEM;    break;
+            case 'a': case 'A':  stOp.dwArg |= FILE_ATTRIBUTE_ARCHIVE;   break;
+            default:
+               sError = _T("Unknown attribute in filter test \"") + sToken + _T("\"");
+               return false;
+         }
+      }
+#ifndef _WIN32
+      // Only the hidden bit comes with the directory listing.
+      if (stOp.dwArg & ~FILE_ATTRIBUTE_HIDDEN)
+         stOp.wFlags = FOP_NEEDINFO;
+#endif
+   }
+   else if (sName == _T("name") || sName == _T("dir"))
+   {
+      if (wCompare != FCMP_EQ)
+      {
+         sError = _T("Bad comparison in filter test \"") + sToken + _T("\"");
+         return false;
+      }
+      stOp.wTest = (sName == _T("name")) ? FTEST_NAME : FTEST_DIR;
+      stOp.dwArg = static_cast<DWORD>(cWildSets.size());
+      cWildSets.push_back(CWildcardSet());
+      if (!cWildSets.back().Add(sValue.c_str()))
+      {
+         sError = _T("Invalid wildcard in filter test \"") + sToken + _T("\"");
+         return false;
+      }
+   }
+   else if (sName == _T("path"))
+   {
+      if (wCompare != 0)
+      {
+         sError = _T("Bad comparison in filter test \"") + sToken + _T("\"");
+         return false;
+      }
+      if (dwNextTag == 0)
+      {
+         sError = _T("Too many path tests in filter");
+         return false;
+      }
+      stOp.wTest = FTEST_PATH;
+      stOp.dwArg = dwNextTag;
+      dwNextTag <<= 1;
+      cSubs.Add(sValue.c_str(), stOp.dwArg);
+   }
+   else
+   {
+      sError = _T("Unknown filter test \"") + sToken + _T("\"");
+      return false;
+   }
+
+   iNode = AddNode(FNODE_TEST, &stOp);
+   if (astCompares[iFound].bNot)
+   {
+      int iNot = AddNode(FNODE_NOT);
+      cNodes[iNot].cChildren.push_back(iNode);
+      iNode = iNot;
+   }
+   return true;
+}
+
+//
+// NextToken:
+// Gets the next word or parenthesis of an expression, starting
+// at iPos, and moves iPos past it.  Parts of a word in double
+// quotes can have spaces and parentheses in them, and bQuoted
+// is set if there were any.  Returns false at the end of the
+// expression.
+//
+bool
+CFilter::NextToken(const tstring &sExpr, size_t &iPos, tstring &sToken, bool &bQuoted) const
+{
+   while (iPos < sExpr.size() && (sExpr[iPos] == ' ' || sExpr[iPos] == '\t'))
+      iPos++;
+   if (iPos >= sExpr.size())
+      return false;
+
+   sToken = _T("");
+   bQuoted = false;
+   if (sExpr[iPos] == '(' || sExpr[iPos] == ')')
+   {
+      sToken += sExpr[iPos++];
+      return true;
+   }
+
+   while (iPos < sExpr.size() && sExpr[iPos] != ' ' && sExpr[iPos] != '\t' &&
+          sExpr[iPos] != '(' && sExpr[iPos] != ')')
+   {
+      if (sExpr[iPos] == '"')
+      {
+         bQuoted = true;
+         iPos++;
+         while (iPos < sExpr.size() && sExpr[iPos] != '"')
+            sToken += sExpr[iPos++];
+         if (iPos < sExpr.size())
+            iPos++;
+      }
+      else
+      {
+         sToken += sExpr[iPos++];
+      }
+   }
+   return true;
+}
+
+//
+// SortNode:
+// Works out the cost of a node, and puts the operands of each
+// "and" and "or" under it in order from cheapest to dearest.
+// The tests have no side effects, so the order doesn't change
+// the result.
+//
+void
+CFilter::SortNode(int iNode)
+{
+   if (cNodes[iNode].iKind == FNODE_TEST)
+      return;
+
+   std::vector<int> &cChildren = cNodes[iNode].cChildren;
+   DWORD dwCost = 0;
+   for (size_t i = 0; i < cChildren.size(); i++)
+   {
+      SortNode(cChildren[i]);
+      dwCost += cNodes[cChildren[i]].dwCost;
+   }
+   std::stable_sort(cChildren.begin(), cChildren.end(),
+      [this](int i1, int i2) { return cNodes[i1].dwCost < cNodes[i2].dwCost; });
+   cNodes[iNode].dwCost = dwCost;
+}
+
+//
+// Emit:
+// Adds the tests for a node to the program.  iTrue and iFalse
+// are where to go once the node is known to pass or fail.
+// Returns where the node's tests start.
+//
+int
+CFilter::Emit(int iNode, int iTrue, int iFalse)
+{
+   const FILTER_NODE &stNode = cNodes[iNode];
+   int iNext;
+   switch (stNode.iKind)
+   {
+      case FNODE_TEST:
+         cProgram.push_back(stNode.stOp);
+         cProgram.back().iTrue = iTrue;
+         cProgram.back().iFalse = iFalse;
+         return static_cast<int>(cProgram.size() - 1);
+
+      case FNODE_NOT:
+         return Emit(stNode.cChildren[0], iFalse, iTrue);
+
+      case FNODE_AND:
+         // Each operand goes on to the next if it passes.
+         iNext = iTrue;
+         for (size_t i = stNode.cChildren.size(); i-- > 0; )
+            iNext = Emit(stNode.cChildren[i], iNext, iFalse);
+         return iNext;
+
+      default:
+         // Each operand goes on to the next if it fails.
+         iNext = iFalse;
+         for (size_t i = stNode.cChildren.size(); i-- > 0; )
+            iNext = Emit(stNode.cChildren[i], iTrue, iNext);
+         return iNext;
+   }
+}
+
+//
+// TestFile:
+// Runs one test on the entry being tested.
+//
+bool
+CFilter::TestFile(const FILTER_OP &stOp, FILTER_STATE &stState) const
+{
+   const CDirEntry *pEntry = stState.pEntry;
+   if (stOp.wFlags & FOP_NEEDINFO)
+      LoadEntryInfo(stState.pszPath, pEntry);
+
+   switch (stOp.wTest)
+   {
+      case FTEST_ATTRIB:
+         return (pEntry->dwAttrib & stOp.dwArg) == stOp.dwArg;
+
+      case FTEST_DEPTH:
+         return CompareNumber(CountNames(stState.pszRelPath), stOp);
+
+      case FTEST_NAME:
+         return cWildSets[stOp.dwArg].Matches(pEntry->sName.c_str());
+
+      case FTEST_DIR:
+         return DirNameMatches(cWildSets[stOp.dwArg], stState.pszRelPath, false);
+
+      case FTEST_PATH:
+         // All the substrings are found in one scan, the first
+         // time any of them is needed.  Entries are tested a
+         // directory at a time, so each thread keeps a cursor
+         // that only has to scan the part of the pathname that
+         // differs from the last one.
+         if (!stState.bScanned)
+         {
+            static thread_local CSubstringCursor cCursor;
+            stState.dwFound = cCursor.Find(cSubs, stState.pszPath);
+            stState.bScanned = true;
+         }
+         return (stState.dwFound & stOp.dwArg) != 0;
+
+      case FTEST_WILDPATH:
+         return cWildSets[stOp.dwArg].Matches(stState.pszPath);
+
+      case FTEST_SIZE:
+         return CompareNumber(static_cast<ULONGLONG>(pEntry->dBytes), stOp);
+
+      case FTEST_AGE:
+         return CompareNumber(
+            (qwNow > pEntry->qwLastWrite) ? qwNow - pEntry->qwLastWrite : 0, stOp);
+
+      case FTEST_DATES:
+         return pEntry->qwLastWrite >= stOp.qwValue && pEntry->qwLastWrite < stOp.qwValue2;
+
+      case FTEST_IGNORED:
+         return cIgnore.Ignored(stState.pszPath, nRootLen, stState.bIsDir);
+   }
+   return false;
+}
+
+//
+// TestSubtree:
+// Runs one test on a directory, for everything in it.  The
+// tests that are applied to directories as if they were files
+// are run that way.  Returns SUBTREE_TRUE or SUBTREE_FALSE if
+// the test passes or fails for every entry in the directory
+// (at any depth), or SUBTREE_UNKNOWN if that depends on the
+// entry.
+//
+int
+CFilter::TestSubtree(const FILTER_OP &stOp, FILTER_STATE &stState) const
+{
+   if (stOp.wFlags & FOP_DIRS)
+      return TestFile(stOp, stState) ? SUBTREE_TRUE : SUBTREE_FALSE;
+
+   ULONGLONG qwDepth;
+   switch (stOp.wTest)
+   {
+      case FTEST_PATH:
+         // Everything in the directory has its pathname in
+         // theirs.
+         return TestFile(stOp, stState) ? SUBTREE_TRUE : SUBTREE_UNKNOWN;
+
+      case FTEST_DIR:
+         if (DirNameMatches(cWildSets[stOp.dwArg], stState.pszRelPath, true))
+            return SUBTREE_TRUE;
+         return SUBTREE_UNKNOWN;
+
+      case FTEST_DEPTH:
+         // Everything in the directory is at least this deep,
+         // with no limit on how much deeper.
+         qwDepth = CountNames(stState.pszRelPath) + 1;
+         switch (stOp.wCompare)
+         {
+            case FCMP_LT:  return (qwDepth >= stOp.qwValue) ? SUBTREE_FALSE : SUBTREE_UNKNOWN;
+            case FCMP_LE:  return (qwDepth > stOp.qwValue) ? SUBTREE_FALSE : SUBTREE_UNKNOWN;
+            case FCMP_GT:  return (qwDepth > stOp.qwValue) ? SUBTREE_TRUE : SUBTREE_UNKNOWN;
+            case FCMP_GE:  return (qwDepth >= stOp.qwValue) ? SUBTREE_TRUE : SUBTREE_UNKNOWN;
+            default:       return (qwDepth > stOp.qwValue) ? SUBTREE_FALSE : SUBTREE_UNKNOWN;
+         }
+   }
+   return SUBTREE_UNKNOWN;
+}
+
+//
+// RunSubtree:
+// Runs the program from the given test on a directory, for
+// everything in it.  Where a test's result depends on the
+// entry, both ways are followed.  Returns SUBTREE_FALSE if
+// nothing in the directory can pass.  cMemo keeps the result
+// from each test, since several paths can lead to the same one.
+//
+int
+CFilter::RunSubtree(int iOp, FILTER_STATE &stState, std::vector<signed char> &cMemo) const
+{
+   if (iOp < 0)
+      return (iOp == FILTER_ACCEPT) ? SUBTREE_TRUE : SUBTREE_FALSE;
+   if (cMemo[iOp] != SUBTREE_UNSET)
+      return cMemo[iOp];
+
+   const FILTER_OP &stOp = cProgram[iOp];
+   int iResult = TestSubtree(stOp, stState);
+   if (iResult == SUBTREE_TRUE)
+   {
+      iResult = RunSubtree(stOp.iTrue, stState, cMemo);
+   }
+   else if (iResult == SUBTREE_FALSE)
+   {
+      iResult = RunSubtree(stOp.iFalse, stState, cMemo);
+   }
+   else
+   {
+      int iIfTrue = RunSubtree(stOp.iTrue, stState, cMemo);
+      int iIfFalse = RunSubtree(stOp.iFalse, stState, cMemo);
+      iResult = (iIfTrue == iIfFalse) ? iIfTrue : SUBTREE_UNKNOWN;
+   }
+   cMemo[iOp] = static_cast<signed char>(iResult);
+   return iResult;
+}
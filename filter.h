@@ -0,0 +1,214 @@
+//--------------------------------------------------------------------
+//
+// filter.h
+//
+// C++ header for the class that decides which source files and
+// directories are copied, from the selection options given on the
+// command line.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#pragma once
+#ifndef __FILTER_H
+#define __FILTER_H
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "filetree.h"
+#include "match.h"
+#include "ignore.h"
+#include <vector>
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Tests in a filter program (FILTER_OP::wTest).
+#define FTEST_ATTRIB    1  // Entry has all the attributes in dwArg.
+#define FTEST_DEPTH     2  // Number of names in the pathname after
+                           // the source, compared with qwValue.
+#define FTEST_NAME      3  // Entry's name matches wildcard set dwArg.
+#define FTEST_DIR       4  // Name of a directory between the source
+                           // and the entry matches wildcard set dwArg.
+#define FTEST_PATH      5  // Pathname contains a substring tagged
+                           // with one of the bits in dwArg.
+#define FTEST_WILDPATH  6  // Pathname matches wildcard set dwArg.
+#define FTEST_SIZE      7  // File size compared with qwValue.
+#define FTEST_AGE       8  // Time since last write compared with qwValue.
+#define FTEST_DATES     9  // Last write is from qwValue up to (but not
+                           // including) qwValue2.
+#define FTEST_IGNORED  10  // Entry is ignored by the rules files.
+
+// Comparisons for the tests that compare numbers (FILTER_OP::wCompare).
+#define FCMP_LT         1
+#define FCMP_LE         2
+#define FCMP_GT         3
+#define FCMP_GE         4
+#define FCMP_EQ         5
+
+// Flags for FILTER_OP::wFlags.
+#define FOP_DIRS        0x0001   // Test directories the same way as
+                                 // files, rather than as subtrees.
+#define FOP_NEEDINFO    0x0002   // Needs the entry's size, dates, or
+                                 // read-only bit (see LoadEntryInfo).
+
+// Where a filter program ends up (FILTER_OP::iTrue and iFalse).
+#define FILTER_ACCEPT   (-1)
+#define FILTER_REJECT   (-2)
+
+//----------------------------------------------------------
+// TYPES
+//----------------------------------------------------------
+
+// One test in a filter program.  The program is a flat list of
+// tests, each saying which one to go to next if it passes and
+// if it fails, ending with FILTER_ACCEPT or FILTER_REJECT.
+typedef struct
+{
+   WORD        wTest;         // What to test (FTEST_...).
+   WORD        wCompare;      // How to compare numbers (FCMP_...).
+   WORD        wFlags;        // FOP_... flags.
+   DWORD       dwArg;         // Attributes, substring tags, or
+                              // wildcard set.
+   ULONGLONG   qwValue;       // Number to compare with.
+   ULONGLONG   qwValue2;      // Second number, for FTEST_DATES.
+   int         iTrue;         // Next test if this one passes.
+   int         iFalse;        // Next test if this one fails.
+} FILTER_OP;
+
+//----------------------------------------------------------
+// CLASSES
+//----------------------------------------------------------
+
+// Class to decide which entries of the source tree are copied.
+// Each selection option adds a clause, and an entry is copied
+// only if it passes all of them.  The /FILTER option adds an
+// expression in a small language of tests on the entry's size,
+// age, attributes, name, directories, depth, and pathname,
+// combined with "and", "or", "not", and parentheses.
+//
+// Compile turns the clauses into one program, with the cheapest
+// tests first and expensive ones (those that have to fetch the
+// entry's information from disk) last, so most entries are
+// settled before they're reached.
+//
+// A directory is removed (with everything in it) only if nothing
+// in it could pass.  The tests of the older options (/INCLUDE,
+// /EXCLUDE, wildcards, /NEW, /OLD, and hidden files) are applied
+// to directories as if they were files, the way they always have
+// been, and so are the rules files, where an ignored directory
+// means everything in it is ignored too.  Filter expressions are
+// for files; on a directory, the tests that depend only on the
+// directories in the pathname (path, dir, and depth) are checked
+// for the whole subtree, and the others are taken as unknown.
+class CFilter
+{
+public:
+   tstring        sError;        // Description of last error that occurred.
+
+   CFilter();
+   void Clear(void);
+   bool AddExpression(const _TCHAR *pszExpr);
+   void AddSubstring(const _TCHAR *pszSub, bool bInclude);
+   bool AddWildcard(const _TCHAR *pszWild);
+   void AddDateRange(ULONGLONG qwFrom, ULONGLONG qwTo);
+   void AddNoAttributes(DWORD dwAttrib);
+   bool AddRulesFile(const _TCHAR *pszFile);
+   void AddDirRulesFile(const _TCHAR *pszName);
+   void SetCaseSensitive(bool bCaseSensitive)   { cIgnore.SetCaseSensitive(bCaseSensitive); }
+   void Compile(size_t nRootLen);
+   bool Empty(void) const  { return cClauses.empty(); }
+   bool Test(const _TCHAR *pszPath, const CDirEntry *pEntry, bool bIsDir) const;
+
+private:
+   // One node of a parsed expression.
+   typedef struct
+   {
+      int               iKind;      // FNODE_... (see filter.cpp)
+      FILTER_OP         stOp;       // The test, for FNODE_TEST.
+      std::vector<int>  cChildren;  // Operands, for the others.
+      DWORD             dwCost;     // Rough cost to evaluate.
+   } FILTER_NODE;
+
+   // What's been found out about the entry being tested.
+   typedef struct
+   {
+      const _TCHAR     *pszPath;    // Pathname of the entry.
+      const _TCHAR     *pszRelPath; // Part of it after the source.
+      const CDirEntry  *pEntry;     // The entry.
+      bool              bIsDir;     // True if it's a directory.
+      bool              bScanned;   // True if dwFound is set.
+      DWORD             dwFound;    // Tags of the substrings in the
+                                    // pathname.
+   } FILTER_STATE;
+
+   std::vector<FILTER_NODE>   cNodes;     // Nodes of the clauses.
+   std::vector<int>           cClauses;   // Clauses that must all pass.
+   std::vector<CWildcardSet>  cWildSets;  // Wildcards for the tests.
+   CSubstringSet              cSubs;      // Substrings for FTEST_PATH,
+                                          // each tagged with one bit.
+   CIgnoreRules               cIgnore;    // Rules for FTEST_IGNORED.
+   bool           bIgnoreAdded;  // True once FTEST_IGNORED has a clause.
+   DWORD          dwNextTag;     // Next free tag bit in cSubs.
+   DWORD          dwIncludeTag;  // Tag of /INCLUDE strings, or 0.
+   DWORD          dwExcludeTag;  // Tag of /EXCLUDE strings, or 0.
+   int            iWildSet;      // Wildcard set for the command line
+                                 // wildcards, or -1.
+   size_t         nRootLen;      // Length of the source pathname.
+   ULONGLONG      qwNow;         // Time Compile was called, for ages.
+   std::vector<FILTER_OP>     cProgram;   // The compiled program.
+   int            iStart;        // First test of the program.
+
+   int AddNode(int iKind, const FILTER_OP *pOp = NULL);
+   int AddTest(WORD wTest, WORD wFlags, DWORD dwArg = 0);
+   void AddIgnoreClause(void);
+   bool ParseOr(const tstring &sExpr, size_t &iPos, int &iNode);
+   bool ParseAnd(const tstring &sExpr, size_t &iPos, int &iNode);
+   bool ParseNot(const tstring &sExpr, size_t &iPos, int &iNode);
+   bool ParseTest(const tstring &sToken, int &iNode);
+   bool NextToken(const tstring &sExpr, size_t &iPos, tstring &sToken, bool &bQuoted) const;
+   void SortNode(int iNode);
+   int Emit(int iNode, int iTrue, int iFalse);
+   bool TestFile(const FILTER_OP &stOp, FILTER_STATE &stState) const;
+   int TestSubtree(const FILTER_OP &stOp, FILTER_STATE &stState) const;
+   int RunSubtree(int iOp, FILTER_STATE &stState, std::vector<signed char> &cMemo) const;
+};
+
+#endif //__FILTER_H
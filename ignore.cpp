@@ -0,0 +1,537 @@
+//--------------------------------------------------------------------
+//
+// ignore.cpp
+//
+// C++ code for the class that decides which source files and
+// directories are ignored, from rules files in the same format as
+// the ".gitignore" files used by git.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "ignore.h"
+#include "strkern.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Characters with a special meaning in a pattern.
+#define IGNORE_SPECIAL  _T("*?[\\")
+
+//----------------------------------------------------------
+// LOCAL FUNCTIONS
+//----------------------------------------------------------
+
+//
+// IsSeparator:
+// Determines if a character in a pathname separates names.
+// Patterns always use '/', whatever the system uses.
+//
+static inline bool
+IsSeparator(_TCHAR c)
+{
+   return c == '/' || c == PATHSEP;
+}
+
+//
+// FoldChar:
+// Returns a character in lower case, if case doesn't matter.
+// Only the ASCII letters are folded, the same as FoldCase.
+//
+static inline _TCHAR
+FoldChar(_TCHAR c, bool bCaseSensitive)
+{
+   if (bCaseSensitive || c < 'A' || c > 'Z')
+      return c;
+   return static_cast<_TCHAR>(c - 'A' + 'a');
+}
+
+//
+// MatchClass:
+// Matches a character against a [...] set in a pattern, where
+// pszPat points to the '['.  The set can start with '!' or '^'
+// to match the characters not in it, and can have ranges such
+// as a-z.  Sets *pbMatched, and returns the pattern after the
+// ']', or NULL if there's no ']' (so the '[' is just itself).
+//
+static const _TCHAR *
+MatchClass(const _TCHAR *pszPat, _TCHAR c, bool bCaseSensitive, bool *pbMatched)
+{
+   const _TCHAR *p = pszPat + 1;
+   bool bNot = (*p == '!' || *p == '^');
+   if (bNot)
+      p++;
+
+   bool bMatched = false;
+   _TCHAR cFold = FoldChar(c, bCaseSensitive);
+   bool bFirst = true;
+   while (*p != '\0' && (*p != ']' || bFirst))
+   {
+      bFirst = false;
+      _TCHAR cLow = *p++;
+      if (cLow == '\\' && *p != '\0')
+         cLow = *p++;
+      _TCHAR cHigh = cLow;
+      if (p[0] == '-' && p[1] != '\0' && p[1] != ']')
+      {
+         p++;
+         cHigh = *p++;
+         if (cHigh == '\\' && *p != '\0')
+            cHigh = *p++;
+      }
+      if ((c >= cLow && c <= cHigh) ||
+          (cFold >= FoldChar(cLow, bCaseSensitive) && cFold <= FoldChar(cHigh, bCaseSensitive)))
+         bMatched = true;
+   }
+   if (*p == '\0')
+      return NULL;
+
+   *pbMatched = (bMatched != bNot) && !IsSeparator(c);
+   return p + 1;
+}
+
+//
+// GlobMatch:
+// Matches text against a pattern from a rules file.  '*' and
+// '?' match anything but a separator, a "**" between slashes
+// (or at either end) matches any number of whole names, and a
+// backslash makes the next character match only itself.
+// pszStart is the start of the whole pattern.
+//
+static bool
+GlobMatch(const _TCHAR *pszPat, const _TCHAR *pszStart, const _TCHAR *pszText, bool bCaseSensitive)
+{
+   const _TCHAR *p = pszPat;
+   const _TCHAR *t = pszText;
+   while (*p != '\0')
+   {
+      if (p[0] == '*' && p[1] == '*' && (p == pszStart || p[-1] == '/') &&
+          (p[2] == '/' || p[2] == '\0'))
+      {
+         // "**" as a whole name matches any number of names.
+         if (p[2] == '\0')
+            return true;
+         p += 3;
+         for (;;)
+         {
+            if (GlobMatch(p, pszStart, t, bCaseSensitive))
+               return true;
+            while (*t != '\0' && !IsSeparator(*t))
+               t++;
+            if (*t == '\0')
+               return false;
+            t++;
+         }
+      }
+      else if (*p == '*')
+      {
+         while (*p == '*')
+            p++;
+         for (;;)
+         {
+            if (GlobMatch(p, pszStart, t, bCaseSensitive))
+               return true;
+            if (*t == '\0' || IsSeparator(*t))
+               return false;
+            t++;
+         }
+      }
+      else if (*p == '?')
+      {
+         if (*t == '\0' || IsSeparator(*t))
+            return false;
+         p++;
+         t++;
+      }
+      else
+      {
+         bool bMatched;
+         const _TCHAR *pszNext = NULL;
+         if (*p == '[' && *t != '\0')
+            pszNext = MatchClass(p, *t, bCaseSensitive, &bMatched);
+         if (pszNext != NULL)
+         {
+            if (!bMatched)
+               return false;
+            p = pszNext;
+            t++;
+            continue;
+         }
+
+         _TCHAR c = *p++;
+         if (c == '\\' && *p != '\0')
+            c = *p++;
+         if (c == '/')
+         {
+            if (!IsSeparator(*t))
+               return false;
+         }
+         else if (FoldChar(c, bCaseSensitive) != FoldChar(*t, bCaseSensitive))
+         {
+            return false;
+         }
+         t++;
+      }
+   }
+   return *t == '\0';
+}
+
+//
+// LastRule:
+// Returns the last of a list of rules that can match an entry,
+// given whether it's a directory, or -1 if there isn't one.
+//
+static int
+LastRule(const std::vector<IGNORE_RULE> &cRules, const std::vector<int> &cList, bool bIsDir)
+{
+   for (size_t i = cList.size(); i-- > 0; )
+   {
+      if (bIsDir || !(cRules[cList[i]].wFlags & IGR_DIRONLY))
+         return cList[i];
+   }
+   return -1;
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CIgnoreRules
+//----------------------------------------------------------
+
+// Default constructor.
+CIgnoreRules::CIgnoreRules()
+{
+   Clear();
+}
+
+//
+// Clear:
+// Removes all the rules, so nothing is ignored.
+//
+void
+CIgnoreRules::Clear(void)
+{
+   sError = _T("");
+   cGlobal.cRules.clear();
+   cGlobal.cNames.clear();
+   cGlobal.cExts.clear();
+   cGlobal.cOthers.clear();
+   cGlobal.nBaseLen = 0;
+   cGlobal.pParent = NULL;
+   sDirFileName = _T("");
+   bCaseSensitive = false;
+   std::lock_guard<std::mutex> lock(mtxDirs);
+   cDirs.clear();
+   cLists.clear();
+}
+
+//
+// AddFile:
+// Reads global rules from a file, for /RULES.  Their patterns
+// match pathnames from the source directory.  Returns false if
+// the file can't be read.
+//
+bool
+CIgnoreRules::AddFile(const _TCHAR *pszFile)
+{
+   if (!ReadFile(cGlobal, pszFile))
+   {
+      sError = _T("Failed opening rules file");
+      return false;
+   }
+   return true;
+}
+
+//
+// Ignored:
+// Determines if an entry of the source tree is ignored by the
+// rules.  pszPath is its full pathname, and nRootLen is the
+// length of the source directory's pathname, including the
+// separator after it.  The directories above the entry are
+// taken to have passed already.
+//
+bool
+CIgnoreRules::Ignored(const _TCHAR *pszPath, size_t nRootLen, bool bIsDir) const
+{
+   size_t nLen = _tcslen(pszPath);
+   if (nLen <= nRootLen)
+      return false;
+   const _TCHAR *pszRelPath = pszPath + nRootLen;
+   size_t nRelLen = nLen - nRootLen;
+   const _TCHAR *pSep = FindLastChar(pszRelPath, nRelLen, PATHSEP);
+   const _TCHAR *pszName = (pSep != NULL) ? pSep + 1 : pszRelPath;
+
+   // Find the rules for the entry's directory.  Entries are
+   // tested a directory at a time, so each thread remembers the
+   // last one it looked up.
+   const RULE_LIST *pList = &cGlobal;
+   if (!sDirFileName.empty())
+   {
+      static thread_local const CIgnoreRules *pLastOwner = NULL;
+      static thread_local tstring sLastDir;
+      static thread_local const RULE_LIST *pLastList = NULL;
+      size_t nDirLen = (pSep != NULL) ? static_cast<size_t>(pSep - pszRelPath) : 0;
+      if (pLastOwner != this || sLastDir.compare(0, tstring::npos, pszRelPath, nDirLen) != 0)
+      {
+         tstring sRoot(pszPath, nRootLen);
+         sLastDir.assign(pszRelPath, nDirLen);
+         pLastList = DirRules(sRoot, sLastDir);
+         pLastOwner = this;
+      }
+      pList = pLastList;
+   }
+
+   // The deepest rules file with a rule that matches decides.
+   for ( ; pList != NULL; pList = pList->pParent)
+   {
+      int iRule = MatchList(*pList, pszRelPath, pszName, bIsDir);
+      if (iRule >= 0)
+         return !(pList->cRules[iRule].wFlags & IGR_NEGATE);
+   }
+   return false;
+}
+
+//
+// AddRule:
+// Parses one line of a rules file, and adds its rule (if it
+// has one) to a list.  Rules that are just a name, or just
+// "*.ext", go in the tables for looking them up by name.
+//
+void
+CIgnoreRules::AddRule(RULE_LIST &cList, const _TCHAR *pszLine) const
+{
+   tstring s = pszLine;
+
+   // Trailing spaces don't count, unless there's a backslash
+   // before them.
+   while (!s.empty() && (s[s.size() - 1] == ' ' || s[s.size() - 1] == '\t'))
+   {
+      if (s.size() >= 2 && s[s.size() - 2] == '\\')
+         break;
+      s.erase(s.size() - 1);
+   }
+   if (s.empty() || s[0] == '#')
+      return;
+
+   IGNORE_RULE stRule;
+   stRule.wFlags = 0;
+   if (s[0] == '!')
+   {
+      stRule.wFlags |= IGR_NEGATE;
+      s.erase(0, 1);
+   }
+   if (!s.empty() && s[s.size() - 1] == '/')
+   {
+      stRule.wFlags |= IGR_DIRONLY;
+      s.erase(s.size() - 1);
+   }
+
+   // "**/" at the start matches at any depth, the same as a name
+   // with no slash.
+   while (s.compare(0, 3, _T("**/")) == 0 && s.find('/', 3) == tstring::npos)
+      s.erase(0, 3);
+   if (s.find('/') != tstring::npos)
+   {
+      stRule.wFlags |= IGR_ANCHORED;
+      if (s[0] == '/')
+         s.erase(0, 1);
+   }
+   if (s.empty())
+      return;
+
+   stRule.sPattern = s;
+   int iRule = static_cast<int>(cList.cRules.size());
+   cList.cRules.push_back(stRule);
+
+   if (!(stRule.wFlags & IGR_ANCHORED) && s.find_first_of(IGNORE_SPECIAL) == tstring::npos)
+   {
+      cList.cNames[FoldName(s.c_str(), s.size())].push_back(iRule);
+   }
+   else if (!(stRule.wFlags & IGR_ANCHORED) && s.size() > 2 && s[0] == '*' && s[1] == '.' &&
+            s.find_first_of(IGNORE_SPECIAL _T("."), 2) == tstring::npos)
+   {
+      cList.cExts[FoldName(s.c_str() + 2, s.size() - 2)].push_back(iRule);
+   }
+   else
+   {
+      cList.cOthers.push_back(iRule);
+   }
+}
+
+//
+// ReadFile:
+// Reads the rules from a file into a list.  Blank lines, and
+// lines starting with '#', are skipped.  Returns false if the
+// file can't be opened.
+//
+bool
+CIgnoreRules::ReadFile(RULE_LIST &cList, const _TCHAR *pszFile) const
+{
+   FILE *pFile;
+   if (_tfopen_s(&pFile, pszFile, _T("r")))
+      return false;
+
+   tstring sLine;
+   while (readline(pFile, sLine))
+      AddRule(cList, sLine.c_str());
+   fclose(pFile);
+   return true;
+}
+
+//
+// FoldName:
+// Returns a name as it's kept in the tables for looking up
+// rules, which is in lower case unless case matters.
+//
+tstring
+CIgnoreRules::FoldName(const _TCHAR *pszName, size_t nLen) const
+{
+   tstring s(pszName, nLen);
+   if (!bCaseSensitive && nLen > 0)
+      FoldCase(&s[0], pszName, nLen);
+   return s;
+}
+
+//
+// MatchList:
+// Returns the last rule in a list that matches an entry, or -1
+// if none do.  pszRelPath is the entry's pathname below the
+// source, and pszName is its name.
+//
+int
+CIgnoreRules::MatchList(
+   const RULE_LIST &cList,
+   const _TCHAR *pszRelPath,
+   const _TCHAR *pszName,
+   bool bIsDir
+   ) const
+{
+   if (cList.cRules.empty())
+      return -1;
+
+   int iBest = -1;
+   size_t nNameLen = _tcslen(pszName);
+   if (!cList.cNames.empty())
+   {
+      std::unordered_map<tstring, std::vector<int> >::const_iterator it;
+      it = cList.cNames.find(FoldName(pszName, nNameLen));
+      if (it != cList.cNames.end())
+         iBest = LastRule(cList.cRules, it->second, bIsDir);
+   }
+   if (!cList.cExts.empty())
+   {
+      const _TCHAR *pDot = FindLastChar(pszName, nNameLen, '.');
+      if (pDot != NULL && pDot[1] != '\0')
+      {
+         std::unordered_map<tstring, std::vector<int> >::const_iterator it =
+            cList.cExts.find(FoldName(pDot + 1, nNameLen - (pDot + 1 - pszName)));
+         if (it != cList.cExts.end())
+            iBest = std::max(iBest, LastRule(cList.cRules, it->second, bIsDir));
+      }
+   }
+
+   // Only the rules after the best one so far can change the
+   // outcome.
+   const _TCHAR *pszBasePath = pszRelPath + cList.nBaseLen;
+   for (size_t i = cList.cOthers.size(); i-- > 0 && cList.cOthers[i] > iBest; )
+   {
+      const IGNORE_RULE &stRule = cList.cRules[cList.cOthers[i]];
+      if ((stRule.wFlags & IGR_DIRONLY) && !bIsDir)
+         continue;
+      const _TCHAR *pszText = (stRule.wFlags & IGR_ANCHORED) ? pszBasePath : pszName;
+      if (GlobMatch(stRule.sPattern.c_str(), stRule.sPattern.c_str(), pszText, bCaseSensitive))
+         return cList.cOthers[i];
+   }
+   return iBest;
+}
+
+//
+// DirRules:
+// Returns the rules for the entries in a directory, given the
+// source directory's pathname (with the separator after it)
+// and the directory's pathname below that.  The directory's
+// rules file is read the first time, and if it has no rules,
+// the directory just gets the rules of the one above it.
+//
+const CIgnoreRules::RULE_LIST *
+CIgnoreRules::DirRules(const tstring &sRoot, const tstring &sRelDir) const
+{
+   {
+      std::lock_guard<std::mutex> lock(mtxDirs);
+      std::unordered_map<tstring, const RULE_LIST *>::const_iterator it = cDirs.find(sRelDir);
+      if (it != cDirs.end())
+         return it->second;
+   }
+
+   // Get the rules from above first, since the directory's own
+   // come ahead of them.  The file is read without holding the
+   // lock, so other threads can carry on.
+   const RULE_LIST *pParent = &cGlobal;
+   if (!sRelDir.empty())
+   {
+      const _TCHAR *pSep = FindLastChar(sRelDir.c_str(), sRelDir.size(), PATHSEP);
+      size_t nParentLen = (pSep != NULL) ? static_cast<size_t>(pSep - sRelDir.c_str()) : 0;
+      pParent = DirRules(sRoot, sRelDir.substr(0, nParentLen));
+   }
+
+   std::unique_ptr<RULE_LIST> pNew(new RULE_LIST);
+   pNew->nBaseLen = sRelDir.empty() ? 0 : sRelDir.size() + 1;
+   pNew->pParent = pParent;
+   tstring sFile = sRoot + sRelDir;
+   if (!sRelDir.empty())
+      sFile += PATHSEP;
+   sFile += sDirFileName;
+   const RULE_LIST *pList = pParent;
+   if (ReadFile(*pNew, sFile.c_str()) && !pNew->cRules.empty())
+      pList = pNew.get();
+
+   // Another thread may have got here first.
+   std::lock_guard<std::mutex> lock(mtxDirs);
+   std::pair<std::unordered_map<tstring, const RULE_LIST *>::iterator, bool> stInsert =
+      cDirs.insert(std::make_pair(sRelDir, pList));
+   if (stInsert.second && pList == pNew.get())
+      cLists.push_back(std::move(pNew));
+   return stInsert.first->second;
+}
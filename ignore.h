@@ -0,0 +1,158 @@
+//--------------------------------------------------------------------
+//
+// ignore.h
+//
+// C++ header for the class that decides which source files and
+// directories are ignored, from rules files in the same format as
+// the ".gitignore" files used by git.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#pragma once
+#ifndef __IGNORE_H
+#define __IGNORE_H
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "filetree.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Flags for IGNORE_RULE::wFlags.
+#define IGR_NEGATE      0x0001   // Rule started with '!', so matching
+                                 // entries are kept, not ignored.
+#define IGR_DIRONLY     0x0002   // Rule ended with '/', so it only
+                                 // matches directories.
+#define IGR_ANCHORED    0x0004   // Rule has a '/' before its end, so it
+                                 // matches the pathname from the rules
+                                 // file's directory, not just the name.
+
+//----------------------------------------------------------
+// TYPES
+//----------------------------------------------------------
+
+// One rule from a rules file.
+typedef struct
+{
+   tstring     sPattern;      // Pattern, without the '!', and without
+                              // the '/' at the start or end.
+   WORD        wFlags;        // IGR_... flags.
+} IGNORE_RULE;
+
+//----------------------------------------------------------
+// CLASSES
+//----------------------------------------------------------
+
+// Class to test entries of the source tree against rules in the
+// format of git's ".gitignore" files.  Each line of a rules file
+// is a pattern, where '*' and '?' match anything but a slash,
+// "**" matches any number of directories, and [...] matches one
+// of a set of characters.  A pattern with no slash (except at
+// the end) matches names at any depth; otherwise it matches the
+// pathname from the rules file's directory.  A pattern ending in
+// a slash only matches directories, and one starting with '!'
+// keeps entries that an earlier rule would ignore.  The last
+// rule that matches an entry decides it, and the rules files in
+// deeper directories come ahead of those above them, and of the
+// global rules given with /RULES.
+//
+// Once a directory is ignored, nothing in it is looked at (the
+// same as git, which can't bring back a file in an ignored
+// directory), so ignored trees are never scanned.  Per-directory
+// rules files are read the first time an entry in the directory
+// is tested; this can be called from several threads at once.
+class CIgnoreRules
+{
+public:
+   tstring        sError;        // Description of last error that occurred.
+
+   CIgnoreRules();
+   void Clear(void);
+   bool AddFile(const _TCHAR *pszFile);
+   void SetDirFileName(const _TCHAR *pszName)   { sDirFileName = pszName; }
+   void SetCaseSensitive(bool bCaseSensitive)   { this->bCaseSensitive = bCaseSensitive; }
+   bool Ignored(const _TCHAR *pszPath, size_t nRootLen, bool bIsDir) const;
+
+private:
+   // The rules from one rules file (or from all the global ones),
+   // with the ones that can be looked up by name kept apart from
+   // those that have to be matched one at a time.
+   typedef struct RULE_LIST
+   {
+      std::vector<IGNORE_RULE>   cRules;     // All the rules, in order.
+      std::unordered_map<tstring, std::vector<int> > cNames;
+                                             // Rules that are just a name,
+                                             // by the name.
+      std::unordered_map<tstring, std::vector<int> > cExts;
+                                             // Rules that are "*.ext", by
+                                             // the extension.
+      std::vector<int>           cOthers;    // The rest of the rules.
+      size_t                     nBaseLen;   // Length of the directory's
+                                             // pathname below the source,
+                                             // with the separator after it.
+      const struct RULE_LIST    *pParent;    // Rules from the directories
+                                             // above, or NULL.
+   } RULE_LIST;
+
+   RULE_LIST      cGlobal;       // Rules given with /RULES.
+   tstring        sDirFileName;  // Name of per-directory rules files,
+                                 // or empty for none.
+   bool           bCaseSensitive;// True if case matters in the patterns.
+   mutable std::mutex mtxDirs;   // Protects cDirs and cLists.
+   mutable std::unordered_map<tstring, const RULE_LIST *> cDirs;
+                                 // Rules for each directory looked at so
+                                 // far, by its pathname below the source.
+   mutable std::vector<std::unique_ptr<RULE_LIST> > cLists;
+                                 // Rules read from per-directory files.
+
+   void AddRule(RULE_LIST &cList, const _TCHAR *pszLine) const;
+   bool ReadFile(RULE_LIST &cList, const _TCHAR *pszFile) const;
+   tstring FoldName(const _TCHAR *pszName, size_t nLen) const;
+   int MatchList(const RULE_LIST &cList, const _TCHAR *pszRelPath, const _TCHAR *pszName, bool bIsDir) const;
+   const RULE_LIST *DirRules(const tstring &sRoot, const tstring &sRelDir) const;
+};
+
+#endif //__IGNORE_H
@@ -0,0 +1,596 @@
+//--------------------------------------------------------------------
+//
+// match.cpp
+//
+// C++ code for the classes that test pathnames against the sets of
+// patterns given on the command line.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "match.h"
+#include "strkern.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <algorithm>
+
+//----------------------------------------------------------
+// LOCAL FUNCTIONS
+//----------------------------------------------------------
+
+//
+// CharValue:
+// Returns the value of a character, without sign extension.
+//
+static inline unsigned
+CharValue(_TCHAR c)
+{
+#ifdef _UNICODE
+   return static_cast<unsigned>(c);
+#else
+   return static_cast<unsigned char>(c);
+#endif
+}
+
+//
+// FoldChar:
+// Returns a character value in lower case, the same way the
+// wildcard matching has always compared characters.
+//
+static inline unsigned
+FoldChar(unsigned c)
+{
+   return (c < 0x80) ? static_cast<unsigned>(tolower(static_cast<int>(c))) : c;
+}
+
+//
+// InRanges:
+// Determines if a (lower case) character value is in one of
+// a state's ranges.
+//
+static bool
+InRanges(const std::vector<std::pair<unsigned, unsigned> > &cRanges, unsigned c)
+{
+   for (size_t i = 0; i < cRanges.size(); i++)
+   {
+      if (c >= cRanges[i].first && c <= cRanges[i].second)
+         return true;
+   }
+   return false;
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CWildcardSet
+//----------------------------------------------------------
+
+// Default constructor.
+CWildcardSet::CWildcardSet()
+{
+   Clear();
+}
+
+//
+// Clear:
+// Removes all the wildcards.
+//
+void
+CWildcardSet::Clear(void)
+{
+   nWilds = 0;
+   nStates = 0;
+   cStart.clear();
+   cFinal.clear();
+   cLoop.clear();
+   cTable.clear();
+   cAccepts.clear();
+}
+
+//
+// Add:
+// Compiles a wildcard and adds it to the set.  Each character
+// the wildcard matches ('?', a group in square brackets, or an
+// ordinary character) becomes one state, entered from the one
+// before it on any of the characters it accepts.  A '*' makes
+// the state before it loop on any character, so it can match
+// any number of them, including none.
+// Returns false if the wildcard is malformed (a '[' with no
+// ']'), in which case it isn't added.
+//
+bool
+CWildcardSet::Add(const _TCHAR *pszWild)
+{
+   // Parse the wildcard into states.  State 0 is the start,
+   // which no character moves into.
+   std::vector<RANGES> cNew(1);
+   std::vector<bool> cNewLoop(1, false);
+   const _TCHAR *p = pszWild;
+   while (*p != '\0')
+   {
+      if (*p == '*')
+      {
+         cNewLoop.back() = true;
+         p++;
+         continue;
+      }
+
+      RANGES cRanges;
+      if (*p == '?')
+      {
+         cRanges.push_back(std::make_pair(1u, UINT_MAX));
+         p++;
+      }
+      else if (*p == '[')
+      {
+         p++;
+         while (*p != ']' && *p != '\0')
+         {
+            unsigned c = FoldChar(CharValue(p[0]));
+            if (p[1] == '-' && p[2] != '\0' && p[2] != ']')
+            {
+               cRanges.push_back(std::make_pair(c, FoldChar(CharValue(p[2]))));
+               p += 3;
+            }
+            else
+            {
+               cRanges.push_back(std::make_pair(c, c));
+               p++;
+            }
+         }
+         if (*p != ']')
+            return false;  // No ']' at end of group.
+         p++;
+      }
+      else if (*p == '/' || *p == '\\')
+      {
+         // Slash and backslash are interchangeable.
+         cRanges.push_back(std::make_pair(CharValue('/'), CharValue('/')));
+         cRanges.push_back(std::make_pair(CharValue('\\'), CharValue('\\')));
+         p++;
+      }
+      else
+      {
+         unsigned c = FoldChar(CharValue(*p));
+         cRanges.push_back(std::make_pair(c, c));
+         p++;
+      }
+      cNew.push_back(cRanges);
+      cNewLoop.push_back(false);
+   }
+
+   // Make room for the new states, a word at a time.
+   size_t iFirst = nStates;
+   nStates += cNew.size();
+   while (cStart.size() * 64 < nStates)
+   {
+      cStart.push_back(0);
+      cFinal.push_back(0);
+      cLoop.push_back(0);
+      cTable.resize(cTable.size() + WILD_TABLE_SIZE, 0);
+   }
+
+   // Fill in the bits for each state.
+   for (size_t iNew = 0; iNew < cNew.size(); iNew++)
+   {
+      size_t iState = iFirst + iNew;
+      size_t iWord = iState / 64;
+      ULONGLONG qwBit = 1ULL << (iState % 64);
+      if (iNew == 0)
+         cStart[iWord] |= qwBit;
+      if (iNew == cNew.size() - 1)
+         cFinal[iWord] |= qwBit;
+      if (cNewLoop[iNew])
+         cLoop[iWord] |= qwBit;
+      for (unsigned c = 0; c < WILD_TABLE_SIZE && iNew > 0; c++)
+      {
+         if (InRanges(cNew[iNew], FoldChar(c)))
+            cTable[iWord * WILD_TABLE_SIZE + c] |= qwBit;
+      }
+      cAccepts.push_back(cNew[iNew]);
+   }
+
+   nWilds++;
+   return true;
+}
+
+//
+// Matches:
+// Determines if a string matches any of the wildcards in the
+// set.  The active states of all the wildcards are kept in one
+// bit vector.  For each character, a state stays active if it
+// loops, and the state after each active state becomes active
+// if it accepts the character.  Since a wildcard's first state
+// accepts nothing, nothing carries over from one wildcard into
+// the next.  Stops as soon as no states are left.
+//
+bool
+CWildcardSet::Matches(const _TCHAR *pszText) const
+{
+   size_t nWords = cStart.size();
+   if (nWords == 0)
+      return false;
+
+   // Most sets fit in one word.
+   if (nWords == 1)
+   {
+      ULONGLONG qwActive = cStart[0];
+      for (const _TCHAR *p = pszText; *p != '\0'; p++)
+      {
+         qwActive = ((qwActive << 1) & CharMask(CharValue(*p), 0)) | (qwActive & cLoop[0]);
+         if (qwActive == 0)
+            return false;
+      }
+      return (qwActive & cFinal[0]) != 0;
+   }
+
+   std::vector<ULONGLONG> cActive(cStart);
+   for (const _TCHAR *p = pszText; *p != '\0'; p++)
+   {
+      unsigned c = CharValue(*p);
+      ULONGLONG qwCarry = 0;
+      ULONGLONG qwAny = 0;
+      for (size_t iWord = 0; iWord < nWords; iWord++)
+      {
+         ULONGLONG qwWord = cActive[iWord];
+         cActive[iWord] = (((qwWord << 1) | qwCarry) & CharMask(c, iWord)) | (qwWord & cLoop[iWord]);
+         qwCarry = qwWord >> 63;
+         qwAny |= cActive[iWord];
+      }
+      if (qwAny == 0)
+         return false;
+   }
+   for (size_t iWord = 0; iWord < nWords; iWord++)
+   {
+      if (cActive[iWord] & cFinal[iWord])
+         return true;
+   }
+   return false;
+}
+
+//
+// CharMask:
+// Returns the states in one word that a character can move
+// into.  Characters that aren't in the table are checked
+// against each state's ranges.
+//
+ULONGLONG
+CWildcardSet::CharMask(unsigned c, size_t iWord) const
+{
+   if (c < WILD_TABLE_SIZE)
+      return cTable[iWord * WILD_TABLE_SIZE + c];
+
+   ULONGLONG qwMask = 0;
+   size_t iEnd = (iWord + 1) * 64;
+   if (iEnd > nStates)
+      iEnd = nStates;
+   c = FoldChar(c);
+   for (size_t iState = iWord * 64; iState < iEnd; iState++)
+   {
+      if (InRanges(cAccepts[iState], c))
+         qwMask |= 1ULL << (iState % 64);
+   }
+   return qwMask;
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CSubstringSet
+//----------------------------------------------------------
+
+// Default constructor.
+CSubstringSet::CSubstringSet()
+{
+   Clear();
+}
+
+//
+// Clear:
+// Removes all the substrings.
+//
+void
+CSubstringSet::Clear(void)
+{
+   cSubs.clear();
+   nClasses = 1;
+   cClass.clear();
+   cWideClass.clear();
+   cMoves.clear();
+   cTags.clear();
+}
+
+//
+// Add:
+// Adds a substring to the set, with the tags to return when
+// it's found.  An empty substring is never found, the same as
+// with SubstringMatch, so it isn't added.
+//
+void
+CSubstringSet::Add(const _TCHAR *pszSub, DWORD dwTags)
+{
+   if (*pszSub == '\0' || dwTags == 0)
+      return;
+
+   tstring sSub;
+   for (const _TCHAR *p = pszSub; *p != '\0'; p++)
+      sSub += static_cast<_TCHAR>(FoldChar(CharValue(*p)));
+   cSubs.push_back(std::make_pair(sSub, dwTags));
+}
+
+//
+// Compile:
+// Builds the automaton for the substrings that have been added.
+// The substrings go into a trie first, one state for each
+// prefix.  Then the states are visited breadth first, and each
+// missing move is filled in from the state for the longest
+// suffix that's also a prefix (the failure link), which has
+// already been visited.  A state also gets the tags of its
+// failure link, so every substring ending at a character is
+// found without following the links while scanning.
+//
+void
+CSubstringSet::Compile(void)
+{
+   // Give each character in the substrings a class.
+   nClasses = 1;
+   cClass.assign(WILD_TABLE_SIZE, 0);
+   cWideClass.clear();
+   for (size_t iSub = 0; iSub < cSubs.size(); iSub++)
+   {
+      const tstring &sSub = cSubs[iSub].first;
+      for (size_t i = 0; i < sSub.size(); i++)
+      {
+         unsigned c = CharValue(sSub[i]);
+         if (c < WILD_TABLE_SIZE)
+         {
+            if (cClass[c] == 0)
+               cClass[c] = static_cast<DWORD>(nClasses++);
+         }
+         else if (ClassOf(c) == 0)
+         {
+            cWideClass.push_back(std::make_pair(c, static_cast<DWORD>(nClasses++)));
+            std::sort(cWideClass.begin(), cWideClass.end());
+         }
+      }
+   }
+
+   // Upper case characters go in the same class as lower case.
+   for (unsigned c = 0; c < WILD_TABLE_SIZE; c++)
+   {
+      if (FoldChar(c) != c)
+         cClass[c] = cClass[FoldChar(c)];
+   }
+
+   // Build the trie.  State 0 is the start, which is never moved
+   // into from another state in the trie, so 0 means no move yet.
+   cMoves.assign(nClasses, 0);
+   cTags.assign(1, 0);
+   for (size_t iSub = 0; iSub < cSubs.size(); iSub++)
+   {
+      const tstring &sSub = cSubs[iSub].first;
+      DWORD iState = 0;
+      for (size_t i = 0; i < sSub.size(); i++)
+      {
+         size_t iMove = iState * nClasses + ClassOf(CharValue(sSub[i]));
+         if (cMoves[iMove] == 0)
+         {
+            cMoves[iMove] = static_cast<DWORD>(cTags.size());
+            cTags.push_back(0);
+            cMoves.resize(cMoves.size() + nClasses, 0);
+         }
+         iState = cMoves[iMove];
+      }
+      cTags[iState] |= cSubs[iSub].second;
+   }
+
+   // Fill in the missing moves breadth first.  The moves missing
+   // from the start state stay there.
+   std::vector<DWORD> cFail(cTags.size(), 0);
+   std::vector<DWORD> cQueue;
+   cQueue.reserve(cTags.size());
+   for (size_t iClass = 0; iClass < nClasses; iClass++)
+   {
+      if (cMoves[iClass] != 0)
+         cQueue.push_back(cMoves[iClass]);
+   }
+   for (size_t iHead = 0; iHead < cQueue.size(); iHead++)
+   {
+      DWORD iState = cQueue[iHead];
+      DWORD iFail = cFail[iState];
+      cTags[iState] |= cTags[iFail];
+      for (size_t iClass = 0; iClass < nClasses; iClass++)
+      {
+         DWORD &iMove = cMoves[iState * nClasses + iClass];
+         DWORD iFailMove = cMoves[iFail * nClasses + iClass];
+         if (iMove != 0)
+         {
+            cFail[iMove] = iFailMove;
+            cQueue.push_back(iMove);
+         }
+         else
+         {
+            iMove = iFailMove;
+         }
+      }
+   }
+}
+
+//
+// Start:
+// Returns the state to start scanning a string from.
+//
+CSubstringSet::SCAN_STATE
+CSubstringSet::Start(void) const
+{
+   SCAN_STATE stScan;
+   stScan.iState = 0;
+   stScan.dwTags = 0;
+   return stScan;
+}
+
+//
+// Scan:
+// Scans some characters of a string, continuing from the given
+// state, and leaves the state at the end of them, so the scan
+// can be continued from there with the rest of the string.
+//
+void
+CSubstringSet::Scan(SCAN_STATE &stScan, const _TCHAR *pszText, size_t nLen) const
+{
+   if (cMoves.empty())
+      return;  // Nothing to find.
+
+   const DWORD *pMoves = &cMoves[0];
+   const DWORD *pTags = &cTags[0];
+   DWORD iState = stScan.iState;
+   DWORD dwTags = stScan.dwTags;
+   for (size_t i = 0; i < nLen; i++)
+   {
+      iState = pMoves[iState * nClasses + ClassOf(CharValue(pszText[i]))];
+      dwTags |= pTags[iState];
+   }
+   stScan.iState = iState;
+   stScan.dwTags = dwTags;
+}
+
+//
+// Find:
+// Scans a whole string, and returns the tags of the substrings
+// it contains, or 0 if it contains none of them.
+//
+DWORD
+CSubstringSet::Find(const _TCHAR *pszText) const
+{
+   SCAN_STATE stScan = Start();
+   Scan(stScan, pszText, _tcslen(pszText));
+   return stScan.dwTags;
+}
+
+//
+// ClassOf:
+// Returns the class of a character, or 0 if it isn't in any
+// of the substrings.
+//
+DWORD
+CSubstringSet::ClassOf(unsigned c) const
+{
+   if (c < WILD_TABLE_SIZE)
+      return cClass[c];
+
+   c = FoldChar(c);
+   std::vector<std::pair<unsigned, DWORD> >::const_iterator it =
+      std::lower_bound(cWideClass.begin(), cWideClass.end(), std::make_pair(c, static_cast<DWORD>(0)));
+   if (it != cWideClass.end() && it->first == c)
+      return it->second;
+   return 0;
+}
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CSubstringCursor
+//----------------------------------------------------------
+
+// Default constructor.
+CSubstringCursor::CSubstringCursor()
+{
+   pSet = NULL;
+}
+
+//
+// Find:
+// Returns the tags of the substrings in a set that the given
+// pathname contains, or 0 if it contains none of them.
+//
+DWORD
+CSubstringCursor::Find(const CSubstringSet &cSet, const _TCHAR *pszPath)
+{
+   // Start over if the set has changed.
+   if (pSet != &cSet || cMarks.empty())
+   {
+      pSet = &cSet;
+      sDir.clear();
+      cMarks.assign(1, std::make_pair(static_cast<size_t>(0), cSet.Start()));
+   }
+
+   // Find where the name starts.
+   size_t nLen = _tcslen(pszPath);
+   const _TCHAR *pLast = FindLastChar(pszPath, nLen, PATHSEP);
+   size_t nDir = (pLast == NULL) ? 0 : static_cast<size_t>(pLast - pszPath) + 1;
+
+   // Find how much of the directory part is the same as the
+   // last pathname's, and go back to the state at the last
+   // separator in that part.
+   size_t nSame = 0;
+   if (nDir == sDir.size() && memcmp(pszPath, sDir.c_str(), nDir * sizeof(_TCHAR)) == 0)
+   {
+      nSame = nDir;
+   }
+   else
+   {
+      size_t nMax = std::min(nDir, sDir.size());
+      while (nSame < nMax && pszPath[nSame] == sDir[nSame])
+         nSame++;
+   }
+   while (cMarks.back().first > nSame)
+      cMarks.pop_back();
+
+   // Scan the rest of the directory part, one name at a time.
+   size_t nPos = cMarks.back().first;
+   CSubstringSet::SCAN_STATE stScan = cMarks.back().second;
+   if (nPos < nDir)
+   {
+      sDir.resize(nPos);
+      sDir.append(pszPath + nPos, nDir - nPos);
+      while (nPos < nDir)
+      {
+         size_t nEnd = FindChar(pszPath + nPos, nDir - nPos, PATHSEP) - pszPath + 1;
+         cSet.Scan(stScan, pszPath + nPos, nEnd - nPos);
+         cMarks.push_back(std::make_pair(nEnd, stScan));
+         nPos = nEnd;
+      }
+   }
+   else
+   {
+      sDir.resize(nDir);
+   }
+
+   // Scan the name.
+   cSet.Scan(stScan, pszPath + nDir, nLen - nDir);
+   return stScan.dwTags;
+}
@@ -0,0 +1,172 @@
+//--------------------------------------------------------------------
+//
+// match.h
+//
+// C++ header for the classes that test pathnames against the sets
+// of patterns given on the command line.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#pragma once
+#ifndef __MATCH_H
+#define __MATCH_H
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "filetree.h"
+#include <vector>
+#include <utility>
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Characters below this value are looked up in a table by
+// CWildcardSet and CSubstringSet; the rest are checked against
+// each state, or looked up in a sorted list.
+#define WILD_TABLE_SIZE 256
+
+//----------------------------------------------------------
+// CLASSES
+//----------------------------------------------------------
+
+// Class to test strings against a set of wildcards, with the same
+// syntax as WildcardMatch:  '?' matches any one character, '*'
+// matches any series of characters, [x-y] and [abc...] match one
+// of the given characters, slash and backslash match each other,
+// and case doesn't matter.  Each wildcard is compiled when it's
+// added into a row of states, one for each character it matches,
+// and all the rows go side by side in one bit vector, so a string
+// is tested against every wildcard at once, in a single pass over
+// its characters.
+class CWildcardSet
+{
+public:
+   CWildcardSet();
+   void Clear(void);
+   bool Add(const _TCHAR *pszWild);
+   bool Matches(const _TCHAR *pszText) const;
+   bool Empty(void) const  { return nWilds == 0; }
+
+private:
+   typedef std::vector<std::pair<unsigned, unsigned> > RANGES;
+
+   size_t                  nWilds;     // Number of wildcards added.
+   size_t                  nStates;    // Number of state bits in use.
+   std::vector<ULONGLONG>  cStart;     // States active before the first character.
+   std::vector<ULONGLONG>  cFinal;     // States where a wildcard has matched.
+   std::vector<ULONGLONG>  cLoop;      // States that stay active on any character
+                                       // (the ones followed by '*').
+   std::vector<ULONGLONG>  cTable;     // For each word of states, the states that
+                                       // each character below WILD_TABLE_SIZE can
+                                       // move into from the state before them.
+   std::vector<RANGES>     cAccepts;   // The characters (in lower case) that move
+                                       // into each state, as ranges.
+
+   ULONGLONG CharMask(unsigned c, size_t iWord) const;
+};
+
+// Class to test strings for a set of substrings, with the same
+// syntax as SubstringMatch (case doesn't matter), but for all of
+// the substrings at once.  Each substring is added with some tag
+// bits, and a test returns the tags of all the substrings found.
+// Compile builds the substrings into one Aho-Corasick automaton,
+// with the failure links resolved into a table of moves, so a
+// string is tested in a single pass with one lookup for each of
+// its characters.  Compile must be called after the last Add,
+// and before the set is used.
+class CSubstringSet
+{
+public:
+   // Where a scan has got to.
+   typedef struct
+   {
+      DWORD       iState;        // State of the automaton.
+      DWORD       dwTags;        // Tags of the substrings found so far.
+   } SCAN_STATE;
+
+   CSubstringSet();
+   void Clear(void);
+   void Add(const _TCHAR *pszSub, DWORD dwTags);
+   void Compile(void);
+   bool Empty(void) const  { return cSubs.empty(); }
+   SCAN_STATE Start(void) const;
+   void Scan(SCAN_STATE &stScan, const _TCHAR *pszText, size_t nLen) const;
+   DWORD Find(const _TCHAR *pszText) const;
+
+private:
+   std::vector<std::pair<tstring, DWORD> > cSubs;  // Substrings (in lower case)
+                                                   // and their tags.
+   size_t                  nClasses;   // Number of character classes, one for
+                                       // each character in the substrings, and
+                                       // class 0 for all the other characters.
+   std::vector<DWORD>      cClass;     // Class of each character below
+                                       // WILD_TABLE_SIZE, in either case.
+   std::vector<std::pair<unsigned, DWORD> > cWideClass;  // Classes of the other
+                                       // characters in the substrings, sorted.
+   std::vector<DWORD>      cMoves;     // For each state, the state each class
+                                       // of character moves to.
+   std::vector<DWORD>      cTags;      // Tags of the substrings that end at
+                                       // each state.
+
+   DWORD ClassOf(unsigned c) const;
+};
+
+// Class to test the pathnames of the entries in a tree against
+// a CSubstringSet as the tree is walked.  The scan's state at
+// each separator of the last pathname is kept, so the next one
+// only scans the part after the directories the two have in
+// common; for entries in the same directory, that's just the
+// name.  Each thread needs its own cursor.
+class CSubstringCursor
+{
+public:
+   CSubstringCursor();
+   DWORD Find(const CSubstringSet &cSet, const _TCHAR *pszPath);
+
+private:
+   const CSubstringSet *pSet;    // Set the states below are for.
+   tstring        sDir;          // Last pathname, up to its last separator.
+   std::vector<std::pair<size_t, CSubstringSet::SCAN_STATE> > cMarks;
+                                 // States at the start of sDir and after
+                                 // each of its separators.
+};
+
+#endif //__MATCH_H
@@ -0,0 +1,294 @@
+//--------------------------------------------------------------------
+//
+// posix.cpp
+//
+// C++ code for the POSIX support functions declared in posix.h,
+// which let BCPY build and run natively on Linux and other POSIX
+// systems.
+//
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#ifndef _WIN32
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "posix.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Number of seconds between the FILETIME epoch (1601-01-01)
+// and the POSIX epoch (1970-01-01).
+#define EPOCH_DIFF_SECS    11644473600LL
+
+// Number of FILETIME ticks per second.
+#define TICKS_PER_SEC      10000000LL
+
+//----------------------------------------------------------
+// FUNCTIONS
+//----------------------------------------------------------
+
+//
+// _gettch:
+// Reads one keypress from the console, without waiting for
+// the enter key and without echoing it.  Returns the
+// character read, or EOF if error.
+//
+int
+_gettch(void)
+{
+   struct termios stOld, stNew;
+   if (tcgetattr(STDIN_FILENO, &stOld) != 0)
+      return getchar(); // Not a terminal; just read a character.
+
+   stNew = stOld;
+   stNew.c_lflag &= ~(ICANON | ECHO);
+   tcsetattr(STDIN_FILENO, TCSANOW, &stNew);
+   int c = getchar();
+   tcsetattr(STDIN_FILENO, TCSANOW, &stOld);
+   return c;
+}
+
+//
+// WallClock:
+// Returns the elapsed wall time since the program started,
+// in units of CLOCKS_PER_SEC, like clock() does on Windows.
+//
+clock_t
+WallClock(void)
+{
+   static struct timespec tsStart = { 0, 0 };
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   if (tsStart.tv_sec == 0 && tsStart.tv_nsec == 0)
+      tsStart = ts;
+   double dSecs = (double)(ts.tv_sec - tsStart.tv_sec) + (double)(ts.tv_nsec - tsStart.tv_nsec) / 1e9;
+   return (clock_t)(dSecs * CLOCKS_PER_SEC);
+}
+
+//
+// TimespecToFileTime:
+// Converts a native timestamp to a FILETIME.
+//
+void
+TimespecToFileTime(const struct timespec *pts, FILETIME *pft)
+{
+   uint64_t uTicks = (uint64_t)(pts->tv_sec + EPOCH_DIFF_SECS) * TICKS_PER_SEC +
+                     (uint64_t)(pts->tv_nsec / 100);
+   pft->dwLowDateTime = (DWORD)(uTicks & 0xFFFFFFFF);
+   pft->dwHighDateTime = (DWORD)(uTicks >> 32);
+}
+
+//
+// FileTimeToTimespec:
+// Converts a FILETIME to a native timestamp.
+//
+void
+FileTimeToTimespec(const FILETIME *pft, struct timespec *pts)
+{
+   uint64_t uTicks = ((uint64_t)pft->dwHighDateTime << 32) | pft->dwLowDateTime;
+   pts->tv_sec = (time_t)((int64_t)(uTicks / TICKS_PER_SEC) - EPOCH_DIFF_SECS);
+   pts->tv_nsec = (long)(uTicks % TICKS_PER_SEC) * 100;
+}
+
+//
+// FileTimeToSystemTime:
+// Converts a FILETIME to broken-down UTC calendar time.
+// Returns TRUE if successful, FALSE if the time couldn't
+// be represented.
+//
+BOOL
+FileTimeToSystemTime(const FILETIME *pft, SYSTEMTIME *pst)
+{
+   struct timespec ts;
+   struct tm tmTime;
+   FileTimeToTimespec(pft, &ts);
+   if (gmtime_r(&ts.tv_sec, &tmTime) == NULL)
+   {
+      memset(pst, 0, sizeof(SYSTEMTIME));
+      return FALSE;
+   }
+
+   pst->wYear = (WORD)(tmTime.tm_year + 1900);
+   pst->wMonth = (WORD)(tmTime.tm_mon + 1);
+   pst->wDayOfWeek = (WORD)tmTime.tm_wday;
+   pst->wDay = (WORD)tmTime.tm_mday;
+   pst->wHour = (WORD)tmTime.tm_hour;
+   pst->wMinute = (WORD)tmTime.tm_min;
+   pst->wSecond = (WORD)tmTime.tm_sec;
+   pst->wMilliseconds = (WORD)(ts.tv_nsec / 1000000);
+   return TRUE;
+}
+
+//
+// SystemTimeToFileTime:
+// Converts broken-down UTC calendar time to a FILETIME.
+// Returns FALSE if any of the fields are out of range.
+//
+BOOL
+SystemTimeToFileTime(const SYSTEMTIME *pst, FILETIME *pft)
+{
+   static const int aiDaysInMonth[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+   if (pst->wYear < 1601 || pst->wYear > 30827 ||
+       pst->wMonth < 1 || pst->wMonth > 12 ||
+       pst->wDay < 1 || pst->wDay > aiDaysInMonth[pst->wMonth - 1] ||
+       pst->wHour > 23 || pst->wMinute > 59 || pst->wSecond > 59 ||
+       pst->wMilliseconds > 999)
+   {
+      return FALSE;
+   }
+
+   struct tm tmTime;
+   memset(&tmTime, 0, sizeof(tmTime));
+   tmTime.tm_year = pst->wYear - 1900;
+   tmTime.tm_mon = pst->wMonth - 1;
+   tmTime.tm_mday = pst->wDay;
+   tmTime.tm_hour = pst->wHour;
+   tmTime.tm_min = pst->wMinute;
+   tmTime.tm_sec = pst->wSecond;
+   struct timespec ts;
+   ts.tv_sec = timegm(&tmTime);
+   ts.tv_nsec = (long)pst->wMilliseconds * 1000000;
+
+   // Reject February 29 in a year that doesn't have one,
+   // which timegm would have moved to March 1.
+   if (tmTime.tm_mday != pst->wDay)
+      return FALSE;
+
+   TimespecToFileTime(&ts, pft);
+   return TRUE;
+}
+
+//
+// GetSystemTimeAsFileTime:
+// Retrieves the current time (UTC) as a FILETIME.
+//
+void
+GetSystemTimeAsFileTime(FILETIME *pft)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   TimespecToFileTime(&ts, pft);
+}
+
+//
+// StatToAttributes:
+// Builds Win32-style attribute bits from a file's stat
+// information.  Files without owner write permission are
+// read-only, and names beginning with '.' are hidden, which
+// is the usual convention on POSIX systems.  Anything that
+// is neither a regular file nor a directory (devices, FIFOs,
+// sockets) is flagged as a system file.
+//
+DWORD
+StatToAttributes(const _TCHAR *pszName, const struct stat *pst)
+{
+   DWORD dwAttrib = 0;
+
+   if (S_ISDIR(pst->st_mode))
+      dwAttrib |= FILE_ATTRIBUTE_DIRECTORY;
+   else if (!S_ISREG(pst->st_mode))
+      dwAttrib |= FILE_ATTRIBUTE_SYSTEM;
+   if (!(pst->st_mode & S_IWUSR))
+      dwAttrib |= FILE_ATTRIBUTE_READONLY;
+   if (pszName != NULL && pszName[0] == '.')
+      dwAttrib |= FILE_ATTRIBUTE_HIDDEN;
+   if (dwAttrib == 0)
+      dwAttrib = FILE_ATTRIBUTE_NORMAL;
+
+   return dwAttrib;
+}
+
+//
+// GetFileAttributes:
+// Retrieves the attribute bits of a file or directory on
+// disk.  Returns INVALID_FILE_ATTRIBUTES if the file
+// doesn't exist or can't be examined.
+//
+DWORD
+GetFileAttributes(const _TCHAR *pszPath)
+{
+   struct stat st;
+   if (stat(pszPath, &st) != 0)
+      return INVALID_FILE_ATTRIBUTES;
+
+   const _TCHAR *pszName = strrchr(pszPath, '/');
+   pszName = (pszName == NULL) ? pszPath : pszName + 1;
+   return StatToAttributes(pszName, &st);
+}
+
+//
+// SetFileAttributes:
+// Changes the attributes of a file on disk.  POSIX systems
+// have no hidden or system bits, so only the read-only bit
+// is applied (by adding or removing write permission).
+// Returns TRUE if successful, FALSE if not.
+//
+BOOL
+SetFileAttributes(const _TCHAR *pszPath, DWORD dwAttrib)
+{
+   if (dwAttrib == INVALID_FILE_ATTRIBUTES)
+      return FALSE;
+
+   struct stat st;
+   if (stat(pszPath, &st) != 0)
+      return FALSE;
+
+   mode_t mode = st.st_mode & 07777;
+   if (dwAttrib & FILE_ATTRIBUTE_READONLY)
+      mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+   else
+      mode |= S_IWUSR;
+   if (mode == (st.st_mode & 07777))
+      return TRUE;   // Nothing to change.
+
+   return (chmod(pszPath, mode) == 0) ? TRUE : FALSE;
+}
+
+#endif //!_WIN32
+
@@ -0,0 +1,215 @@
+//--------------------------------------------------------------------
+//
+// posix.h
+//
+// C++ header file for building BCPY natively on Linux and other
+// POSIX systems.  Supplies the small subset of <tchar.h>, the
+// Microsoft "secure" CRT, and the Win32 types that the BCPY sources
+// use, mapped directly onto the native C library and system calls.
+// Nothing here is needed (or included) when building for Windows.
+//
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#pragma once
+#ifndef __POSIX_H
+#define __POSIX_H
+
+#ifndef _WIN32
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Character type mapping.  Linux filenames are byte strings
+// (normally UTF-8), so the POSIX build always uses the narrow
+// character functions, as <tchar.h> does when _UNICODE is not
+// defined.
+#define _T(x)           x
+#define _tcslen         strlen
+#define _tcscmp         strcmp
+#define _tcsicmp        strcasecmp
+#define _tcsnicmp       strncasecmp
+#define _tcsncmp        strncmp
+#define _totlower       tolower
+#define _istdigit       isdigit
+#define _tcschr         strchr
+#define _tcsrchr        strrchr
+#define _ttoi           atoi
+#define _tprintf        printf
+#define _ftprintf       fprintf
+#define _stprintf_s     snprintf
+#define _trmdir         rmdir
+#define _tunlink        unlink
+#define _trename        rename
+#define _tgetcwd        getcwd
+#define _tmkdir(p)      mkdir((p), 0777)
+
+// Win32 file attribute bits, as synthesized from struct stat
+// by GetFileAttributes and the directory scanner.
+#define FILE_ATTRIBUTE_READONLY     0x00000001
+#define FILE_ATTRIBUTE_HIDDEN       0x00000002
+#define FILE_ATTRIBUTE_SYSTEM       0x00000004
+#define FILE_ATTRIBUTE_DIRECTORY    0x00000010
+#define FILE_ATTRIBUTE_ARCHIVE      0x00000020
+#define FILE_ATTRIBUTE_NORMAL       0x00000080
+#define INVALID_FILE_ATTRIBUTES     ((DWORD)-1)
+
+#ifndef TRUE
+#define TRUE   1
+#endif
+#ifndef FALSE
+#define FALSE  0
+#endif
+
+//----------------------------------------------------------
+// TYPES
+//----------------------------------------------------------
+
+typedef char         _TCHAR;
+typedef unsigned char _TUCHAR;
+typedef uint32_t     DWORD;
+typedef uint16_t     WORD;
+typedef int          BOOL;
+typedef unsigned long long ULONGLONG;
+
+// Timestamp in 100 nanosecond units since January 1, 1601 (UTC),
+// laid out the same way as the Win32 structure.
+typedef struct
+{
+   DWORD    dwLowDateTime;
+   DWORD    dwHighDateTime;
+} FILETIME;
+
+// Broken-down calendar time (UTC), as returned by
+// FileTimeToSystemTime.
+typedef struct
+{
+   WORD     wYear;
+   WORD     wMonth;
+   WORD     wDayOfWeek;
+   WORD     wDay;
+   WORD     wHour;
+   WORD     wMinute;
+   WORD     wSecond;
+   WORD     wMilliseconds;
+} SYSTEMTIME;
+
+//----------------------------------------------------------
+// FUNCTIONS
+//----------------------------------------------------------
+
+// Copies a string into a buffer of the given size.
+// Returns zero if successful, or an error number if the
+// string didn't fit (in which case the buffer is emptied).
+inline int
+_tcscpy_s(_TCHAR *pszDest, size_t nSize, const _TCHAR *pszSrc)
+{
+   size_t nLen = strlen(pszSrc);
+   if (nLen >= nSize)
+   {
+      if (nSize > 0)
+         pszDest[0] = '\0';
+      return ERANGE;
+   }
+   memcpy(pszDest, pszSrc, nLen + 1);
+   return 0;
+}
+
+// Appends a string to the string in a buffer of the given size.
+// Returns zero if successful, or an error number if the result
+// didn't fit (in which case the buffer is emptied).
+inline int
+_tcscat_s(_TCHAR *pszDest, size_t nSize, const _TCHAR *pszSrc)
+{
+   size_t nDest = strnlen(pszDest, nSize);
+   if (nDest >= nSize)
+      return EINVAL;
+   return _tcscpy_s(pszDest + nDest, nSize - nDest, pszSrc);
+}
+
+// Opens a stdio stream.  Returns zero if successful, or an
+// error number if not.
+inline int
+_tfopen_s(FILE **ppFile, const _TCHAR *pszName, const _TCHAR *pszMode)
+{
+   *ppFile = fopen(pszName, pszMode);
+   return (*ppFile == NULL) ? errno : 0;
+}
+
+// Reads a single keypress from the console without echo.
+int _gettch(void);
+
+// clock() measures elapsed wall time on Windows, but processor
+// time (summed over all threads) on POSIX systems.  BCPY times
+// things with WallClock instead, which has the Windows behavior.
+clock_t WallClock(void);
+
+// Converts between native timestamps and FILETIMEs.
+void TimespecToFileTime(const struct timespec *pts, FILETIME *pft);
+void FileTimeToTimespec(const FILETIME *pft, struct timespec *pts);
+BOOL FileTimeToSystemTime(const FILETIME *pft, SYSTEMTIME *pst);
+BOOL SystemTimeToFileTime(const SYSTEMTIME *pst, FILETIME *pft);
+void GetSystemTimeAsFileTime(FILETIME *pft);
+
+// Builds Win32-style attribute bits for a file from its name and
+// stat information.
+DWORD StatToAttributes(const _TCHAR *pszName, const struct stat *pst);
+
+// Retrieves or changes the attributes of a file on disk.
+// Only the read-only bit can be changed on POSIX systems.
+DWORD GetFileAttributes(const _TCHAR *pszPath);
+BOOL SetFileAttributes(const _TCHAR *pszPath, DWORD dwAttrib);
+
+#endif //!_WIN32
+
+#endif //__POSIX_H
+
@@ -0,0 +1,582 @@
+//--------------------------------------------------------------------
+//
+// strkern.cpp
+//
+// C++ code for the string functions used on pathnames and names in
+// the hot paths of the BCPY program, with vectorized versions for
+// processors that support them.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "strkern.h"
+#include <string.h>
+
+// The vectorized versions need SSE2, which every x86-64
+// processor has; AVX2 is checked for when the program starts.
+// Wide characters are vectorized only where they're 16 bits.
+#if (defined(__x86_64__) || defined(_M_X64)) && (!defined(_UNICODE) || defined(_WIN32))
+#define STRKERN_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+#ifdef STRKERN_X86
+
+// Marks a function to be compiled for AVX2.  Visual C++
+// doesn't need this to use the AVX2 intrinsics.
+#if defined(__GNUC__) || defined(__clang__)
+#define AVX2_FUNC __attribute__((target("avx2")))
+#else
+#define AVX2_FUNC
+#endif
+
+// Operations on each character in a vector, for the width of
+// _TCHAR.
+#ifdef _UNICODE
+#define SSE_SET1(c)        _mm_set1_epi16(static_cast<short>(c))
+#define SSE_CMPEQ(a, b)    _mm_cmpeq_epi16(a, b)
+#define SSE_CMPGT(a, b)    _mm_cmpgt_epi16(a, b)
+#define SSE_ADD(a, b)      _mm_add_epi16(a, b)
+#define AVX_SET1(c)        _mm256_set1_epi16(static_cast<short>(c))
+#define AVX_CMPEQ(a, b)    _mm256_cmpeq_epi16(a, b)
+#define AVX_CMPGT(a, b)    _mm256_cmpgt_epi16(a, b)
+#define AVX_ADD(a, b)      _mm256_add_epi16(a, b)
+#else
+#define SSE_SET1(c)        _mm_set1_epi8(static_cast<char>(c))
+#define SSE_CMPEQ(a, b)    _mm_cmpeq_epi8(a, b)
+#define SSE_CMPGT(a, b)    _mm_cmpgt_epi8(a, b)
+#define SSE_ADD(a, b)      _mm_add_epi8(a, b)
+#define AVX_SET1(c)        _mm256_set1_epi8(static_cast<char>(c))
+#define AVX_CMPEQ(a, b)    _mm256_cmpeq_epi8(a, b)
+#define AVX_CMPGT(a, b)    _mm256_cmpgt_epi8(a, b)
+#define AVX_ADD(a, b)      _mm256_add_epi8(a, b)
+#endif
+
+// Number of characters in each size of vector.
+#define SSE_CHARS          (16 / sizeof(_TCHAR))
+#define AVX_CHARS          (32 / sizeof(_TCHAR))
+
+#endif //STRKERN_X86
+
+//----------------------------------------------------------
+// TYPES
+//----------------------------------------------------------
+
+// The versions of the functions to use on this processor.
+typedef struct
+{
+   const _TCHAR *pszName;
+   size_t (*pMismatchNoCase)(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen);
+   void (*pFoldCase)(_TCHAR *pszDest, const _TCHAR *pszSrc, size_t nLen);
+   const _TCHAR *(*pFindChar)(const _TCHAR *psz, size_t nLen, _TCHAR c);
+   const _TCHAR *(*pFindLastChar)(const _TCHAR *psz, size_t nLen, _TCHAR c);
+} STRING_KERNELS;
+
+//----------------------------------------------------------
+// LOCAL FUNCTIONS
+//----------------------------------------------------------
+
+//
+// FoldAscii:
+// Returns a character in lower case, if it's an ASCII letter.
+//
+static inline unsigned
+FoldAscii(_TCHAR c)
+{
+#ifdef _UNICODE
+   unsigned u = static_cast<unsigned>(c);
+#else
+   unsigned u = static_cast<unsigned char>(c);
+#endif
+   return (u >= 'A' && u <= 'Z') ? u + ('a' - 'A') : u;
+}
+
+//
+// ScalarMismatchNoCase:
+// One character at a time version of MismatchNoCase.
+//
+static size_t
+ScalarMismatchNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen)
+{
+   for (size_t i = 0; i < nLen; i++)
+   {
+      if (psz1[i] != psz2[i] && FoldAscii(psz1[i]) != FoldAscii(psz2[i]))
+         return i;
+   }
+   return nLen;
+}
+
+//
+// ScalarFoldCase:
+// One character at a time version of FoldCase.
+//
+static void
+ScalarFoldCase(_TCHAR *pszDest, const _TCHAR *pszSrc, size_t nLen)
+{
+   for (size_t i = 0; i < nLen; i++)
+      pszDest[i] = static_cast<_TCHAR>(FoldAscii(pszSrc[i]));
+}
+
+//
+// ScalarFindChar:
+// One character at a time version of FindChar.
+//
+static const _TCHAR *
+ScalarFindChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   for (size_t i = 0; i < nLen; i++)
+   {
+      if (psz[i] == c)
+         return psz + i;
+   }
+   return NULL;
+}
+
+//
+// ScalarFindLastChar:
+// One character at a time version of FindLastChar.
+//
+static const _TCHAR *
+ScalarFindLastChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   while (nLen > 0)
+   {
+      nLen--;
+      if (psz[nLen] == c)
+         return psz + nLen;
+   }
+   return NULL;
+}
+
+#ifdef STRKERN_X86
+
+//
+// LowBit:
+// Returns the number of the lowest bit set in a non-zero mask.
+//
+static inline unsigned
+LowBit(unsigned uMask)
+{
+#ifdef _MSC_VER
+   unsigned long ulBit;
+   _BitScanForward(&ulBit, uMask);
+   return ulBit;
+#else
+   return __builtin_ctz(uMask);
+#endif
+}
+
+//
+// HighBit:
+// Returns the number of the highest bit set in a non-zero mask.
+//
+static inline unsigned
+HighBit(unsigned uMask)
+{
+#ifdef _MSC_VER
+   unsigned long ulBit;
+   _BitScanReverse(&ulBit, uMask);
+   return ulBit;
+#else
+   return 31 - __builtin_clz(uMask);
+#endif
+}
+
+//
+// SseFold:
+// Changes the ASCII upper case letters in a vector to lower
+// case.  The compares are signed, so characters above 0x7F
+// (in the width of _TCHAR) are never taken for letters.
+//
+static inline __m128i
+SseFold(__m128i v)
+{
+   __m128i vUpper = _mm_and_si128(SSE_CMPGT(v, SSE_SET1('A' - 1)), SSE_CMPGT(SSE_SET1('Z' + 1), v));
+   return SSE_ADD(v, _mm_and_si128(vUpper, SSE_SET1('a' - 'A')));
+}
+
+//
+// SseMismatchNoCase:
+// SSE2 version of MismatchNoCase.
+//
+static size_t
+SseMismatchNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen)
+{
+   size_t i = 0;
+   for (; i + SSE_CHARS <= nLen; i += SSE_CHARS)
+   {
+      __m128i v1 = SseFold(_mm_loadu_si128(reinterpret_cast<const __m128i *>(psz1 + i)));
+      __m128i v2 = SseFold(_mm_loadu_si128(reinterpret_cast<const __m128i *>(psz2 + i)));
+      unsigned uSame = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)));
+      if (uSame != 0xFFFF)
+         return i + LowBit(~uSame & 0xFFFF) / sizeof(_TCHAR);
+   }
+   return i + ScalarMismatchNoCase(psz1 + i, psz2 + i, nLen - i);
+}
+
+//
+// SseFoldCase:
+// SSE2 version of FoldCase.
+//
+static void
+SseFoldCase(_TCHAR *pszDest, const _TCHAR *pszSrc, size_t nLen)
+{
+   size_t i = 0;
+   for (; i + SSE_CHARS <= nLen; i += SSE_CHARS)
+   {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pszSrc + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(pszDest + i), SseFold(v));
+   }
+   ScalarFoldCase(pszDest + i, pszSrc + i, nLen - i);
+}
+
+//
+// SseFindChar:
+// SSE2 version of FindChar.
+//
+static const _TCHAR *
+SseFindChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   __m128i vChar = SSE_SET1(c);
+   size_t i = 0;
+   for (; i + SSE_CHARS <= nLen; i += SSE_CHARS)
+   {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(psz + i));
+      unsigned uFound = static_cast<unsigned>(_mm_movemask_epi8(SSE_CMPEQ(v, vChar)));
+      if (uFound != 0)
+         return psz + i + LowBit(uFound) / sizeof(_TCHAR);
+   }
+   return ScalarFindChar(psz + i, nLen - i, c);
+}
+
+//
+// SseFindLastChar:
+// SSE2 version of FindLastChar.
+//
+static const _TCHAR *
+SseFindLastChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   __m128i vChar = SSE_SET1(c);
+   for (; nLen >= SSE_CHARS; nLen -= SSE_CHARS)
+   {
+      const _TCHAR *p = psz + nLen - SSE_CHARS;
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      unsigned uFound = static_cast<unsigned>(_mm_movemask_epi8(SSE_CMPEQ(v, vChar)));
+      if (uFound != 0)
+         return p + HighBit(uFound) / sizeof(_TCHAR);
+   }
+   return ScalarFindLastChar(psz, nLen, c);
+}
+
+//
+// AvxFold:
+// AVX2 version of SseFold.
+//
+AVX2_FUNC static inline __m256i
+AvxFold(__m256i v)
+{
+   __m256i vUpper = _mm256_and_si256(AVX_CMPGT(v, AVX_SET1('A' - 1)), AVX_CMPGT(AVX_SET1('Z' + 1), v));
+   return AVX_ADD(v, _mm256_and_si256(vUpper, AVX_SET1('a' - 'A')));
+}
+
+//
+// AvxMismatchNoCase:
+// AVX2 version of MismatchNoCase.  The last part that's too
+// short for a whole vector is left to the SSE2 version.
+//
+AVX2_FUNC static size_t
+AvxMismatchNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen)
+{
+   size_t i = 0;
+   for (; i + AVX_CHARS <= nLen; i += AVX_CHARS)
+   {
+      __m256i v1 = AvxFold(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(psz1 + i)));
+      __m256i v2 = AvxFold(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(psz2 + i)));
+      unsigned uSame = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2)));
+      if (uSame != 0xFFFFFFFF)
+         return i + LowBit(~uSame) / sizeof(_TCHAR);
+   }
+   return i + SseMismatchNoCase(psz1 + i, psz2 + i, nLen - i);
+}
+
+//
+// AvxFoldCase:
+// AVX2 version of FoldCase.
+//
+AVX2_FUNC static void
+AvxFoldCase(_TCHAR *pszDest, const _TCHAR *pszSrc, size_t nLen)
+{
+   size_t i = 0;
+   for (; i + AVX_CHARS <= nLen; i += AVX_CHARS)
+   {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pszSrc + i));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(pszDest + i), AvxFold(v));
+   }
+   SseFoldCase(pszDest + i, pszSrc + i, nLen - i);
+}
+
+//
+// AvxFindChar:
+// AVX2 version of FindChar.
+//
+AVX2_FUNC static const _TCHAR *
+AvxFindChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   __m256i vChar = AVX_SET1(c);
+   size_t i = 0;
+   for (; i + AVX_CHARS <= nLen; i += AVX_CHARS)
+   {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(psz + i));
+      unsigned uFound = static_cast<unsigned>(_mm256_movemask_epi8(AVX_CMPEQ(v, vChar)));
+      if (uFound != 0)
+         return psz + i + LowBit(uFound) / sizeof(_TCHAR);
+   }
+   return SseFindChar(psz + i, nLen - i, c);
+}
+
+//
+// AvxFindLastChar:
+// AVX2 version of FindLastChar.
+//
+AVX2_FUNC static const _TCHAR *
+AvxFindLastChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   __m256i vChar = AVX_SET1(c);
+   for (; nLen >= AVX_CHARS; nLen -= AVX_CHARS)
+   {
+      const _TCHAR *p = psz + nLen - AVX_CHARS;
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+      unsigned uFound = static_cast<unsigned>(_mm256_movemask_epi8(AVX_CMPEQ(v, vChar)));
+      if (uFound != 0)
+         return p + HighBit(uFound) / sizeof(_TCHAR);
+   }
+   return SseFindLastChar(psz, nLen, c);
+}
+
+//
+// HasAvx2:
+// Determines if the processor and operating system support
+// AVX2.
+//
+static bool
+HasAvx2(void)
+{
+#ifdef _MSC_VER
+   int aiInfo[4];
+   __cpuid(aiInfo, 0);
+   if (aiInfo[0] < 7)
+      return false;
+
+   // The OS must save the AVX registers (OSXSAVE and XCR0).
+   __cpuid(aiInfo, 1);
+   if ((aiInfo[2] & (1 << 27)) == 0 || (aiInfo[2] & (1 << 28)) == 0)
+      return false;
+   if ((_xgetbv(0) & 6) != 6)
+      return false;
+
+   __cpuidex(aiInfo, 7, 0);
+   return (aiInfo[1] & (1 << 5)) != 0;
+#else
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif //STRKERN_X86
+
+//
+// ChooseKernels:
+// Picks the fastest versions of the functions that this
+// processor supports.
+//
+static STRING_KERNELS
+ChooseKernels(void)
+{
+   STRING_KERNELS stKernels;
+#ifdef STRKERN_X86
+   if (HasAvx2())
+   {
+      stKernels.pszName = _T("AVX2");
+      stKernels.pMismatchNoCase = AvxMismatchNoCase;
+      stKernels.pFoldCase = AvxFoldCase;
+      stKernels.pFindChar = AvxFindChar;
+      stKernels.pFindLastChar = AvxFindLastChar;
+   }
+   else
+   {
+      stKernels.pszName = _T("SSE2");
+      stKernels.pMismatchNoCase = SseMismatchNoCase;
+      stKernels.pFoldCase = SseFoldCase;
+      stKernels.pFindChar = SseFindChar;
+      stKernels.pFindLastChar = SseFindLastChar;
+   }
+#else
+   stKernels.pszName = _T("scalar");
+   stKernels.pMismatchNoCase = ScalarMismatchNoCase;
+   stKernels.pFoldCase = ScalarFoldCase;
+   stKernels.pFindChar = ScalarFindChar;
+   stKernels.pFindLastChar = ScalarFindLastChar;
+#endif
+   return stKernels;
+}
+
+//
+// Kernels:
+// Returns the versions of the functions to use, which are
+// picked the first time they're needed.
+//
+static inline const STRING_KERNELS &
+Kernels(void)
+{
+   static const STRING_KERNELS stKernels = ChooseKernels();
+   return stKernels;
+}
+
+//----------------------------------------------------------
+// FUNCTIONS
+//----------------------------------------------------------
+
+//
+// MismatchNoCase:
+// Compares the first nLen characters of two strings, ignoring
+// case.  Returns the position of the first character that's
+// different, or nLen if they're all the same.
+//
+size_t
+MismatchNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen)
+{
+   return Kernels().pMismatchNoCase(psz1, psz2, nLen);
+}
+
+//
+// EqualNoCase:
+// Determines if the first nLen characters of two strings are
+// the same, ignoring case.
+//
+bool
+EqualNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen)
+{
+   return Kernels().pMismatchNoCase(psz1, psz2, nLen) == nLen;
+}
+
+//
+// StartsWithNoCase:
+// Determines if a string starts with the given prefix,
+// ignoring case.
+//
+bool
+StartsWithNoCase(const _TCHAR *pszText, size_t nTextLen, const _TCHAR *pszPrefix, size_t nPrefixLen)
+{
+   if (nTextLen < nPrefixLen)
+      return false;
+   return Kernels().pMismatchNoCase(pszText, pszPrefix, nPrefixLen) == nPrefixLen;
+}
+
+//
+// CompareNoCase:
+// Compares two strings, ignoring case, for sorting.  Returns
+// less than, equal to, or greater than zero, the same way
+// _tcsicmp does.
+//
+int
+CompareNoCase(const _TCHAR *psz1, size_t nLen1, const _TCHAR *psz2, size_t nLen2)
+{
+   size_t nLen = (nLen1 < nLen2) ? nLen1 : nLen2;
+   size_t i = Kernels().pMismatchNoCase(psz1, psz2, nLen);
+   if (i < nLen)
+      return (FoldAscii(psz1[i]) < FoldAscii(psz2[i])) ? -1 : 1;
+   if (nLen1 != nLen2)
+      return (nLen1 < nLen2) ? -1 : 1;
+   return 0;
+}
+
+//
+// FoldCase:
+// Copies nLen characters of a string, changing the ASCII
+// letters to lower case.  The source and destination can be
+// the same.
+//
+void
+FoldCase(_TCHAR *pszDest, const _TCHAR *pszSrc, size_t nLen)
+{
+   Kernels().pFoldCase(pszDest, pszSrc, nLen);
+}
+
+//
+// FindChar:
+// Finds the first occurrence of a character in the first nLen
+// characters of a string.  Returns NULL if it isn't there.
+//
+const _TCHAR *
+FindChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   return Kernels().pFindChar(psz, nLen, c);
+}
+
+//
+// FindLastChar:
+// Finds the last occurrence of a character in the first nLen
+// characters of a string.  Returns NULL if it isn't there.
+//
+const _TCHAR *
+FindLastChar(const _TCHAR *psz, size_t nLen, _TCHAR c)
+{
+   return Kernels().pFindLastChar(psz, nLen, c);
+}
+
+//
+// StringKernelName:
+// Returns the name of the versions of the string functions
+// in use ("AVX2", "SSE2", or "scalar").
+//
+const _TCHAR *
+StringKernelName(void)
+{
+   return Kernels().pszName;
+}
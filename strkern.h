@@ -0,0 +1,78 @@
+//--------------------------------------------------------------------
+//
+// strkern.h
+//
+// C++ header for the string functions used on pathnames and names
+// in the hot paths of the BCPY program, with vectorized versions
+// for processors that support them.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#pragma once
+#ifndef __STRKERN_H
+#define __STRKERN_H
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <tchar.h>
+#else
+#include "posix.h"
+#endif
+
+//----------------------------------------------------------
+// FUNCTIONS
+//----------------------------------------------------------
+
+// All of these work on strings of known length, which don't
+// have to be nul-terminated, and never look past the given
+// length.  Case is ignored only for the ASCII letters, the
+// same way _tcsicmp does in the "C" locale.
+size_t MismatchNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen);
+bool EqualNoCase(const _TCHAR *psz1, const _TCHAR *psz2, size_t nLen);
+bool StartsWithNoCase(const _TCHAR *pszText, size_t nTextLen, const _TCHAR *pszPrefix, size_t nPrefixLen);
+int CompareNoCase(const _TCHAR *psz1, size_t nLen1, const _TCHAR *psz2, size_t nLen2);
+void FoldCase(_TCHAR *pszDest, const _TCHAR *pszSrc, size_t nLen);
+const _TCHAR *FindChar(const _TCHAR *psz, size_t nLen, _TCHAR c);
+const _TCHAR *FindLastChar(const _TCHAR *psz, size_t nLen, _TCHAR c);
+const _TCHAR *StringKernelName(void);
+
+#endif //__STRKERN_H
@@ -0,0 +1,59 @@
+#!/bin/sh
+#-----------------------------------------------------------------------
+# Stress check for /COPYTHREADS.  Builds a source tree of many small
+# files and a few multi-chunk ones, copies it several times with a
+# pool of copy threads, and compares the result with diff -r.  Also
+# checks /VERIFY and /MOVE against a reference copy of the source.
+#
+# Usage: tests/copythreads.sh [path-to-bcpy] [rounds]
+#-----------------------------------------------------------------------
+
+BCPY=${1:-./bcpy}
+ROUNDS=${2:-10}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/bcpy-check.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+fail()
+{
+   echo "FAIL: $*"
+   exit 1
+}
+
+# Source tree: 300 small files with distinct contents in 10
+# directories, plus a few files spanning several copy buffers.
+for d in a b c d e f g h i j; do
+   mkdir -p "$WORK/src/$d/sub"
+   n=0
+   while [ $n -lt 30 ]; do
+      echo "$d $n" > "$WORK/src/$d/f$n.txt"
+      n=$((n + 1))
+   done
+   head -c 300000 /dev/urandom > "$WORK/src/$d/sub/big.bin"
+done
+cp -R "$WORK/src" "$WORK/ref"
+
+round=1
+while [ $round -le "$ROUNDS" ]; do
+   rm -rf "$WORK/dst"
+   "$BCPY" -Q -COPYTHREADS=8 -VERIFY "$WORK/src" "$WORK/dst" > "$WORK/out.txt" 2>&1 ||
+      fail "copy round $round exited with an error"
+   diff -r "$WORK/src" "$WORK/dst" > /dev/null ||
+      fail "copy round $round produced different contents"
+   round=$((round + 1))
+done
+
+# Verification must catch a changed file.
+echo "changed" > "$WORK/dst/c/f3.txt"
+"$BCPY" -Q -COPYTHREADS=8 -VERIFY -UPDATE "$WORK/src" "$WORK/dst" > /dev/null 2>&1
+diff -r "$WORK/src" "$WORK/dst" > /dev/null ||
+   fail "update with verify left different contents"
+
+# Moving deletes the source, so compare against the reference.
+rm -rf "$WORK/dst"
+"$BCPY" -Q -COPYTHREADS=8 -MOVE "$WORK/src" "$WORK/dst" > /dev/null 2>&1 ||
+   fail "move exited with an error"
+diff -r "$WORK/ref" "$WORK/dst" > /dev/null ||
+   fail "move produced different contents"
+
+echo "PASS: $ROUNDS rounds of threaded copies match the source"
+exit 0
@@ -47,15 +47,25 @@
 //----------------------------------------------------------
 
 #include "util.h"
+#include "strkern.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <vector>
+#ifdef _WIN32
 #include <conio.h>
 #include <direct.h>
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 //----------------------------------------------------------
 // MACROS
@@ -87,23 +97,17 @@
 bool
 SubstringMatch(const _TCHAR *pszSub, const _TCHAR *pszText)
 {
-   // Compare at each character in the string.
-   while (*pszText != '\0')
-   {
-      // Check if not enough characters left to make a match.
-      if (_tcslen(pszText) < _tcslen(pszSub))
-         return false;  // Not enough characters left.
-
-      // If first character matches...
-      if (tolower(*pszText) == tolower(*pszSub))
-      {
-         // Is this a match?
-         if (_tcsnicmp(pszSub, pszText, _tcslen(pszSub)) == 0)
-            return true;   // Yes!
-      }
+   size_t nSub = _tcslen(pszSub);
+   size_t nText = _tcslen(pszText);
+   if (nSub == 0)
+      return false;
 
-      // Try the next character.
-      pszText++;
+   // Compare at each character in the string, until there
+   // aren't enough characters left to make a match.
+   for (size_t i = 0; i + nSub <= nText; i++)
+   {
+      if (EqualNoCase(pszText + i, pszSub, nSub))
+         return true;   // Yes!
    }
 
    // Substring not found in string.
@@ -353,41 +357,42 @@ DirExists(const _TCHAR *pszPath)
 bool
 MakeDir(const _TCHAR *pszPath)
 {
-   _TCHAR szDir[MAX_PATH];
-   int iPos = 0;
+   // Work on a copy of the path, which is cut short after each
+   // segment in turn.  There's no limit on its length.
+   size_t nLen = _tcslen(pszPath);
+   std::vector<_TCHAR> cDir(pszPath, pszPath + nLen + 1);
+   size_t nPos = 0;
 
    // Process each segment of the path.
-   const _TCHAR *p = pszPath;
-   while (*p != '\0')
+   while (nPos < nLen)
    {
-      // Eat the backslash, if any.
-      if (*p == '\\')
-      {
-         szDir[iPos++] = *p++;
-         szDir[iPos] = '\0';
-      }
+      // Eat the separator, if any.
+      if (cDir[nPos] == PATHSEP)
+         nPos++;
 
       // Extract path segment.
-      while (*p != '\0' && *p != '\\')
-      {
-         szDir[iPos++] = *p++;
-         szDir[iPos] = '\0';
-      }
+      while (nPos < nLen && cDir[nPos] != PATHSEP)
+         nPos++;
+      _TCHAR ch = cDir[nPos];
+      cDir[nPos] = '\0';
 
-      if (!DirExists(szDir))
+      if (!DirExists(&cDir[0]))
       {
          // Make it.
-         if (_tmkdir(szDir))
+         if (_tmkdir(&cDir[0]))
          {
             // Failed!
             return false;
          }
       }
+      cDir[nPos] = ch;
    }
 
    return true;
 }
 
+#ifdef _WIN32
+
 //
 // RawCopyFileWin32:
 // Creates a copy of a file on disk.  This function copies
@@ -464,8 +469,10 @@ RawCopyFileWin32(
       return -2;
    }
 
-   // Temp storage for file copying.
-   static char pBuffer[65536];
+   // Temp storage for file copying.  Allocated per call, since
+   // several copy threads may be in here at the same time.
+   std::vector<char> cBuffer(65536);
+   char *pBuffer = &cBuffer[0];
 
    // Start status display, if status function given.
    if (pFunc != NULL)
@@ -547,6 +554,198 @@ RawCopyFileWin32(
    return 0;
 }
 
+#else
+
+//
+// RawCopyFilePosix:
+// Creates a copy of a file on disk using native POSIX I/O.
+// This function copies only the contents of the file (the
+// new file is created with the source file's permission
+// bits), not the timestamps.
+//
+// Optionally accepts a status callback function and context
+// pointer, in which case the callback function is called
+// periodically so the caller can update a status display
+// during the compare operation.  If the callback function
+// returns false, the operation is aborted.
+//
+// Returns:
+//    0 = successful.
+//   -1 = Failed opening file for read.
+//   -2 = Failed opening file for write.
+//   -3 = Failed writing file.
+//   -4 = Failed reading file.
+//   -5 = Status function returned false.
+//
+int
+RawCopyFilePosix(
+   const _TCHAR *pszSrc,      // File to copy from.
+   const _TCHAR *pszDest,     // File to copy to.
+   double *pdCopied,          // Pointer to variable to receive count of bytes copied.
+   bool bLowPriority,         // True if code should allow other processes to run between file chunks read.
+   bool (*pFunc)(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double dBytesCopied, double dFileSize), // Pointer to status callback function.  May be NULL.
+   void *pContext             // Pointer to context pointer for status callback function.  May be NULL.
+   )
+{
+   double dTotalBytes = 0;    // Keep track of how many bytes copied.
+
+   // Open the input file.
+   int fdIn = open(pszSrc, O_RDONLY);
+   if (fdIn < 0)
+   {
+      // Failed opening file for reading.
+      return -1;
+   }
+
+   // Determine size and permissions of input file.
+   struct stat st;
+   if (fstat(fdIn, &st) != 0)
+   {
+      // Failed getting file size!
+      close(fdIn);
+      return -1;
+   }
+   double dFileLength = (double)st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+   posix_fadvise(fdIn, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   // Open the output file.
+   int fdOut = open(pszDest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+   if (fdOut < 0)
+   {
+      // Failed opening file for write.
+      close(fdIn);
+      return -2;
+   }
+
+   // Temp storage for file copying.  Allocated per call, since
+   // several copy threads may be in here at the same time.
+   std::vector<char> cBuffer(65536);
+   char *pBuffer = &cBuffer[0];
+
+   // Start status display, if status function given.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, pszSrc, pszDest, dTotalBytes, dFileLength))
+      {
+         close(fdIn);
+         close(fdOut);
+         return -5; // Progress function wants to abort.
+      }
+   }
+
+   // Read chunks until we've done the whole file.
+   ssize_t iBytes = 0;
+   while ((iBytes = read(fdIn, pBuffer, cBuffer.size())) != 0)
+   {
+      if (iBytes < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         break;   // Read error; caught by the size check below.
+      }
+
+      // Write the chunk we just read out to the output file.
+      ssize_t iDone = 0;
+      while (iDone < iBytes)
+      {
+         ssize_t iWrote = write(fdOut, pBuffer + iDone, iBytes - iDone);
+         if (iWrote < 0 && errno == EINTR)
+            continue;
+         if (iWrote <= 0)
+         {
+            // Failed writing to output file!
+            close(fdIn);
+            close(fdOut);
+            _tunlink(pszDest);
+            return -3;
+         }
+         iDone += iWrote;
+      }
+
+      // Update total count of bytes copied.
+      dTotalBytes += (double)iBytes;
+
+      // Update status display.
+      // Note that this is called very frequently, so the caller
+      // may not want to update a display on _every_ callback.
+      if (pFunc != NULL)
+      {
+         if (!pFunc(pContext, pszSrc, pszDest, dTotalBytes, dFileLength))
+         {
+            close(fdIn);
+            close(fdOut);
+            _tunlink(pszDest);
+            return -5; // Progress function wants to abort.
+         }
+      }
+
+      // Let other threads run.
+      if (bLowPriority)
+         sched_yield();
+   }
+
+   // Finish status display, if status function given.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, pszSrc, pszDest, dTotalBytes, dFileLength))
+      {
+         close(fdIn);
+         close(fdOut);
+         _tunlink(pszDest);
+         return -5; // Progress function wants to abort.
+      }
+   }
+
+   // Close files.  Errors from delayed writes show up here.
+   close(fdIn);
+   if (close(fdOut) != 0)
+   {
+      _tunlink(pszDest);
+      return -3;
+   }
+
+   // Make sure the whole file was read.
+   if (dTotalBytes != dFileLength)
+   {
+      // Read error!
+      _tunlink(pszDest);
+      return -4;
+   }
+
+   // If caller wants count of bytes copied.
+   if (pdCopied != NULL)
+      *pdCopied = dTotalBytes;
+
+   // No error.
+   return 0;
+}
+
+//
+// CopyFileTimesPosix:
+// Sets the access and modification times of a file to
+// match those of another file.
+// Returns true if successful, false if error.
+//
+bool
+CopyFileTimesPosix(const _TCHAR *pszSrc, const _TCHAR *pszDest)
+{
+   struct stat st;
+   if (stat(pszSrc, &st) != 0)
+      return false;
+
+   struct timespec ts[2];
+   ts[0] = st.st_atim;
+   ts[1] = st.st_mtim;
+   if (utimensat(AT_FDCWD, pszDest, ts, 0) != 0)
+      return false;
+
+   return true;
+}
+
+#endif //_WIN32
+
 //
 // RawCopyFile:
 // Creates a copy of a file on disk.  This function copies
@@ -602,8 +801,10 @@ RawCopyFile(
       return -2;
    }
 
-   // Temp storage for file copying.
-   static char pBuffer[65536];
+   // Temp storage for file copying.  Allocated per call, since
+   // several copy threads may be in here at the same time.
+   std::vector<char> cBuffer(65536);
+   char *pBuffer = &cBuffer[0];
 
    // Start status display, if status function given.
    if (pFunc != NULL)
@@ -690,6 +891,8 @@ RawCopyFile(
    return RawCopyFile(pszSrc, pszDest, piCopied, NULL, NULL);
 }
 
+#ifdef _WIN32
+
 //
 // CompareFileWin32:
 // Compares the contents of two files.  If the contents of
@@ -766,9 +969,12 @@ CompareFileWin32(const _TCHAR *pszSrc, const _TCHAR *pszDest,
       }
    }
 
-   // Temp storage for file comparing.
-   static char pBuffer1[65536];
-   static char pBuffer2[65536];
+   // Temp storage for file comparing.  Allocated per call, since
+   // several copy threads may be in here at the same time.
+   std::vector<char> cBuffer1(65536);
+   std::vector<char> cBuffer2(65536);
+   char *pBuffer1 = &cBuffer1[0];
+   char *pBuffer2 = &cBuffer2[0];
 
    // Read chunks until we've done the whole file.
    DWORD dwBytes = 0;
@@ -839,6 +1045,153 @@ CompareFileWin32(const _TCHAR *pszSrc, const _TCHAR *pszDest,
    return true;
 }
 
+#else
+
+//
+// CompareFilePosix:
+// Compares the contents of two files using native POSIX I/O.
+// If the contents of the files differ, or if either file can't
+// be opened, or if one file's size differs from the other, then
+// this function will return false.  Otherwise returns true.
+//
+// Optionally accepts a callback function and context
+// pointer, in which case the callback function is called
+// periodically so the caller can update a status display
+// during the compare operation.  If the callback function
+// returns false, the operation is aborted.
+//
+bool
+CompareFilePosix(const _TCHAR *pszSrc, const _TCHAR *pszDest,
+   bool bLowPriority,      // True if code should allow other processes to run between file chunks read.
+   bool (*pFunc)(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double dBytesCopied, double dFileSize),
+   void *pContext)
+{
+   double dTotalBytes = 0;    // Keep track of how many bytes compared.
+
+   // Open the first file.
+   int fd1 = open(pszSrc, O_RDONLY);
+   if (fd1 < 0)
+      return false;
+
+   // Determine size of first file.
+   struct stat st;
+   if (fstat(fd1, &st) != 0)
+   {
+      close(fd1);
+      return false;
+   }
+   double dFileLength = (double)st.st_size;
+
+   // Open the second file.
+   int fd2 = open(pszDest, O_RDONLY);
+   if (fd2 < 0)
+   {
+      close(fd1);
+      return false;
+   }
+
+   // Start status display, if status function given.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, pszSrc, pszDest, dTotalBytes, dFileLength))
+      {
+         close(fd1);
+         close(fd2);
+         return false; // Progress function wants to abort.
+      }
+   }
+
+   // Temp storage for file comparing.  Allocated per call, since
+   // several copy threads may be in here at the same time.
+   std::vector<char> cBuffer1(65536);
+   std::vector<char> cBuffer2(65536);
+   char *pBuffer1 = &cBuffer1[0];
+   char *pBuffer2 = &cBuffer2[0];
+
+   // Read chunks until we've done the whole file.
+   ssize_t iBytes = 0;
+   while ((iBytes = read(fd1, pBuffer1, cBuffer1.size())) > 0)
+   {
+      // Read same chunk from 2nd file.
+      ssize_t iBytes2 = 0;
+      while (iBytes2 < iBytes)
+      {
+         ssize_t iRead = read(fd2, pBuffer2 + iBytes2, iBytes - iBytes2);
+         if (iRead < 0 && errno == EINTR)
+            continue;
+         if (iRead <= 0)
+            break;
+         iBytes2 += iRead;
+      }
+      if (iBytes2 != iBytes)
+      {
+         // Files differ in size or read error!
+         close(fd1);
+         close(fd2);
+         return false;
+      }
+
+      // Compare the two chunks.
+      if (memcmp(pBuffer1, pBuffer2, iBytes) != 0)
+      {
+         // Contents of files differ!
+         close(fd1);
+         close(fd2);
+         return false;
+      }
+
+      // Update total count of bytes compared.
+      dTotalBytes += (double)iBytes;
+
+      // Update status display.
+      // Note that this is called very frequently, so the caller
+      // may not want to update a display on _every_ callback.
+      if (pFunc != NULL)
+      {
+         if (!pFunc(pContext, pszSrc, pszDest, dTotalBytes, dFileLength))
+         {
+            close(fd1);
+            close(fd2);
+            return false; // Progress function wants to abort.
+         }
+      }
+
+      // Let other threads run.
+      if (bLowPriority)
+         sched_yield();
+   }
+
+   // Finish status display, if status function given.
+   if (pFunc != NULL)
+   {
+      if (!pFunc(pContext, pszSrc, pszDest, dTotalBytes, dFileLength))
+      {
+         close(fd1);
+         close(fd2);
+         return false; // Progress function wants to abort.
+      }
+   }
+
+   // The second file must not have anything left over.
+   char cExtra;
+   bool bExtra = (read(fd2, &cExtra, 1) > 0);
+
+   close(fd1);
+   close(fd2);
+
+   // Make sure the whole file was read.
+   if (dTotalBytes != dFileLength || bExtra)
+   {
+      // Read error!
+      return false;
+   }
+
+   // No error.
+   return true;
+}
+
+#endif //_WIN32
+
 //
 // CompareFile:
 // Compares the contents of two files.  If the contents of
@@ -888,9 +1241,12 @@ CompareFile(const _TCHAR *pszSrc, const _TCHAR *pszDest,
          return false; // Progress function wants to abort.
    }
 
-   // Temp storage for file comparing.
-   static char pBuffer1[65536];
-   static char pBuffer2[65536];
+   // Temp storage for file comparing.  Allocated per call, since
+   // several copy threads may be in here at the same time.
+   std::vector<char> cBuffer1(65536);
+   std::vector<char> cBuffer2(65536);
+   char *pBuffer1 = &cBuffer1[0];
+   char *pBuffer2 = &cBuffer2[0];
 
    // Read chunks until we've done the whole file.
    int iBytes = 0;
@@ -949,6 +1305,8 @@ CompareFile(const _TCHAR *pszSrc, const _TCHAR *pszDest,
    return true;
 }
 
+#ifdef _WIN32
+
 //
 // rationalize_path:
 // Converts a relative path to an absolute path.
@@ -1119,6 +1477,90 @@ rationalize_path(_TCHAR *fn)
    }
 }
 
+#else
+
+//
+// rationalize_path:
+// Converts a relative path to an absolute path, removing
+// any "." and ".." elements and any redundant separators.
+//
+// Parameters:
+//   Name   Description
+//   ----   -----------
+//   fn     Path to be converted.  Must have room for MAXPATH
+//          characters.
+//
+// Returns:
+//   NONE
+//
+void
+rationalize_path(_TCHAR *fn)
+{
+   _TCHAR      result[MAXPATH + 1];    // Buffer to build result in.
+   _TCHAR      element[MAXPATH + 1];   // Element from path.
+   int         rpos = 0;               // Position in 'result'.
+   int         epos;                   // Position in 'element'.
+   int         fpos = 0;               // Position in 'fn'.
+
+   // Check for bogus argument.
+   if (fn == NULL)
+      return;
+   if (fn[0] == '\0')
+      return;
+
+   // If the path is relative, start with the current working
+   // directory.
+   result[0] = '\0';
+   if (fn[0] != '/')
+   {
+      if (getcwd(result, MAXPATH) == NULL)
+         result[0] = '\0';
+      _tcscat_s(result, MAXPATH, _T("/"));
+   }
+   _tcscat_s(result, MAXPATH, fn);
+
+   // Process each element in the path, putting the completed
+   // path back into 'fn' as we go.
+   fn[0] = '\0';
+   while (result[rpos] != '\0')
+   {
+      // Skip leading path separator (if any).
+      while (result[rpos] == '/')
+         rpos++;
+
+      // Extract element from path.
+      epos = 0;
+      while (result[rpos] != '/' && result[rpos] != '\0')
+         element[epos++] = result[rpos++];
+      element[epos] = '\0';
+
+      if (epos == 0 || _tcscmp(element, _T(".")) == 0)
+      {
+         // Ignore empty elements and 'current directory'.
+      }
+      else if (_tcscmp(element, _T("..")) == 0)
+      {
+         // Back up one element in 'fn'.
+         while (fpos > 0 && fn[fpos] != '/')
+            fpos--;
+         fn[fpos] = '\0';
+      }
+      else
+      {
+         // Normal subdirectory name (or filename).
+         _tcscat_s(&fn[fpos], MAXPATH - fpos, _T("/"));
+         _tcscat_s(&fn[fpos], MAXPATH - fpos, element);
+         fpos += static_cast<int>(_tcslen(&fn[fpos]));
+      }
+   }
+
+   // The root directory has no elements at all.
+   if (fn[0] == '\0')
+      _tcscpy_s(fn, MAXPATH, _T("/"));
+}
+
+#endif //_WIN32
+
 //
 // FindBaseFilename:
 // Given the pathname of a file, finds the filename portion
@@ -1130,10 +1572,10 @@ FindBaseFilename(const _TCHAR *pszPath)
 {
    if (pszPath == NULL || pszPath[0] == '\0')
       return NULL;
-   const _TCHAR *p = _tcsrchr(pszPath, _TCHAR('\\'));
+   const _TCHAR *p = FindLastChar(pszPath, _tcslen(pszPath), PATHSEP);
    if (p == NULL)
       return &pszPath[0];
-   else if (*p == '\\')
+   else if (*p == PATHSEP)
       return (p + 1);
    else
       return p;
@@ -1212,6 +1654,43 @@ readline(FILE *fp, _TCHAR *s, int smax)
    return 1;
 }
 
+//
+// readline:
+// Same as above, except that the whole line is read into a
+// string, however long it is, so it's never split.
+//
+// Parameters:
+//   Name   Description
+//   ----   -----------
+//   fp     Open file to read from.
+//   s      String to be filled.
+//
+// Returns:
+//   Value   Meaning
+//   -----   -------
+//   1       Successful.
+//   0       Error or end-of-file occured.
+//
+int
+readline(FILE *fp, std::basic_string<_TCHAR> &s)
+{
+   int   ch;         // Character from file.
+   int   count = 0;  // # of bytes read from file.
+
+   s.clear();
+   while ((ch = fgetc(fp)) != EOF)
+   {
+      count++;
+      if (ch == '\n')
+         return 1;   // End of line.
+      if (ch != '\r')
+         s += static_cast<_TCHAR>(ch);
+   }
+
+   // Hit the end of file.
+   return (count > 0) ? 1 : 0;
+}
+
 //
 // OptionNameIs:
 // Checks the name of a command line option.
@@ -1237,18 +1716,12 @@ OptionNameIs(const _TCHAR *szArg, const _TCHAR *szName)
    if (szArg[0] == '-' || szArg[0] == '/')
       szArg++;
 
-   // Compare the specified name with the argument string.
-   while (*szArg && *szName)
-   {
-      // Does this character match?
-      if (tolower(*szName++) != tolower(*szArg++))
-         return false;
-   }
-
-   // If the argument string ended before the name string, then
-   // bail.
-   if (*szName)
+   // Compare the specified name with the argument string.  If
+   // the argument string ends before the name string, then bail.
+   size_t nName = _tcslen(szName);
+   if (!StartsWithNoCase(szArg, _tcslen(szArg), szName, nName))
       return false;
+   szArg += nName;
 
    // If the next character of the argument string is alphanumeric,
    // then bail.
@@ -1276,8 +1749,8 @@ OptionNameIs(const _TCHAR *szArg, const _TCHAR *szName)
 const _TCHAR *
 OptionValue(const _TCHAR *szArg)
 {
-   static _TCHAR *empty = _T("");
-   static _TCHAR p[1024] = _T("");
+   static const _TCHAR *empty = _T("");
+   static std::basic_string<_TCHAR> p;
 
    if (szArg == NULL)
       return empty;
@@ -1293,19 +1766,19 @@ OptionValue(const _TCHAR *szArg)
       if (*szArg == '"' && szArg[1] != '\0')
          szArg++;
 
-      // Copy the rest of the string.
-      _tcscpy_s(p, 1024, szArg);
+      // Copy the rest of the string, however long it is.
+      p = szArg;
 
       // Remove trailing spaces (if any).
-      while (_tcslen(p) > 0 && p[_tcslen(p) - 1] == ' ' || p[_tcslen(p) - 1] == '\t')
-         p[_tcslen(p) - 1] = '\0';
+      while (p.size() > 0 && (p[p.size() - 1] == ' ' || p[p.size() - 1] == '\t'))
+         p.resize(p.size() - 1);
 
       // Remove trailing quote (if any).
-      if (_tcslen(p) > 1 && p[_tcslen(p) - 1] == '"')
-         p[_tcslen(p) - 1] = '\0';
+      if (p.size() > 1 && p[p.size() - 1] == '"')
+         p.resize(p.size() - 1);
 
       // Caller gets pointer to string buffer.
-      return &p[0];
+      return p.c_str();
    }
 
    return empty;
@@ -52,7 +52,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <string>
+#ifdef _WIN32
 #include <tchar.h>
+#else
+#include "posix.h"
+#endif
 
 //----------------------------------------------------------
 // MACROS
@@ -63,6 +69,23 @@
 #define MAXPATH   512
 #endif //MAXPATH
 
+// Character that separates the elements of a pathname.
+#ifndef PATHSEP
+#ifdef _WIN32
+#define PATHSEP      '\\'
+#define PATHSEP_STR  _T("\\")
+#else
+#define PATHSEP      '/'
+#define PATHSEP_STR  _T("/")
+#endif
+#endif //PATHSEP
+
+// Elapsed wall time, in units of CLOCKS_PER_SEC.  On Windows,
+// clock() measures just that; posix.cpp supplies it elsewhere.
+#ifdef _WIN32
+#define WallClock()  clock()
+#endif
+
 //----------------------------------------------------------
 // FUNCTIONS
 //----------------------------------------------------------
@@ -84,9 +107,19 @@ bool CompareFile(const _TCHAR *pszSrc, const _TCHAR *pszDest,
 bool CompareFileWin32(const _TCHAR *pszSrc, const _TCHAR *pszDest, bool bLowPriority,
    bool (*pFunc)(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double dBytesCopied, double dFileSize) = NULL,
    void *pContext = NULL);
+#ifndef _WIN32
+int RawCopyFilePosix(const _TCHAR *pszSrc, const _TCHAR *pszDest, double *pdCopied, bool bLowPriority,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double dBytesCopied, double dFileSize) = NULL,
+   void *pContext = NULL);
+bool CompareFilePosix(const _TCHAR *pszSrc, const _TCHAR *pszDest, bool bLowPriority,
+   bool (*pFunc)(void *pContext, const _TCHAR *pszSrc, const _TCHAR *pszDest, double dBytesCopied, double dFileSize) = NULL,
+   void *pContext = NULL);
+bool CopyFileTimesPosix(const _TCHAR *pszSrc, const _TCHAR *pszDest);
+#endif
 void rationalize_path(_TCHAR *fn);
 const _TCHAR *FindBaseFilename(const _TCHAR *pszPath);
 int readline(FILE *fp, _TCHAR *s, int smax);
+int readline(FILE *fp, std::basic_string<_TCHAR> &s);
 bool OptionNameIs(const _TCHAR *szArg, const _TCHAR *szName);
 const _TCHAR *OptionValue(const _TCHAR *szArg);
 void FormatThousands(_TCHAR *pszNumber);
@@ -0,0 +1,343 @@
+//--------------------------------------------------------------------
+//
+// watch.cpp
+//
+// C++ code for the CWatcher class, which reports changes made to
+// the files in a set of directories, using the file system change
+// notifications provided by the operating system.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "watch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include <map>
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+//----------------------------------------------------------
+// MACROS
+//----------------------------------------------------------
+
+// Size of the buffer for reading change notifications.
+#define WATCH_BUFFER_SIZE  (64 * 1024)
+
+#ifdef __linux__
+// The changes we want to hear about.  Rewritten files are seen
+// when they're closed, rather than on every write.
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#endif
+
+//----------------------------------------------------------
+// IMPLEMENTATION OF CLASS CWatcher
+//----------------------------------------------------------
+
+// Default constructor.
+CWatcher::CWatcher()
+   : fdNotify(-1)
+{
+}
+
+// Destructor.
+CWatcher::~CWatcher()
+{
+#ifdef __linux__
+   if (fdNotify >= 0)
+      close(fdNotify);
+#endif
+}
+
+//
+// Open:
+// Prepares to receive change notifications.  Must be called
+// before any of the other methods.
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CWatcher::Open(void)
+{
+#ifdef __linux__
+   fdNotify = inotify_init1(IN_CLOEXEC);
+   if (fdNotify < 0)
+   {
+      sError = _T("Failed initializing change notifications");
+      return false;
+   }
+   return true;
+#else
+   sError = _T("Watching for changes is not supported on this system");
+   return false;
+#endif
+}
+
+//
+// AddDir:
+// Starts watching for changes to the entries in a directory
+// (not its children).  Watching a directory that's already
+// being watched does nothing.
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CWatcher::AddDir(const _TCHAR *pszDirPath)
+{
+#ifdef __linux__
+   int wd = inotify_add_watch(fdNotify, pszDirPath, WATCH_EVENTS);
+   if (wd < 0)
+   {
+      if (errno == ENOSPC)
+         sError = _T("Too many directories to watch (see /proc/sys/fs/inotify/max_user_watches)");
+      else
+         sError = _T("Failed watching directory");
+      return false;
+   }
+
+   // The same directory always gets the same watch, but it may
+   // have been reached by a different path.
+   std::unordered_map<int, tstring>::iterator it = cPaths.find(wd);
+   if (it != cPaths.end())
+      cWatches.erase(it->second);
+   cPaths[wd] = pszDirPath;
+   cWatches[pszDirPath] = wd;
+   return true;
+#else
+   (void)pszDirPath;
+   sError = _T("Watching for changes is not supported on this system");
+   return false;
+#endif
+}
+
+//
+// IsWatched:
+// Returns true if the given directory is being watched.
+//
+bool
+CWatcher::IsWatched(const _TCHAR *pszDirPath) const
+{
+   return cWatches.find(pszDirPath) != cWatches.end();
+}
+
+//
+// RenameDir:
+// Updates the paths of the watched directories after a watched
+// directory has been renamed (which renames its children too).
+//
+void
+CWatcher::RenameDir(const tstring &sOldPath, const tstring &sNewPath)
+{
+   tstring sOldPrefix = sOldPath + PATHSEP_STR;
+   for (std::unordered_map<int, tstring>::iterator it = cPaths.begin(); it != cPaths.end(); ++it)
+   {
+      if (it->second == sOldPath || it->second.compare(0, sOldPrefix.size(), sOldPrefix) == 0)
+      {
+         cWatches.erase(it->second);
+         it->second = sNewPath + it->second.substr(sOldPath.size());
+         cWatches[it->second] = it->first;
+      }
+   }
+}
+
+//
+// WaitForChanges:
+// Waits until something changes in the watched directories,
+// then keeps collecting changes until none have arrived for
+// iQuietMs milliseconds, or until iMaxMs milliseconds have
+// passed, so that a burst of changes is handled all at once.
+//
+// Returns the pathnames of the directories whose entries changed
+// in cDirty (sorted, so parents come before their children), and
+// the old and new pathnames of the entries that were renamed from
+// one watched directory to another in cRenames.  The directories
+// involved in renames are in cDirty too.  If bOverflow is set,
+// some changes were lost, and everything needs to be checked.
+// New directories aren't watched until AddDir is called for them.
+//
+// Returns true if successful; false if error.  The sError member
+// will contain an error message if return value is false.
+//
+bool
+CWatcher::WaitForChanges(
+   int iQuietMs,
+   int iMaxMs,
+   std::vector<tstring> &cDirty,
+   std::vector<std::pair<tstring, tstring> > &cRenames,
+   bool &bOverflow
+   )
+{
+   cDirty.clear();
+   cRenames.clear();
+   bOverflow = false;
+
+#ifdef __linux__
+   std::set<tstring> cDirtySet;
+   std::map<uint32_t, tstring> cMovedFrom;
+   std::vector<char> cBuffer(WATCH_BUFFER_SIZE);
+   clock_t tFirst = 0;
+   bool bAny = false;
+
+   for (;;)
+   {
+      // Wait forever for the first change, then only as long
+      // as changes keep coming.
+      int iTimeout = -1;
+      if (bAny)
+      {
+         int iLeft = iMaxMs - static_cast<int>((WallClock() - tFirst) * 1000 / CLOCKS_PER_SEC);
+         if (iLeft <= 0)
+            break;   // Waited long enough.
+         iTimeout = (iLeft < iQuietMs) ? iLeft : iQuietMs;
+      }
+      struct pollfd stPoll;
+      stPoll.fd = fdNotify;
+      stPoll.events = POLLIN;
+      stPoll.revents = 0;
+      int iReady = poll(&stPoll, 1, iTimeout);
+      if (iReady < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         sError = _T("Failed waiting for changes");
+         return false;
+      }
+      if (iReady == 0)
+         break;   // Quiet long enough.
+      if (!bAny)
+         tFirst = WallClock();
+
+      ssize_t iBytes = read(fdNotify, &cBuffer[0], cBuffer.size());
+      if (iBytes < 0)
+      {
+         if (errno == EINTR || errno == EAGAIN)
+            continue;
+         sError = _T("Failed reading change notifications");
+         return false;
+      }
+
+      for (ssize_t iPos = 0; iPos < iBytes; )
+      {
+         const struct inotify_event *pEvent = (const struct inotify_event *)&cBuffer[iPos];
+         iPos += sizeof(struct inotify_event) + pEvent->len;
+         bAny = true;
+
+         if (pEvent->mask & IN_Q_OVERFLOW)
+         {
+            bOverflow = true;
+            continue;
+         }
+
+         std::unordered_map<int, tstring>::iterator it = cPaths.find(pEvent->wd);
+         if (it == cPaths.end())
+            continue;   // Not watching this any more.
+
+         // The watch goes away when its directory does.
+         if (pEvent->mask & IN_IGNORED)
+         {
+            cWatches.erase(it->second);
+            cPaths.erase(it);
+            continue;
+         }
+         if (pEvent->len == 0)
+            continue;   // Change to the directory itself.
+
+         tstring sDir = it->second;
+         tstring sPath = sDir;
+         if (sPath[sPath.size() - 1] != PATHSEP)
+            sPath += PATHSEP;
+         sPath += pEvent->name;
+         cDirtySet.insert(sDir);
+
+         // Pair up the two halves of a rename.
+         if (pEvent->mask & IN_MOVED_FROM)
+         {
+            cMovedFrom[pEvent->cookie] = sPath;
+         }
+         else if (pEvent->mask & IN_MOVED_TO)
+         {
+            std::map<uint32_t, tstring>::iterator itFrom = cMovedFrom.find(pEvent->cookie);
+            if (itFrom != cMovedFrom.end())
+            {
+               cRenames.push_back(std::make_pair(itFrom->second, sPath));
+               if (pEvent->mask & IN_ISDIR)
+                  RenameDir(itFrom->second, sPath);
+               cMovedFrom.erase(itFrom);
+            }
+         }
+      }
+   }
+
+   cDirty.assign(cDirtySet.begin(), cDirtySet.end());
+   return true;
+#else
+   (void)iQuietMs;
+   (void)iMaxMs;
+   sError = _T("Watching for changes is not supported on this system");
+   return false;
+#endif
+}
+
+//----------------------------------------------------------
+// FUNCTIONS
+//----------------------------------------------------------
+
+//
+// WatchScanCallback:
+// Callback for CDir::ScanFiles that starts watching each
+// directory before it's scanned, so that nothing added after
+// the scan is missed.  The context pointer points to a
+// CWatcher.
+// Returns false (which aborts the scan) if the directory
+// couldn't be watched.
+//
+bool
+WatchScanCallback(void *pContext, const _TCHAR *pszDirPath)
+{
+   CWatcher *pWatcher = (CWatcher *)pContext;
+   return pWatcher->AddDir(pszDirPath);
+}
@@ -0,0 +1,96 @@
+//--------------------------------------------------------------------
+//
+// watch.h
+//
+// C++ header for the CWatcher class, which reports changes made
+// to the files in a set of directories, using the file system
+// change notifications provided by the operating system.
+//
+//--------------------------------------------------------------------
+//
+// (C) Copyright 1985-2019 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//
+//--------------------------------------------------------------------
+
+#pragma once
+#ifndef __WATCH_H
+#define __WATCH_H
+
+//----------------------------------------------------------
+// INCLUDES
+//----------------------------------------------------------
+
+#include "filetree.h"
+#include <vector>
+#include <string>
+#include <utility>
+#include <unordered_map>
+
+//----------------------------------------------------------
+// CLASSES
+//----------------------------------------------------------
+
+// Class to wait for changes in a set of directories.  Currently
+// only implemented on Linux (with inotify); Open fails elsewhere.
+class CWatcher
+{
+public:
+   tstring  sError;  // Error message string if a method returns false.
+
+public:
+   CWatcher();
+   ~CWatcher();
+   bool Open(void);
+   bool AddDir(const _TCHAR *pszDirPath);
+   bool IsWatched(const _TCHAR *pszDirPath) const;
+   bool WaitForChanges(int iQuietMs, int iMaxMs, std::vector<tstring> &cDirty, std::vector<std::pair<tstring, tstring> > &cRenames, bool &bOverflow);
+
+private:
+   int                                 fdNotify;   // inotify descriptor.
+   std::unordered_map<int, tstring>    cPaths;     // Path of each watched dir.
+   std::unordered_map<tstring, int>    cWatches;   // Watch for each path.
+
+   void RenameDir(const tstring &sOldPath, const tstring &sNewPath);
+};
+
+//----------------------------------------------------------
+// FUNCTIONS
+//----------------------------------------------------------
+
+// Callback to pass to CDir::ScanFiles to start watching each
+// directory before it's scanned.  The context pointer should
+// point to a CWatcher.
+bool WatchScanCallback(void *pContext, const _TCHAR *pszDirPath);
+
+#endif //__WATCH_H